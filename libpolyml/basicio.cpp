@@ -98,12 +98,26 @@ DCJM May 2000.
 #ifdef HAVE_STDIO_H
 #include <stdio.h>
 #endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
 #include <limits>
+#include <vector>
 
 #ifndef INFTIM
 #define INFTIM (-1)
 #endif
 
+#ifndef PIPE_BUF
+#define PIPE_BUF 512 // The minimum required by Posix.
+#endif
+
 #ifdef HAVE_DIRENT_H
 # include <dirent.h>
 # define NAMLEN(dirent) strlen((dirent)->d_name)
@@ -139,6 +153,9 @@ DCJM May 2000.
 #include "locking.h"
 #include "rtsentry.h"
 #include "timing.h"
+#include "ioreactor.h"
+#include "iouring.h"
+#include "memmgr.h"
 
 
 #define TOOMANYFILES EMFILE
@@ -164,26 +181,21 @@ extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyBasicIOGeneral(FirstArgument threadId, PolyWord code, PolyWord strm, PolyWord arg);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyPollIODescriptors(FirstArgument threadId, PolyWord streamVec, PolyWord bitVec, PolyWord maxMillisecs);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyPosixCreatePersistentFD(FirstArgument threadId, PolyWord fd);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyBasicIOMapFile(FirstArgument threadId, PolyWord fileName);
 }
 
 static bool isAvailable(TaskData *taskData, int ioDesc)
 {
-#ifdef __CYGWIN__
-      static struct timeval poll = {0,1};
-#else
-      static struct timeval poll = {0,0};
-#endif
-      fd_set read_fds;
-      int selRes;
-      FD_ZERO(&read_fds);
-      FD_SET(ioDesc, &read_fds);
-
-      /* If there is something there we can return. */
-      selRes = select(FD_SETSIZE, &read_fds, NULL, NULL, &poll);
-      if (selRes > 0) return true; /* Something waiting. */
-      else if (selRes < 0 && errno != EINTR) // Maybe another thread closed descr
-          raise_syscall(taskData, "select error", ERRORNUMBER);
-      else return false;
+    struct pollfd fds;
+    fds.fd = ioDesc;
+    fds.events = POLLIN;
+    fds.revents = 0;
+    /* If there is something there we can return. */
+    int pollRes = poll(&fds, 1, 0);
+    if (pollRes > 0) return true; /* Something waiting. */
+    else if (pollRes < 0 && errno != EINTR) // Maybe another thread closed descr
+        raise_syscall(taskData, "poll error", ERRORNUMBER);
+    else return false;
 }
 
 // The strm argument is a volatile word containing the descriptor.
@@ -193,6 +205,7 @@ static bool isAvailable(TaskData *taskData, int ioDesc)
 // N.B.  There are also persistent descriptors created with PolyPosixCreatePersistentFD
 Handle wrapFileDescriptor(TaskData *taskData, int fd)
 {
+    forgetDescriptorKind(fd);
     return MakeVolatileWord(taskData, fd+1);
 }
 
@@ -269,6 +282,27 @@ static void waitForAvailableInput(TaskData *taskData, Handle stream)
     }
 }
 
+// Read through io_uring if it is available.  Returns the operation, which the
+// caller must free after copying the data, or null if the caller should read
+// the descriptor itself.
+static IOUringOp *ringRead(TaskData *taskData, int fd, size_t length, ssize_t *haveRead)
+{
+    if (! IOUringAvailable()) return 0;
+    IOUringOp *op = IOUringStart(IOURING_READ, fd, 0, length, 0);
+    if (op == 0) raise_syscall(taskData, "Unable to allocate buffer", NOMEMORY);
+    int res = IOUringWait(taskData, op);
+    if (res >= 0)
+    {
+        *haveRead = res;
+        return op;
+    }
+    IOUringFree(op);
+    // Older kernels may return EAGAIN if the descriptor is in non-blocking mode.
+    if (res != -EAGAIN && res != -EINTR)
+        raise_syscall(taskData, "Error while reading", -res);
+    return 0;
+}
+
 /* Read into an array. */
 // We can't combine readArray and readString because we mustn't compute the
 // destination of the data in readArray until after any GC.
@@ -285,9 +319,26 @@ static Handle readArray(TaskData *taskData, Handle stream, Handle args, bool/*is
     {
         // First test to see if we have input available.
         // These tests may result in a GC if another thread is running.
-        // First test to see if we have input available.
-        // These tests may result in a GC if another thread is running.
-        waitForAvailableInput(taskData, stream);
+        int fd = getStreamFileDescriptor(taskData, stream->Word());
+        if (! isAvailable(taskData, fd))
+        {
+            // Rather than waiting until the descriptor is ready and then reading
+            // it, pass the read to io_uring.  Input that is already available,
+            // e.g. from a regular file, is cheaper to read directly.
+            size_t length = getPolyUnsigned(taskData, DEREFWORDHANDLE(args)->Get(2));
+            ssize_t haveRead;
+            IOUringOp *op = ringRead(taskData, fd, length, &haveRead);
+            if (op != 0)
+            {
+                // The array may have been moved while we were waiting.
+                byte *base = DEREFHANDLE(args)->Get(0).AsObjPtr()->AsBytePtr();
+                POLYUNSIGNED offset = getPolyUnsigned(taskData, DEREFWORDHANDLE(args)->Get(1));
+                memcpy(base + offset, IOUringData(op), haveRead);
+                IOUringFree(op);
+                return Make_fixed_precision(taskData, haveRead);
+            }
+            waitForAvailableInput(taskData, stream);
+        }
 
         // We can now try to read without blocking.
         // Actually there's a race here in the unlikely situation that there
@@ -295,7 +346,7 @@ static Handle readArray(TaskData *taskData, Handle stream, Handle args, bool/*is
         // both detect that input is available but only one may succeed in
         // reading without blocking.  This doesn't apply where the threads use
         // the higher-level IO interfaces in ML which have their own mutexes.
-        int fd = getStreamFileDescriptor(taskData, stream->Word());
+        fd = getStreamFileDescriptor(taskData, stream->Word());
         byte *base = DEREFHANDLE(args)->Get(0).AsObjPtr()->AsBytePtr();
         POLYUNSIGNED offset = getPolyUnsigned(taskData, DEREFWORDHANDLE(args)->Get(1));
         size_t length = getPolyUnsigned(taskData, DEREFWORDHANDLE(args)->Get(2));
@@ -322,72 +373,198 @@ static Handle readString(TaskData *taskData, Handle stream, Handle args, bool/*i
     {
         // First test to see if we have input available.
         // These tests may result in a GC if another thread is running.
-        waitForAvailableInput(taskData, stream);
-
-        // We can now try to read without blocking.
         int fd = getStreamFileDescriptor(taskData, stream->Word());
-        // We previously allocated the buffer on the stack but that caused
-        // problems with multi-threading at least on Mac OS X because of
-        // stack exhaustion.  We limit the space to 100k. */
-        if (length > 102400) length = 102400;
-        byte *buff = (byte*)malloc(length);
-        if (buff == 0) raise_syscall(taskData, "Unable to allocate buffer", NOMEMORY);
-        ssize_t haveRead = read(fd, buff, length);
+        if (! isAvailable(taskData, fd))
+        {
+            ssize_t haveRead;
+            IOUringOp *op = ringRead(taskData, fd, length > 102400 ? 102400 : length, &haveRead);
+            if (op != 0)
+            {
+                Handle result;
+                try {
+                    result = SAVE(C_string_to_Poly(taskData, (const char*)IOUringData(op), haveRead));
+                }
+                catch (...) {
+                    IOUringFree(op);
+                    throw;
+                }
+                IOUringFree(op);
+                return result;
+            }
+            waitForAvailableInput(taskData, stream);
+        }
+
+        // We can now try to read without blocking.  Read directly into a string
+        // allocated for the largest possible result and then shrink it.  We don't
+        // release the ML heap between allocating it and reading so it can't move.
+        // Allocating a large string for a pipe or socket that only has a few bytes
+        // available would be wasteful so in that case we limit it to 100k.  For a
+        // regular file we can find out how much is left.  Some, e.g. in /proc,
+        // report a size of zero so we only use the size if it is past the position.
+        size_t toRead = length;
+        if (toRead > 102400)
+        {
+            fd = getStreamFileDescriptor(taskData, stream->Word());
+            struct stat fbuff;
+            off_t pos;
+            if (fstat(fd, &fbuff) == 0 && S_ISREG(fbuff.st_mode) &&
+                    (pos = lseek(fd, 0, SEEK_CUR)) >= 0 && fbuff.st_size > pos)
+            {
+                if ((uintmax_t)(fbuff.st_size - pos) < toRead) toRead = (size_t)(fbuff.st_size - pos);
+            }
+            else toRead = 102400;
+        }
+        if (toRead == 0) return SAVE(EmptyString(taskData));
+        Handle result = alloc_and_save(taskData, WORDS(toRead) + 1, F_BYTE_OBJ);
+        PolyStringObject *str = (PolyStringObject *)DEREFHANDLE(result);
+        fd = getStreamFileDescriptor(taskData, stream->Word());
+        ssize_t haveRead = read(fd, str->chars, toRead);
         if (haveRead >= 0)
         {
-            Handle result = SAVE(C_string_to_Poly(taskData, (char*)buff, haveRead));
-            free(buff);
+            str->length = (POLYUNSIGNED)haveRead;
+            shrinkObject(str, WORDS(haveRead) + 1);
             return result;
         }
-        free(buff);
         // If it failed because it was interrupted keep trying otherwise it's an error.
         if (errno != EINTR)
             raise_syscall(taskData, "Error while reading", ERRORNUMBER);
     }
 }
 
+// Test whether we can write without blocking.  Returns false if it will block,
+// true if it will not.
+static bool canOutput(TaskData *taskData, int fd)
+{
+    /* Unix - use "poll" to find out if output is possible. */
+    struct pollfd fds;
+    fds.fd = fd;
+    fds.events = POLLOUT;
+    fds.revents = 0;
+    int pollRes = poll(&fds, 1, 0);
+    if (pollRes < 0 && errno != EINTR)
+        raise_syscall(taskData, "poll failed", ERRORNUMBER);
+    return pollRes > 0;
+}
+
+// The kind of each descriptor as far as writeArray is concerned.  This is cached
+// so that writing does not need fstat and fcntl calls every time.  The entry is
+// reset when a new stream is made for the descriptor and when its flags are set.
+#define DESCRIPTOR_KIND_CACHE   1024
+enum { DESCR_UNKNOWN = 0, DESCR_DIRECT, DESCR_PIPE, DESCR_SOCKET };
+static unsigned char descriptorKinds[DESCRIPTOR_KIND_CACHE];
+
+void forgetDescriptorKind(int fd)
+{
+    if (fd >= 0 && fd < DESCRIPTOR_KIND_CACHE)
+        descriptorKinds[fd] = DESCR_UNKNOWN;
+}
+
+static int getDescriptorKind(int fd)
+{
+    if (fd >= 0 && fd < DESCRIPTOR_KIND_CACHE && descriptorKinds[fd] != DESCR_UNKNOWN)
+        return descriptorKinds[fd];
+    // Only a pipe or a socket can wait indefinitely for a reader.  Anything else,
+    // including regular files, is written directly.  If the descriptor is in
+    // non-blocking mode we also just write and the ML code deals with EAGAIN.
+    int kind = DESCR_DIRECT;
+    struct stat statBuff;
+    if (fstat(fd, &statBuff) == 0 && (S_ISFIFO(statBuff.st_mode) || S_ISSOCK(statBuff.st_mode)) &&
+        (fcntl(fd, F_GETFL) & O_NONBLOCK) == 0)
+    {
+#ifdef MSG_DONTWAIT
+        kind = S_ISSOCK(statBuff.st_mode) ? DESCR_SOCKET : DESCR_PIPE;
+#else
+        kind = DESCR_PIPE;
+#endif
+    }
+    if (fd >= 0 && fd < DESCRIPTOR_KIND_CACHE)
+        descriptorKinds[fd] = (unsigned char)kind;
+    return kind;
+}
+
+// Write to a pipe that may block, with the ML heap released.  The data is
+// copied first because the GC may move the array.
+static ssize_t writeOutsideHeap(TaskData *taskData, int fd, const byte *toWrite, size_t length)
+{
+    byte *buffer = (byte*)malloc(length);
+    if (buffer == 0) raise_syscall(taskData, "Insufficient memory", NOMEMORY);
+    memcpy(buffer, toWrite, length);
+    processes->ThreadReleaseMLMemory(taskData);
+    ssize_t haveWritten = write(fd, buffer, length);
+    int err = errno;
+    processes->ThreadUseMLMemory(taskData);
+    free(buffer);
+    errno = err;
+    return haveWritten;
+}
+
 static Handle writeArray(TaskData *taskData, Handle stream, Handle args, bool/*isText*/)
 {
     /* The isText argument is ignored in both Unix and Windows but
        is provided for future use.  Windows remembers the mode used
        when the file was opened to determine whether to translate
        LF into CRLF. */
-    PolyWord base = DEREFWORDHANDLE(args)->Get(0);
     POLYUNSIGNED    offset = getPolyUnsigned(taskData, DEREFWORDHANDLE(args)->Get(1));
     size_t length = getPolyUnsigned(taskData, DEREFWORDHANDLE(args)->Get(2));
     int fd = getStreamFileDescriptor(taskData, stream->Word());
-    /* We don't actually handle cases of blocking on output. */
-    byte *toWrite = base.AsObjPtr()->AsBytePtr();
+    int kind = getDescriptorKind(fd);
+    if (kind != DESCR_DIRECT)
+    {
+        bool isSocket = kind == DESCR_SOCKET;
+        // Write without blocking and if it would block wait, releasing the ML heap,
+        // so that a slow reader doesn't hold up the GC.
+        while (true)
+        {
+            // The array may have been moved by the GC while we were waiting.
+            byte *toWrite = DEREFWORDHANDLE(args)->Get(0).AsObjPtr()->AsBytePtr();
+            ssize_t haveWritten = -1;
+#ifdef MSG_DONTWAIT
+            if (isSocket)
+                haveWritten = send(fd, toWrite+offset, length, MSG_DONTWAIT);
+            else
+#endif
+            // There's no way to make a single write to a pipe non-blocking without
+            // changing the mode that it shares with other processes.  Once poll
+            // reports the pipe as ready a write of up to PIPE_BUF bytes will not
+            // block.  A larger write is passed to io_uring if it is available and
+            // otherwise made in full with the ML heap released.
+            if (! canOutput(taskData, fd))
+                errno = EAGAIN;
+            else if (length <= PIPE_BUF)
+                haveWritten = write(fd, toWrite+offset, length);
+            else if (! IOUringAvailable())
+                haveWritten = writeOutsideHeap(taskData, fd, toWrite+offset, length);
+            else errno = EAGAIN;
+            if (haveWritten >= 0) return Make_fixed_precision(taskData, haveWritten);
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                raise_syscall(taskData, "Error while writing", ERRORNUMBER);
+
+            if (IOUringAvailable() && ! isSocket && errno == EAGAIN)
+            {
+                IOUringOp *op = IOUringStart(IOURING_WRITE, fd, toWrite+offset, length, 0);
+                if (op == 0) raise_syscall(taskData, "Unable to allocate buffer", NOMEMORY);
+                int res = IOUringWait(taskData, op);
+                IOUringFree(op);
+                if (res >= 0) return Make_fixed_precision(taskData, res);
+                if (res != -EAGAIN && res != -EINTR)
+                    raise_syscall(taskData, "Error while writing", -res);
+            }
+            else if (errno != EINTR)
+            {
+                WaitOutputFD waiter(fd);
+                processes->ThreadPauseForIO(taskData, &waiter);
+            }
+            // The stream may have been closed while we were waiting.
+            fd = getStreamFileDescriptor(taskData, stream->Word());
+        }
+    }
+    byte *toWrite = DEREFWORDHANDLE(args)->Get(0).AsObjPtr()->AsBytePtr();
     ssize_t haveWritten = write(fd, toWrite+offset, length);
     if (haveWritten < 0) raise_syscall(taskData, "Error while writing", ERRORNUMBER);
 
     return Make_fixed_precision(taskData, haveWritten);
 }
 
-// Test whether we can write without blocking.  Returns false if it will block,
-// true if it will not.
-static bool canOutput(TaskData *taskData, Handle stream)
-{
-    int fd = getStreamFileDescriptor(taskData, stream->Word());
-
-    /* Unix - use "select" to find out if output is possible. */
-#ifdef __CYGWIN__
-    static struct timeval poll = {0,1};
-#else
-    static struct timeval poll = {0,0};
-#endif
-    fd_set read_fds, write_fds, except_fds;
-    int sel;
-    FD_ZERO(&read_fds);
-    FD_ZERO(&write_fds);
-    FD_ZERO(&except_fds);
-    FD_SET(fd, &write_fds);
-    sel = select(FD_SETSIZE,&read_fds,&write_fds,&except_fds,&poll);
-    if (sel < 0 && errno != EINTR)
-        raise_syscall(taskData, "select failed", ERRORNUMBER);
-    return sel > 0;
-}
-
 static long seekStream(TaskData *taskData, int fd, long pos, int origin)
 {
     long lpos = lseek(fd, pos, origin);
@@ -476,7 +653,7 @@ void WaitPoll::Wait(unsigned maxMillisecs)
 {
     // N.B. We use this for OS.Process.sleep with empty descriptor list.
     if (maxTime < maxMillisecs) maxMillisecs = maxTime;
-    pollResult = poll(fdVec, nDescr, maxMillisecs);
+    pollResult = WaitForDescriptors(fdVec, (unsigned)nDescr, maxMillisecs);
     if (pollResult < 0) errorResult = ERRORNUMBER;
 }
 
@@ -523,9 +700,9 @@ POLYEXTERNALSYMBOL POLYUNSIGNED PolyPollIODescriptors(FirstArgument threadId, Po
         for (unsigned i = 0; i < nDesc; i++)
         {
             int res = 0;
-            if (fds[i].revents & POLLIN) res = POLL_BIT_IN;
-            if (fds[i].revents & POLLOUT) res = POLL_BIT_OUT;
-            if (fds[i].revents & POLLPRI) res = POLL_BIT_PRI;
+            if (fds[i].revents & POLLIN) res |= POLL_BIT_IN;
+            if (fds[i].revents & POLLOUT) res |= POLL_BIT_OUT;
+            if (fds[i].revents & POLLPRI) res |= POLL_BIT_PRI;
             DEREFWORDHANDLE(result)->Set(i, TAGGED(res));
         }
     }
@@ -843,17 +1020,17 @@ static Handle IO_dispatch_c(TaskData *taskData, Handle args, Handle strm, Handle
         return Make_fixed_precision(taskData, 0);
 
     case 28: /* Test whether output is possible. */
-        return Make_fixed_precision(taskData, canOutput(taskData, strm) ? 1:0);
+        return Make_fixed_precision(taskData, canOutput(taskData, getStreamFileDescriptor(taskData, strm->Word())) ? 1:0);
 
     case 29: /* Block until output is possible. */
         // We should check for interrupts even if we're not going to block.
         processes->TestAnyEvents(taskData);
         while (true) {
-            if (canOutput(taskData, strm))
+            int fd = getStreamFileDescriptor(taskData, strm->Word());
+            if (canOutput(taskData, fd))
                 return Make_fixed_precision(taskData, 0);
-            // Use the default waiter for the moment since we don't have
-            // one to test for output.
-            processes->ThreadPauseForIO(taskData, Waiter::defaultWaiter);
+            WaitOutputFD waiter(fd);
+            processes->ThreadPauseForIO(taskData, &waiter);
         }
 
         /* Functions added for Posix structure. */
@@ -1110,12 +1287,174 @@ POLYEXTERNALSYMBOL POLYUNSIGNED PolyPosixCreatePersistentFD(FirstArgument thread
     else return result->Word().AsUnsigned();
 
 }
+// Files mapped into memory.  Each file is mapped into a separate space as
+// a single byte object.  The GC never moves it.  We hold a weak reference
+// to it so that when it is no longer reachable the space is deleted and
+// the file is unmapped.
+class MappedFile
+{
+public:
+    MappedFile(PermanentMemSpace *s, PolyObject *o): space(s), object(o) {}
+    PermanentMemSpace *space;
+    PolyObject *object;
+};
+
+class MappedFiles: public RtsModule
+{
+public:
+    MappedFiles(): mappedLock("Mapped files") {}
+    virtual void GarbageCollect(ScanAddress *process);
+    void Add(PermanentMemSpace *space, PolyObject *object);
+private:
+    PLock mappedLock;
+    std::vector<MappedFile> mapped;
+};
+
+static MappedFiles mappedFiles;
+
+void MappedFiles::Add(PermanentMemSpace *space, PolyObject *object)
+{
+    PLocker lock(&mappedLock);
+    mapped.push_back(MappedFile(space, object));
+}
+
+void MappedFiles::GarbageCollect(ScanAddress *process)
+{
+    for (std::vector<MappedFile>::iterator i = mapped.begin(); i != mapped.end(); )
+    {
+        PolyObject *obj = i->object;
+        process->ScanRuntimeAddress(&obj, ScanAddress::STRENGTH_WEAK);
+        // The object is never moved.  If it has been copied into a saved state
+        // the references to it have been updated and we keep the original
+        // until it is no longer reachable.
+        if (obj == 0)
+        {
+            gMem.DeleteMappedSpace(i->space);
+            i = mapped.erase(i);
+        }
+        else i++;
+    }
+}
+
+// Map a regular file and return it as a Word8Vector.vector.
+static Handle mapFile(TaskData *taskData, Handle fileName)
+{
+    TempString cFileName(fileName->Word());
+    if (cFileName == 0) raise_syscall(taskData, "Insufficient memory", NOMEMORY);
+    int fd = open(cFileName, O_RDONLY);
+    if (fd < 0) raise_syscall(taskData, "Cannot open", ERRORNUMBER);
+    struct stat fbuff;
+    if (fstat(fd, &fbuff) != 0)
+    {
+        int err = ERRORNUMBER;
+        close(fd);
+        raise_syscall(taskData, "stat failed", err);
+    }
+    if (! S_ISREG(fbuff.st_mode))
+    {
+        close(fd);
+        raise_syscall(taskData, "Not a regular file", EINVAL);
+    }
+    if (fbuff.st_size == 0)
+    {
+        close(fd);
+        return SAVE(EmptyString(taskData));
+    }
+    size_t length = (size_t)fbuff.st_size;
+    if ((uintmax_t)fbuff.st_size != length || WORDS(length) + 1 > MAX_OBJECT_SIZE)
+    {
+        close(fd);
+        raise_syscall(taskData, "File too large", EFBIG);
+    }
+
+    // The object is placed at the end of the first page so that the data start
+    // on a page boundary and the file can be mapped there.  The rest of the
+    // space is filled with dummy objects.
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    PermanentMemSpace *space = gMem.NewMappedSpace(pageSize + length);
+    if (space == 0)
+    {
+        close(fd);
+        raise_syscall(taskData, "Insufficient memory", NOMEMORY);
+    }
+    PolyWord *objAddr = space->bottom + pageSize / sizeof(PolyWord) - 1;
+#ifdef POLYML32IN64
+    // Objects must be on an 8-byte boundary so the data can't be page-aligned.
+    objAddr--;
+#endif
+    PolyStringObject *result = (PolyStringObject*)objAddr;
+    bool mapped = false;
+#ifdef HAVE_SYS_MMAN_H
+    // The last page is mapped writable so that the unused part can be filled.
+    // Because it is private this does not change the file.
+    if (((uintptr_t)result->chars & (pageSize - 1)) == 0)
+        mapped = mmap(result->chars, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, 0) != MAP_FAILED;
+#endif
+    if (! mapped)
+    {
+        // Otherwise read the file into the space.  It is still outside the heap.
+        size_t haveRead = 0;
+        while (haveRead < length)
+        {
+            ssize_t res = read(fd, result->chars + haveRead, length - haveRead);
+            if (res > 0) haveRead += res;
+            else if (res < 0 && errno == EINTR) continue;
+            else
+            {
+                int err = res == 0 ? EIO : ERRORNUMBER;
+                close(fd);
+                gMem.DeleteMappedSpace(space);
+                raise_syscall(taskData, "Error while reading", err);
+            }
+        }
+    }
+    close(fd);
+
+    gMem.FillUnusedSpace(space->bottom, objAddr - space->bottom - 1);
+    result->SetLengthWord((POLYUNSIGNED)(WORDS(length) + 1), F_BYTE_OBJ);
+    result->length = (POLYUNSIGNED)length;
+    PolyWord *end = objAddr + WORDS(length) + 1;
+    if (end < space->top)
+        gMem.FillUnusedSpace(end, space->top - end);
+#ifdef HAVE_SYS_MMAN_H
+    // The vector is immutable so make the pages holding the data read-only.  A
+    // stray write then faults instead of making the vector differ from the file.
+    // The length word is in the first page which is left writable for the GC.
+    byte *dataPages = (byte*)(((uintptr_t)result->chars + pageSize - 1) & ~(uintptr_t)(pageSize - 1));
+    if (dataPages < (byte*)space->top)
+        (void)mprotect(dataPages, (byte*)space->top - dataPages, PROT_READ);
+#endif
+    mappedFiles.Add(space, result);
+    return SAVE(result);
+}
+
+POLYUNSIGNED PolyBasicIOMapFile(FirstArgument threadId, PolyWord fileName)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle pushedName = taskData->saveVec.push(fileName);
+    Handle result = 0;
+
+    try {
+        result = mapFile(taskData, pushedName);
+    }
+    catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
 struct _entrypts basicIOEPT[] =
 {
     { "PolyChDir",                      (polyRTSFunction)&PolyChDir},
     { "PolyBasicIOGeneral",             (polyRTSFunction)&PolyBasicIOGeneral},
     { "PolyPollIODescriptors",          (polyRTSFunction)&PolyPollIODescriptors },
     { "PolyPosixCreatePersistentFD",    (polyRTSFunction)&PolyPosixCreatePersistentFD},
+    { "PolyBasicIOMapFile",             (polyRTSFunction)&PolyBasicIOMapFile},
 
     { NULL, NULL} // End of list.
 };
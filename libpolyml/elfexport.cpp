@@ -118,6 +118,9 @@
 #include "version.h"
 #include "polystring.h"
 #include "timing.h"
+#include "gctaskfarm.h"
+
+#include <vector>
 
 #define sym_last_local_sym sym_data_section
 
@@ -275,6 +278,54 @@
 # error "No support for exporting on this architecture"
 #endif
 
+#if USE_RELA
+typedef ElfXX_Rela ElfXX_Reloc;
+#else
+typedef ElfXX_Rel ElfXX_Reloc;
+#endif
+
+#define RELOCATION_BUFFER_ENTRIES   4096
+
+// The relocations for an area.  With a single GC thread the areas are scanned
+// in turn and the relocations are written whenever the buffer is full.  With
+// more than one the areas are scanned by separate tasks, the relocations are
+// held in memory and each table is written in one go once the scan is complete.
+// References to external symbols are recorded during the scan and the
+// relocations for them added afterwards so that the symbols are numbered in
+// the same order whatever the number of threads.
+class ELFAreaRelocations
+{
+public:
+    ELFAreaRelocations(): outFile(0), written(0) {}
+
+    void add(const ElfXX_Reloc &reloc)
+    {
+        relocs.push_back(reloc);
+        if (outFile != 0 && relocs.size() >= RELOCATION_BUFFER_ENTRIES)
+            flush();
+    }
+
+    void flush()
+    {
+        if (relocs.size() == 0) return;
+        fwrite(&relocs[0], sizeof(ElfXX_Reloc), relocs.size(), outFile);
+        written += relocs.size() * sizeof(ElfXX_Reloc);
+        relocs.clear();
+    }
+
+    std::vector<ElfXX_Reloc> relocs;
+    FILE *outFile; // If this is set the buffer is written out when it is full.
+    size_t written; // Number of bytes written so far.
+
+    struct ExternalRef
+    {
+        void *relocAddr;
+        const char *name;
+        bool isFuncPtr;
+    };
+    std::vector<ExternalRef> externals;
+};
+
 // The first two symbols are special:
 // Zero is always special in ELF
 // 1 is used for the data section
@@ -291,20 +342,20 @@ enum {
     // Finally the symbol table
 };
 
-// Add an external reference to the RTS
-void ELFExport::addExternalReference(void *relocAddr, const char *name, bool isFuncPtr)
+ELFExport::~ELFExport()
 {
-    externTable.makeEntry(name);
-    // The symbol is added after the memory table entries and poly_exports
-    writeRelocation(0, relocAddr, symbolNum++, isFuncPtr);
+    delete[](areaRelocs);
 }
 
-// Generate the address relative to the start of the segment.
-void ELFExport::setRelocationAddress(void *p, ElfXX_Addr *reloc)
+// Add an external reference to the RTS.  This is recorded and the relocation
+// is created in writeRelocations.
+void ELFExport::addExternalReference(void *relocAddr, const char *name, bool isFuncPtr)
 {
-    unsigned area = findArea(p);
-    POLYUNSIGNED offset = (char*)p - (char*)memTable[area].mtOriginalAddr;
-    *reloc = offset;
+    ELFAreaRelocations::ExternalRef ref;
+    ref.relocAddr = relocAddr;
+    ref.name = name;
+    ref.isFuncPtr = isFuncPtr;
+    areaRelocs[findArea(relocAddr)].externals.push_back(ref);
 }
 
 /* Get the index corresponding to an address. */
@@ -326,7 +377,8 @@ PolyWord ELFExport::writeRelocation(POLYUNSIGNED offset, void *relocAddr, unsign
     ElfXX_Rel reloc;
 #endif
     // Set the offset within the section we're scanning.
-    setRelocationAddress(relocAddr, &reloc.r_offset);
+    unsigned area = findArea(relocAddr);
+    reloc.r_offset = (char*)relocAddr - (char*)memTable[area].mtOriginalAddr;
 #ifdef HOSTARCHITECTURE_MIPS64
     reloc.r_sym = symbolNum;
     reloc.r_ssym = 0;
@@ -336,8 +388,7 @@ PolyWord ELFExport::writeRelocation(POLYUNSIGNED offset, void *relocAddr, unsign
 #else
     reloc.r_info = ELFXX_R_INFO(symbolNum, isFuncPtr ? HOST_DIRECT_FPTR_RELOC : HOST_DIRECT_DATA_RELOC);
 #endif
-    fwrite(&reloc, sizeof(reloc), 1, exportFile);
-    relocationCount++;
+    areaRelocs[area].add(reloc);
     return PolyWord::FromUnsigned(offset);
 }
 
@@ -391,7 +442,8 @@ void ELFExport::ScanConstant(PolyObject *base, byte *addr, ScanRelocationKind co
 #else
             ElfXX_Rel reloc;
 #endif
-            setRelocationAddress(addr, &reloc.r_offset);
+            unsigned area = findArea(addr);
+            reloc.r_offset = (char*)addr - (char*)memTable[area].mtOriginalAddr;
             // We seem to need to subtract 4 bytes to get the correct offset in ELF
             offset -= 4;
             reloc.r_info = ELFXX_R_INFO(AreaToSym(aArea), R_PC_RELATIVE);
@@ -406,8 +458,7 @@ void ELFExport::ScanConstant(PolyObject *base, byte *addr, ScanRelocationKind co
                 offset >>= 8;
             }
 #endif
-            fwrite(&reloc, sizeof(reloc), 1, exportFile);
-            relocationCount++;
+            areaRelocs[area].add(reloc);
         }
         break;
 #endif
@@ -465,13 +516,63 @@ void ELFExport::createStructsRelocation(unsigned sym, size_t offset, size_t adde
 #else
     reloc.r_info = ELFXX_R_INFO(sym, HOST_DIRECT_DATA_RELOC);
 #endif
-    fwrite(&reloc, sizeof(reloc), 1, exportFile);
-    relocationCount++;
+    areaRelocs[memTableEntries].add(reloc);
+}
+
+// Task to create the relocation table for an area and turn all addresses into offsets.
+void ELFExport::relocateAreaTask(GCTaskId *, void *arg1, void *arg2)
+{
+    ELFExport *exports = (ELFExport *)arg1;
+    unsigned area = (unsigned)(uintptr_t)arg2;
+    char *start = (char*)exports->memTable[area].mtOriginalAddr;
+    char *end = start + exports->memTable[area].mtLength;
+    try {
+        for (PolyWord *p = (PolyWord*)start; p < (PolyWord*)end; )
+        {
+            p++;
+            PolyObject *obj = (PolyObject*)p;
+            POLYUNSIGNED length = obj->Length();
+            // Update any constants before processing the object
+            // We need that for relative jumps/calls in X86/64.
+            if (length != 0 && obj->IsCodeObject())
+                machineDependent->ScanConstantsWithinCode(obj, exports);
+            exports->relocateObject(obj);
+            p += length;
+        }
+    }
+    catch (std::bad_alloc &) {
+        exports->outOfMemory = true;
+    }
+}
+
+// Add the relocations for the external references in an area, in the order they
+// were found, and write the rest of the relocation table for the area.  Returns
+// the size of the table.
+size_t ELFExport::writeRelocations(unsigned area)
+{
+    ELFAreaRelocations *r = &areaRelocs[area];
+    r->outFile = exportFile;
+    try {
+        for (std::vector<ELFAreaRelocations::ExternalRef>::iterator i = r->externals.begin(); i < r->externals.end(); i++)
+        {
+            // The symbol is added after the memory table entries and poly_exports
+            unsigned index;
+            externTable.makeEntry(i->name, &index);
+            writeRelocation(0, i->relocAddr, symbolNum + index, i->isFuncPtr);
+        }
+    }
+    catch (std::bad_alloc &) {
+        throw MemoryException();
+    }
+    r->flush();
+    // Release the memory.
+    std::vector<ElfXX_Reloc>().swap(r->relocs);
+    std::vector<ELFAreaRelocations::ExternalRef>().swap(r->externals);
+    return r->written;
 }
 
 void ELFExport::exportStore(void)
 {
-    PolyWord    *p;
     ElfXX_Ehdr fhdr;
     ElfXX_Shdr *sections = 0;
 #ifdef __linux__
@@ -660,40 +761,47 @@ void ELFExport::exportStore(void)
     sections[numSections - 1].sh_type = SHT_PROGBITS;
 #endif
 
+    // Create the relocations.  If there is more than one GC thread each area
+    // is processed by a separate task.
+    areaRelocs = new ELFAreaRelocations[memTableEntries+1];
+    sortAreas(); // Before findArea is called by the tasks.
+    bool parallel = gpTaskFarm->ThreadCount() > 1;
+    if (parallel)
+    {
+        for (unsigned i = 0; i < memTableEntries; i++)
+        {
+            if ((memTable[i].mtFlags & (MTF_BYTES|MTF_WRITEABLE)) != MTF_BYTES)
+                gpTaskFarm->AddWorkOrRunNow(&ELFExport::relocateAreaTask, this, (void*)(uintptr_t)i);
+        }
+        gpTaskFarm->WaitForCompletion();
+    }
+
     // Write the relocations.
     unsigned relocSection = sect_data;
-    for (unsigned i = 0; i < memTableEntries; i++)
+    for (unsigned i = 0; i < memTableEntries && ! outOfMemory; i++)
     {
         relocSection++;
         if ((memTable[i].mtFlags & (MTF_BYTES|MTF_WRITEABLE)) == MTF_BYTES)
             continue;
         alignFile(sections[relocSection].sh_addralign);
         sections[relocSection].sh_offset = ftell(exportFile);
-        relocationCount = 0;
-        // Create the relocation table and turn all addresses into offsets.
-        char *start = (char*)memTable[i].mtOriginalAddr;
-        char *end = start + memTable[i].mtLength;
-        for (p = (PolyWord*)start; p < (PolyWord*)end; )
+        if (! parallel)
         {
-            p++;
-            PolyObject *obj = (PolyObject*)p;
-            POLYUNSIGNED length = obj->Length();
-            // Update any constants before processing the object
-            // We need that for relative jumps/calls in X86/64.
-            if (length != 0 && obj->IsCodeObject())
-                machineDependent->ScanConstantsWithinCode(obj, this);
-            relocateObject(obj);
-            p += length;
+            areaRelocs[i].outFile = exportFile;
+            relocateAreaTask(0, this, (void*)(uintptr_t)i);
         }
-        sections[relocSection].sh_size =
-            relocationCount * (USE_RELA ? sizeof(ElfXX_Rela) : sizeof(ElfXX_Rel));
+        sections[relocSection].sh_size = writeRelocations(i);
         relocSection++;
     }
+    if (outOfMemory)
+    {
+        delete[] sections;
+        throw MemoryException();
+    }
 
     // Relocations for "exports" and "memTable";
     alignFile(sections[sect_table_data+1].sh_addralign);
     sections[sect_table_data+1].sh_offset = ftell(exportFile);
-    relocationCount = 0;
     // TODO: This won't be needed if we put these in a separate section.
     POLYUNSIGNED areaSpace = 0;
     for (unsigned i = 0; i < memTableEntries; i++)
@@ -717,8 +825,7 @@ void ELFExport::exportStore(void)
             0 /* No offset relative to base symbol*/);
     }
 
-    sections[sect_table_data+1].sh_size =
-        relocationCount * (USE_RELA ? sizeof(ElfXX_Rela) : sizeof(ElfXX_Rel));
+    sections[sect_table_data+1].sh_size = writeRelocations(memTableEntries);
 
     // Now the symbol table.
     alignFile(sections[sect_symtab].sh_addralign);
@@ -749,7 +856,7 @@ void ELFExport::exportStore(void)
         writeSymbol(externTable.strings+i, 0, 0, STB_GLOBAL, STT_FUNC, SHN_UNDEF);
 
     sections[sect_symtab].sh_info = EXTRA_SYMBOLS+memTableEntries; // One more than last local sym
-    sections[sect_symtab].sh_size = sizeof(ElfXX_Sym) * symbolNum;
+    sections[sect_symtab].sh_size = sizeof(ElfXX_Sym) * (symbolNum + externTable.stringCount);
 
     // Now the binary data.
     unsigned dataSection = sect_data;
@@ -92,11 +92,14 @@ typedef struct
 #endif
 
 class TaskData;
+class GCTaskId;
+class ELFAreaRelocations;
 
 class ELFExport: public Exporter, public ScanAddress
 {
 public:
-    ELFExport(): relocationCount(0), symbolNum(0) {}
+    ELFExport(): areaRelocs(0), outOfMemory(false), symbolNum(0) {}
+    ~ELFExport();
 public:
     virtual void exportStore(void);
 
@@ -108,19 +111,24 @@ private:
     virtual void addExternalReference(void *addr, const char *name, bool isFuncPtr);
 
 private:
-    void setRelocationAddress(void *p, ElfXX_Addr *reloc);
     PolyWord createRelocation(PolyWord p, void *relocAddr);
     PolyWord writeRelocation(POLYUNSIGNED offset, void *relocAddr, unsigned symbolNum, bool isFuncPtr);
     void writeSymbol(const char *symbolName, long value, long size, int binding, int sttype, int section);
     unsigned long makeStringTableEntry(const char *str, ExportStringTable *stab);
     void alignFile(int align);
     void createStructsRelocation(unsigned area, size_t offset, size_t addend);
+    size_t writeRelocations(unsigned area);
+    static void relocateAreaTask(GCTaskId *, void *arg1, void *arg2);
 
-    unsigned relocationCount;
+    // The relocations for each area are built in memory by a task for the area.
+    // The entry after those for the areas holds the relocations for the table.
+    ELFAreaRelocations *areaRelocs;
+    bool outOfMemory; // Set if a task could not allocate memory for the relocations.
 
     // There are two tables - one is used for section names, the other for symbol names.
     ExportStringTable symStrings, sectionStrings;
-    // Table and count for external references.
+    // Table of external references.  The symbol for each follows those for
+    // the areas and poly_exports.
     ExportStringTable externTable;
     unsigned symbolNum;
 };
@@ -50,6 +50,14 @@
 #include <stdlib.h>
 #endif
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
 #if (defined(_WIN32))
 #include <tchar.h>
 #else
@@ -59,6 +67,8 @@
 #define _tcscat strcat
 #endif
 
+#include <algorithm>
+
 #include "exporter.h"
 #include "save_vec.h"
 #include "polystring.h"
@@ -72,6 +82,8 @@
 #include "processes.h" // For IO_SPACING
 #include "sys.h" // For EXC_Fail
 #include "rtsentry.h"
+#include "gctaskfarm.h"
+#include "mpoly.h" // For userOptions
 
 #include "pexport.h"
 
@@ -93,7 +105,7 @@
 
 extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyExport(FirstArgument threadId, PolyWord fileName, PolyWord root);
-    POLYEXTERNALSYMBOL POLYUNSIGNED PolyExportPortable(FirstArgument threadId, PolyWord fileName, PolyWord root);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyExportPortable(FirstArgument threadId, PolyWord fileName, PolyWord root, PolyWord binary);
 }
 
 /*
@@ -130,16 +142,147 @@ public:
     POLYUNSIGNED mutSize, noOverSize;
 };
 
-CopyScan::CopyScan(unsigned h/*=0*/): hierarchy(h)
+ExportFileBacking::ExportFileBacking(int f, bool c, uint64_t start, uint64_t a):
+    fd(f), endOffset(start), closeAtEnd(c), disabled(false), alignment(a)
+{
+}
+
+ExportFileBacking::~ExportFileBacking()
+{
+#ifndef _WIN32
+    if (closeAtEnd && fd != -1)
+        close(fd);
+#endif
+}
+
+ExportFileBacking *ExportFileBacking::CreateTemporary(const char *fileName)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    TempString dirName(strdup(fileName));
+    if (dirName == 0)
+        return 0;
+    char *slash = strrchr(dirName, '/');
+    if (slash == 0)
+        strcpy(dirName, ".");
+    else if (slash == dirName)
+        slash[1] = 0; // Root directory
+    else *slash = 0;
+    int fd = OSMem::CreateTemporaryFile(dirName);
+    if (fd == -1)
+        return 0;
+    return new ExportFileBacking(fd, true, 0, getpagesize());
+#endif
+}
+
+PermanentMemSpace *ExportFileBacking::NewExportSpace(uintptr_t words, bool mut, bool noOv, bool code)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    if (fd == -1 || disabled)
+        return 0;
+    uint64_t offset = (endOffset + alignment - 1) & ~(alignment - 1);
+    uint64_t bytes = ((uint64_t)words * sizeof(PolyWord) + alignment - 1) & ~(alignment - 1);
+    // The file must be long enough before the pages are written.  Allocate the
+    // blocks now rather than extending it with ftruncate.  If the file were
+    // sparse and the disc filled up, writing to a page would raise SIGBUS.
+    // Without posix_fallocate memory is used instead.
+    PermanentMemSpace *space = 0;
+#ifdef HAVE_POSIX_FALLOCATE
+    if (posix_fallocate(fd, (off_t)offset, (off_t)bytes) == 0)
+        space = gMem.NewExportSpace((uintptr_t)(bytes / sizeof(PolyWord)), mut, noOv, code, fd, offset);
+#endif
+    if (space == 0)
+    {
+        // Don't try again.  This will fail, for example, in 32-in-64 or if code
+        // needs a separate writable area.
+        if (debugOptions & DEBUG_SAVING)
+            Log("SAVE: Unable to map export space from file.  Using memory instead.\n");
+        if (ftruncate(fd, (off_t)endOffset) != 0) {}
+        disabled = true;
+        return 0;
+    }
+    try {
+        mappedSpaces.push_back(std::pair<PermanentMemSpace*, uint64_t>(space, offset));
+    }
+    catch (std::bad_alloc&) {
+        // The space will be deleted with the other export spaces.
+        disabled = true;
+        return 0;
+    }
+    endOffset = offset + bytes;
+    return space;
+#endif
+}
+
+bool ExportFileBacking::FileOffset(PermanentMemSpace *space, uint64_t &offset)
+{
+    for (std::vector<std::pair<PermanentMemSpace*, uint64_t> >::iterator i = mappedSpaces.begin(); i != mappedSpaces.end(); i++)
+    {
+        if (i->first == space)
+        {
+            offset = i->second;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Each thread copying the data has its own stack of objects that have been
+// copied but whose addresses have not yet been processed and its own export
+// spaces so that it can allocate without locking.  A worker is used by
+// at most one task at a time.
+class CopyScanWorker: public ScanAddress
+{
+public:
+    CopyScanWorker(): owner(0), active(false) {}
+
+    virtual POLYUNSIGNED ScanAddressAt(PolyWord *pt);
+    // Have to follow pointers from closures into code.
+    virtual POLYUNSIGNED ScanCodeAddressAt(PolyObject **pt);
+    virtual PolyObject *ScanObjectAddress(PolyObject *base);
+    virtual void ScanAddressesInObject(PolyObject *base, POLYUNSIGNED lengthWord);
+    void ScanAddressesInObject(PolyObject *base)
+        { ScanAddressesInObject(base, base->LengthWord()); }
+
+    POLYUNSIGNED CopyObject(PolyObject **pt);
+    void ScanObject(PolyObject *obj, POLYUNSIGNED lengthWord);
+    void PushToStack(PolyObject *obj);
+
+    CopyScan *owner;
+    bool active;
+    std::vector<PolyObject*> stack;
+    std::vector<PermanentMemSpace*> spaces;
+};
+
+CopyScan::CopyScan(unsigned h/*=0*/): hierarchy(h), copyLock("Copy scan")
 {
     defaultImmSize = defaultMutSize = defaultCodeSize = defaultNoOverSize = 0;
     tombs = 0;
     graveYard = 0;
+    backing = 0;
+    workers = 0;
+    nWorkers = nInUse = 0;
+    outOfMemory = false;
 }
 
 void CopyScan::initialise(bool isExport/*=true*/)
 {
     ASSERT(gMem.eSpaces.size() == 0);
+    // There is a worker for each GC thread up to the number given by the
+    // --exportthreads option.  The first is used by the calling thread to scan
+    // the roots and then released.  The default is a single worker because the
+    // layout of the output is only deterministic then.
+    nWorkers = gpTaskFarm->ThreadCount();
+    if (nWorkers > userOptions.exportthreads) nWorkers = userOptions.exportthreads;
+    if (nWorkers == 0) nWorkers = 1;
+    workers = new CopyScanWorker[nWorkers];
+    for (unsigned w = 0; w < nWorkers; w++)
+        workers[w].owner = this;
+    workers[0].active = true;
+    nInUse = 1;
     // Set the space sizes to a proportion of the space currently in use.
     // Computing these sizes is not obvious because CopyScan is used both
     // for export and for saved states.  For saved states in particular we
@@ -252,16 +395,133 @@ void CopyScan::initialise(bool isExport/*=true*/)
 
 CopyScan::~CopyScan()
 {
+    // Make sure there are no tasks still using the spaces.
+    if (nInUse != 0)
+        gpTaskFarm->WaitForCompletion();
     gMem.DeleteExportSpaces();
     if (graveYard)
         delete[](graveYard);
+    delete[](workers);
+}
+
+// Create a new export space.  Called by the workers.
+PermanentMemSpace *CopyScan::NewExportSpace(uintptr_t words, bool mut, bool noOv, bool code)
+{
+    PLocker lock(&copyLock);
+    PermanentMemSpace *space = 0;
+    if (backing != 0)
+        space = backing->NewExportSpace(words, mut, noOv, code);
+    if (space == 0)
+        space = gMem.NewExportSpace(words, mut, noOv, code);
+    return space;
+}
+
+// Start a new task to process an object if there is a free worker.  Because
+// nInUse is checked without the lock we may find that there is not.
+bool CopyScan::ForkNew(PolyObject *obj)
+{
+    CopyScanWorker *worker = 0;
+    {
+        PLocker lock(&copyLock);
+        if (nInUse == nWorkers)
+            return false;
+        for (unsigned w = 0; w < nWorkers; w++)
+        {
+            if (! workers[w].active)
+            {
+                worker = &workers[w];
+                break;
+            }
+        }
+        ASSERT(worker != 0);
+        worker->active = true;
+        nInUse++;
+    }
+    if (gpTaskFarm->AddWork(&CopyScan::CopyTask, worker, obj))
+        return true;
+    PLocker lock(&copyLock);
+    worker->active = false;
+    nInUse--;
+    return false;
+}
+
+// Copying task.  Processes the addresses in an object that has been copied and
+// everything copied as a result.
+void CopyScan::CopyTask(GCTaskId *, void *arg1, void *arg2)
+{
+    CopyScanWorker *worker = (CopyScanWorker*)arg1;
+    CopyScan *owner = worker->owner;
+    try {
+        worker->ScanAddressesInObject((PolyObject*)arg2);
+    }
+    catch (MemoryException &)
+    {
+        owner->outOfMemory = true;
+        worker->stack.clear();
+    }
+    PLocker lock(&owner->copyLock);
+    worker->active = false;
+    owner->nInUse--;
+}
+
+// Copy a root and everything reachable from it.  Other tasks may still be
+// copying when this returns.
+PolyObject *CopyScan::ScanObjectAddress(PolyObject *base)
+{
+    CopyScanWorker *worker = &workers[0];
+    ASSERT(worker->active);
+    if (outOfMemory)
+        return base;
+    try {
+        PolyObject *newAddr = worker->ScanObjectAddress(base);
+        worker->ScanAddressesInObject(newAddr, 0);
+        return newAddr;
+    }
+    catch (MemoryException &)
+    {
+        // Reported by WaitForCompletion.
+        outOfMemory = true;
+        worker->stack.clear();
+        return base;
+    }
+}
+
+// Update the addresses in a root object, typically in the permanent mutable area.
+void CopyScan::ScanAddressesInObject(PolyObject *base, POLYUNSIGNED lengthWord)
+{
+    CopyScanWorker *worker = &workers[0];
+    ASSERT(worker->active);
+    if (outOfMemory)
+        return;
+    try {
+        worker->ScanAddressesInObject(base, lengthWord);
+    }
+    catch (MemoryException &)
+    {
+        outOfMemory = true;
+        worker->stack.clear();
+    }
 }
 
+void CopyScan::WaitForCompletion(void)
+{
+    // Release the worker used for the roots.
+    {
+        PLocker lock(&copyLock);
+        if (workers[0].active)
+        {
+            workers[0].active = false;
+            nInUse--;
+        }
+    }
+    gpTaskFarm->WaitForCompletion();
+    ASSERT(nInUse == 0);
+    if (outOfMemory)
+        throw MemoryException();
+}
 
-// This function is called for each address in an object
-// once it has been copied to its new location.  We copy first
-// then scan to update the addresses.
-POLYUNSIGNED CopyScan::ScanAddressAt(PolyWord *pt)
+// The address of an object within an object that has been copied or in a root.
+POLYUNSIGNED CopyScanWorker::ScanAddressAt(PolyWord *pt)
 {
     PolyWord val = *pt;
     // Ignore integers.
@@ -269,15 +529,113 @@ POLYUNSIGNED CopyScan::ScanAddressAt(PolyWord *pt)
         return 0;
 
     PolyObject *obj = val.AsObjPtr();
-    POLYUNSIGNED l = ScanAddress(&obj);
+    POLYUNSIGNED l = CopyObject(&obj);
     *pt = obj;
     return l;
 }
 
-// This function is called for each address in an object
-// once it has been copied to its new location.  We copy first
-// then scan to update the addresses.
-POLYUNSIGNED CopyScan::ScanAddress(PolyObject **pt)
+// The address of code in the code area.  We treat this as a normal heap cell.
+// We will probably need to copy this and to process addresses within it.
+POLYUNSIGNED CopyScanWorker::ScanCodeAddressAt(PolyObject **pt)
+{
+    if (CopyObject(pt) != 0)
+        PushToStack(*pt);
+    return 0;
+}
+
+// Called for constants within code as well as for roots.
+PolyObject *CopyScanWorker::ScanObjectAddress(PolyObject *base)
+{
+    PolyObject *obj = base;
+    if (CopyObject(&obj) != 0)
+        PushToStack(obj);
+    return obj;
+}
+
+// Add an object that has been copied to the stack to have its addresses
+// processed.  If a worker is free and there is already other work on the
+// stack start a new task for it instead.
+void CopyScanWorker::PushToStack(PolyObject *obj)
+{
+    if (owner->nInUse >= owner->nWorkers || stack.size() < 2 || ! owner->ForkNew(obj))
+    {
+        try {
+            stack.push_back(obj);
+        }
+        catch (std::bad_alloc &) {
+            throw MemoryException();
+        }
+    }
+}
+
+// Process the addresses in an object and then in everything on the stack.
+// If the length word is zero the object has already been pushed.
+void CopyScanWorker::ScanAddressesInObject(PolyObject *obj, POLYUNSIGNED lengthWord)
+{
+    if (lengthWord != 0)
+        ScanObject(obj, lengthWord);
+    while (! stack.empty())
+    {
+        obj = stack.back();
+        stack.pop_back();
+        ScanObject(obj, obj->LengthWord());
+    }
+}
+
+// Process the addresses in a single object.  Anything that has not yet been
+// copied is copied and pushed to the stack rather than being processed recursively.
+void CopyScanWorker::ScanObject(PolyObject *obj, POLYUNSIGNED lengthWord)
+{
+    if (OBJ_IS_BYTE_OBJECT(lengthWord))
+        return;
+
+    POLYUNSIGNED length = OBJ_OBJECT_LENGTH(lengthWord);
+    PolyWord *baseAddr = (PolyWord*)obj;
+
+    if (OBJ_IS_CODE_OBJECT(lengthWord))
+    {
+        // Scan constants within the code.
+        machineDependent->ScanConstantsWithinCode(obj, obj, length, this);
+        // Skip to the constants and get ready to scan them.
+        obj->GetConstSegmentForCode(length, baseAddr, length);
+        // Adjust to the read-write area if necessary.
+        baseAddr = gMem.SpaceForAddress(baseAddr)->writeAble(baseAddr);
+    }
+    else if (OBJ_IS_CLOSURE_OBJECT(lengthWord))
+    {
+        // The first word is a code pointer so we need to treat it specially
+        // but it is possible it hasn't yet been set.
+        if ((*(uintptr_t*)baseAddr & 1) == 0)
+            ScanCodeAddressAt((PolyObject**)baseAddr);
+        baseAddr += sizeof(PolyObject*) / sizeof(PolyWord);
+        length -= sizeof(PolyObject*) / sizeof(PolyWord);
+    }
+
+    // Work from the end so that the first word is popped first.  For
+    // a list that means the head is processed before the tail.
+    for (PolyWord *pt = baseAddr + length; pt != baseAddr; )
+    {
+        pt--;
+        if (ScanAddressAt(pt) != 0)
+            PushToStack(pt->AsObjPtr());
+    }
+}
+
+// Get the new address from a forwarding pointer.
+static inline PolyObject *forwardedAddress(POLYUNSIGNED lengthWord, bool isCode)
+{
+#ifdef POLYML32IN64
+    if (isCode)
+        return (PolyObject*)(globalCodeBase + ((lengthWord & ~_OBJ_TOMBSTONE_BIT) << 1));
+#endif
+    return OBJ_GET_POINTER(lengthWord);
+}
+
+// Copy an object if it has not already been copied and update the address.
+// Returns the length word if the copy needs to be scanned.  Several threads
+// may try to copy the same object.  Each makes its own copy and then tries to
+// set the forwarding pointer and the losers discard theirs.
+POLYUNSIGNED CopyScanWorker::CopyObject(PolyObject **pt)
 {
     PolyObject *obj = *pt;
     MemSpace *space = gMem.SpaceForObjectAddress(obj);
@@ -289,55 +647,39 @@ POLYUNSIGNED CopyScan::ScanAddress(PolyObject **pt)
         return 0;
 
     // If this is at a lower level than the hierarchy we are saving
-    // then leave it untouched.
+    // then leave it untouched.  A file mapped into memory is copied.
     if (space->spaceType == ST_PERMANENT)
     {
         PermanentMemSpace *pmSpace = (PermanentMemSpace*)space;
-        if (pmSpace->hierarchy < hierarchy)
+        if (pmSpace->hierarchy < owner->hierarchy && ! pmSpace->mappedFile)
             return 0;
     }
 
-    // Have we already scanned this?
-    if (obj->ContainsForwardingPtr())
+    // The forwarding pointer goes in the length word except that the immutable
+    // permanent areas are read-only so it goes in the grave-yard.
+    PolyObject *forwardObj = obj;
+    if (space->spaceType == ST_PERMANENT && !space->isMutable && ((PermanentMemSpace*)space)->hierarchy == 0 &&
+            ! ((PermanentMemSpace*)space)->mappedFile)
     {
-        // Update the address to the new value.
-#ifdef POLYML32IN64
-        PolyObject *newAddr;
-        if (space->isCode)
-            newAddr = (PolyObject*)(globalCodeBase + ((obj->LengthWord() & ~_OBJ_TOMBSTONE_BIT) << 1));
-        else newAddr = obj->GetForwardingPtr();
-#else
-        PolyObject *newAddr = obj->GetForwardingPtr();
-#endif
-        *pt = newAddr;
-        return 0; // No need to scan it again.
-    }
-    else if (space->spaceType == ST_PERMANENT)
-    {
-        // See if we have this in the grave-yard.
-        for (unsigned i = 0; i < tombs; i++)
+        unsigned m;
+        for (m = 0; m < owner->tombs; m++)
         {
-            GraveYard *g = &graveYard[i];
+            GraveYard *g = &owner->graveYard[m];
             if ((PolyWord*)obj >= g->startAddr && (PolyWord*)obj < g->endAddr)
             {
-                PolyWord *tombAddr = g->graves + ((PolyWord*)obj - g->startAddr);
-                PolyObject *tombObject = (PolyObject*)tombAddr;
-                if (tombObject->ContainsForwardingPtr())
-                {
-#ifdef POLYML32IN64
-                    PolyObject *newAddr;
-                    if (space->isCode)
-                        newAddr = (PolyObject*)(globalCodeBase + ((tombObject->LengthWord() & ~_OBJ_TOMBSTONE_BIT) << 1));
-                    else newAddr = tombObject->GetForwardingPtr();
-#else
-                    PolyObject *newAddr = tombObject->GetForwardingPtr();
-#endif
-                    *pt = newAddr;
-                    return 0;
-                }
+                forwardObj = (PolyObject*)(g->graves + ((PolyWord*)obj - g->startAddr));
                 break; // No need to look further
             }
         }
+        ASSERT(m < owner->tombs); // Should be there.
+    }
+
+    // Have we already copied this?
+    POLYUNSIGNED forwardWord = forwardObj->LengthWord();
+    if (OBJ_IS_POINTER(forwardWord))
+    {
+        *pt = forwardedAddress(forwardWord, space->isCode);
+        return 0; // No need to scan it again.
     }
 
     // No, we need to copy it.
@@ -346,8 +688,6 @@ POLYUNSIGNED CopyScan::ScanAddress(PolyObject **pt)
     POLYUNSIGNED lengthWord = obj->LengthWord();
     POLYUNSIGNED words = OBJ_OBJECT_LENGTH(lengthWord);
 
-    PolyObject *newObj = 0;
-    PolyObject* writAble = 0;
     bool isMutableObj = obj->IsMutable();
     bool isNoOverwrite = false;
     bool isByteObj = obj->IsByteObject();
@@ -355,8 +695,10 @@ POLYUNSIGNED CopyScan::ScanAddress(PolyObject **pt)
     if (isMutableObj)
         isNoOverwrite = obj->IsNoOverwriteObject();
     else isCodeObj = obj->IsCodeObject();
-    // Allocate a new address for the object.
-    for (std::vector<PermanentMemSpace *>::iterator i = gMem.eSpaces.begin(); i < gMem.eSpaces.end(); i++)
+    // Allocate a new address for the object in one of this worker's spaces.
+    PermanentMemSpace *destSpace = 0;
+    bool newSpace = false;
+    for (std::vector<PermanentMemSpace *>::iterator i = spaces.begin(); i < spaces.end(); i++)
     {
         PermanentMemSpace *space = *i;
         if (isMutableObj == space->isMutable &&
@@ -368,63 +710,61 @@ POLYUNSIGNED CopyScan::ScanAddress(PolyObject **pt)
             size_t spaceLeft = space->top - space->topPointer;
             if (spaceLeft > words)
             {
-                newObj = (PolyObject*)(space->topPointer + 1);
-                writAble = space->writeAble(newObj);
-                space->topPointer += words + 1;
-#ifdef POLYML32IN64
-                // Maintain the odd-word alignment of topPointer
-                if ((words & 1) == 0 && space->topPointer < space->top)
-                {
-                    *space->writeAble(space->topPointer) = PolyWord::FromUnsigned(0);
-                    space->topPointer++;
-                }
-#endif
+                destSpace = space;
                 break;
             }
         }
     }
-    if (newObj == 0)
+    if (destSpace == 0)
     {
         // Didn't find room in the existing spaces.  Create a new space.
         uintptr_t spaceWords;
         if (isMutableObj)
         {
-            if (isNoOverwrite) spaceWords = defaultNoOverSize;
-            else spaceWords = defaultMutSize;
+            if (isNoOverwrite) spaceWords = owner->defaultNoOverSize;
+            else spaceWords = owner->defaultMutSize;
         }
         else
         {
-            if (isCodeObj) spaceWords = defaultCodeSize;
-            else spaceWords = defaultImmSize;
+            if (isCodeObj) spaceWords = owner->defaultCodeSize;
+            else spaceWords = owner->defaultImmSize;
         }
         if (spaceWords <= words)
             spaceWords = words + 1; // Make sure there's space for this object.
-        PermanentMemSpace *space = gMem.NewExportSpace(spaceWords, isMutableObj, isNoOverwrite, isCodeObj);
-        if (isByteObj) space->byteOnly = true;
-        if (space == 0)
+        destSpace = owner->NewExportSpace(spaceWords, isMutableObj, isNoOverwrite, isCodeObj);
+        if (destSpace == 0)
         {
             if (debugOptions & DEBUG_SAVING)
                 Log("SAVE: Unable to allocate export space, size: %lu.\n", spaceWords);
             // Unable to allocate this.
             throw MemoryException();
         }
-        newObj = (PolyObject*)(space->topPointer + 1);
-        writAble = space->writeAble(newObj);
-        space->topPointer += words + 1;
-#ifdef POLYML32IN64
-        // Maintain the odd-word alignment of topPointer
-        if ((words & 1) == 0 && space->topPointer < space->top)
-        {
-            *space->writeAble(space->topPointer) = PolyWord::FromUnsigned(0);
-            space->topPointer++;
+        if (isByteObj) destSpace->byteOnly = true;
+        newSpace = true;
+        try {
+            spaces.push_back(destSpace);
         }
-#endif
-        ASSERT(space->topPointer <= space->top && space->topPointer >= space->bottom);
+        catch (std::bad_alloc &) {
+            throw MemoryException();
+        }
+    }
+    PolyWord *oldTop = destSpace->topPointer;
+    PolyObject *newObj = (PolyObject*)(destSpace->topPointer + 1);
+    PolyObject *writAble = destSpace->writeAble(newObj);
+    destSpace->topPointer += words + 1;
+#ifdef POLYML32IN64
+    // Maintain the odd-word alignment of topPointer
+    if ((words & 1) == 0 && destSpace->topPointer < destSpace->top)
+    {
+        *destSpace->writeAble(destSpace->topPointer) = PolyWord::FromUnsigned(0);
+        destSpace->topPointer++;
     }
+#endif
+    ASSERT(destSpace->topPointer <= destSpace->top && destSpace->topPointer >= destSpace->bottom);
 
     writAble->SetLengthWord(lengthWord); // copy length word
 
-    if (hierarchy == 0 /* Exporting object module */ && isNoOverwrite && isMutableObj && !isByteObj)
+    if (owner->hierarchy == 0 /* Exporting object module */ && isNoOverwrite && isMutableObj && !isByteObj)
     {
         // These are not exported. They are used for special values e.g. mutexes
         // that should be set to 0/nil/NONE at start-up.
@@ -438,44 +778,31 @@ POLYUNSIGNED CopyScan::ScanAddress(PolyObject **pt)
     }
     else memcpy(writAble, obj, words * sizeof(PolyWord));
 
-    if (space->spaceType == ST_PERMANENT && !space->isMutable && ((PermanentMemSpace*)space)->hierarchy == 0)
-    {
-        // The immutable permanent areas are read-only.
-        unsigned m;
-        for (m = 0; m < tombs; m++)
-        {
-            GraveYard *g = &graveYard[m];
-            if ((PolyWord*)obj >= g->startAddr && (PolyWord*)obj < g->endAddr)
-            {
-                PolyWord *tombAddr = g->graves + ((PolyWord*)obj - g->startAddr);
-                PolyObject *tombObject = (PolyObject*)tombAddr;
-#ifdef POLYML32IN64
-                if (isCodeObj)
-                {
-                    POLYUNSIGNED ll = (POLYUNSIGNED)(((PolyWord*)newObj - globalCodeBase) >> 1 | _OBJ_TOMBSTONE_BIT);
-                    tombObject->SetLengthWord(ll);
-                }
-                else tombObject->SetForwardingPtr(newObj);
-#else
-                tombObject->SetForwardingPtr(newObj);
-#endif
-                break; // No need to look further
-            }
-        }
-        ASSERT(m < tombs); // Should be there.
-    }
-    else if (isCodeObj)
+    // Set the forwarding pointer unless another thread has got there first.
+    POLYUNSIGNED newForward;
 #ifdef POLYML32IN64
     // If this is a code address we can't use the usual forwarding pointer format.
     // Instead we have to compute the offset relative to the base of the code.
+    if (isCodeObj)
+        newForward = (POLYUNSIGNED)(((PolyWord*)newObj-globalCodeBase) >> 1 | _OBJ_TOMBSTONE_BIT);
+    else
+#endif
+        newForward = OBJ_SET_POINTER(newObj);
+    if (forwardObj == obj && isCodeObj)
+        forwardObj = space->writeAble(obj);
+    // There's no need for an atomic operation if there's only one worker.
+    if (owner->nWorkers == 1)
+        ((PolyWord*)forwardObj)[-1] = PolyWord::FromUnsigned(newForward);
+    else if (! atomiclySetForwarding(&owner->copyLock, (POLYUNSIGNED*)forwardObj, forwardWord, newForward))
     {
-        POLYUNSIGNED ll = (POLYUNSIGNED)(((PolyWord*)newObj-globalCodeBase) >> 1 | _OBJ_TOMBSTONE_BIT);
-        gMem.SpaceForObjectAddress(obj)->writeAble(obj)->SetLengthWord(ll);
+        // Another thread has copied it.  Discard our copy unless that would leave
+        // an empty space, in which case make it into a dummy object.
+        if (newSpace)
+            writAble->SetLengthWord(words, F_BYTE_OBJ);
+        else destSpace->topPointer = oldTop;
+        *pt = forwardedAddress(forwardObj->LengthWord(), space->isCode);
+        return 0;
     }
-#else
-        gMem.SpaceForObjectAddress(obj)->writeAble(obj)->SetForwardingPtr(newObj);
-#endif
-    else obj->SetForwardingPtr(newObj); // Put forwarding pointer in old object.
 
     if (OBJ_IS_CODE_OBJECT(lengthWord))
     {
@@ -491,26 +818,6 @@ POLYUNSIGNED CopyScan::ScanAddress(PolyObject **pt)
     return lengthWord;  // This new object needs to be scanned.
 }
 
-// The address of code in the code area.  We treat this as a normal heap cell.
-// We will probably need to copy this and to process addresses within it.
-POLYUNSIGNED CopyScan::ScanCodeAddressAt(PolyObject **pt)
-{
-    POLYUNSIGNED lengthWord = ScanAddress(pt);
-    if (lengthWord)
-        ScanAddressesInObject(*pt, lengthWord);
-    return 0;
-}
-
-PolyObject *CopyScan::ScanObjectAddress(PolyObject *base)
-{
-    PolyWord val = base;
-    // Scan this as an address. 
-    POLYUNSIGNED lengthWord = CopyScan::ScanAddressAt(&val);
-    if (lengthWord)
-        ScanAddressesInObject(val.AsObjPtr(), lengthWord);
-    return val.AsObjPtr();
-}
-
 #define MAX_EXTENSION   4 // The longest extension we may need to add is ".obj"
 
 // Convert the forwarding pointers in a region back into length words.
@@ -599,6 +906,10 @@ static void exporter(TaskData *taskData, Handle fileName, Handle root, const TCH
 #endif
     if (exports->exportFile == NULL)
         raise_syscall(taskData, "Cannot open export file", ERRORNUMBER);
+#ifndef _WIN32
+    // Hold the copy in a temporary file rather than in memory if possible.
+    exports->backing = ExportFileBacking::CreateTemporary(fileNameBuff);
+#endif
 
     // Request a full GC  to reduce the size of fix-ups.
     FullGC(taskData);
@@ -616,11 +927,13 @@ void Exporter::RunExport(PolyObject *rootFunction)
 
     PolyObject *copiedRoot = 0;
     CopyScan copyScan(hierarchy);
+    copyScan.backing = backing;
 
     try {
         copyScan.initialise();
         // Copy the root and everything reachable from it into the temporary area.
         copiedRoot = copyScan.ScanObjectAddress(rootFunction);
+        copyScan.WaitForCompletion();
     }
     catch (MemoryException &)
     {
@@ -648,6 +961,11 @@ void Exporter::RunExport(PolyObject *rootFunction)
         // Code areas are filled with objects from the bottom.
         FixForwarding(space->bottom, space->top - space->bottom);
     }
+    for (std::vector<PermanentMemSpace*>::iterator i = gMem.mSpaces.begin(); i < gMem.mSpaces.end(); i++)
+    {
+        MemSpace *space = *i;
+        FixForwarding(space->bottom, space->top - space->bottom);
+    }
 
     // Reraise the exception after cleaning up the forwarding pointers.
     if (copiedRoot == 0)
@@ -790,7 +1108,8 @@ POLYUNSIGNED PolyExport(FirstArgument threadId, PolyWord fileName, PolyWord root
     return TAGGED(0).AsUnsigned(); // Returns unit
 }
 
-POLYUNSIGNED PolyExportPortable(FirstArgument threadId, PolyWord fileName, PolyWord root)
+// Export in the portable format.  This is the text format unless binary is true.
+POLYUNSIGNED PolyExportPortable(FirstArgument threadId, PolyWord fileName, PolyWord root, PolyWord binary)
 {
     TaskData *taskData = TaskData::FindTaskForId(threadId);
     ASSERT(taskData != 0);
@@ -800,8 +1119,9 @@ POLYUNSIGNED PolyExportPortable(FirstArgument threadId, PolyWord fileName, PolyW
     Handle pushedRoot = taskData->saveVec.push(root);
 
     try {
-        PExport exports;
-        exporter(taskData, pushedName, pushedRoot, _T(".txt"), &exports);
+        bool isBinary = binary.UnTagged() != 0;
+        PExport exports(isBinary);
+        exporter(taskData, pushedName, pushedRoot, isBinary ? _T(".bin") : _T(".txt"), &exports);
     } catch (...) { } // If an ML exception is raised
 
     taskData->saveVec.reset(reset);
@@ -812,13 +1132,14 @@ POLYUNSIGNED PolyExportPortable(FirstArgument threadId, PolyWord fileName, PolyW
 
 // Helper functions for exporting.  We need to produce relocation information
 // and this code is common to every method.
-Exporter::Exporter(unsigned int h): exportFile(NULL), errorMessage(0), hierarchy(h), memTable(0), newAreas(0)
+Exporter::Exporter(unsigned int h): exportFile(NULL), errorMessage(0), backing(0), hierarchy(h), memTable(0), newAreas(0)
 {
 }
 
 Exporter::~Exporter()
 {
     delete[](memTable);
+    delete(backing);
     if (exportFile)
         fclose(exportFile);
 }
@@ -837,14 +1158,43 @@ void Exporter::createRelocation(PolyWord* pt)
     *gMem.SpaceForAddress(pt)->writeAble(pt) = createRelocation(*pt, pt);
 }
 
+class AreaAddressOrder
+{
+public:
+    AreaAddressOrder(struct _memTableEntry *t): table(t) {}
+    bool operator()(unsigned a, unsigned b) const
+        { return (char*)table[a].mtOriginalAddr < (char*)table[b].mtOriginalAddr; }
+    struct _memTableEntry *table;
+};
+
+void Exporter::sortAreas(void)
+{
+    areaOrder.resize(memTableEntries);
+    for (unsigned i = 0; i < memTableEntries; i++)
+        areaOrder[i] = i;
+    std::sort(areaOrder.begin(), areaOrder.end(), AreaAddressOrder(memTable));
+}
+
 // Check through the areas to see where the address is.  It must be
-// in one of them.
+// in one of them.  This is called for every relocation so the areas
+// are searched in address order.
 unsigned Exporter::findArea(void *p)
 {
-    for (unsigned i = 0; i < memTableEntries; i++)
+    if (areaOrder.size() != memTableEntries)
+        sortAreas();
+    // Find the number of areas that start below the address.
+    size_t lower = 0, upper = areaOrder.size();
+    while (lower < upper)
     {
-        if (p > memTable[i].mtOriginalAddr &&
-            p <= (char*)memTable[i].mtOriginalAddr + memTable[i].mtLength)
+        size_t middle = (lower + upper) / 2;
+        if ((char*)memTable[areaOrder[middle]].mtOriginalAddr < (char*)p)
+            lower = middle + 1;
+        else upper = middle;
+    }
+    if (lower != 0)
+    {
+        unsigned i = areaOrder[lower - 1];
+        if ((char*)p <= (char*)memTable[i].mtOriginalAddr + memTable[i].mtLength)
             return i;
     }
     { ASSERT(0); }
@@ -884,7 +1234,7 @@ void Exporter::relocateObject(PolyObject *p)
     }
 }
 
-ExportStringTable::ExportStringTable(): strings(0), stringSize(0), stringAvailable(0)
+ExportStringTable::ExportStringTable(): strings(0), stringSize(0), stringAvailable(0), stringCount(0)
 {
 }
 
@@ -893,9 +1243,54 @@ ExportStringTable::~ExportStringTable()
     free(strings);
 }
 
-// Add a string to the string table, growing it if necessary.
-unsigned long ExportStringTable::makeEntry(const char *str)
+static size_t hashString(const char *str)
 {
+    size_t hash = 2166136261U; // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)str; *p != 0; p++)
+        hash = (hash ^ *p) * 16777619U;
+    return hash;
+}
+
+// Double the size of the hash table and re-enter the strings.
+void ExportStringTable::growHashTable(void)
+{
+    std::vector<std::pair<unsigned long, unsigned> > oldTable;
+    oldTable.swap(hashTable);
+    try {
+        hashTable.resize(oldTable.size() == 0 ? 256 : oldTable.size() * 2);
+    }
+    catch (std::bad_alloc &) {
+        if (debugOptions & DEBUG_SAVING)
+            Log("SAVE: Unable to grow string hash table, entries: %u.\n", stringCount);
+        throw MemoryException();
+    }
+    size_t mask = hashTable.size() - 1;
+    for (std::vector<std::pair<unsigned long, unsigned> >::iterator i = oldTable.begin(); i < oldTable.end(); i++)
+    {
+        if (i->first == 0) continue;
+        size_t h = hashString(strings + i->first - 1) & mask;
+        while (hashTable[h].first != 0) h = (h + 1) & mask;
+        hashTable[h] = *i;
+    }
+}
+
+// Add a string to the string table, growing it if necessary.  The strings are
+// entered in a hash table so that each is only added once.
+unsigned long ExportStringTable::makeEntry(const char *str, unsigned *index)
+{
+    if ((stringCount + 1) * 2 > hashTable.size())
+        growHashTable();
+    size_t mask = hashTable.size() - 1;
+    size_t h = hashString(str) & mask;
+    while (hashTable[h].first != 0)
+    {
+        if (strcmp(strings + hashTable[h].first - 1, str) == 0)
+        {
+            if (index != 0) *index = hashTable[h].second;
+            return hashTable[h].first - 1;
+        }
+        h = (h + 1) & mask;
+    }
     unsigned len = (unsigned)strlen(str);
     unsigned long entry = stringSize;
     if (stringSize + len + 1 > stringAvailable)
@@ -914,6 +1309,9 @@ unsigned long ExportStringTable::makeEntry(const char *str)
      }
     strcpy(strings + stringSize, str);
     stringSize += len + 1;
+    hashTable[h] = std::pair<unsigned long, unsigned>(entry + 1, stringCount);
+    if (index != 0) *index = stringCount;
+    stringCount++;
     return entry;
 }
 
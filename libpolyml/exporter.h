@@ -28,9 +28,43 @@
 #include <stdio.h> // For FILE
 #endif
 
+#include <vector>
+
 class SaveVecEntry;
 typedef SaveVecEntry *Handle;
 class TaskData;
+class PermanentMemSpace;
+
+// The export spaces that hold the copy of the data being exported or saved can
+// be mapped from a file rather than allocated in memory.  The copy is then in
+// the file's pages, which the system can write out when memory is short, so
+// exporting does not need memory for a second copy of the heap.
+class ExportFileBacking
+{
+public:
+    // Spaces are placed in the file from startOffset at multiples of alignment,
+    // which must be a multiple of the page size.
+    ExportFileBacking(int fd, bool closeAtEnd, uint64_t startOffset, uint64_t alignment);
+    ~ExportFileBacking();
+    // Create a backing in a temporary file, if possible in the same directory as
+    // the file being written.  Returns null if a temporary file cannot be created.
+    // Not available in Windows.
+    static ExportFileBacking *CreateTemporary(const char *fileName);
+
+    // Create an export space mapped from the file.  Returns null if that is not possible.
+    PermanentMemSpace *NewExportSpace(uintptr_t words, bool mut, bool noOv, bool code);
+    // Returns true and sets the offset if the space is mapped from the file.
+    bool FileOffset(PermanentMemSpace *space, uint64_t &offset);
+
+    int fd;
+    uint64_t endOffset; // The end of the area used in the file.
+
+private:
+    bool closeAtEnd;
+    bool disabled; // Set if mapping failed.  Later spaces are allocated in memory.
+    uint64_t alignment;
+    std::vector<std::pair<PermanentMemSpace*, uint64_t> > mappedSpaces;
+};
 
 extern Handle exportNative(TaskData *mdTaskData, Handle args);
 extern Handle exportPortable(TaskData *mdTaskData, Handle args);
@@ -53,11 +87,15 @@ protected:
     void relocateObject(PolyObject *p);
     void createRelocation(PolyWord *pt);
     unsigned findArea(void *p); // Find index of area that address is in.
+    // Sort the areas by address for findArea.  This is done when findArea is
+    // first called but must be done explicitly if it may be called by several threads.
+    void sortAreas(void);
     virtual void addExternalReference(void *p, const char *entryPoint, bool isFuncPtr) {}
 
 public:
     FILE     *exportFile;
     const char *errorMessage;
+    ExportFileBacking *backing; // If non-null the export spaces are mapped from this.
 
 protected:
     unsigned int hierarchy;
@@ -65,6 +103,9 @@ protected:
     unsigned memTableEntries;
     PolyObject *rootFunction; // Address of the root function.
     unsigned newAreas;
+
+private:
+    std::vector<unsigned> areaOrder; // Indexes of the memTable entries in address order.
 };
 
 // The object-code exporters all use a similar string table format
@@ -74,13 +115,26 @@ class ExportStringTable
 public:
     ExportStringTable();
     ~ExportStringTable();
-    unsigned long makeEntry(const char *str);
+    // Add a string and return its offset.  If the string is already in the
+    // table the existing entry is used.  If index is not null it is set to
+    // the position of the string in the table, counting from zero.
+    unsigned long makeEntry(const char *str, unsigned *index = 0);
 
     char *strings;
     unsigned long stringSize, stringAvailable;
+    unsigned stringCount; // Number of different strings.
+
+private:
+    void growHashTable(void);
+    // Open hash table.  Each entry is the offset plus one and the position of
+    // a string or zero if it is empty.
+    std::vector<std::pair<unsigned long, unsigned> > hashTable;
 };
 
 #include "scanaddrs.h"
+#include "locking.h"
+
+class GCTaskId;
 
 // Because permanent immutable areas are read-only we need to
 // have somewhere else to hold the tomb-stones.
@@ -92,20 +146,26 @@ public:
     PolyWord *startAddr, *endAddr;
 };
 
+class CopyScanWorker;
+
+// Copies everything reachable from the roots into export spaces.  The
+// copying is done by tasks on the GC threads, each with its own stack and
+// its own export spaces, and forwarding pointers are set atomically.
+// The roots are scanned on the calling thread and WaitForCompletion must
+// be called before the copied data are used.
 class CopyScan: public ScanAddress
 {
 public:
     CopyScan(unsigned h=0);
     void initialise(bool isExport=true);
     ~CopyScan();
-protected:
-    virtual POLYUNSIGNED ScanAddressAt(PolyWord *pt);
-    // Have to follow pointers from closures into code.
-    virtual POLYUNSIGNED ScanCodeAddressAt(PolyObject **pt);
-    POLYUNSIGNED ScanAddress(PolyObject **pt);
 
-public:
+    // Copy the objects reachable from a root and return the new address of the root.
     virtual PolyObject *ScanObjectAddress(PolyObject *base);
+    // Called from ScanAddressesInRegion to update the addresses in a root object.
+    virtual void ScanAddressesInObject(PolyObject *base, POLYUNSIGNED lengthWord);
+    // Wait for the copying tasks.  Raises MemoryException if any of them ran out of space.
+    void WaitForCompletion(void);
 
     // Default sizes of the segments.
     uintptr_t defaultImmSize, defaultCodeSize, defaultMutSize, defaultNoOverSize;
@@ -113,6 +173,19 @@ public:
 
     GraveYard *graveYard;
     unsigned tombs;
+    ExportFileBacking *backing;
+
+private:
+    PermanentMemSpace *NewExportSpace(uintptr_t words, bool mut, bool noOv, bool code);
+    bool ForkNew(PolyObject *obj);
+    static void CopyTask(GCTaskId *, void *arg1, void *arg2);
+
+    CopyScanWorker *workers;
+    unsigned nWorkers, nInUse;
+    bool outOfMemory;
+    PLock copyLock; // Protects nInUse, the worker states and the creation of spaces.
+
+    friend class CopyScanWorker;
 };
 
 extern struct _entrypts exporterEPT[];
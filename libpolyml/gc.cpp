@@ -347,6 +347,7 @@ void CreateHeap()
     // Create the task farm if required
     if (userOptions.gcthreads != 1)
     {
+        gTaskFarm.SetAffinity(userOptions.gcaffinityCount, userOptions.gcaffinity);
         if (! gTaskFarm.Initialise(userOptions.gcthreads, 100))
             Crash("Unable to initialise the GC task farm");
     }
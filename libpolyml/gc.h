@@ -48,6 +48,11 @@ extern GCTaskFarm *gpTaskFarm;
 
 extern void CopyObjectToNewAddress(PolyObject *srcAddress, PolyObject *destAddress, POLYUNSIGNED L);
 
+// Set the length word of the object at pt to update unless another thread has
+// changed it from testVal.  The lock is only used if there is no atomic operation.
+class PLock;
+extern bool atomiclySetForwarding(PLock *lock, POLYUNSIGNED *pt, POLYUNSIGNED testVal, POLYUNSIGNED update);
+
 extern bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate);
 
 // GC Phases.
@@ -69,6 +69,18 @@ void MTGCCheckWeakRef::ScanRuntimeAddress(PolyObject **pt, RtsStrength weak)
     if (weak == STRENGTH_STRONG)
         return;
 
+    MemSpace *sp = gMem.SpaceForObjectAddress(val);
+    if (sp != 0 && sp->spaceType == ST_PERMANENT && ((PermanentMemSpace*)sp)->mappedFile)
+    {
+        // A file mapped into memory.  The mark phase sets the mark bit if it
+        // is reachable.  Clear it here.
+        POLYUNSIGNED L = val->LengthWord();
+        if (L & _OBJ_GC_MARK)
+            val->SetLengthWord(L & ~_OBJ_GC_MARK);
+        else *pt = 0;
+        return;
+    }
+
     LocalMemSpace *space = gMem.LocalSpaceForAddress(w.AsStackAddr()-1);
     if (space == 0)
         return; // Not in local area
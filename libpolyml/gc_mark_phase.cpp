@@ -295,6 +295,20 @@ void MTGCProcessMarkPointers::MarkPointersTask(GCTaskId *, void *arg1, void *arg
     ASSERT(marker->markStack[0] == 0);
 }
 
+// Objects in permanent areas are not marked except for files mapped into memory.
+// These are marked so that MTGCCheckWeakRef can tell whether they are still
+// reachable.  Several threads may set the bit at the same time but they all
+// write the same value.
+static inline void MarkMappedFile(MemSpace *sp, PolyObject *obj)
+{
+    if (sp != 0 && sp->spaceType == ST_PERMANENT && ((PermanentMemSpace*)sp)->mappedFile)
+    {
+        POLYUNSIGNED L = obj->LengthWord();
+        if ((L & _OBJ_GC_MARK) == 0)
+            obj->SetLengthWord(L | _OBJ_GC_MARK);
+    }
+}
+
 // Tests if this needs to be scanned.  It marks it if it has not been marked
 // unless it has to be scanned.
 bool MTGCProcessMarkPointers::TestForScan(PolyWord *pt)
@@ -316,7 +330,10 @@ bool MTGCProcessMarkPointers::TestForScan(PolyWord *pt)
 
     MemSpace *sp = gMem.SpaceForObjectAddress(obj);
     if (sp == 0 || (sp->spaceType != ST_LOCAL && sp->spaceType != ST_CODE))
+    {
+        MarkMappedFile(sp, obj);
         return false; // Ignore it if it points to a permanent area
+    }
 
     POLYUNSIGNED L = obj->LengthWord();
     if (L & _OBJ_GC_MARK)
@@ -351,7 +368,10 @@ PolyObject *MTGCProcessMarkPointers::ScanObjectAddress(PolyObject *obj)
     MemSpace *sp = gMem.SpaceForAddress((PolyWord*)obj-1);
 
     if (!(sp->spaceType == ST_LOCAL || sp->spaceType == ST_CODE))
+    {
+        MarkMappedFile(sp, obj);
         return obj; // Ignore it if it points to a permanent area
+    }
 
     // We may have a forwarding pointer if this has been moved by the
     // minor GC.
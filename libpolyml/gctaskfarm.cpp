@@ -47,6 +47,7 @@
 #include "gctaskfarm.h"
 #include "diagnostics.h"
 #include "timing.h"
+#include "processes.h"
 
 static GCTaskId gTask;
 
@@ -58,6 +59,8 @@ GCTaskFarm::GCTaskFarm(): workLock("GC task farm work")
     workQueue = 0;
     terminate = false;
     threadCount = activeThreadCount = 0;
+    startedThreads = affinityCount = 0;
+    affinity = 0;
     threadHandles = 0;
 }
 
@@ -159,6 +162,15 @@ void GCTaskFarm::ThreadFunction()
 #endif
     workLock.Lock();
     activeThreadCount++;
+    unsigned threadIndex = startedThreads++;
+    if (affinityCount != 0)
+    {
+        unsigned proc = affinity[threadIndex % affinityCount];
+        bool isSet = SetThreadAffinity(1, &proc);
+        if (debugOptions & DEBUG_GCTASKS)
+            Log("GCTask: Thread %p %s processor %u\n", &myTaskId,
+                isSet ? "restricted to" : "could not be restricted to", proc);
+    }
     while (! terminate) {
         // Invariant: We have the lock and the activeThreadCount includes this thread.
         // Find some work.
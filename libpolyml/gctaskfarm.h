@@ -53,6 +53,10 @@ public:
     // Posix fork in case there is a GC before the exec.
     void SetSingleThreaded() { threadCount = 0; queueSize = 0; }
 
+    // Set the processors for the worker threads.  Worker n is restricted to
+    // processor n modulo the count.  Must be called before Initialise.
+    void SetAffinity(unsigned count, const unsigned *procs) { affinityCount = count; affinity = procs; }
+
     bool AddWork(gctask task, void *arg1, void *arg2);
     void AddWorkOrRunNow(gctask task, void *arg1, void *arg2);
     void WaitForCompletion(void);
@@ -78,6 +82,9 @@ private:
     bool terminate; // Set to true to kill all workers.
     unsigned threadCount; // Count of workers.
     unsigned activeThreadCount; // Count of workers doing work.
+    unsigned startedThreads; // Used to give each worker an index for its affinity.
+    unsigned affinityCount;
+    const unsigned *affinity;
 
     void ThreadFunction(void);
 
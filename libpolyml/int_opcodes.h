@@ -130,6 +130,7 @@
 #define INSTR_clearMutable      0x95
 #define INSTR_atomicIncr        0x97 // Legacy
 #define INSTR_atomicDecr        0x98 // Legacy
+#define INSTR_atomicReset       0x99 // Legacy
 #define INSTR_equalWord         0xa0
 #define INSTR_lessSigned        0xa2
 #define INSTR_lessUnsigned      0xa3
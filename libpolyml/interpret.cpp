@@ -1019,6 +1019,16 @@ int IntTaskData::SwitchToPoly()
             break;
         }
 
+        case INSTR_atomicReset:
+        {
+            // Generated by the 5.8.1 compiler used for bootstrapping.
+            PLocker l(&mutexLock);
+            PolyObject* p = (*sp).w().AsObjPtr();
+            p->Set(0, TAGGED(0)); // Set this to released.
+            *sp = TAGGED(0); // Push the unit result
+            break;
+        }
+
         case INSTR_equalWord:
         {
             PolyWord u = *sp++;
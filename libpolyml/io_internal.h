@@ -186,6 +186,8 @@ extern Handle wrapFileDescriptor(TaskData *taskData, int fd);
 // Get a file descriptor and raise an exception if it is closed.
 extern int getStreamFileDescriptor(TaskData *taskData, PolyWord strm);
 extern int getStreamFileDescriptorWithoutCheck(PolyWord strm);
+// Forget the cached kind of a descriptor after its flags have been changed.
+extern void forgetDescriptorKind(int fd);
 
 #endif
 
@@ -0,0 +1,304 @@
+/*
+    Title:  ioreactor.cpp - Wait for file descriptors
+
+    Copyright (c) 2026 David C. J. Matthews
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License version 2.1 as published by the Free Software Foundation.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#elif defined(_WIN32)
+#include "winconfig.h"
+#else
+#error "No configuration file"
+#endif
+
+#if (!defined(_WIN32))
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "ioreactor.h"
+#include "locking.h"
+#include "rts_module.h"
+#include "diagnostics.h"
+
+#if (defined(HAVE_SYS_EPOLL_H) && defined(HAVE_POLL_H))
+#define USE_EPOLL_REACTOR 1
+#endif
+
+#ifdef USE_EPOLL_REACTOR
+
+// A thread waiting for any of a set of descriptors.
+class ReactorWaiter
+{
+public:
+    ReactorWaiter(struct pollfd *f, unsigned n): fds(f), nFds(n) {}
+    struct pollfd *fds;
+    unsigned nFds;
+    PWaitWord wakeUp;
+};
+
+typedef std::vector<ReactorWaiter*> WaiterList;
+
+// The reactor thread waits in epoll_wait for all the descriptors that
+// threads are blocked on.  Each descriptor is registered with EPOLLONESHOT
+// so once it has fired it is disabled until a waiter rearms it.
+class IOReactor: public RtsModule
+{
+public:
+    IOReactor(): reactorLock("IO reactor"), epollFd(-1), threadRunning(false), startFailed(false) {}
+    virtual void ForkChild(void);
+
+    bool Register(ReactorWaiter *waiter);
+    void Deregister(ReactorWaiter *waiter);
+
+private:
+    bool StartReactor(void);
+    bool Arm(int fd, const WaiterList &list, bool isNew);
+    void RemoveWaiter(ReactorWaiter *waiter);
+    void ReactorThread(void);
+    static void *ReactorThreadFunction(void *parameter);
+
+    // Protects the table.  An entry exists for every descriptor that has been
+    // added to the epoll set.  The list is empty if it has fired and the
+    // waiters have not yet removed themselves.
+    PLock reactorLock;
+    std::map<int, WaiterList> waiting;
+    int epollFd;
+    bool threadRunning, startFailed;
+};
+
+static IOReactor ioReactor;
+
+// Called with reactorLock held.
+bool IOReactor::StartReactor(void)
+{
+    if (startFailed) return false;
+#ifdef EPOLL_CLOEXEC
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    epollFd = epoll_create(64);
+#endif
+    if (epollFd >= 0)
+    {
+        pthread_attr_t attrs;
+        pthread_attr_init(&attrs);
+        pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED);
+        pthread_t threadId;
+        threadRunning = pthread_create(&threadId, &attrs, ReactorThreadFunction, this) == 0;
+        pthread_attr_destroy(&attrs);
+        if (threadRunning) return true;
+        close(epollFd);
+        epollFd = -1;
+    }
+    if (debugOptions & DEBUG_THREADS)
+        Log("THREAD: Unable to start the IO reactor - using poll\n");
+    startFailed = true;
+    return false;
+}
+
+// After a fork the child must not share the epoll set with the parent.
+void IOReactor::ForkChild(void)
+{
+    if (epollFd >= 0) close(epollFd);
+    epollFd = -1;
+    threadRunning = false;
+    waiting.clear();
+}
+
+// Add or modify the epoll entry so that it fires for any of the events
+// the waiters are interested in.
+bool IOReactor::Arm(int fd, const WaiterList &list, bool isNew)
+{
+    struct epoll_event event;
+    event.events = EPOLLONESHOT;
+    event.data.fd = fd;
+    for (WaiterList::const_iterator i = list.begin(); i != list.end(); i++)
+    {
+        for (unsigned j = 0; j < (*i)->nFds; j++)
+        {
+            if ((*i)->fds[j].fd != fd) continue;
+            short events = (*i)->fds[j].events;
+            if (events & POLLIN) event.events |= EPOLLIN;
+            if (events & POLLOUT) event.events |= EPOLLOUT;
+            if (events & POLLPRI) event.events |= EPOLLPRI;
+        }
+    }
+    if (epoll_ctl(epollFd, isNew ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event) == 0)
+        return true;
+    // The descriptor may have been closed and reopened since it was added.
+    if (! isNew && errno == ENOENT)
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+    return false;
+}
+
+bool IOReactor::Register(ReactorWaiter *waiter)
+{
+    PLocker lock(&reactorLock);
+    if (! threadRunning && ! StartReactor())
+        return false;
+    for (unsigned i = 0; i < waiter->nFds; i++)
+    {
+        int fd = waiter->fds[i].fd;
+        if (fd < 0) continue; // Ignored by poll.
+        std::map<int, WaiterList>::iterator entry = waiting.find(fd);
+        bool isNew = entry == waiting.end();
+        WaiterList &list = waiting[fd];
+        // The same descriptor may appear more than once.
+        if (std::find(list.begin(), list.end(), waiter) != list.end()) continue;
+        list.push_back(waiter);
+        if (! Arm(fd, list, isNew))
+        {
+            // epoll can't be used for this descriptor.
+            list.pop_back();
+            if (isNew) waiting.erase(fd);
+            RemoveWaiter(waiter);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Remove a waiter from the table.  Called with reactorLock held.  A descriptor
+// with no remaining waiters is removed from the epoll set.  Otherwise it is rearmed
+// in case it fired while this waiter was still registered.
+void IOReactor::RemoveWaiter(ReactorWaiter *waiter)
+{
+    for (unsigned i = 0; i < waiter->nFds; i++)
+    {
+        std::map<int, WaiterList>::iterator entry = waiting.find(waiter->fds[i].fd);
+        if (entry == waiting.end()) continue;
+        WaiterList &list = entry->second;
+        WaiterList::iterator w = std::find(list.begin(), list.end(), waiter);
+        // If it has fired the list will have been cleared.
+        if (w != list.end()) list.erase(w);
+        else if (! list.empty()) continue;
+        if (list.empty())
+        {
+            // This fails if the descriptor has been closed.
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, entry->first, NULL);
+            waiting.erase(entry);
+        }
+        else Arm(entry->first, list, false);
+    }
+}
+
+void IOReactor::Deregister(ReactorWaiter *waiter)
+{
+    PLocker lock(&reactorLock);
+    RemoveWaiter(waiter);
+}
+
+void IOReactor::ReactorThread(void)
+{
+    // Block all signals so they will be delivered to the main thread.
+    sigset_t active_signals;
+    sigfillset(&active_signals);
+    pthread_sigmask(SIG_SETMASK, &active_signals, NULL);
+    struct epoll_event events[64];
+    while (true)
+    {
+        int nEvents = epoll_wait(epollFd, events, sizeof(events)/sizeof(events[0]), -1);
+        if (nEvents < 0)
+        {
+            if (errno == EINTR) continue;
+            return;
+        }
+        PLocker lock(&reactorLock);
+        for (int i = 0; i < nEvents; i++)
+        {
+            std::map<int, WaiterList>::iterator entry = waiting.find(events[i].data.fd);
+            if (entry == waiting.end()) continue;
+            // Wake all the waiters.  Each will check its descriptors and either
+            // return or register again.
+            for (WaiterList::iterator w = entry->second.begin(); w != entry->second.end(); w++)
+                (*w)->wakeUp.Wake();
+            entry->second.clear();
+        }
+    }
+}
+
+void *IOReactor::ReactorThreadFunction(void *parameter)
+{
+    ((IOReactor*)parameter)->ReactorThread();
+    return 0;
+}
+
+#endif
+
+int WaitForDescriptors(struct pollfd *fds, unsigned nFds, unsigned maxMillisecs)
+{
+#ifdef USE_EPOLL_REACTOR
+    // See if any are already ready.  This also deals with descriptors such as
+    // regular files that epoll doesn't support.  poll reports them as ready.
+    int result = poll(fds, nFds, 0);
+    if (result != 0 || maxMillisecs == 0) return result;
+    // An empty list is used simply to wait.
+    if (nFds == 0) return poll(fds, nFds, maxMillisecs);
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct timespec deadline;
+    deadline.tv_sec = tv.tv_sec + maxMillisecs / 1000;
+    deadline.tv_nsec = (tv.tv_usec + (maxMillisecs % 1000) * 1000) * 1000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    ReactorWaiter waiter(fds, nFds);
+    while (true)
+    {
+        if (! ioReactor.Register(&waiter))
+            return poll(fds, nFds, maxMillisecs);
+        bool woken = waiter.wakeUp.WaitUntil(&deadline);
+        ioReactor.Deregister(&waiter);
+        result = poll(fds, nFds, 0);
+        // If we were woken but nothing is ready another waiter on the
+        // same descriptor may have been interested in a different event.
+        if (result != 0 || ! woken) return result;
+    }
+#else
+    return poll(fds, nFds, maxMillisecs);
+#endif
+}
+
+#endif
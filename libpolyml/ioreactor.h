@@ -0,0 +1,39 @@
+/*
+    Title:  ioreactor.h - Wait for file descriptors
+
+    Copyright (c) 2026 David C. J. Matthews
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License version 2.1 as published by the Free Software Foundation.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifndef IOREACTOR_H_INCLUDED
+#define IOREACTOR_H_INCLUDED
+
+#if (!defined(_WIN32))
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+// Wait until at least one of the descriptors is ready or the time has expired.
+// This has the same interface as "poll" and sets the revents fields.  Where epoll
+// is available the descriptors are registered with a single reactor thread that
+// wakes the caller when one of them becomes ready.  Otherwise this calls poll.
+// Unlike select there is no limit on the descriptor numbers.
+extern int WaitForDescriptors(struct pollfd *fds, unsigned nFds, unsigned maxMillisecs);
+
+#endif
+
+#endif
@@ -0,0 +1,1004 @@
+/*
+    Title:  iouring.cpp - Asynchronous IO through io_uring
+
+    Copyright (c) 2026 David C. J. Matthews
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License version 2.1 as published by the Free Software Foundation.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/*
+Reads and writes on file descriptors and sockets may be submitted to a single
+io_uring ring shared by all the ML threads.  A thread queues its request and then
+waits with the ML heap released.  Requests queued by several threads are
+submitted with one system call and a completion thread wakes the waiting threads.
+Since objects in the ML heap may be moved by the GC the data are transferred
+through buffers owned by the RTS.  A pool of these is registered with the kernel.
+
+The same mechanism provides the asynchronous read and write primitives in BinPrimIO.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#elif defined(_WIN32)
+#include "winconfig.h"
+#else
+#error "No configuration file"
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_ASSERT_H
+#include <assert.h>
+#define ASSERT(x) assert(x)
+#else
+#define ASSERT(x) 0
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#if (!defined(_WIN32))
+#include <pthread.h>
+#endif
+
+#include <map>
+#include <vector>
+
+#include "globals.h"
+#include "iouring.h"
+#include "ioreactor.h"
+#include "locking.h"
+#include "rts_module.h"
+#include "diagnostics.h"
+#include "processes.h"
+#include "run_time.h"
+#include "arb.h"
+#include "polystring.h"
+#include "save_vec.h"
+#include "io_internal.h"
+#include "rtsentry.h"
+#include "scanaddrs.h"
+
+extern "C" {
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyIOAsyncRead(FirstArgument threadId, PolyWord strm, PolyWord length);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyIOAsyncWrite(FirstArgument threadId, PolyWord strm, PolyWord args);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyIOAsyncIsComplete(FirstArgument threadId, PolyWord request);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyIOAsyncAwait(FirstArgument threadId, PolyWord request);
+}
+
+// IORING_FEAT_RW_CUR_POS was added at the same time as the read, write, send
+// and recv operations.  We need them all.
+#if (defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_SYSCALL_H) && defined(HAVE_SYS_MMAN_H) && \
+     defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup))
+#define USE_IO_URING 1
+#endif
+
+#define SAVE(x) taskData->saveVec.push(x)
+
+#define IOURING_ENTRIES         256         // Size of the submission queue
+#define IOURING_BUFFERS         32          // Number of registered buffers
+#define IOURING_BUFFER_SIZE     (64*1024)   // Size of each registered buffer
+#define IOURING_MAX_TRANSFER    (1024*1024) // Maximum size of a single operation
+
+#if (!defined(_WIN32))
+
+class IOUringOp
+{
+public:
+    IOUringOp(int k, int f, int flags): kind(k), fd(f), msgFlags(flags), buffer(0), bufferIndex(-1),
+        length(0), result(0), queued(false), complete(false), abandoned(false), completions(1) {}
+
+    int kind, fd, msgFlags;
+    byte *buffer;
+    int bufferIndex; // Index of the registered buffer or -1 if it was allocated with malloc.
+    size_t length;
+    int result; // Number of bytes or negated error code.
+    bool queued; // False if this is to be done synchronously in IOUringWait.
+    // These are protected by ringLock.
+    bool complete, abandoned;
+    // Number of completion entries still to come.  This includes the entry
+    // for a cancellation request so the memory isn't reused until then.
+    unsigned completions;
+    PWaitWord done;
+};
+
+class IOUring: public RtsModule
+{
+public:
+    IOUring();
+    virtual void ForkChild(void);
+
+    bool Available(void);
+    IOUringOp *Start(int kind, int fd, const byte *data, size_t length, int msgFlags);
+    void Flush(void);
+    bool Completed(IOUringOp *op);
+    void Abandon(IOUringOp *op);
+    bool Cancel(IOUringOp *op);
+    void Free(IOUringOp *op);
+
+private:
+    bool Setup(void);
+    void TearDown(void);
+    bool QueueFull(void);
+    struct io_uring_sqe *NextEntry(void);
+    void Reap(void);
+    void Completion(uint64_t userData, int res);
+    void FreeOp(IOUringOp *op);
+    void CompletionThread(void);
+    static void *CompletionThreadFunction(void *parameter);
+
+    PLock ringLock;
+    int ringFd;
+    bool startFailed;
+#ifdef USE_IO_URING
+    // The memory shared with the kernel.
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray, sqEntries;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+#endif
+    // Number of entries queued but not yet submitted.
+    unsigned toSubmit;
+    // Set while a thread is submitting.  Entries queued in the meantime are
+    // submitted by that thread before it clears this.
+    bool submitting;
+    // Registered buffers.
+    byte *bufferPool;
+    bool buffersRegistered;
+    std::vector<int> freeBuffers;
+};
+
+static IOUring ioUring;
+
+IOUring::IOUring(): ringLock("io_uring"), ringFd(-1), startFailed(false),
+    toSubmit(0), submitting(false), bufferPool(0), buffersRegistered(false)
+{
+#ifdef USE_IO_URING
+    sqRing = cqRing = 0;
+    sqes = 0;
+#endif
+}
+
+#ifdef USE_IO_URING
+
+// Set up the ring.  Called with ringLock held.
+bool IOUring::Setup(void)
+{
+    if (startFailed) return false;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = (int)syscall(__NR_io_uring_setup, IOURING_ENTRIES, &params);
+    // We need to be able to read and write at the current file position.
+    if (ringFd >= 0 && (params.features & IORING_FEAT_RW_CUR_POS) == 0)
+    {
+        close(ringFd);
+        ringFd = -1;
+    }
+    if (ringFd >= 0)
+    {
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            if (cqRingSize > sqRingSize) sqRingSize = cqRingSize;
+            cqRingSize = sqRingSize;
+        }
+        sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqRing = mmap(0, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            cqRing = sqRing;
+        else cqRing = mmap(0, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        sqes = (struct io_uring_sqe *)mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == (struct io_uring_sqe *)MAP_FAILED)
+            TearDown();
+    }
+    if (ringFd >= 0)
+    {
+        char *sq = (char*)sqRing, *cq = (char*)cqRing;
+        sqHead = (unsigned*)(sq + params.sq_off.head);
+        sqTail = (unsigned*)(sq + params.sq_off.tail);
+        sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+        sqArray = (unsigned*)(sq + params.sq_off.array);
+        sqEntries = params.sq_entries;
+        cqHead = (unsigned*)(cq + params.cq_off.head);
+        cqTail = (unsigned*)(cq + params.cq_off.tail);
+        cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+        // Register the buffers.  This may fail if the locked memory limit is too
+        // small in which case the buffers are used without registering them.
+        if (bufferPool == 0)
+        {
+            bufferPool = (byte*)malloc(IOURING_BUFFERS * IOURING_BUFFER_SIZE);
+            if (bufferPool != 0)
+            {
+                for (int i = IOURING_BUFFERS-1; i >= 0; i--)
+                    freeBuffers.push_back(i);
+            }
+        }
+        if (bufferPool != 0)
+        {
+            struct iovec iov[IOURING_BUFFERS];
+            for (unsigned i = 0; i < IOURING_BUFFERS; i++)
+            {
+                iov[i].iov_base = bufferPool + i * IOURING_BUFFER_SIZE;
+                iov[i].iov_len = IOURING_BUFFER_SIZE;
+            }
+            buffersRegistered =
+                syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, iov, IOURING_BUFFERS) == 0;
+        }
+
+        pthread_attr_t attrs;
+        pthread_attr_init(&attrs);
+        pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED);
+        pthread_t threadId;
+        bool threadRunning = pthread_create(&threadId, &attrs, CompletionThreadFunction, this) == 0;
+        pthread_attr_destroy(&attrs);
+        if (threadRunning)
+        {
+            if (debugOptions & DEBUG_THREADS)
+                Log("THREAD: Using io_uring%s\n", buffersRegistered ? " with registered buffers" : "");
+            return true;
+        }
+        TearDown();
+    }
+    if (debugOptions & DEBUG_THREADS)
+        Log("THREAD: io_uring is not available\n");
+    startFailed = true;
+    return false;
+}
+
+void IOUring::TearDown(void)
+{
+    if (sqes != 0 && sqes != (struct io_uring_sqe *)MAP_FAILED) munmap(sqes, sqesSize);
+    if (cqRing != 0 && cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+    if (sqRing != 0 && sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+    sqes = 0;
+    sqRing = cqRing = 0;
+    close(ringFd);
+    ringFd = -1;
+    buffersRegistered = false;
+}
+
+// After a fork the child must not share the ring with the parent.  Any operations
+// in progress belong to the parent.  The child sets up a new ring if it needs one.
+void IOUring::ForkChild(void)
+{
+    if (ringFd >= 0) TearDown();
+    startFailed = false;
+    toSubmit = 0;
+    submitting = false;
+}
+
+// Called with ringLock held.
+bool IOUring::QueueFull(void)
+{
+    return *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries;
+}
+
+// Return the next submission queue entry, cleared.  Called with ringLock held and
+// the queue not full.  The caller must call Flush after releasing the lock.
+struct io_uring_sqe *IOUring::NextEntry(void)
+{
+    unsigned tail = *sqTail;
+    unsigned index = tail & *sqMask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail+1, __ATOMIC_RELEASE);
+    toSubmit++;
+    return sqe;
+}
+
+IOUringOp *IOUring::Start(int kind, int fd, const byte *data, size_t length, int msgFlags)
+{
+    if (length > IOURING_MAX_TRANSFER) length = IOURING_MAX_TRANSFER;
+    IOUringOp *op = new IOUringOp(kind, fd, msgFlags);
+    bool useRing;
+    {
+        PLocker lock(&ringLock);
+        useRing = ringFd >= 0 || Setup();
+        if (length <= IOURING_BUFFER_SIZE && ! freeBuffers.empty())
+        {
+            op->bufferIndex = freeBuffers.back();
+            freeBuffers.pop_back();
+            op->buffer = bufferPool + op->bufferIndex * IOURING_BUFFER_SIZE;
+        }
+    }
+    if (op->buffer == 0)
+    {
+        op->buffer = (byte*)malloc(length == 0 ? 1 : length);
+        if (op->buffer == 0)
+        {
+            delete op;
+            return 0;
+        }
+    }
+    op->length = length;
+    if (data != 0) memcpy(op->buffer, data, length);
+    if (! useRing) return op;
+
+    ringLock.Lock();
+    // If the queue is full we have to submit the existing entries.  The kernel
+    // consumes them during the system call.
+    while (QueueFull())
+    {
+        ringLock.Unlock();
+        Flush();
+        ringLock.Lock();
+    }
+    bool fixed = op->bufferIndex >= 0 && buffersRegistered;
+    struct io_uring_sqe *sqe = NextEntry();
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)op->buffer;
+    sqe->len = (unsigned)length;
+    sqe->user_data = (uintptr_t)op;
+    switch (kind)
+    {
+    case IOURING_READ:
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->off = (uint64_t)-1; // Current position
+        break;
+    case IOURING_WRITE:
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->off = (uint64_t)-1;
+        break;
+    case IOURING_RECV:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->msg_flags = msgFlags;
+        break;
+    case IOURING_SEND:
+        sqe->opcode = IORING_OP_SEND;
+        sqe->msg_flags = msgFlags;
+        break;
+    }
+    if (fixed) sqe->buf_index = op->bufferIndex;
+    op->queued = true;
+    ringLock.Unlock();
+    return op;
+}
+
+// Submit the queued entries.  If another thread is already submitting it will
+// pick these up, so entries queued by several threads are submitted together.
+void IOUring::Flush(void)
+{
+    ringLock.Lock();
+    if (submitting || ringFd < 0)
+    {
+        ringLock.Unlock();
+        return;
+    }
+    submitting = true;
+    while (toSubmit != 0)
+    {
+        unsigned count = toSubmit;
+        ringLock.Unlock();
+        int res = (int)syscall(__NR_io_uring_enter, ringFd, count, 0, 0, NULL, 0);
+        int err = errno;
+        ringLock.Lock();
+        if (res > 0) toSubmit -= res;
+        else if (res < 0 && err != EINTR && err != EAGAIN && err != EBUSY)
+        {
+            // Fail the entries that have not been submitted.  The kernel has not
+            // seen them since no other thread can be submitting.
+            unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            for (unsigned i = head; i != *sqTail; i++)
+            {
+                struct io_uring_sqe *sqe = &sqes[sqArray[i & *sqMask]];
+                Completion(sqe->user_data, -err);
+            }
+            __atomic_store_n(sqTail, head, __ATOMIC_RELEASE);
+            toSubmit = 0;
+        }
+        // Operations that can be done immediately, such as reads from the page cache,
+        // have completed already.  Processing them here saves waiting for the completion thread.
+        Reap();
+    }
+    submitting = false;
+    ringLock.Unlock();
+}
+
+// Process the completion queue.  Called with ringLock held.
+void IOUring::Reap(void)
+{
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+        Completion(cqe->user_data, cqe->res);
+        head++;
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+// An entry has completed.  The user data is the address of the operation with
+// the bottom bit set if this was a request to cancel it.  Called with ringLock held.
+void IOUring::Completion(uint64_t userData, int res)
+{
+    IOUringOp *op = (IOUringOp*)(uintptr_t)(userData & ~(uint64_t)1);
+    if ((userData & 1) == 0)
+    {
+        op->result = res;
+        op->complete = true;
+    }
+    op->completions--;
+    if (! op->abandoned) op->done.Wake();
+    else if (op->completions == 0) FreeOp(op);
+}
+
+void IOUring::CompletionThread(void)
+{
+    // Block all signals so they will be delivered to the main thread.
+    sigset_t active_signals;
+    sigfillset(&active_signals);
+    pthread_sigmask(SIG_SETMASK, &active_signals, NULL);
+    int fd = ringFd;
+    while (true)
+    {
+        int res = (int)syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (res < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return;
+        PLocker lock(&ringLock);
+        Reap();
+    }
+}
+
+// Called when the waiting thread has been interrupted.  The buffer may still be in use
+// by the kernel so the operation is freed when it completes.
+void IOUring::Abandon(IOUringOp *op)
+{
+    ringLock.Lock();
+    if (op->complete || ! op->queued)
+    {
+        FreeOp(op);
+        ringLock.Unlock();
+        return;
+    }
+    op->abandoned = true;
+    // Try to cancel it.  If the queue is full it will complete eventually anyway.
+    if (! QueueFull())
+    {
+        struct io_uring_sqe *sqe = NextEntry();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)op;
+        sqe->user_data = (uintptr_t)op | 1;
+        op->completions++;
+    }
+    ringLock.Unlock();
+    Flush();
+}
+
+// Called when the waiting thread has an interrupt pending.  Try to cancel the
+// operation and wait until it has finished one way or the other.  Returns true
+// if nothing was transferred.  Otherwise a read has already taken the data from
+// the descriptor, or a write has sent it, and the result must be returned.
+bool IOUring::Cancel(IOUringOp *op)
+{
+    ringLock.Lock();
+    if (! op->complete)
+    {
+        while (QueueFull())
+        {
+            ringLock.Unlock();
+            Flush();
+            ringLock.Lock();
+        }
+        struct io_uring_sqe *sqe = NextEntry();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)op;
+        sqe->user_data = (uintptr_t)op | 1;
+        op->completions++;
+    }
+    ringLock.Unlock();
+    Flush();
+    // The buffer may be in use until all the completions have arrived.
+    ringLock.Lock();
+    while (op->completions != 0)
+    {
+        ringLock.Unlock();
+        op->done.Wait();
+        ringLock.Lock();
+    }
+    bool cancelled = op->result <= 0;
+    ringLock.Unlock();
+    return cancelled;
+}
+
+#else
+
+bool IOUring::Setup(void)
+{
+    startFailed = true;
+    return false;
+}
+
+void IOUring::ForkChild(void) {}
+void IOUring::Flush(void) {}
+void IOUring::Abandon(IOUringOp *op) { Free(op); }
+bool IOUring::Cancel(IOUringOp *) { return true; }
+
+IOUringOp *IOUring::Start(int kind, int fd, const byte *data, size_t length, int msgFlags)
+{
+    if (length > IOURING_MAX_TRANSFER) length = IOURING_MAX_TRANSFER;
+    IOUringOp *op = new IOUringOp(kind, fd, msgFlags);
+    op->buffer = (byte*)malloc(length == 0 ? 1 : length);
+    if (op->buffer == 0)
+    {
+        delete op;
+        return 0;
+    }
+    op->length = length;
+    if (data != 0) memcpy(op->buffer, data, length);
+    return op;
+}
+
+#endif
+
+bool IOUring::Available(void)
+{
+    PLocker lock(&ringLock);
+    return ringFd >= 0 || Setup();
+}
+
+bool IOUring::Completed(IOUringOp *op)
+{
+    PLocker lock(&ringLock);
+    return op->complete;
+}
+
+// Free an operation.  Called with ringLock held.
+void IOUring::FreeOp(IOUringOp *op)
+{
+    if (op->bufferIndex >= 0) freeBuffers.push_back(op->bufferIndex);
+    else free(op->buffer);
+    delete op;
+}
+
+void IOUring::Free(IOUringOp *op)
+{
+    PLocker lock(&ringLock);
+    FreeOp(op);
+}
+
+void *IOUring::CompletionThreadFunction(void *parameter)
+{
+#ifdef USE_IO_URING
+    ((IOUring*)parameter)->CompletionThread();
+#endif
+    return 0;
+}
+
+// Wait until a queued operation completes.
+class WaitIOUring: public Waiter
+{
+public:
+    WaitIOUring(IOUringOp *o): op(o) {}
+    virtual void Wait(unsigned maxMillisecs);
+private:
+    IOUringOp *op;
+};
+
+void WaitIOUring::Wait(unsigned maxMillisecs)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct timespec deadline;
+    deadline.tv_sec = tv.tv_sec + maxMillisecs / 1000;
+    deadline.tv_nsec = (tv.tv_usec + (maxMillisecs % 1000) * 1000) * 1000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    op->done.WaitUntil(&deadline);
+}
+
+// Wait until a descriptor is ready for an operation that is done synchronously.
+class WaitDescriptor: public Waiter
+{
+public:
+    WaitDescriptor(int fd, short events) { pfd.fd = fd; pfd.events = events; pfd.revents = 0; }
+    virtual void Wait(unsigned maxMillisecs) { WaitForDescriptors(&pfd, 1, maxMillisecs); }
+private:
+    struct pollfd pfd;
+};
+
+static short eventsFor(IOUringOp *op)
+{
+    return op->kind == IOURING_READ || op->kind == IOURING_RECV ? POLLIN : POLLOUT;
+}
+
+// Carry out an operation when the ring is not available.
+static int synchronousTransfer(TaskData *taskData, IOUringOp *op)
+{
+    while (true)
+    {
+        struct pollfd pfd;
+        pfd.fd = op->fd;
+        pfd.events = eventsFor(op);
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) != 0)
+        {
+            ssize_t res = 0;
+            switch (op->kind)
+            {
+            case IOURING_READ: res = read(op->fd, op->buffer, op->length); break;
+            case IOURING_WRITE: res = write(op->fd, op->buffer, op->length); break;
+            case IOURING_RECV: res = recv(op->fd, (char*)op->buffer, op->length, op->msgFlags); break;
+            case IOURING_SEND: res = send(op->fd, (char*)op->buffer, op->length, op->msgFlags); break;
+            }
+            if (res >= 0) return (int)res;
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) return -errno;
+        }
+        WaitDescriptor waiter(op->fd, eventsFor(op));
+        processes->ThreadPauseForIO(taskData, &waiter);
+    }
+}
+
+bool IOUringAvailable(void)
+{
+    return ioUring.Available();
+}
+
+IOUringOp *IOUringStart(int kind, int fd, const byte *data, size_t length, int msgFlags)
+{
+    return ioUring.Start(kind, fd, data, length, msgFlags);
+}
+
+bool IOUringIsComplete(IOUringOp *op)
+{
+    if (! op->queued)
+    {
+        struct pollfd pfd;
+        pfd.fd = op->fd;
+        pfd.events = eventsFor(op);
+        pfd.revents = 0;
+        return poll(&pfd, 1, 0) != 0;
+    }
+    ioUring.Flush();
+    return ioUring.Completed(op);
+}
+
+int IOUringWait(TaskData *taskData, IOUringOp *op)
+{
+    bool interrupted = false;
+    try {
+        // A synchronous transfer is only made when the descriptor is ready so
+        // an interrupt raised while waiting for that does not lose any data.
+        if (! op->queued)
+            return synchronousTransfer(taskData, op);
+        ioUring.Flush();
+        WaitIOUring waiter(op);
+        while (! interrupted && ! ioUring.Completed(op))
+            interrupted = processes->ThreadWaitForIO(taskData, &waiter);
+    }
+    catch (...) {
+        ioUring.Abandon(op);
+        throw;
+    }
+    // If we have been interrupted the operation is cancelled.  If it has
+    // already transferred data it returns the result and the interrupt remains
+    // pending.  The buffer may not be reused until the kernel has finished with it.
+    if (interrupted)
+    {
+        processes->ThreadReleaseMLMemory(taskData);
+        bool cancelled = ioUring.Cancel(op);
+        processes->ThreadUseMLMemory(taskData);
+        if (cancelled)
+        {
+            try {
+                processes->TestAnyEvents(taskData);
+            }
+            catch (...) {
+                ioUring.Free(op);
+                throw;
+            }
+        }
+    }
+    return op->result;
+}
+
+const byte *IOUringData(IOUringOp *op)
+{
+    return op->buffer;
+}
+
+void IOUringFree(IOUringOp *op)
+{
+    ioUring.Free(op);
+}
+
+// Asynchronous requests from ML.  ML holds a token, a mutable cell containing the
+// request number.  The entry is removed from the table when the request is awaited.
+// The table holds a weak reference to the token so that a request that is never
+// awaited is abandoned once the token is no longer reachable.
+class AsyncRequest
+{
+public:
+    AsyncRequest(PolyObject *t = 0, IOUringOp *o = 0): token(t), op(o) {}
+    PolyObject *token;
+    IOUringOp *op;
+};
+
+class AsyncRequests: public RtsModule
+{
+public:
+    AsyncRequests(): asyncLock("Async IO"), nextRequest(0) {}
+    virtual void GarbageCollect(ScanAddress *process);
+    virtual void ForkChild(void);
+    Handle Add(TaskData *taskData, IOUringOp *op);
+    IOUringOp *Find(PolyWord token);
+    IOUringOp *Take(PolyWord token);
+
+    PLock asyncLock;
+private:
+    std::map<POLYUNSIGNED, AsyncRequest> requests;
+    POLYUNSIGNED nextRequest;
+};
+
+static AsyncRequests asyncRequests;
+
+Handle AsyncRequests::Add(TaskData *taskData, IOUringOp *op)
+{
+    Handle token;
+    try {
+        token = alloc_and_save(taskData, 1, F_MUTABLE_BIT);
+    }
+    catch (...) {
+        ioUring.Abandon(op);
+        throw;
+    }
+    PLocker lock(&asyncLock);
+    POLYUNSIGNED request = ++nextRequest;
+    token->WordP()->Set(0, TAGGED(request));
+    requests[request] = AsyncRequest(token->WordP(), op);
+    return token;
+}
+
+// Return the operation or null if it has already been awaited.  Called with asyncLock held.
+IOUringOp *AsyncRequests::Find(PolyWord token)
+{
+    std::map<POLYUNSIGNED, AsyncRequest>::iterator i =
+        requests.find(token.AsObjPtr()->Get(0).UnTaggedUnsigned());
+    return i == requests.end() ? 0 : i->second.op;
+}
+
+// Remove a request from the table.  Returns null if it has already been awaited.
+IOUringOp *AsyncRequests::Take(PolyWord token)
+{
+    PLocker lock(&asyncLock);
+    std::map<POLYUNSIGNED, AsyncRequest>::iterator i =
+        requests.find(token.AsObjPtr()->Get(0).UnTaggedUnsigned());
+    if (i == requests.end()) return 0;
+    IOUringOp *op = i->second.op;
+    requests.erase(i);
+    return op;
+}
+
+// Update the tokens and abandon any requests whose tokens are unreachable.  The
+// ML threads are stopped so no other thread can be using the table.
+void AsyncRequests::GarbageCollect(ScanAddress *process)
+{
+    for (std::map<POLYUNSIGNED, AsyncRequest>::iterator i = requests.begin(); i != requests.end(); )
+    {
+        process->ScanRuntimeAddress(&i->second.token, ScanAddress::STRENGTH_WEAK);
+        if (i->second.token == 0)
+        {
+            ioUring.Abandon(i->second.op);
+            requests.erase(i++);
+        }
+        else i++;
+    }
+}
+
+// The requests belong to the parent.  Free the child's copies.
+void AsyncRequests::ForkChild(void)
+{
+    for (std::map<POLYUNSIGNED, AsyncRequest>::iterator i = requests.begin(); i != requests.end(); i++)
+        ioUring.Free(i->second.op);
+    requests.clear();
+}
+
+static Handle startAsync(TaskData *taskData, int kind, int fd, const byte *data, size_t length)
+{
+    IOUringOp *op = IOUringStart(kind, fd, data, length, 0);
+    if (op == 0) raise_syscall(taskData, "Unable to allocate buffer", ENOMEM);
+    Handle token = asyncRequests.Add(taskData, op);
+    // Submit it now so that it runs while the thread continues.
+    ioUring.Flush();
+    return token;
+}
+
+#endif
+
+// Start an asynchronous read of up to "length" bytes.  Returns the token for the request.
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyIOAsyncRead(FirstArgument threadId, PolyWord strm, PolyWord length)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle result = 0;
+
+    try {
+#if (!defined(_WIN32))
+        int fd = getStreamFileDescriptor(taskData, strm);
+        size_t len = getPolyUnsigned(taskData, length);
+        result = startAsync(taskData, IOURING_READ, fd, 0, len);
+#else
+        raise_fail(taskData, "Asynchronous IO is not implemented");
+#endif
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
+// Start an asynchronous write.  The argument is the base address, offset and length.
+// The data are copied before this returns.
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyIOAsyncWrite(FirstArgument threadId, PolyWord strm, PolyWord args)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle result = 0;
+
+    try {
+#if (!defined(_WIN32))
+        int fd = getStreamFileDescriptor(taskData, strm);
+        PolyObject *argObj = args.AsObjPtr();
+        byte *base = argObj->Get(0).AsObjPtr()->AsBytePtr();
+        POLYUNSIGNED offset = getPolyUnsigned(taskData, argObj->Get(1));
+        size_t len = getPolyUnsigned(taskData, argObj->Get(2));
+        result = startAsync(taskData, IOURING_WRITE, fd, base + offset, len);
+#else
+        raise_fail(taskData, "Asynchronous IO is not implemented");
+#endif
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
+// Test whether a request has finished.  Returns true if it has already been awaited.
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyIOAsyncIsComplete(FirstArgument threadId, PolyWord request)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    bool complete = true;
+
+#if (!defined(_WIN32))
+    {
+        PLocker lock(&asyncRequests.asyncLock);
+        IOUringOp *op = asyncRequests.Find(request);
+        if (op != 0) complete = IOUringIsComplete(op);
+    }
+#endif
+
+    taskData->PostRTSCall();
+    return TAGGED(complete ? 1 : 0).AsUnsigned();
+}
+
+// Wait for a request to finish.  Returns the data as a vector for a read and
+// the number of bytes written for a write.
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyIOAsyncAwait(FirstArgument threadId, PolyWord request)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle result = 0;
+
+    try {
+#if (!defined(_WIN32))
+        IOUringOp *op = asyncRequests.Take(request);
+        if (op == 0) raise_fail(taskData, "Request has already been awaited");
+        // If this raises an exception the operation is cancelled.
+        int res = IOUringWait(taskData, op);
+        bool isRead = op->kind == IOURING_READ;
+        if (res >= 0 && isRead)
+        {
+            try {
+                result = SAVE(C_string_to_Poly(taskData, (const char*)IOUringData(op), res));
+            }
+            catch (...) {
+                IOUringFree(op);
+                throw;
+            }
+        }
+        IOUringFree(op);
+        if (res < 0) raise_syscall(taskData, isRead ? "Error while reading" : "Error while writing", -res);
+        if (! isRead) result = Make_fixed_precision(taskData, res);
+#else
+        raise_fail(taskData, "Asynchronous IO is not implemented");
+#endif
+    }
+    catch (KillException &) {
+        processes->ThreadExit(taskData); // TestAnyEvents may test for kill
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
+struct _entrypts ioUringEPT[] =
+{
+    { "PolyIOAsyncRead",                (polyRTSFunction)&PolyIOAsyncRead},
+    { "PolyIOAsyncWrite",               (polyRTSFunction)&PolyIOAsyncWrite},
+    { "PolyIOAsyncIsComplete",          (polyRTSFunction)&PolyIOAsyncIsComplete},
+    { "PolyIOAsyncAwait",               (polyRTSFunction)&PolyIOAsyncAwait},
+
+    { NULL, NULL} // End of list.
+};
@@ -0,0 +1,70 @@
+/*
+    Title:  iouring.h - Asynchronous IO through io_uring
+
+    Copyright (c) 2026 David C. J. Matthews
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License version 2.1 as published by the Free Software Foundation.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifndef IOURING_H_INCLUDED
+#define IOURING_H_INCLUDED
+
+#include "globals.h" // For byte
+
+class TaskData;
+class IOUringOp;
+
+// Kinds of operation.  Reads and writes use the current file position.
+enum {
+    IOURING_READ,
+    IOURING_WRITE,
+    IOURING_RECV,
+    IOURING_SEND
+};
+
+// Returns true if operations are submitted to a shared io_uring ring.  This is
+// only the case on Linux when the kernel supports it.  If it returns false callers
+// should use their existing code.
+extern bool IOUringAvailable(void);
+
+// Start an operation on a descriptor.  The data are transferred through a buffer
+// owned by the RTS, preferably one registered with the kernel, so that the ML heap
+// may be garbage-collected while the operation is in progress.  For writes and sends
+// the data are copied into the buffer here.  The length may be reduced so the
+// operation may transfer fewer bytes than requested.  Operations are queued and
+// submitted together when a thread next waits, so several threads can share a
+// single system call.  If the ring is not available the operation is carried out
+// when it is waited for.  Returns null if the buffer could not be allocated.
+extern IOUringOp *IOUringStart(int kind, int fd, const byte *data, size_t length, int msgFlags);
+
+// Test whether the operation has finished.  If the ring is not available this
+// tests whether the descriptor is ready.
+extern bool IOUringIsComplete(IOUringOp *op);
+
+// Wait for the operation to finish, releasing the ML heap while waiting.  Returns
+// the number of bytes transferred or a negated error code.  If the thread is
+// interrupted the operation is cancelled and freed and the interrupt is raised.
+// If the operation had already transferred data the result is returned instead
+// and the interrupt is raised at the next check so that no data are lost.
+extern int IOUringWait(TaskData *taskData, IOUringOp *op);
+
+// The data read by a completed operation.
+extern const byte *IOUringData(IOUringOp *op);
+
+extern void IOUringFree(IOUringOp *op);
+
+extern struct _entrypts ioUringEPT[];
+
+#endif
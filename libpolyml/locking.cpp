@@ -70,6 +70,14 @@
 #include <stdio.h>
 #endif
 
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#endif
+
 #include "locking.h"
 #include "diagnostics.h"
 
@@ -226,6 +234,97 @@ void PCondVar::Signal(void)
 #endif
 }
 
+#ifdef USE_FUTEX_WAITWORD
+static long futex(volatile int *addr, int op, int val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+PWaitWord::PWaitWord(): value(0)
+{
+}
+
+void PWaitWord::Wait(void)
+{
+    while (true)
+    {
+        // Consume a wake-up if there is one.
+        if (__sync_bool_compare_and_swap(&value, 1, 0))
+            return;
+        // Otherwise indicate that we are waiting and block.  This returns
+        // immediately if the value has changed.
+        if (__sync_bool_compare_and_swap(&value, 0, 2) || value == 2)
+            futex(&value, FUTEX_WAIT_PRIVATE, 2, NULL);
+    }
+}
+
+bool PWaitWord::WaitUntil(const timespec *timeArg)
+{
+    while (true)
+    {
+        if (__sync_bool_compare_and_swap(&value, 1, 0))
+            return true;
+        if (__sync_bool_compare_and_swap(&value, 0, 2) || value == 2)
+        {
+            // FUTEX_WAIT_BITSET takes an absolute time.
+            if (futex(&value, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME, 2, timeArg) != 0 &&
+                    errno == ETIMEDOUT)
+            {
+                // Timed out.  If we have been woken in the meantime we
+                // go round again and consume it.
+                if (__sync_bool_compare_and_swap(&value, 2, 0))
+                    return false;
+            }
+        }
+    }
+}
+
+void PWaitWord::Wake(void)
+{
+    int old;
+    do {
+        old = value;
+    } while (! __sync_bool_compare_and_swap(&value, old, 1));
+    // Only make the system call if the thread is actually waiting.
+    if (old == 2)
+        futex(&value, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
+
+#else
+// Other systems use a lock and condition variable.  The lock is held only briefly.
+PWaitWord::PWaitWord(): lock("Wait word"), woken(false)
+{
+}
+
+void PWaitWord::Wait(void)
+{
+    PLocker l(&lock);
+    while (! woken)
+        cond.Wait(&lock);
+    woken = false;
+}
+
+#if (defined(_WIN32))
+bool PWaitWord::WaitUntil(const FILETIME *timeArg)
+#else
+bool PWaitWord::WaitUntil(const timespec *timeArg)
+#endif
+{
+    PLocker l(&lock);
+    if (! woken)
+        cond.WaitUntil(&lock, timeArg);
+    bool result = woken;
+    woken = false;
+    return result;
+}
+
+void PWaitWord::Wake(void)
+{
+    PLocker l(&lock);
+    woken = true;
+    cond.Signal();
+}
+#endif
 
 // Initialise a semphore.  Tries to create an unnamed semaphore if
 // it can but tries a named semaphore if it can't.  Mac OS X only
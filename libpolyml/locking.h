@@ -103,6 +103,47 @@ private:
 #endif
 };
 
+// A wait word for a single waiting thread.  Wake may be called by any thread
+// at any time and does not need a lock.  If the waiter is not currently
+// waiting the wake-up is remembered and the next call to Wait or WaitUntil
+// returns immediately.  On Linux this uses a futex so that waking a thread
+// that is not waiting does not involve a system call.
+// Remembering the wake-up means that a waker does not have to know whether
+// the waiter has reached Wait yet.  The I/O reactor relies on this: a thread
+// registers its descriptors and then waits, and the reactor may wake it in
+// between.  The cost is that a wake-up that arrives after WaitUntil has timed
+// out is still pending, so a later wait on the same word returns at once.
+// A return from Wait or WaitUntil is therefore only a hint and the caller
+// must test its own condition again.  The reactor uses a new word for each
+// call and the io_uring code tests the state of the operation after each wait.
+// Condition variables can't use this because a wait that returned early
+// would appear to the ML code as a signal.
+#if (defined(HAVE_LINUX_FUTEX_H) && defined(HAVE_SYS_SYSCALL_H) && defined(HAVE_SYNC_FETCH))
+#define USE_FUTEX_WAITWORD 1
+#endif
+
+class PWaitWord {
+public:
+    PWaitWord();
+    void Wait(void);
+    // Wait until woken or until the absolute time.  Returns true if it was woken.
+#if (defined(_WIN32))
+    bool WaitUntil(const FILETIME *timeArg);
+#else
+    bool WaitUntil(const timespec *timeArg);
+#endif
+    void Wake(void);
+private:
+#ifdef USE_FUTEX_WAITWORD
+    // 0 = nothing pending, 1 = woken, 2 = thread is waiting
+    volatile int value;
+#else
+    PLock lock;
+    PCondVar cond;
+    bool woken;
+#endif
+};
+
 // Semaphore.  Wrapper for Posix semaphore or Windows semaphore.
 class PSemaphore {
 public:
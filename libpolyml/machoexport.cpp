@@ -94,8 +94,9 @@ void MachoExport::adjustOffset(unsigned area, size_t &offset)
 
 void MachoExport::addExternalReference(void *relocAddr, const char *name, bool /*isFuncPtr*/)
 {
-    externTable.makeEntry(name);
-    writeRelocation(0, relocAddr, symbolNum++, true);
+    unsigned index;
+    externTable.makeEntry(name, &index); // Each name is only entered once.
+    writeRelocation(0, relocAddr, symbolNum + index, true);
 }
 
 // Generate the address relative to the start of the segment.
@@ -467,7 +468,7 @@ void MachoExport::exportStore(void)
         fwrite(&symbol, sizeof(symbol), 1, exportFile);
     }
 
-    symTab.nsyms = symbolNum;
+    symTab.nsyms = symbolNum + externTable.stringCount;
 
     // The symbol name table
     symTab.stroff = ftell(exportFile);
@@ -146,6 +146,8 @@ MemMgr::~MemMgr()
         delete(*i);
     for (std::vector<PermanentMemSpace *>::iterator i = eSpaces.begin(); i < eSpaces.end(); i++)
         delete(*i);
+    for (std::vector<PermanentMemSpace *>::iterator i = mSpaces.begin(); i < mSpaces.end(); i++)
+        delete(*i);
     for (std::vector<StackSpace *>::iterator i = sSpaces.begin(); i < sSpaces.end(); i++)
         delete(*i);
     for (std::vector<CodeSpace *>::iterator i = cSpaces.begin(); i < cSpaces.end(); i++)
@@ -181,7 +183,7 @@ bool MemMgr::Initialise()
 }
 
 // Create and initialise a new local space and add it to the table.
-LocalMemSpace* MemMgr::NewLocalSpace(uintptr_t size, bool mut)
+LocalMemSpace* MemMgr::NewLocalSpace(uintptr_t size, bool mut, bool addToTable)
 {
     try {
         LocalMemSpace *space = new LocalMemSpace(&osHeapAlloc);
@@ -207,7 +209,7 @@ LocalMemSpace* MemMgr::NewLocalSpace(uintptr_t size, bool mut)
         PolyWord* heapSpace = (PolyWord*)osHeapAlloc.AllocateDataArea(iSpace);
         // The size may have been rounded up to a block boundary.
         size = iSpace / sizeof(PolyWord);
-        bool success = heapSpace != 0 && space->InitSpace(heapSpace, size, mut) && AddLocalSpace(space);
+        bool success = heapSpace != 0 && space->InitSpace(heapSpace, size, mut) && (! addToTable || AddLocalSpace(space));
 
         if (reservation != 0) osHeapAlloc.FreeDataArea(reservation, rSpace);
         if (success)
@@ -215,8 +217,11 @@ LocalMemSpace* MemMgr::NewLocalSpace(uintptr_t size, bool mut)
             if (debugOptions & DEBUG_MEMMGR)
                 Log("MMGR: New local %smutable space %p, size=%luk words, bottom=%p, top=%p\n", mut ? "": "im",
                     space, space->spaceSize()/1024, space->bottom, space->top);
-            currentHeapSize += space->spaceSize();
-            globalStats.setSize(PSS_TOTAL_HEAP, currentHeapSize * sizeof(PolyWord));
+            if (addToTable)
+            {
+                currentHeapSize += space->spaceSize();
+                globalStats.setSize(PSS_TOTAL_HEAP, currentHeapSize * sizeof(PolyWord));
+            }
             return space;
         }
 
@@ -327,7 +332,8 @@ PermanentMemSpace* MemMgr::NewPermanentSpace(PolyWord *base, uintptr_t words,
     }
 }
 
-PermanentMemSpace *MemMgr::AllocateNewPermanentSpace(uintptr_t byteSize, unsigned flags, unsigned index, unsigned hierarchy)
+PermanentMemSpace *MemMgr::AllocateNewPermanentSpace(uintptr_t byteSize, unsigned flags, unsigned index, unsigned hierarchy,
+                                                      int fd, uint64_t offset, void *hint, bool exactAddress)
 {
     try {
         OSMem *alloc = flags & MTF_EXECUTABLE ? &osCodeAlloc : &osHeapAlloc;
@@ -335,7 +341,18 @@ PermanentMemSpace *MemMgr::AllocateNewPermanentSpace(uintptr_t byteSize, unsigne
         size_t actualSize = byteSize;
         PolyWord* base;
         void* newShadow=0;
-        if (flags & MTF_EXECUTABLE)
+        if (fd >= 0)
+        {
+            base = (PolyWord*)alloc->MapFileArea(hint, actualSize, fd, offset, newShadow);
+            if (base != 0 && exactAddress && base != hint)
+            {
+                if (flags & MTF_EXECUTABLE)
+                    alloc->FreeCodeArea(base, newShadow, actualSize);
+                else alloc->FreeDataArea(base, actualSize);
+                base = 0;
+            }
+        }
+        else if (flags & MTF_EXECUTABLE)
             base = (PolyWord*)alloc->AllocateCodeArea(actualSize, newShadow);
         else base = (PolyWord*)alloc->AllocateDataArea(actualSize);
         if (base == 0)
@@ -385,6 +402,62 @@ bool MemMgr::CompletePermanentSpaceAllocation(PermanentMemSpace *space)
     return true;
 }
 
+// Create a space for a mapped file.  The memory is allocated in the same way
+// as any other data area so that in 32-in-64 it is within the heap.  The caller
+// may then map the file over part of it.
+PermanentMemSpace *MemMgr::NewMappedSpace(uintptr_t byteSize)
+{
+    PLocker lock(&mappedSpaceLock);
+    try {
+        PermanentMemSpace *space = new PermanentMemSpace(&osHeapAlloc);
+        size_t actualSize = byteSize;
+        space->bottom = (PolyWord*)osHeapAlloc.AllocateDataArea(actualSize);
+        if (space->bottom == 0)
+        {
+            delete space;
+            return 0;
+        }
+        space->topPointer = space->top = space->bottom + actualSize/sizeof(PolyWord);
+        space->spaceType = ST_PERMANENT;
+        space->byteOnly = true;
+        space->mappedFile = true;
+        try {
+            AddTree(space);
+            mSpaces.push_back(space);
+        }
+        catch (std::exception&) {
+            RemoveTree(space);
+            delete space;
+            return 0;
+        }
+        if (debugOptions & DEBUG_MEMMGR)
+            Log("MMGR: New mapped space %p allocated at %p size %lu\n", space, space->bottom, space->spaceSize());
+        return space;
+    }
+    catch (std::bad_alloc&) {
+        return 0;
+    }
+}
+
+// Called in the GC when the mapped object is no longer reachable.
+void MemMgr::DeleteMappedSpace(PermanentMemSpace *space)
+{
+    PLocker lock(&mappedSpaceLock);
+    for (std::vector<PermanentMemSpace *>::iterator i = mSpaces.begin(); i < mSpaces.end(); i++)
+    {
+        if (*i == space)
+        {
+            if (debugOptions & DEBUG_MEMMGR)
+                Log("MMGR: Deleted mapped space %p at %p size %zu\n", space, space->bottom, space->spaceSize());
+            RemoveTree(space);
+            mSpaces.erase(i);
+            delete space;
+            return;
+        }
+    }
+    ASSERT(false); // It should always be in the table.
+}
+
 // Delete a local space and remove it from the table.
 void MemMgr::DeleteLocalSpace(std::vector<LocalMemSpace*>::iterator &iter)
 {
@@ -413,7 +486,7 @@ void MemMgr::RemoveEmptyLocals()
 }
 
 // Create and initialise a new export space and add it to the table.
-PermanentMemSpace* MemMgr::NewExportSpace(uintptr_t size, bool mut, bool noOv, bool code)
+PermanentMemSpace* MemMgr::NewExportSpace(uintptr_t size, bool mut, bool noOv, bool code, int fd, uint64_t offset)
 {
     try {
         OSMem *alloc = code ? &osCodeAlloc : &osHeapAlloc;
@@ -425,7 +498,14 @@ PermanentMemSpace* MemMgr::NewExportSpace(uintptr_t size, bool mut, bool noOv, b
         space->index = nextIndex++;
         // Allocate the memory itself.
         size_t iSpace = size*sizeof(PolyWord);
-        if (code)
+        if (fd >= 0)
+        {
+            void* shadow;
+            space->bottom = (PolyWord*)alloc->MapFileArea(0, iSpace, fd, offset, shadow, true);
+            if (space->bottom != 0 && code)
+                space->shadowSpace = (PolyWord*)shadow;
+        }
+        else if (code)
         {
             void* shadow;
             space->bottom = (PolyWord*)alloc->AllocateCodeArea(iSpace, shadow);
@@ -438,7 +518,8 @@ PermanentMemSpace* MemMgr::NewExportSpace(uintptr_t size, bool mut, bool noOv, b
         {
             delete space;
             if (debugOptions & DEBUG_MEMMGR)
-                Log("MMGR: New export %smutable space: insufficient space\n", mut ? "" : "im");
+                Log("MMGR: New export %smutable space: %s\n", mut ? "" : "im",
+                    fd >= 0 ? "unable to map file" : "insufficient space");
             return 0;
         }
 
@@ -454,8 +535,8 @@ PermanentMemSpace* MemMgr::NewExportSpace(uintptr_t size, bool mut, bool noOv, b
 #endif
 
         if (debugOptions & DEBUG_MEMMGR)
-            Log("MMGR: New export %smutable %s%sspace %p, size=%luk words, bottom=%p, top=%p\n", mut ? "" : "im",
-                noOv ? "no-overwrite " : "", code ? "code " : "", space,
+            Log("MMGR: New export %smutable %s%s%sspace %p, size=%luk words, bottom=%p, top=%p\n", mut ? "" : "im",
+                noOv ? "no-overwrite " : "", code ? "code " : "", fd >= 0 ? "file-mapped " : "", space,
                 space->spaceSize() / 1024, space->bottom, space->top);
 
         // Add to the table.
@@ -767,7 +848,7 @@ CodeSpace::CodeSpace(PolyWord *start, PolyWord *shadow, uintptr_t spaceSize, OSM
 #endif
 }
 
-CodeSpace *MemMgr::NewCodeSpace(uintptr_t size)
+CodeSpace *MemMgr::NewCodeSpace(uintptr_t size, bool addToTable)
 {
     // Allocate a new area and add it at the end of the table.
     CodeSpace *allocSpace = 0;
@@ -786,7 +867,7 @@ CodeSpace *MemMgr::NewCodeSpace(uintptr_t size)
                 delete allocSpace;
                 allocSpace = 0;
             }
-            else if (!AddCodeSpace(allocSpace))
+            else if (addToTable && !AddCodeSpace(allocSpace))
             {
                 delete allocSpace;
                 allocSpace = 0;
@@ -808,6 +889,46 @@ CodeSpace *MemMgr::NewCodeSpace(uintptr_t size)
     return allocSpace;
 }
 
+CodeSpace *MemMgr::NewMappedCodeSpace(uintptr_t byteSize, int fd, uint64_t offset, void *hint)
+{
+    size_t actualSize = byteSize;
+    void *shadow = 0;
+    PolyWord *mem = (PolyWord*)osCodeAlloc.MapFileArea(hint, actualSize, fd, offset, shadow);
+    if (mem == 0)
+        return 0;
+    CodeSpace *allocSpace = 0;
+    try {
+        allocSpace = new CodeSpace(mem, (PolyWord*)shadow, actualSize / sizeof(PolyWord), &osCodeAlloc);
+        if (!allocSpace->headerMap.Create(allocSpace->spaceSize()))
+        {
+            delete allocSpace;
+            return 0;
+        }
+        if (debugOptions & DEBUG_MEMMGR)
+            Log("MMGR: New code space %p mapped at %p size %lu\n", allocSpace, allocSpace->bottom, allocSpace->spaceSize());
+    }
+    catch (std::bad_alloc&)
+    {
+        if (allocSpace == 0)
+            osCodeAlloc.FreeCodeArea(mem, shadow, actualSize);
+        else delete allocSpace;
+        return 0;
+    }
+    return allocSpace;
+}
+
+// Add a space that was created without being added to the table.
+bool MemMgr::AddLoadedSpace(MemSpace *space)
+{
+    if (space->spaceType == ST_CODE)
+        return AddCodeSpace((CodeSpace*)space);
+    if (! AddLocalSpace((LocalMemSpace*)space))
+        return false;
+    currentHeapSize += space->spaceSize();
+    globalStats.setSize(PSS_TOTAL_HEAP, currentHeapSize * sizeof(PolyWord));
+    return true;
+}
+
 // Allocate memory for a piece of code.  This needs to be both mutable and executable,
 // at least for native code.  The interpreted version need not (should not?) make the
 // area executable.  It will not be executed until the mutable bit has been cleared.
@@ -118,13 +118,14 @@ class PermanentMemSpace: public MemSpace
 {
 protected:
     PermanentMemSpace(OSMem *alloc): MemSpace(alloc), index(0), hierarchy(0), noOverwrite(false),
-        byteOnly(false), topPointer(0) {}
+        byteOnly(false), mappedFile(false), topPointer(0) {}
 
 public:
     unsigned    index;      // An identifier for the space.  Used when saving and loading.
     unsigned    hierarchy;  // The hierarchy number: 0=from executable, 1=top level saved state, ...
     bool        noOverwrite; // Don't save this in deeper hierarchies.
     bool        byteOnly; // Only contains byte data - no need to scan for addresses.
+    bool        mappedFile; // Holds a single byte object whose data are mapped from a file.
 
     // When exporting or saving state we copy data into a new area.
     // This area grows upwards unlike the local areas that grow down.
@@ -237,16 +238,21 @@ public:
 
     // Create a local space for initial allocation.
     LocalMemSpace *CreateAllocationSpace(uintptr_t size);
-    // Create and initialise a new local space and add it to the table.
-    LocalMemSpace *NewLocalSpace(uintptr_t size, bool mut);
+    // Create and initialise a new local space and add it to the table.  If addToTable
+    // is false the space is not added and the caller must add it with AddLoadedSpace.
+    LocalMemSpace *NewLocalSpace(uintptr_t size, bool mut, bool addToTable = true);
     // Create an entry for a permanent space.
     PermanentMemSpace *NewPermanentSpace(PolyWord *base, uintptr_t words,
         unsigned flags, unsigned index, unsigned hierarchy = 0);
 
     // Create a permanent space but allocate memory for it.
-    // Sets bottom and top to the actual memory size.
+    // Sets bottom and top to the actual memory size.  If a file descriptor is given
+    // the memory is mapped from the file at the offset, at the hinted address if that
+    // is free, and this returns 0 if the file cannot be mapped.  If exactAddress is
+    // true it also returns 0 if the file cannot be mapped at the hinted address.
     PermanentMemSpace *AllocateNewPermanentSpace(uintptr_t byteSize, unsigned flags,
-                            unsigned index, unsigned hierarchy = 0);
+                            unsigned index, unsigned hierarchy = 0,
+                            int fd = -1, uint64_t offset = 0, void *hint = 0, bool exactAddress = false);
     // Called after an allocated permanent area has been filled in.
     bool CompletePermanentSpaceAllocation(PermanentMemSpace *space);
 
@@ -263,7 +269,16 @@ public:
     PolyWord *AllocHeapSpace(uintptr_t words)
         { uintptr_t allocated = words; return AllocHeapSpace(words, allocated); }
 
-    CodeSpace *NewCodeSpace(uintptr_t size);
+    CodeSpace *NewCodeSpace(uintptr_t size, bool addToTable = true);
+    // Create a code space, not added to the table, with the contents mapped privately
+    // from a file so that pages that are not written are shared with other processes.
+    // Returns 0 if the file cannot be mapped.
+    CodeSpace *NewMappedCodeSpace(uintptr_t byteSize, int fd, uint64_t offset, void *hint);
+    // Add a local or code space created with addToTable false or by NewMappedCodeSpace.
+    // Must only be called when other threads are stopped.
+    bool AddLoadedSpace(MemSpace *space);
+    // Free a space created with addToTable false or by NewMappedCodeSpace that was not added.
+    void DeleteLoadedSpace(MemSpace *space) { delete space; }
     // Allocate space for code.  This is initially mutable to allow the code to be built.
     PolyObject *AllocCodeSpace(POLYUNSIGNED size);
 
@@ -285,8 +300,17 @@ public:
     // Delete a stack when a thread has finished.
     bool DeleteStackSpace(StackSpace *space);
 
+    // Create a space to hold a byte object whose data are mapped from a file.  The
+    // caller fills in the space.  These spaces are never saved or exported.
+    // Instead, like local data, the object is copied.  They are deleted by the GC
+    // when the object is no longer reachable.
+    PermanentMemSpace *NewMappedSpace(uintptr_t byteSize);
+    void DeleteMappedSpace(PermanentMemSpace *space);
+
     // Create and delete export spaces
-    PermanentMemSpace *NewExportSpace(uintptr_t size, bool mut, bool noOv, bool code);
+    // If fd is not -1 the space is mapped from the file at the offset and the result
+    // is null if that is not possible.
+    PermanentMemSpace *NewExportSpace(uintptr_t size, bool mut, bool noOv, bool code, int fd = -1, uint64_t offset = 0);
     void DeleteExportSpaces(void);
     bool PromoteExportSpaces(unsigned hierarchy); // Turn export spaces into permanent spaces.
     bool DemoteImportSpaces(void); // Turn previously imported spaces into local.
@@ -373,6 +397,10 @@ public:
     // Table for export spaces
     std::vector<PermanentMemSpace *> eSpaces;
 
+    // Table for mapped file spaces
+    std::vector<PermanentMemSpace *> mSpaces;
+    PLock mappedSpaceLock;
+
     // Table for stack spaces
     std::vector<StackSpace *> sSpaces;
     PLock stackSpaceLock;
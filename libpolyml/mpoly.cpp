@@ -59,6 +59,7 @@
 #define _tcslen strlen
 #define _tcstol strtol
 #define _tcsncmp strncmp
+#define _tcscmp strcmp
 #define _tcschr strchr
 #endif
 
@@ -105,6 +106,8 @@ enum {
     OPT_GCPERCENT,
     OPT_RESERVE,
     OPT_GCTHREADS,
+    OPT_GCAFFINITY,
+    OPT_EXPORTTHREADS,
     OPT_DEBUGOPTS,
     OPT_DEBUGFILE,
     OPT_DDESERVICE,
@@ -123,7 +126,10 @@ static struct __argtab {
     { _T("--maxheap"),      "Maximum heap size (MB)",                               OPT_HEAPMAX },
     { _T("--gcpercent"),    "Target percentage time in GC (1-99)",                  OPT_GCPERCENT },
     { _T("--stackspace"),   "Space to reserve for thread stacks and C++ heap(MB)",  OPT_RESERVE },
+    // This must come before --gcthreads since arguments are matched by prefix.
+    { _T("--gcthreads-affinity"), "Processors for GC threads: list e.g. 0,2-5 or cores", OPT_GCAFFINITY },
     { _T("--gcthreads"),    "Number of threads to use for garbage collection",      OPT_GCTHREADS },
+    { _T("--exportthreads"), "Number of GC threads to copy data for export (default 1)", OPT_EXPORTTHREADS },
     { _T("--debug"),        "Debug options: checkmem, gc, x",                       OPT_DEBUGOPTS },
     { _T("--logfile"),      "Logging file (default is to log to stdout)",           OPT_DEBUGFILE },
 #if (defined(_WIN32))
@@ -211,6 +217,77 @@ POLYUNSIGNED parseSize(const TCHAR *p, const TCHAR *arg)
     return result;
 }
 
+// Parse the list of processors for the GC threads.  This is a comma-separated
+// list of processor numbers or ranges e.g. 0,2,4-7.  "cores" puts each thread
+// on a separate physical core.  The result is stored in userOptions.
+static bool gcAffinityCores = false;
+
+static void setGCAffinity(const std::vector<unsigned> &procs)
+{
+    free(userOptions.gcaffinity);
+    userOptions.gcaffinity = 0;
+    userOptions.gcaffinityCount = 0;
+    if (procs.empty()) return;
+    userOptions.gcaffinity = (unsigned*)malloc(procs.size() * sizeof(unsigned));
+    if (userOptions.gcaffinity == 0) return;
+    for (unsigned i = 0; i < procs.size(); i++)
+        userOptions.gcaffinity[i] = procs[i];
+    userOptions.gcaffinityCount = (unsigned)procs.size();
+}
+
+static void parseAffinity(const TCHAR *p, const TCHAR *arg)
+{
+    if (_tcscmp(p, _T("cores")) == 0)
+    {
+        gcAffinityCores = true;
+        return;
+    }
+    std::vector<unsigned> procs;
+    while (true)
+    {
+        TCHAR *endp;
+        if (*p < '0' || *p > '9')
+            Usage("Malformed %s option\n", arg);
+        unsigned first = _tcstol(p, &endp, 10), last = first;
+        p = endp;
+        if (*p == '-')
+        {
+            p++;
+            if (*p < '0' || *p > '9')
+                Usage("Malformed %s option\n", arg);
+            last = _tcstol(p, &endp, 10);
+            p = endp;
+            if (last < first || last - first > 65536)
+                Usage("Malformed %s option\n", arg);
+        }
+        for (unsigned n = first; n <= last; n++)
+            procs.push_back(n);
+        if (*p == 0) break;
+        if (*p != ',')
+            Usage("Malformed %s option\n", arg);
+        p++;
+    }
+    gcAffinityCores = false;
+    setGCAffinity(procs);
+}
+
+// Choose one processor from each physical core.
+static void affinityFromCores(void)
+{
+    std::vector<ProcessorInfo> topology;
+    GetProcessorTopology(topology);
+    std::vector<bool> coreUsed;
+    std::vector<unsigned> procs;
+    for (std::vector<ProcessorInfo>::iterator i = topology.begin(); i != topology.end(); i++)
+    {
+        if (i->core >= coreUsed.size()) coreUsed.resize(i->core + 1, false);
+        if (coreUsed[i->core]) continue;
+        coreUsed[i->core] = true;
+        procs.push_back(i->processor);
+    }
+    setGCAffinity(procs);
+}
+
 /* In the Windows version this is called from WinMain in Console.c */
 int polymain(int argc, TCHAR **argv, exportDescription *exports)
 {
@@ -219,6 +296,7 @@ int polymain(int argc, TCHAR **argv, exportDescription *exports)
     /* Get arguments. */
     memset(&userOptions, 0, sizeof(userOptions)); /* Reset it */
     userOptions.gcthreads = 0; // Default multi-threaded
+    userOptions.exportthreads = 1; // Default single-threaded so the output is deterministic
 
     if (polyStdout == 0) polyStdout = stdout;
     if (polyStderr == 0) polyStderr = stderr;
@@ -298,6 +376,14 @@ int polymain(int argc, TCHAR **argv, exportDescription *exports)
                         if (*endp != '\0') 
                             Usage("Incomplete %s option\n", argTable[j].argName);
                         break;
+                    case OPT_GCAFFINITY:
+                        parseAffinity(p, argTable[j].argName);
+                        break;
+                    case OPT_EXPORTTHREADS:
+                        userOptions.exportthreads = _tcstol(p, &endp, 10);
+                        if (*endp != '\0' || userOptions.exportthreads == 0)
+                            Usage("Malformed %s option\n", argTable[j].argName);
+                        break;
                     case OPT_DEBUGOPTS:
                         while (*p != '\0')
                         {
@@ -383,6 +469,9 @@ int polymain(int argc, TCHAR **argv, exportDescription *exports)
             userOptions.gcthreads = NumberOfProcessors();
     }
 
+    if (gcAffinityCores)
+        affinityFromCores();
+
     // Set the heap size if it has been provided otherwise use the default.
     gHeapSizeParameters.SetHeapParameters(minsize, maxsize, initsize, gcpercent);
 
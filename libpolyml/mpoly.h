@@ -37,6 +37,9 @@ extern struct _userOptions {
     TCHAR       **user_arg_strings;
     const TCHAR *programName;
     unsigned    gcthreads;    // Number of threads to use for gc
+    unsigned    exportthreads; // Number of gc threads to copy data for export
+    unsigned    gcaffinityCount; // Processors for the gc threads.  Zero if unrestricted.
+    unsigned    *gcaffinity;
 } userOptions;
 
 class PolyWord;
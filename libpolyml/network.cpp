@@ -124,7 +124,23 @@ typedef int SOCKET;
 #include <windows.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
 #include <new>
+#include <vector>
+#if (!defined(_WIN32))
+#include <map>
+#endif
 
 #include "globals.h"
 #include "gc.h"
@@ -133,6 +149,8 @@ typedef int SOCKET;
 #include "mpoly.h"
 #include "processes.h"
 #include "network.h"
+#include "ioreactor.h"
+#include "iouring.h"
 #include "io_internal.h"
 #include "sys.h"
 #include "polystring.h"
@@ -179,6 +197,13 @@ extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkSendTo(FirstArgument threadId, PolyWord args);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkReceive(FirstArgument threadId, PolyWord args);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkReceiveFrom(FirstArgument threadId, PolyWord args);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkSendWait(FirstArgument threadId, PolyWord args);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkReceiveWait(FirstArgument threadId, PolyWord args);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkSendVector(FirstArgument threadId, PolyWord args);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkReceiveVector(FirstArgument threadId, PolyWord args);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkSendToMultiple(FirstArgument threadId, PolyWord args);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkReceiveFromMultiple(FirstArgument threadId, PolyWord args);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkSendFile(FirstArgument threadId, PolyWord args);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkGetFamilyFromAddress(PolyWord sockAddress);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkGetAddressAndPortFromIP4(FirstArgument threadId, PolyWord sockAddress);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkCreateIP4Address(FirstArgument threadId, PolyWord ip4Address, PolyWord portNumber);
@@ -507,22 +532,41 @@ static Handle getSocketOption(TaskData *taskData, Handle args, int level, int op
 
 
 // Wait until "select" returns.  In Windows this is used only for networking.
+// In Unix this uses poll through the IO reactor since select cannot handle
+// descriptors beyond FD_SETSIZE and scans the whole range on every call.
 class WaitSelect: public Waiter
 {
 public:
     WaitSelect(unsigned maxMillisecs=(unsigned)-1);
     virtual void Wait(unsigned maxMillisecs);
+#if (defined(_WIN32))
     void SetRead(SOCKET fd) {  FD_SET(fd, &readSet); }
     void SetWrite(SOCKET fd) {  FD_SET(fd, &writeSet); }
     void SetExcept(SOCKET fd)  {  FD_SET(fd, &exceptSet); }
     bool IsSetRead(SOCKET fd) { return FD_ISSET(fd, &readSet) != 0; }
     bool IsSetWrite(SOCKET fd) { return FD_ISSET(fd, &writeSet) != 0; }
     bool IsSetExcept(SOCKET fd) { return FD_ISSET(fd, &exceptSet) != 0; }
+#else
+    void SetRead(SOCKET fd) { AddEvent(fd, POLLIN); }
+    void SetWrite(SOCKET fd) { AddEvent(fd, POLLOUT); }
+    void SetExcept(SOCKET fd) { AddEvent(fd, POLLPRI); }
+    // As with select, end-of-file and errors count as ready.
+    bool IsSetRead(SOCKET fd) { return TestEvent(fd, POLLIN, POLLIN|POLLHUP|POLLERR); }
+    bool IsSetWrite(SOCKET fd) { return TestEvent(fd, POLLOUT, POLLOUT|POLLERR); }
+    bool IsSetExcept(SOCKET fd) { return TestEvent(fd, POLLPRI, POLLPRI); }
+#endif
     // Save the result of the select call and any associated error
     int SelectResult(void) { return selectResult; }
     int SelectError(void) { return errorResult; }
 private:
+#if (defined(_WIN32))
     fd_set readSet, writeSet, exceptSet;
+#else
+    void AddEvent(SOCKET fd, short event);
+    bool TestEvent(SOCKET fd, short event, short result);
+    std::vector<struct pollfd> fdVec;
+    std::map<SOCKET, size_t> fdIndex; // Position of each descriptor in fdVec
+#endif
     int selectResult;
     int errorResult;
     unsigned maxTime;
@@ -530,14 +574,17 @@ private:
 
 WaitSelect::WaitSelect(unsigned maxMillisecs)
 {
+#if (defined(_WIN32))
     FD_ZERO(&readSet);
     FD_ZERO(&writeSet);
     FD_ZERO(&exceptSet);
+#endif
     selectResult = 0;
     errorResult = 0;
     maxTime = maxMillisecs;
 }
 
+#if (defined(_WIN32))
 void WaitSelect::Wait(unsigned maxMillisecs)
 {
     if (maxTime < maxMillisecs) maxMillisecs = maxTime;
@@ -547,6 +594,50 @@ void WaitSelect::Wait(unsigned maxMillisecs)
     selectResult = select(FD_SETSIZE, &readSet, &writeSet, &exceptSet, &toWait);
     if (selectResult < 0) errorResult = GETERROR;
 }
+#else
+void WaitSelect::AddEvent(SOCKET fd, short event)
+{
+    std::map<SOCKET, size_t>::iterator i = fdIndex.find(fd);
+    if (i != fdIndex.end())
+        fdVec[i->second].events |= event;
+    else
+    {
+        struct pollfd entry;
+        entry.fd = fd;
+        entry.events = event;
+        entry.revents = 0;
+        fdIndex[fd] = fdVec.size();
+        fdVec.push_back(entry);
+    }
+}
+
+bool WaitSelect::TestEvent(SOCKET fd, short event, short result)
+{
+    std::map<SOCKET, size_t>::iterator i = fdIndex.find(fd);
+    if (i == fdIndex.end()) return false;
+    const struct pollfd &entry = fdVec[i->second];
+    return (entry.events & event) != 0 && (entry.revents & result) != 0;
+}
+
+void WaitSelect::Wait(unsigned maxMillisecs)
+{
+    if (maxTime < maxMillisecs) maxMillisecs = maxTime;
+    selectResult = WaitForDescriptors(fdVec.empty() ? 0 : &fdVec[0], (unsigned)fdVec.size(), maxMillisecs);
+    if (selectResult < 0) errorResult = GETERROR;
+    else
+    {
+        // select reports a closed descriptor as an error.
+        for (std::vector<struct pollfd>::iterator i = fdVec.begin(); i != fdVec.end(); i++)
+        {
+            if (i->revents & POLLNVAL)
+            {
+                selectResult = -1;
+                errorResult = EBADF;
+            }
+        }
+    }
+}
+#endif
 
 #if (defined(_WIN32))
 class WinSocket : public WinStreamBase
@@ -1016,6 +1107,94 @@ POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkReceive(FirstArgument threadId, PolyW
     return TAGGED(recvd).AsUnsigned();
 }
 
+#if (!defined(_WIN32))
+// Send or receive through io_uring and wait for it to complete.  The arguments are
+// the same as for PolyNetworkSend and PolyNetworkReceive.  Returns -1 if io_uring
+// can't be used.
+static ssize_t ringTransfer(TaskData *taskData, int kind, Handle args, int flags, const char *errMsg)
+{
+    if (! IOUringAvailable()) return -1;
+    SOCKET sock = getStreamSocket(taskData, DEREFHANDLE(args)->Get(0));
+    POLYUNSIGNED offset = getPolyUnsigned(taskData, DEREFHANDLE(args)->Get(2));
+    size_t length = getPolyUnsigned(taskData, DEREFHANDLE(args)->Get(3));
+    byte *base = DEREFHANDLE(args)->Get(1).AsObjPtr()->AsBytePtr();
+    IOUringOp *op = IOUringStart(kind, sock, kind == IOURING_SEND ? base + offset : 0, length, flags);
+    if (op == 0) raise_syscall(taskData, "Insufficient memory", NOMEMORY);
+    int res = IOUringWait(taskData, op);
+    if (res > 0 && kind == IOURING_RECV)
+    {
+        // The array may have been moved while we were waiting.
+        base = DEREFHANDLE(args)->Get(1).AsObjPtr()->AsBytePtr();
+        memcpy(base + offset, IOUringData(op), res);
+    }
+    IOUringFree(op);
+    if (res >= 0) return res;
+    if (res != -EAGAIN && res != -EINTR)
+        raise_syscall(taskData, errMsg, -res);
+    return -1;
+}
+#endif
+
+// Blocking send and receive.  These return ~1 if the ML code should wait until
+// the socket is ready and then use PolyNetworkSend or PolyNetworkReceive.
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkSendWait(FirstArgument threadId, PolyWord argsAsWord)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle args = taskData->saveVec.push(argsAsWord);
+    POLYSIGNED sent = -1;
+
+    try {
+#if (!defined(_WIN32))
+        unsigned int dontRoute = get_C_unsigned(taskData, DEREFHANDLE(args)->Get(4));
+        unsigned int outOfBand = get_C_unsigned(taskData, DEREFHANDLE(args)->Get(5));
+        int flags = 0;
+        if (dontRoute != 0) flags |= MSG_DONTROUTE;
+        if (outOfBand != 0) flags |= MSG_OOB;
+        sent = ringTransfer(taskData, IOURING_SEND, args, flags, "send failed");
+#endif
+    }
+    catch (KillException &) {
+        processes->ThreadExit(taskData); // TestAnyEvents may test for kill
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(sent).AsUnsigned();
+}
+
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkReceiveWait(FirstArgument threadId, PolyWord argsAsWord)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle args = taskData->saveVec.push(argsAsWord);
+    POLYSIGNED recvd = -1;
+
+    try {
+#if (!defined(_WIN32))
+        unsigned int peek = get_C_unsigned(taskData, DEREFHANDLE(args)->Get(4));
+        unsigned int outOfBand = get_C_unsigned(taskData, DEREFHANDLE(args)->Get(5));
+        int flags = 0;
+        if (peek != 0) flags |= MSG_PEEK;
+        if (outOfBand != 0) flags |= MSG_OOB;
+        recvd = ringTransfer(taskData, IOURING_RECV, args, flags, "recv failed");
+#endif
+    }
+    catch (KillException &) {
+        processes->ThreadExit(taskData); // TestAnyEvents may test for kill
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(recvd).AsUnsigned();
+}
+
 POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkReceiveFrom(FirstArgument threadId, PolyWord argsAsWord)
 {
     TaskData *taskData = TaskData::FindTaskForId(threadId);
@@ -1068,6 +1247,355 @@ POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkReceiveFrom(FirstArgument threadId, P
     else return result->Word().AsUnsigned();
 }
 
+// Vectored and batched transfers.  These move a list of buffers or datagrams in a
+// single call so that the cost of entering the RTS and finding the socket is shared.
+// The number of entries handled in one call is limited.  Linux limits both iovec
+// arrays and sendmmsg/recvmmsg to 1024 entries.  The ML code calls again for the rest.
+#define MAX_BATCH   1024
+// Largest datagram that can be received in a batch.  This is the limit for
+// UDP and it keeps the size of the receive buffer within bounds.
+#define MAX_DATAGRAM    65536
+
+#if (defined(_WIN32))
+typedef WSABUF IOBUFFER;
+#else
+typedef struct iovec IOBUFFER;
+#endif
+
+static void setIOBuffer(IOBUFFER &buff, byte *base, size_t length)
+{
+#if (defined(_WIN32))
+    buff.buf = (char*)base;
+    buff.len = (ULONG)length;
+#else
+    buff.iov_base = base;
+    buff.iov_len = length;
+#endif
+}
+
+// Extract the buffers from a list of (base, offset, length) triples.
+static void getBufferList(TaskData *taskData, PolyWord list, std::vector<IOBUFFER> &buffers)
+{
+    for (PolyWord p = list; !ML_Cons_Cell::IsNull(p) && buffers.size() < MAX_BATCH; p = ((ML_Cons_Cell*)p.AsObjPtr())->t)
+    {
+        PolyObject *triple = ((ML_Cons_Cell*)p.AsObjPtr())->h.AsObjPtr();
+        byte *base = triple->Get(0).AsObjPtr()->AsBytePtr();
+        POLYUNSIGNED offset = getPolyUnsigned(taskData, triple->Get(1));
+        POLYUNSIGNED length = getPolyUnsigned(taskData, triple->Get(2));
+        IOBUFFER buff;
+        setIOBuffer(buff, base + offset, length);
+        buffers.push_back(buff);
+    }
+}
+
+// Send from or receive into a list of buffers on a stream socket.  The arguments are
+// the socket, a list of (base, offset, length) triples and the two flags.  Returns the
+// number of bytes transferred.
+static POLYUNSIGNED transferVector(FirstArgument threadId, PolyWord argsAsWord, bool isSend)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle args = taskData->saveVec.push(argsAsWord);
+    POLYUNSIGNED transferred = 0;
+
+    try {
+        SOCKET sock = getStreamSocket(taskData, DEREFHANDLE(args)->Get(0));
+        unsigned int flag1 = get_C_unsigned(taskData, DEREFHANDLE(args)->Get(2));
+        unsigned int outOfBand = get_C_unsigned(taskData, DEREFHANDLE(args)->Get(3));
+        int flags = 0;
+        if (flag1 != 0) flags |= isSend ? MSG_DONTROUTE : MSG_PEEK;
+        if (outOfBand != 0) flags |= MSG_OOB;
+        std::vector<IOBUFFER> buffers;
+        getBufferList(taskData, DEREFHANDLE(args)->Get(1), buffers);
+        if (! buffers.empty())
+        {
+#if (defined(_WIN32))
+            DWORD count = 0, dwFlags = flags;
+            int res = isSend ?
+                WSASend(sock, &buffers[0], (DWORD)buffers.size(), &count, dwFlags, NULL, NULL) :
+                WSARecv(sock, &buffers[0], (DWORD)buffers.size(), &count, &dwFlags, NULL, NULL);
+            if (res == SOCKET_ERROR)
+                raise_syscall(taskData, isSend ? "WSASend failed" : "WSARecv failed", GETERROR);
+#else
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &buffers[0];
+            msg.msg_iovlen = buffers.size();
+            ssize_t count = isSend ? sendmsg(sock, &msg, flags) : recvmsg(sock, &msg, flags);
+            if (count < 0)
+                raise_syscall(taskData, isSend ? "sendmsg failed" : "recvmsg failed", GETERROR);
+#endif
+            transferred = count;
+        }
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(transferred).AsUnsigned();
+}
+
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkSendVector(FirstArgument threadId, PolyWord argsAsWord)
+{
+    return transferVector(threadId, argsAsWord, true);
+}
+
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkReceiveVector(FirstArgument threadId, PolyWord argsAsWord)
+{
+    return transferVector(threadId, argsAsWord, false);
+}
+
+// Send a list of datagrams.  Each entry is a tuple of the address, base, offset and
+// length.  Returns the number of datagrams sent.  This is less than the length of the
+// list if the socket buffer fills up.  Raises an exception only if none could be sent.
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkSendToMultiple(FirstArgument threadId, PolyWord argsAsWord)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle args = taskData->saveVec.push(argsAsWord);
+    POLYUNSIGNED sent = 0;
+
+    try {
+        SOCKET sock = getStreamSocket(taskData, DEREFHANDLE(args)->Get(0));
+        unsigned int dontRoute = get_C_unsigned(taskData, DEREFHANDLE(args)->Get(2));
+        unsigned int outOfBand = get_C_unsigned(taskData, DEREFHANDLE(args)->Get(3));
+        int flags = 0;
+        if (dontRoute != 0) flags |= MSG_DONTROUTE;
+        if (outOfBand != 0) flags |= MSG_OOB;
+        std::vector<IOBUFFER> buffers;
+        std::vector<PolyStringObject *> addresses;
+        for (PolyWord p = DEREFHANDLE(args)->Get(1); !ML_Cons_Cell::IsNull(p) && buffers.size() < MAX_BATCH;
+                p = ((ML_Cons_Cell*)p.AsObjPtr())->t)
+        {
+            PolyObject *entry = ((ML_Cons_Cell*)p.AsObjPtr())->h.AsObjPtr();
+            addresses.push_back((PolyStringObject *)entry->Get(0).AsObjPtr());
+            byte *base = entry->Get(1).AsObjPtr()->AsBytePtr();
+            POLYUNSIGNED offset = getPolyUnsigned(taskData, entry->Get(2));
+            POLYUNSIGNED length = getPolyUnsigned(taskData, entry->Get(3));
+            IOBUFFER buff;
+            setIOBuffer(buff, base + offset, length);
+            buffers.push_back(buff);
+        }
+#ifdef HAVE_SENDMMSG
+        if (! buffers.empty())
+        {
+            std::vector<struct mmsghdr> msgs(buffers.size());
+            memset(&msgs[0], 0, msgs.size() * sizeof(struct mmsghdr));
+            for (size_t i = 0; i < msgs.size(); i++)
+            {
+                msgs[i].msg_hdr.msg_name = addresses[i]->chars;
+                msgs[i].msg_hdr.msg_namelen = (socklen_t)addresses[i]->length;
+                msgs[i].msg_hdr.msg_iov = &buffers[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            int res = sendmmsg(sock, &msgs[0], (unsigned)msgs.size(), flags);
+            if (res < 0)
+                raise_syscall(taskData, "sendmmsg failed", GETERROR);
+            sent = res;
+        }
+#else
+        for (; sent < buffers.size(); sent++)
+        {
+            IOBUFFER &buff = buffers[sent];
+#if (defined(_WIN32))
+            int res = sendto(sock, buff.buf, buff.len, flags,
+                (struct sockaddr *)addresses[sent]->chars, (int)addresses[sent]->length);
+#else
+            ssize_t res = sendto(sock, buff.iov_base, buff.iov_len, flags,
+                (struct sockaddr *)addresses[sent]->chars, (socklen_t)addresses[sent]->length);
+#endif
+            if (res == SOCKET_ERROR)
+            {
+                // Report the error if nothing has been sent.  Otherwise return the
+                // number sent and the error will be reported on the next call.
+                if (sent == 0)
+                    raise_syscall(taskData, "sendto failed", GETERROR);
+                break;
+            }
+        }
+#endif
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(sent).AsUnsigned();
+}
+
+// Receive up to "count" datagrams each of up to "size" bytes.  Returns a list of pairs
+// of the data and the sender's address.  Raises an exception only if nothing was
+// received.
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkReceiveFromMultiple(FirstArgument threadId, PolyWord argsAsWord)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle args = taskData->saveVec.push(argsAsWord);
+    Handle result = 0;
+
+    try {
+        SOCKET sock = getStreamSocket(taskData, DEREFHANDLE(args)->Get(0));
+        size_t count = getPolyUnsigned(taskData, DEREFHANDLE(args)->Get(1));
+        size_t size = getPolyUnsigned(taskData, DEREFHANDLE(args)->Get(2));
+        unsigned int peek = get_C_unsigned(taskData, DEREFHANDLE(args)->Get(3));
+        unsigned int outOfBand = get_C_unsigned(taskData, DEREFHANDLE(args)->Get(4));
+        int flags = 0;
+        if (peek != 0) flags |= MSG_PEEK;
+        if (outOfBand != 0) flags |= MSG_OOB;
+        // Peeking more than once would return the same datagram each time.
+        if (peek != 0 && count > 1) count = 1;
+        if (count > MAX_BATCH) count = MAX_BATCH;
+        // The ML code checks this but the buffer size must not overflow.
+        if (size > MAX_DATAGRAM)
+            raise_exception0(taskData, EXC_size);
+
+        // The data are received into a C buffer and then copied into the heap.
+        TempCString data((char*)malloc(count * size + 1));
+        if ((char*)data == 0)
+            raise_syscall(taskData, "Insufficient memory", NOMEMORY);
+        std::vector<struct sockaddr_storage> addrs(count + 1);
+        std::vector<socklen_t> addrLengths(count + 1);
+        std::vector<size_t> lengths(count + 1);
+        size_t received = 0;
+#ifdef HAVE_RECVMMSG
+        if (count != 0)
+        {
+            std::vector<struct iovec> buffers(count);
+            std::vector<struct mmsghdr> msgs(count);
+            memset(&msgs[0], 0, count * sizeof(struct mmsghdr));
+            for (size_t i = 0; i < count; i++)
+            {
+                setIOBuffer(buffers[i], (byte*)(char*)data + i * size, size);
+                msgs[i].msg_hdr.msg_name = &addrs[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+                msgs[i].msg_hdr.msg_iov = &buffers[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            // The socket is non-blocking so this returns as soon as there are no more datagrams.
+            int res = recvmmsg(sock, &msgs[0], (unsigned)count, flags, NULL);
+            if (res < 0)
+                raise_syscall(taskData, "recvmmsg failed", GETERROR);
+            received = res;
+            for (size_t i = 0; i < received; i++)
+            {
+                lengths[i] = msgs[i].msg_len;
+                addrLengths[i] = msgs[i].msg_hdr.msg_namelen;
+            }
+        }
+#else
+        for (; received < count; received++)
+        {
+            addrLengths[received] = sizeof(struct sockaddr_storage);
+#if (defined(_WIN32))
+            int res = recvfrom(sock, (char*)data + received * size, (int)size, flags,
+                (struct sockaddr*)&addrs[received], &addrLengths[received]);
+#else
+            ssize_t res = recvfrom(sock, (char*)data + received * size, size, flags,
+                (struct sockaddr*)&addrs[received], &addrLengths[received]);
+#endif
+            if (res == SOCKET_ERROR)
+            {
+                if (received == 0)
+                    raise_syscall(taskData, "recvfrom failed", GETERROR);
+                break;
+            }
+            lengths[received] = res;
+        }
+#endif
+        // Build the list from the end.
+        result = SAVE(ListNull);
+        for (size_t i = received; i > 0; i--)
+        {
+            Handle mark = taskData->saveVec.mark();
+            size_t length = lengths[i-1];
+            if (length > size) length = size;
+            socklen_t addrLen = addrLengths[i-1];
+            if (addrLen > sizeof(struct sockaddr_storage)) addrLen = sizeof(struct sockaddr_storage);
+            Handle dataHandle = SAVE(C_string_to_Poly(taskData, (char*)data + (i-1) * size, length));
+            Handle addrHandle = SAVE(C_string_to_Poly(taskData, (char*)&addrs[i-1], addrLen));
+            Handle pair = ALLOC(2);
+            DEREFHANDLE(pair)->Set(0, dataHandle->Word());
+            DEREFHANDLE(pair)->Set(1, addrHandle->Word());
+            ML_Cons_Cell *next = (ML_Cons_Cell*)alloc(taskData, SIZEOF(ML_Cons_Cell));
+            next->h = pair->Word();
+            next->t = result->Word();
+            taskData->saveVec.reset(mark);
+            result = SAVE(next);
+        }
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
+// Send data from a file to a stream socket without copying them into the ML heap.
+// The arguments are the socket, the file, the offset and the maximum number of bytes.
+// If the offset is non-negative the data are read from there and the file position
+// is unchanged.  If it is negative they are read from the current position, which is
+// advanced.  Returns the number of bytes sent.  This is zero at the end of the file.
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkSendFile(FirstArgument threadId, PolyWord argsAsWord)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle args = taskData->saveVec.push(argsAsWord);
+    POLYUNSIGNED sent = 0;
+
+    try {
+#if (defined(_WIN32))
+        raise_exception_string(taskData, EXC_Fail, "sendFile is not implemented");
+#else
+        SOCKET sock = getStreamSocket(taskData, DEREFHANDLE(args)->Get(0));
+        int fd = getStreamFileDescriptor(taskData, DEREFHANDLE(args)->Get(1));
+        off_t offset = getPolySigned(taskData, DEREFHANDLE(args)->Get(2));
+        size_t length = getPolyUnsigned(taskData, DEREFHANDLE(args)->Get(3));
+        bool atPosition = offset < 0;
+        ssize_t res = -1;
+#ifdef HAVE_SYS_SENDFILE_H
+        // The socket is non-blocking so this returns EAGAIN if the socket buffer is full.
+        res = sendfile(sock, fd, atPosition ? NULL : &offset, length);
+        // Older kernels only support sendfile from some kinds of file.
+        if (res < 0 && errno != EINVAL && errno != ENOSYS)
+            raise_syscall(taskData, "sendfile failed", GETERROR);
+#endif
+        if (res < 0)
+        {
+            // Copy through a buffer in the RTS.  Only what is actually sent is
+            // consumed so that nothing is lost if the socket would block.
+            if (atPosition && (offset = lseek(fd, 0, SEEK_CUR)) < 0)
+                raise_syscall(taskData, "lseek failed", GETERROR);
+            if (length > 65536) length = 65536;
+            TempCString buffer((char*)malloc(length + 1));
+            if ((char*)buffer == 0)
+                raise_syscall(taskData, "Insufficient memory", NOMEMORY);
+            ssize_t haveRead = pread(fd, buffer, length, offset);
+            if (haveRead < 0)
+                raise_syscall(taskData, "pread failed", GETERROR);
+            res = haveRead == 0 ? 0 : send(sock, buffer, haveRead, 0);
+            if (res < 0)
+                raise_syscall(taskData, "send failed", GETERROR);
+            if (atPosition && lseek(fd, offset + res, SEEK_SET) < 0)
+                raise_syscall(taskData, "lseek failed", GETERROR);
+        }
+        sent = res;
+#endif
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(sent).AsUnsigned();
+}
+
 /* Return a list of known address families. */
 POLYUNSIGNED PolyNetworkGetAddrList(FirstArgument threadId)
 {
@@ -2171,6 +2699,13 @@ struct _entrypts networkingEPT[] =
     { "PolyNetworkSendTo",                      (polyRTSFunction)&PolyNetworkSendTo },
     { "PolyNetworkReceive",                     (polyRTSFunction)&PolyNetworkReceive },
     { "PolyNetworkReceiveFrom",                 (polyRTSFunction)&PolyNetworkReceiveFrom },
+    { "PolyNetworkSendWait",                    (polyRTSFunction)&PolyNetworkSendWait },
+    { "PolyNetworkReceiveWait",                 (polyRTSFunction)&PolyNetworkReceiveWait },
+    { "PolyNetworkSendVector",                  (polyRTSFunction)&PolyNetworkSendVector },
+    { "PolyNetworkReceiveVector",               (polyRTSFunction)&PolyNetworkReceiveVector },
+    { "PolyNetworkSendToMultiple",              (polyRTSFunction)&PolyNetworkSendToMultiple },
+    { "PolyNetworkReceiveFromMultiple",         (polyRTSFunction)&PolyNetworkReceiveFromMultiple },
+    { "PolyNetworkSendFile",                    (polyRTSFunction)&PolyNetworkSendFile },
     { "PolyNetworkGetAddrInfo",                 (polyRTSFunction)&PolyNetworkGetAddrInfo },
     { "PolyNetworkGetFamilyFromAddress",        (polyRTSFunction)&PolyNetworkGetFamilyFromAddress },
     { "PolyNetworkGetAddressAndPortFromIP4",    (polyRTSFunction)&PolyNetworkGetAddressAndPortFromIP4 },
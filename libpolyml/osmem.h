@@ -31,6 +31,10 @@
 #include <stdlib.h>
 #endif
 
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
 #ifdef POLYML32IN64
 #include "bitmap.h"
 #endif
@@ -82,6 +86,24 @@ public:
     // either from importing a portable export file or copying the area in 32-in-64.
     bool DisableWriteForCode(void* codeAddr, void* dataAddr, size_t space);
 
+    // Map part of a file into memory as a data or code area, at the hinted address if
+    // that is free.  The mapping is private so pages are shared with other processes
+    // mapping the same file until they are written.  The offset must be a multiple of
+    // the page size.  Returns NULL if the file cannot be mapped in this way, in which
+    // case the caller should allocate an area and read the data.  The area is freed
+    // with FreeDataArea or FreeCodeArea.
+    // If shared is true writes to the area go to the file.  This is used to build
+    // a file in memory without holding all of it in memory at once.
+    void *MapFileArea(void *hint, size_t& bytes, int fd, uint64_t offset, void*& shadowArea, bool shared = false);
+
+    // Turn a shared file mapping into a private one with the same contents so that
+    // further changes are not written to the file.
+    bool MakeFileAreaPrivate(void *p, size_t bytes, int fd, uint64_t offset);
+
+    // Create a temporary file that is removed when it is closed, preferably in the
+    // given directory.  Returns -1 if that is not possible.
+    static int CreateTemporaryFile(const char *dirName = 0);
+
 protected:
     size_t pageSize;
     enum _MemUsage memUsage;
@@ -121,10 +121,15 @@ static int openTmpFile(const char* dirName)
     return fd;
 }
 
-static int createTemporaryFile()
+int OSMem::CreateTemporaryFile(const char *dirName)
 {
-    char *tmpDir = getenv("TMPDIR");
     int fd;
+    if (dirName != NULL)
+    {
+        fd = openTmpFile(dirName);
+        if (fd != -1) return fd;
+    }
+    char *tmpDir = getenv("TMPDIR");
     if (tmpDir != NULL)
     {
         fd = openTmpFile(tmpDir);
@@ -190,7 +195,7 @@ bool OSMem::Initialise(enum _MemUsage usage, size_t space /* = 0 */, void** pBas
     else
     {
         // More difficult - require file mapping
-        shadowFd = createTemporaryFile();
+        shadowFd = CreateTemporaryFile();
         if (shadowFd == -1) return false;
         if (ftruncate(shadowFd, space) == -1) return false;
         void *readWrite = mmap(0, space, PROT_NONE, MAP_SHARED, shadowFd, 0);
@@ -355,6 +360,18 @@ bool OSMem::DisableWriteForCode(void* codeAddr, void* dataAddr, size_t space)
     return res != -1;
 }
 
+// Areas have to be allocated within the reserved region and addresses in
+// files are relative to the original base so mapping isn't supported.
+void *OSMem::MapFileArea(void *hint, size_t &space, int fd, uint64_t offset, void*& shadowArea, bool shared)
+{
+    return 0;
+}
+
+bool OSMem::MakeFileAreaPrivate(void *p, size_t bytes, int fd, uint64_t offset)
+{
+    return false;
+}
+
 #else
 
 // Native address versions
@@ -391,7 +408,7 @@ bool OSMem::Initialise(enum _MemUsage usage, size_t space /* = 0 */, void **pBas
         return false; // There's a problem.
     munmap(FIXTYPE test, pageSize);
     // Need to create a file descriptor for mapping.
-    shadowFd = createTemporaryFile();
+    shadowFd = CreateTemporaryFile();
     if (shadowFd != -1) return true;
     return false;
 }
@@ -485,4 +502,42 @@ bool OSMem::DisableWriteForCode(void* codeAddr, void* dataAddr, size_t space)
     return res != -1;
 }
 
+void *OSMem::MapFileArea(void *hint, size_t &space, int fd, uint64_t offset, void*& shadowArea, bool shared)
+{
+    // If we need a shadow area for code we can't map the file directly.
+    if (shadowFd != -1) return 0;
+    space = (space + pageSize-1) & ~(pageSize-1);
+    int prot = PROT_READ | PROT_WRITE;
+    if (memUsage == UsageExecutableCode) prot |= PROT_EXEC;
+    int flags = shared ? MAP_SHARED : MAP_PRIVATE;
+    void *result = MAP_FAILED;
+#ifdef MAP_FIXED_NOREPLACE
+    // Linux will not use a hint for a file mapping next to an existing mapping
+    // so ask for the exact address.  This fails if anything is already there.
+    if (hint != 0)
+        result = mmap(hint, space, prot, flags | MAP_FIXED_NOREPLACE, fd, (off_t)offset);
+    // Older kernels treat the flag as a hint.
+    if (result != MAP_FAILED && result != hint)
+    {
+        munmap(result, space);
+        result = MAP_FAILED;
+    }
+#endif
+    // Otherwise the hint is only used if the area is free.
+    if (result == MAP_FAILED)
+        result = mmap(hint, space, prot, flags, fd, (off_t)offset);
+    if (result == MAP_FAILED)
+        return 0;
+    shadowArea = result;
+    return result;
+}
+
+bool OSMem::MakeFileAreaPrivate(void *p, size_t bytes, int fd, uint64_t offset)
+{
+    int prot = PROT_READ | PROT_WRITE;
+    if (memUsage == UsageExecutableCode) prot |= PROT_EXEC;
+    // Replacing the mapping is atomic so if it fails the shared mapping remains.
+    return mmap(p, bytes, prot, MAP_PRIVATE | MAP_FIXED, fd, (off_t)offset) == p;
+}
+
 #endif
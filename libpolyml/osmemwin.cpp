@@ -254,3 +254,19 @@ bool OSMem::DisableWriteForCode(void* codeAddr, void* dataAddr, size_t space)
 
 #endif
 
+// Not currently supported in Windows.  Callers read the data instead.
+void *OSMem::MapFileArea(void *hint, size_t& space, int fd, uint64_t offset, void*& shadowArea, bool shared)
+{
+    return 0;
+}
+
+bool OSMem::MakeFileAreaPrivate(void *p, size_t bytes, int fd, uint64_t offset)
+{
+    return false;
+}
+
+int OSMem::CreateTemporaryFile(const char *dirName)
+{
+    return -1;
+}
+
@@ -86,11 +86,12 @@ void PECOFFExport::writeRelocation(const IMAGE_RELOCATION* reloc)
 
 void PECOFFExport::addExternalReference(void *relocAddr, const char *name, bool/* isFuncPtr*/)
 {
-    externTable.makeEntry(name);
+    unsigned index;
+    externTable.makeEntry(name, &index); // Each name is only entered once.
     IMAGE_RELOCATION reloc;
     // Set the offset within the section we're scanning.
     setRelocationAddress(relocAddr, &reloc.VirtualAddress);
-    reloc.SymbolTableIndex = symbolNum++;
+    reloc.SymbolTableIndex = symbolNum + index;
     reloc.Type = DIRECT_WORD_RELOCATION;
     writeRelocation(&reloc);
 }
@@ -392,7 +393,7 @@ void PECOFFExport::exportStore(void)
     for (unsigned i = 0; i < externTable.stringSize; i += (unsigned)strlen(externTable.strings+i) + 1)
         writeSymbol(externTable.strings+i, 0, 0, true, 0x20);
 
-    fhdr.NumberOfSymbols = symbolNum;
+    fhdr.NumberOfSymbols = symbolNum + externTable.stringCount;
 
     // The string table is written immediately after the symbols.
     // The length is included as the first word.
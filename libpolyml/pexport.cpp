@@ -34,6 +34,10 @@
 #include <errno.h>
 #endif
 
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
 #ifdef HAVE_ASSERT_H
 #include <assert.h>
 #define ASSERT(x) assert(x)
@@ -59,7 +63,35 @@ This file contains the code both to export the file and to import it
 in a new session.
 */
 
-PExport::PExport()
+/*
+The binary format contains the same information as the text format but is
+much quicker to read.  It starts with the eight bytes of binaryMagic, a
+version byte, a byte that is 'B' or 'L' for the byte order of the machine
+that wrote it, the architecture letter and the word length in bytes.  All
+numbers after that are unsigned LEB128 varints.  These are the number of
+objects and the index of the root followed by a table with an entry for
+each object in index order.  An entry is the letter used for the object type
+in the text format, a byte with its F_MUTABLE_BIT, F_NEGATIVE_BIT,
+F_WEAK_BIT and F_NO_OVERWRITE flags and then the lengths that the text
+format puts before the '|'.  An entry that is just a zero byte is an unused
+index.  The contents of the objects follow in the same order.  Byte data,
+including code, is written as it is in memory.  A word is written as a
+number that is twice the index for an address plus one or, for a tagged
+integer, twice the zig-zag encoding of the value.  Constants within code
+are a count followed by the offset, relocation kind and object index of
+each.  Because the table comes first the importer can allocate every object
+and then fill them in as it reads the rest of the file.
+*/
+static const char binaryMagic[8] = { 'P', 'o', 'l', 'y', 'P', 'B', 'i', 'n' };
+#define BINARY_FORMAT_VERSION   1
+
+#ifdef WORDS_BIGENDIAN
+#define BINARY_BYTE_ORDER       'B'
+#else
+#define BINARY_BYTE_ORDER       'L'
+#endif
+
+PExport::PExport(bool binary): binaryFormat(binary)
 {
 }
 
@@ -107,6 +139,82 @@ void PExport::printValue(PolyWord q)
         printAddress(q.AsAddress());
 }
 
+// Classify an object using the letter that identifies its type in the text format.
+char PExport::objectKind(PolyObject *p)
+{
+    POLYUNSIGNED length = p->Length();
+    if (p->IsByteObject())
+    {
+        if (p->IsMutable() && p->IsWeakRefObject() && length >= sizeof(uintptr_t) / sizeof(PolyWord))
+        {
+            // This is either an entry point or a weak ref used in the FFI.
+            if (length == sizeof(uintptr_t)/sizeof(PolyWord))
+                return 'K'; // Weak ref
+            else return 'E'; // Entry point - C null-terminated string.
+        }
+        /* May be a string, a long format arbitrary precision
+           number or a real number. */
+        PolyStringObject* ps = (PolyStringObject*)p;
+        /* This is not infallible but it seems to be good enough
+           to detect the strings. */
+        POLYUNSIGNED bytes = length * sizeof(PolyWord);
+        if (length >= 2 &&
+            ps->length <= bytes - sizeof(POLYUNSIGNED) &&
+            ps->length > bytes - 2 * sizeof(POLYUNSIGNED))
+            return 'S'; /* Looks like a string. */
+        /* Not a string. May be an arbitrary precision integer.
+           If the source and destination word lengths differ we
+           could find that some long-format arbitrary precision
+           numbers could be represented in the tagged short form
+           or vice-versa.  The former case might give rise to
+           errors because when comparing two arbitrary precision
+           numbers for equality we assume that they are not equal
+           if they have different representation.  The latter
+           case could be a problem because we wouldn't know whether
+           to convert the tagged form to long form, which would be
+           correct if the value has type "int" or to truncate it
+           which would be correct for "word".
+           It could also be a real number but that doesn't matter
+           if we recompile everything on the new machine.
+        */
+        return 'B';
+    }
+    else if (p->IsCodeObject())
+    {
+        PolyWord *cp;
+        POLYUNSIGNED constCount, byteCount;
+        return codeLayout(p, cp, constCount, byteCount) ? 'F' : 'D';
+    }
+    else if (p->IsClosureObject())
+        return 'C';
+    else return 'O'; // Ordinary objects, essentially tuples.
+}
+
+// Find the constants and the number of bytes of code in a code object.
+// Returns true if it uses the new format with the offset to the constants
+// in the last word and false if it uses the old format.
+bool PExport::codeLayout(PolyObject *p, PolyWord *&cp, POLYUNSIGNED &constCount, POLYUNSIGNED &byteCount)
+{
+    POLYUNSIGNED length = p->Length();
+    ASSERT(! p->IsMutable() );
+    /* Work out the number of bytes in the code and the
+       number of constants. */
+    p->GetConstSegmentForCode(cp, constCount);
+    /* The byte count is the length of the segment minus the
+       number of constants minus one for the constant count.
+       It includes the marker word, byte count, profile count
+       and, on the X86/64 at least, any non-address constants.
+       These are actually word values. */
+    PolyWord* last_word = p->Offset(length - 1);
+    byteCount = (length - constCount - 1) * sizeof(PolyWord);
+    if (last_word->AsSigned() < 0)
+    {
+        byteCount -= sizeof(PolyWord);
+        return true;
+    }
+    else return false; // Old format
+}
+
 void PExport::printObject(PolyObject *p)
 {
     POLYUNSIGNED length = p->Length();
@@ -125,136 +233,96 @@ void PExport::printObject(PolyObject *p)
     if (OBJ_IS_NO_OVERWRITE(p->LengthWord()))
         putc('V', exportFile);
 
-    if (p->IsByteObject())
+    char kind = objectKind(p);
+    switch (kind)
     {
-        if (p->IsMutable() && p->IsWeakRefObject() && p->Length() >= sizeof(uintptr_t) / sizeof(PolyWord))
+    case 'K': // Weak ref
+        putc('K', exportFile);
+        break;
+
+    case 'E': // Entry point - C null-terminated string.
         {
-            // This is either an entry point or a weak ref used in the FFI.
-            // Clear the first word
-            if (p->Length() == sizeof(uintptr_t)/sizeof(PolyWord))
-                putc('K', exportFile); // Weak ref
-            else if (p->Length() > sizeof(uintptr_t) / sizeof(PolyWord))
-            {
-                // Entry point - C null-terminated string.
-                putc('E', exportFile);
-                const char* name = (char*)p + sizeof(uintptr_t);
-                fprintf(exportFile, "%" PRI_SIZET "|%s", strlen(name), name);
-                *(uintptr_t*)p = 0; // Entry point
-            }
+            putc('E', exportFile);
+            const char* name = (char*)p + sizeof(uintptr_t);
+            fprintf(exportFile, "%" PRI_SIZET "|%s", strlen(name), name);
+            *(uintptr_t*)p = 0; // Entry point
+            break;
         }
-        else
+
+    case 'S':
         {
-            /* May be a string, a long format arbitrary precision
-               number or a real number. */
             PolyStringObject* ps = (PolyStringObject*)p;
-            /* This is not infallible but it seems to be good enough
-               to detect the strings. */
-            POLYUNSIGNED bytes = length * sizeof(PolyWord);
-            if (length >= 2 &&
-                ps->length <= bytes - sizeof(POLYUNSIGNED) &&
-                ps->length > bytes - 2 * sizeof(POLYUNSIGNED))
-            {
-                /* Looks like a string. */
-                fprintf(exportFile, "S%" POLYUFMT "|", ps->length);
-                for (unsigned i = 0; i < ps->length; i++)
-                {
-                    char ch = ps->chars[i];
-                    fprintf(exportFile, "%02x", ch & 0xff);
-                }
-            }
-            else
+            fprintf(exportFile, "S%" POLYUFMT "|", ps->length);
+            for (unsigned i = 0; i < ps->length; i++)
             {
-                /* Not a string. May be an arbitrary precision integer.
-                   If the source and destination word lengths differ we
-                   could find that some long-format arbitrary precision
-                   numbers could be represented in the tagged short form
-                   or vice-versa.  The former case might give rise to
-                   errors because when comparing two arbitrary precision
-                   numbers for equality we assume that they are not equal
-                   if they have different representation.  The latter
-                   case could be a problem because we wouldn't know whether
-                   to convert the tagged form to long form, which would be
-                   correct if the value has type "int" or to truncate it
-                   which would be correct for "word".
-                   It could also be a real number but that doesn't matter
-                   if we recompile everything on the new machine.
-                */
-                byte* u = (byte*)p;
-                putc('B', exportFile);
-                fprintf(exportFile, "%" PRI_SIZET "|", length * sizeof(PolyWord));
-                for (unsigned i = 0; i < (unsigned)(length * sizeof(PolyWord)); i++)
-                {
-                    fprintf(exportFile, "%02x", u[i]);
-                }
+                char ch = ps->chars[i];
+                fprintf(exportFile, "%02x", ch & 0xff);
             }
-        }
-    }
-    else if (p->IsCodeObject())
-    {
-        POLYUNSIGNED constCount;
-        PolyWord *cp;
-        ASSERT(! p->IsMutable() );
-        /* Work out the number of bytes in the code and the
-           number of constants. */
-        p->GetConstSegmentForCode(cp, constCount);
-        /* The byte count is the length of the segment minus the
-           number of constants minus one for the constant count.
-           It includes the marker word, byte count, profile count
-           and, on the X86/64 at least, any non-address constants.
-           These are actually word values. */
-        PolyWord* last_word = p->Offset(length - 1);
-        POLYUNSIGNED byteCount = (length - constCount - 1) * sizeof(PolyWord);
-        if (last_word->AsSigned() < 0)
-        {
-            byteCount -= sizeof(PolyWord);
-            fprintf(exportFile, "F%" POLYUFMT ",%" POLYUFMT "|", constCount, byteCount);
-        }
-        else
-        {
-            // Old format
-            fprintf(exportFile, "D%" POLYUFMT ",%" POLYUFMT "|", constCount, byteCount);
+            break;
         }
 
-        // First the code.
-        byte *u = (byte*)p;
-        for (POLYUNSIGNED i = 0; i < byteCount; i++)
-            fprintf(exportFile, "%02x", u[i]);
-
-        putc('|', exportFile);
-        // Now the constants.
-        for (POLYUNSIGNED i = 0; i < constCount; i++)
-        {
-            printValue(cp[i]);
-            if (i < constCount-1)
-                putc(',', exportFile);
-        }
-        putc('|', exportFile);
-        // Finally any constants in the code object.
-        machineDependent->ScanConstantsWithinCode(p, this);
-    }
-    else // Ordinary objects, essentially tuples, or closures.
-    {
-        if (p->IsClosureObject())
+    case 'B':
         {
-            POLYUNSIGNED nItems = length - sizeof(PolyObject*) / sizeof(PolyWord) + 1;
-            fprintf(exportFile, "C%" POLYUFMT "|", nItems); // Number of items
+            byte* u = (byte*)p;
+            putc('B', exportFile);
+            fprintf(exportFile, "%" PRI_SIZET "|", length * sizeof(PolyWord));
+            for (unsigned i = 0; i < (unsigned)(length * sizeof(PolyWord)); i++)
+            {
+                fprintf(exportFile, "%02x", u[i]);
+            }
+            break;
         }
-        else fprintf(exportFile, "O%" POLYUFMT "|", length);
-        if (p->IsClosureObject())
+
+    case 'D': case 'F':
         {
-            // The first word is always a code address.
-            printAddress(*(PolyObject**)p);
-            i = sizeof(PolyObject*)/sizeof(PolyWord);
-            if (i < length)
-                putc(',', exportFile);
+            POLYUNSIGNED constCount, byteCount;
+            PolyWord *cp;
+            codeLayout(p, cp, constCount, byteCount);
+            fprintf(exportFile, "%c%" POLYUFMT ",%" POLYUFMT "|", kind, constCount, byteCount);
+
+            // First the code.
+            byte *u = (byte*)p;
+            for (POLYUNSIGNED i = 0; i < byteCount; i++)
+                fprintf(exportFile, "%02x", u[i]);
+
+            putc('|', exportFile);
+            // Now the constants.
+            for (POLYUNSIGNED i = 0; i < constCount; i++)
+            {
+                printValue(cp[i]);
+                if (i < constCount-1)
+                    putc(',', exportFile);
+            }
+            putc('|', exportFile);
+            // Finally any constants in the code object.
+            machineDependent->ScanConstantsWithinCode(p, this);
+            break;
         }
-        else i = 0;
-        while (i < length)
+
+    default: // Ordinary objects, essentially tuples, or closures.
         {
-            printValue(p->Get(i));
-            if (i < length-1)
-                putc(',', exportFile);
-            i++;
+            if (kind == 'C')
+            {
+                POLYUNSIGNED nItems = length - sizeof(PolyObject*) / sizeof(PolyWord) + 1;
+                fprintf(exportFile, "C%" POLYUFMT "|", nItems); // Number of items
+                // The first word is always a code address.
+                printAddress(*(PolyObject**)p);
+                i = sizeof(PolyObject*)/sizeof(PolyWord);
+                if (i < length)
+                    putc(',', exportFile);
+            }
+            else
+            {
+                fprintf(exportFile, "O%" POLYUFMT "|", length);
+                i = 0;
+            }
+            while (i < length)
+            {
+                printValue(p->Get(i));
+                if (i < length-1)
+                    putc(',', exportFile);
+                i++;
+            }
         }
     }
     fprintf(exportFile, "\n");
@@ -271,11 +339,31 @@ void PExport::ScanConstant(PolyObject *base, byte *addr, ScanRelocationKind code
     // Put in the byte offset and the relocation type code.
     POLYUNSIGNED offset = (POLYUNSIGNED)(addr - (byte*)base);
     ASSERT (offset < base->Length() * sizeof(POLYUNSIGNED));
+    if (binaryFormat)
+    {
+        CodeConstant c = { offset, code, getIndex(p) };
+        codeConstants.push_back(c);
+        return;
+    }
     fprintf(exportFile, "%" POLYUFMT ",%d,", (POLYUNSIGNED)(addr - (byte*)base), code);
     printAddress(p); // The value to plug in.
     fprintf(exportFile, " ");
 }
 
+// The architecture letter written in the header of both formats.
+static char exportArchitecture()
+{
+    switch (machineDependent->MachineArchitecture())
+    {
+    case MA_Interpreted:
+        return 'I';
+    case MA_I386: case MA_X86_64: case MA_X86_64_32:
+        return 'X';
+    default:
+        return '?';
+    }
+}
+
 void PExport::exportStore(void)
 {
     // We want the entries in pMap to be in ascending
@@ -310,17 +398,15 @@ void PExport::exportStore(void)
         }
     }
 
-    /* Start writing the information. */
-    fprintf(exportFile, "Objects\t%" PRI_SIZET "\n", pMap.size());
-    char arch = '?';
-    switch (machineDependent->MachineArchitecture())
+    if (binaryFormat)
     {
-    case MA_Interpreted:
-        arch = 'I'; break;
-    case MA_I386: case MA_X86_64: case MA_X86_64_32:
-        arch = 'X'; break;
+        exportBinary();
+        return;
     }
-    fprintf(exportFile, "Root\t%" PRI_SIZET " %c %u\n", getIndex(rootFunction), arch, (unsigned)sizeof(PolyWord));
+
+    /* Start writing the information. */
+    fprintf(exportFile, "Objects\t%" PRI_SIZET "\n", pMap.size());
+    fprintf(exportFile, "Root\t%" PRI_SIZET " %c %u\n", getIndex(rootFunction), exportArchitecture(), (unsigned)sizeof(PolyWord));
 
     // Generate each of the areas.
     for (size_t i = 0; i < memTableEntries; i++)
@@ -347,6 +433,159 @@ void PExport::exportStore(void)
 }
 
 
+void PExport::writeNumber(POLYUNSIGNED n)
+{
+    while (n >= 0x80)
+    {
+        putc((int)(n & 0x7f) | 0x80, exportFile);
+        n >>= 7;
+    }
+    putc((int)n, exportFile);
+}
+
+void PExport::writeValue(PolyWord q)
+{
+    if (IS_INT(q) || q == PolyWord::FromUnsigned(0))
+    {
+        POLYSIGNED j = UNTAGGED(q);
+        POLYUNSIGNED zigZag = ((POLYUNSIGNED)j << 1) ^ (POLYUNSIGNED)(j < 0 ? -1 : 0);
+        writeNumber(zigZag << 1);
+    }
+    else writeNumber(((POLYUNSIGNED)getIndex((PolyObject*)q.AsAddress()) << 1) | 1);
+}
+
+void PExport::writeObjectHeader(PolyObject *p)
+{
+    POLYUNSIGNED length = p->Length();
+#ifdef POLYML32IN64
+    // Filler cells have an index but are not written out.
+    if (((uintptr_t)p & 4) != 0 && length == 0)
+    {
+        putc(0, exportFile);
+        return;
+    }
+#endif
+    char kind = objectKind(p);
+    putc(kind, exportFile);
+    putc((int)(p->LengthWord() >> OBJ_PRIVATE_FLAGS_SHIFT) & (F_MUTABLE_BIT|F_NEGATIVE_BIT|F_WEAK_BIT|F_NO_OVERWRITE), exportFile);
+
+    switch (kind)
+    {
+    case 'K':
+        break;
+    case 'E':
+        writeNumber(strlen((char*)p + sizeof(uintptr_t)));
+        break;
+    case 'S':
+        writeNumber(((PolyStringObject*)p)->length);
+        break;
+    case 'B':
+        writeNumber(length * sizeof(PolyWord));
+        break;
+    case 'D': case 'F':
+        {
+            POLYUNSIGNED constCount, byteCount;
+            PolyWord *cp;
+            codeLayout(p, cp, constCount, byteCount);
+            writeNumber(constCount);
+            writeNumber(byteCount);
+            break;
+        }
+    case 'C':
+        writeNumber(length - sizeof(PolyObject*) / sizeof(PolyWord) + 1);
+        break;
+    default:
+        writeNumber(length);
+    }
+}
+
+void PExport::writeObjectContents(PolyObject *p)
+{
+    POLYUNSIGNED length = p->Length();
+#ifdef POLYML32IN64
+    if (((uintptr_t)p & 4) != 0 && length == 0)
+        return;
+#endif
+    switch (objectKind(p))
+    {
+    case 'K':
+        break;
+
+    case 'E':
+        {
+            const char* name = (char*)p + sizeof(uintptr_t);
+            fwrite(name, 1, strlen(name), exportFile);
+            break;
+        }
+
+    case 'S':
+        {
+            PolyStringObject* ps = (PolyStringObject*)p;
+            fwrite(ps->chars, 1, ps->length, exportFile);
+            break;
+        }
+
+    case 'B':
+        fwrite(p, sizeof(PolyWord), length, exportFile);
+        break;
+
+    case 'D': case 'F':
+        {
+            POLYUNSIGNED constCount, byteCount;
+            PolyWord *cp;
+            codeLayout(p, cp, constCount, byteCount);
+            fwrite(p, 1, byteCount, exportFile);
+            for (POLYUNSIGNED i = 0; i < constCount; i++)
+                writeValue(cp[i]);
+            // ScanConstant adds the constants in the code to codeConstants.
+            codeConstants.clear();
+            machineDependent->ScanConstantsWithinCode(p, this);
+            writeNumber(codeConstants.size());
+            for (std::vector<CodeConstant>::iterator i = codeConstants.begin(); i != codeConstants.end(); i++)
+            {
+                writeNumber(i->offset);
+                writeNumber(i->code);
+                writeNumber(i->index);
+            }
+            break;
+        }
+
+    case 'C':
+        {
+            // The first word is always a code address.
+            writeNumber(getIndex(*(PolyObject**)p));
+            for (POLYUNSIGNED i = sizeof(PolyObject*)/sizeof(PolyWord); i < length; i++)
+                writeValue(p->Get(i));
+            break;
+        }
+
+    default:
+        for (POLYUNSIGNED i = 0; i < length; i++)
+            writeValue(p->Get(i));
+    }
+}
+
+void PExport::exportBinary(void)
+{
+    fwrite(binaryMagic, 1, sizeof(binaryMagic), exportFile);
+    putc(BINARY_FORMAT_VERSION, exportFile);
+    putc(BINARY_BYTE_ORDER, exportFile);
+    putc(exportArchitecture(), exportFile);
+    putc(sizeof(PolyWord), exportFile);
+    writeNumber(pMap.size());
+    writeNumber(getIndex(rootFunction));
+
+    // The object table followed by the contents, both in index order.
+    for (std::vector<PolyObject *>::iterator i = pMap.begin(); i != pMap.end(); i++)
+        writeObjectHeader(*i);
+    for (std::vector<PolyObject *>::iterator i = pMap.begin(); i != pMap.end(); i++)
+        writeObjectContents(*i);
+
+    if (ferror(exportFile))
+        errorMessage = "Error while writing export file";
+    fclose(exportFile); exportFile = NULL;
+}
+
 /*
 Import a portable export file and load it into memory.
 Creates "permanent" address entries in the global memory table.
@@ -440,11 +679,29 @@ public:
     PImport();
     ~PImport();
     bool DoImport(void);
+    bool DoImportBinary(void);
     FILE *f;
     PolyObject *Root(void) { return objMap[nRoot]; }
 private:
     bool ReadValue(PolyObject *p, POLYUNSIGNED i);
     bool GetValue(PolyWord *result);
+    PolyObject *NewObject(POLYUNSIGNED nWords, unsigned objBits);
+    void CompleteSpaces(void);
+
+    // Binary format.  The file is read through a buffer.
+    int ReadByte(void);
+    bool ReadBytes(void *dest, size_t length);
+    bool ReadNumber(POLYUNSIGNED *result);
+    bool ReadBinaryValue(PolyWord *result);
+    struct BinaryObjectInfo {
+        BinaryObjectInfo(): kind(0), count(0), bytes(0) {}
+        char kind;
+        POLYUNSIGNED count, bytes;
+    };
+    bool ReadBinaryObject(PolyObject *p, const BinaryObjectInfo &info);
+
+    byte *buffer;
+    size_t bufferPos, bufferEnd;
     
     POLYUNSIGNED nObjects, nRoot;
     PolyObject **objMap;
@@ -462,6 +719,8 @@ PImport::PImport():
     f = NULL;
     objMap = 0;
     spaceIndex = 1;
+    buffer = 0;
+    bufferPos = bufferEnd = 0;
 }
 
 PImport::~PImport()
@@ -469,6 +728,7 @@ PImport::~PImport()
     if (f)
         fclose(f);
     free(objMap);
+    free(buffer);
 }
 
 bool PImport::GetValue(PolyWord *result)
@@ -513,6 +773,30 @@ bool PImport::ReadValue(PolyObject *p, POLYUNSIGNED i)
     else return false;
 }
 
+// Allocate an object in the space appropriate for its flags and set its length word.
+PolyObject *PImport::NewObject(POLYUNSIGNED nWords, unsigned objBits)
+{
+    SpaceAlloc* alloc;
+    if (objBits & F_MUTABLE_BIT)
+        alloc = &mutSpace;
+    else if ((objBits & 3) == F_CODE_OBJ)
+        alloc = &codeSpace;
+    else alloc = &immutSpace;
+    PolyObject* p = alloc->NewObj(nWords);
+    if (p == 0)
+        return 0;
+    /* Put in length PolyWord and flag bits. */
+    alloc->memSpace->writeAble(p)->SetLengthWord(nWords, objBits);
+    return p;
+}
+
+// Now remove write access from immutable spaces.
+void PImport::CompleteSpaces(void)
+{
+    for (std::vector<PermanentMemSpace*>::iterator i = gMem.pSpaces.begin(); i < gMem.pSpaces.end(); i++)
+        gMem.CompletePermanentSpaceAllocation(*i);
+}
+
 bool PImport::DoImport()
 {
     int ch;
@@ -643,18 +927,10 @@ bool PImport::DoImport()
             return false;
         }
 
-        SpaceAlloc* alloc;
-        if (objBits & F_MUTABLE_BIT)
-            alloc = &mutSpace;
-        else if ((objBits & 3) == F_CODE_OBJ)
-            alloc = &codeSpace;
-        else alloc = &immutSpace;
-        PolyObject* p = alloc->NewObj(nWords);
+        PolyObject* p = NewObject(nWords, objBits);
         if (p == 0)
             return false;
         objMap[objNo] = p;
-        /* Put in length PolyWord and flag bits. */
-        alloc->memSpace->writeAble(p)->SetLengthWord(nWords, objBits);
 
         /* Skip the object contents. */
         while (getc(f) != '\n') ;
@@ -881,32 +1157,396 @@ bool PImport::DoImport()
             return false;
         }
     }
-    // Now remove write access from immutable spaces.
-    for (std::vector<PermanentMemSpace*>::iterator i = gMem.pSpaces.begin(); i < gMem.pSpaces.end(); i++)
-        gMem.CompletePermanentSpaceAllocation(*i);
+    CompleteSpaces();
     return true;
 }
 
-// Import a file in the portable format and return a pointer to the root object.
+#define IMPORT_BUFFER_SIZE  (256*1024)
+
+int PImport::ReadByte(void)
+{
+    if (bufferPos == bufferEnd)
+    {
+        bufferEnd = fread(buffer, 1, IMPORT_BUFFER_SIZE, f);
+        bufferPos = 0;
+        if (bufferEnd == 0)
+            return EOF;
+    }
+    return buffer[bufferPos++];
+}
+
+bool PImport::ReadBytes(void *dest, size_t length)
+{
+    byte *d = (byte*)dest;
+    while (length != 0)
+    {
+        if (bufferPos == bufferEnd)
+        {
+            // Read large blocks directly rather than through the buffer.
+            if (length >= IMPORT_BUFFER_SIZE)
+                return fread(d, 1, length, f) == length;
+            bufferEnd = fread(buffer, 1, IMPORT_BUFFER_SIZE, f);
+            bufferPos = 0;
+            if (bufferEnd == 0)
+                return false;
+        }
+        size_t n = bufferEnd - bufferPos;
+        if (n > length) n = length;
+        memcpy(d, buffer + bufferPos, n);
+        bufferPos += n;
+        d += n;
+        length -= n;
+    }
+    return true;
+}
+
+// Read an unsigned LEB128 number.
+bool PImport::ReadNumber(POLYUNSIGNED *result)
+{
+    POLYUNSIGNED n = 0;
+    for (unsigned shift = 0; shift < sizeof(POLYUNSIGNED) * 8; shift += 7)
+    {
+        int ch = ReadByte();
+        if (ch == EOF)
+            return false;
+        n |= (POLYUNSIGNED)(ch & 0x7f) << shift;
+        if ((ch & 0x80) == 0)
+        {
+            *result = n;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool PImport::ReadBinaryValue(PolyWord *result)
+{
+    POLYUNSIGNED n;
+    if (!ReadNumber(&n))
+        return false;
+    if (n & 1)
+    {
+        POLYUNSIGNED obj = n >> 1;
+        if (obj >= nObjects)
+            return false;
+        *result = objMap[obj];
+    }
+    else
+    {
+        /* Tagged integer in zig-zag form. */
+        POLYUNSIGNED zigZag = n >> 1;
+        POLYSIGNED j = (POLYSIGNED)(zigZag >> 1) ^ -(POLYSIGNED)(zigZag & 1);
+        ASSERT(j >= -MAXTAGGED-1 && j <= MAXTAGGED);
+        *result = TAGGED(j);
+    }
+    return true;
+}
+
+// Fill in the contents of an object that has already been allocated.  The
+// lengths from the object table that can't be found from the object are in info.
+bool PImport::ReadBinaryObject(PolyObject *p, const BinaryObjectInfo &info)
+{
+    POLYUNSIGNED length = p->Length();
+    switch (info.kind)
+    {
+    case 'O': /* Simple object. */
+        for (POLYUNSIGNED i = 0; i < length; i++)
+        {
+            PolyWord w = TAGGED(0);
+            if (!ReadBinaryValue(&w))
+                return false;
+            p->Set(i, w);
+        }
+        return true;
+
+    case 'C': // Closure
+        {
+            POLYUNSIGNED obj;
+            if (!ReadNumber(&obj) || obj >= nObjects)
+                return false;
+            *(PolyObject**)p = objMap[obj];
+            for (POLYUNSIGNED i = sizeof(PolyObject*) / sizeof(PolyWord); i < length; i++)
+            {
+                PolyWord w = TAGGED(0);
+                if (!ReadBinaryValue(&w))
+                    return false;
+                p->Set(i, w);
+            }
+            return true;
+        }
+
+    case 'B': /* Byte segment. */
+        if (!ReadBytes(p, info.bytes))
+            return false;
+        // Legacy: If this is an entry point object set its value.
+        if (p->IsMutable() && p->IsWeakRefObject() && length > sizeof(uintptr_t)/sizeof(PolyWord))
+        {
+            bool loadEntryPt = setEntryPoint(p);
+            ASSERT(loadEntryPt);
+        }
+        return true;
+
+    case 'S': /* String. */
+        {
+            PolyStringObject * ps = (PolyStringObject *)p;
+            ps->length = info.bytes;
+            return ReadBytes(ps->chars, info.bytes);
+        }
+
+    case 'D':
+    case 'F':
+        {
+            POLYUNSIGNED nWords = info.count;
+            MemSpace* space = gMem.SpaceForObjectAddress(p);
+            PolyObject *wr = space->writeAble(p);
+            if (!ReadBytes(wr, info.bytes))
+                return false;
+            if (info.kind == 'F')
+            {
+                wr->Set(length - nWords - 2, PolyWord::FromUnsigned(nWords));
+                wr->Set(length - 1, PolyWord::FromSigned((0-nWords-1)*sizeof(PolyWord)));
+            }
+            else wr->Set(length-1, PolyWord::FromUnsigned(nWords));
+            /* Read in the constants. */
+            for (POLYUNSIGNED i = 0; i < nWords; i++)
+            {
+                PolyWord w = TAGGED(0);
+                if (!ReadBinaryValue(&w))
+                    return false;
+                wr->Set(i+length-nWords-1, w);
+            }
+            // Constants within the code.
+            POLYUNSIGNED nConsts;
+            if (!ReadNumber(&nConsts))
+                return false;
+            for (POLYUNSIGNED i = 0; i < nConsts; i++)
+            {
+                POLYUNSIGNED offset, code, obj;
+                if (!ReadNumber(&offset) || !ReadNumber(&code) || !ReadNumber(&obj) || obj >= nObjects)
+                    return false;
+                byte *toPatch = (byte*)p + offset; // Pass the execute address here.
+                ScanAddress::SetConstantValue(toPatch, objMap[obj], (ScanRelocationKind)code);
+            }
+            // Clear the mutable bit
+            wr->SetLengthWord(length, F_CODE_OBJ);
+            return true;
+        }
+
+    case 'K':
+        // Weak reference - must be zeroed
+        *(uintptr_t*)p = 0;
+        return true;
+
+    case 'E':
+        // Entry point - address followed by string
+        {
+            *(uintptr_t*)p = 0;
+            char* b = (char*)p + sizeof(uintptr_t);
+            if (!ReadBytes(b, info.bytes))
+                return false;
+            b[info.bytes] = 0;
+            bool loadEntryPt = setEntryPoint(p);
+            ASSERT(loadEntryPt);
+            return true;
+        }
+
+    default:
+        return false;
+    }
+}
+
+// Import the binary format.  The magic number has already been read.
+bool PImport::DoImportBinary()
+{
+    ASSERT(gMem.pSpaces.size() == 0);
+    ASSERT(gMem.eSpaces.size() == 0);
+
+    buffer = (byte*)malloc(IMPORT_BUFFER_SIZE);
+    if (buffer == 0)
+    {
+        fprintf(polyStderr, "Unable to allocate memory\n");
+        return false;
+    }
+
+    int version = ReadByte();
+    int byteOrder = ReadByte();
+    int arch = ReadByte();
+    int wordLength = ReadByte();
+    if (version != BINARY_FORMAT_VERSION || wordLength == EOF)
+    {
+        fprintf(polyStderr, "Unsupported version of the binary portable format\n");
+        return false;
+    }
+    // Byte data, including code, is written in the byte order of the machine
+    // that exported it.  Interpreted code checks the byte order at run-time
+    // so only native code has to match.
+    if (byteOrder != BINARY_BYTE_ORDER && arch != 'I')
+    {
+        fprintf(polyStderr, "File was exported on a machine with a different byte order\n");
+        return false;
+    }
+    // If we're booting a native code version from interpreted
+    // code we have to interpret.
+    machineDependent->SetBootArchitecture((char)arch, (unsigned)wordLength);
+
+    if (!ReadNumber(&nObjects) || !ReadNumber(&nRoot) || nRoot >= nObjects)
+    {
+        fprintf(polyStderr, "Invalid header in import file\n");
+        return false;
+    }
+    /* Create a mapping table. */
+    objMap = (PolyObject**)calloc(nObjects, sizeof(PolyObject*));
+    std::vector<BinaryObjectInfo> objInfo;
+    try {
+        objInfo.resize(nObjects);
+    }
+    catch (std::bad_alloc &) {
+        free(objMap); objMap = 0;
+    }
+    if (objMap == 0)
+    {
+        fprintf(polyStderr, "Unable to allocate memory\n");
+        return false;
+    }
+
+    // The object table.  Allocate every object so that the contents can be
+    // filled in as they are read.
+    for (POLYUNSIGNED objNo = 0; objNo < nObjects; objNo++)
+    {
+        BinaryObjectInfo &info = objInfo[objNo];
+        int kind = ReadByte();
+        if (kind == 0)
+            continue; // Unused index.
+        int flags = ReadByte();
+        if (flags == EOF)
+        {
+            fprintf(polyStderr, "Unexpected end of file\n");
+            return false;
+        }
+        info.kind = (char)kind;
+        unsigned objBits = flags & (F_MUTABLE_BIT|F_NEGATIVE_BIT|F_WEAK_BIT|F_NO_OVERWRITE);
+        POLYUNSIGNED nWords = 0;
+        bool ok = true;
+        switch (kind)
+        {
+        case 'O': /* Simple object. */
+            ok = ReadNumber(&nWords);
+            break;
+
+        case 'B': /* Byte segment. */
+            objBits |= F_BYTE_OBJ;
+            ok = ReadNumber(&info.bytes);
+            /* Round up to appropriate number of words. */
+            nWords = (info.bytes + sizeof(PolyWord) -1) / sizeof(PolyWord);
+            break;
+
+        case 'S': /* String. */
+            objBits |= F_BYTE_OBJ;
+            /* The length is the number of characters. */
+            ok = ReadNumber(&info.bytes);
+            /* Round up to appropriate number of words.  Need to add
+               one PolyWord for the length PolyWord.  */
+            nWords = (info.bytes + sizeof(PolyWord) -1) / sizeof(PolyWord) + 1;
+            break;
+
+        case 'D': // Code segment.
+        case 'F':
+            objBits |= F_CODE_OBJ;
+            /* The number of words for constants and the number of bytes of code. */
+            ok = ReadNumber(&info.count) && ReadNumber(&info.bytes);
+            nWords = info.count + (kind == 'F' ? 2 : 1); // Add one or two words for no of consts + offset.
+            /* Add in the size of the code itself. */
+            nWords += (info.bytes + sizeof(PolyWord) -1) / sizeof(PolyWord);
+            break;
+
+        case 'C': // Closure
+            objBits |= F_CLOSURE_OBJ;
+            ok = ReadNumber(&nWords); // This is the number of items.
+            nWords += sizeof(PolyObject*) / sizeof(PolyWord) - 1;
+            break;
+
+        case 'K': // Single weak reference
+            nWords = sizeof(uintptr_t)/sizeof(PolyWord);
+            objBits |= F_BYTE_OBJ;
+            break;
+
+        case 'E': // Entry point - address followed by string
+            objBits |= F_BYTE_OBJ;
+            // The length is the length of the string but it must be null-terminated
+            ok = ReadNumber(&info.bytes);
+            // Add one uintptr_t plus one plus padding to an integral number of words.
+            nWords = (info.bytes + sizeof(uintptr_t) + sizeof(PolyWord)) / sizeof(PolyWord);
+            break;
+
+        default:
+            fprintf(polyStderr, "Invalid object type\n");
+            return false;
+        }
+        if (!ok)
+        {
+            fprintf(polyStderr, "Unexpected end of file\n");
+            return false;
+        }
+        PolyObject* p = NewObject(nWords, objBits);
+        if (p == 0)
+            return false;
+        objMap[objNo] = p;
+    }
+
+    // The contents.
+    for (POLYUNSIGNED objNo = 0; objNo < nObjects; objNo++)
+    {
+        if (objMap[objNo] != 0 && !ReadBinaryObject(objMap[objNo], objInfo[objNo]))
+        {
+            fprintf(polyStderr, "Invalid or truncated import file\n");
+            return false;
+        }
+    }
+    CompleteSpaces();
+    return true;
+}
+
+// Import a file in either of the portable formats and return a pointer to the root object.
 PolyObject *ImportPortable(const TCHAR *fileName)
 {
     PImport pImport;
+    // Open it as a binary file to check for the magic number of the binary
+    // format and reopen it as text if it isn't there.
+#if (defined(_WIN32) && defined(UNICODE))
+    pImport.f = _wfopen(fileName, L"rb");
+#else
+    pImport.f = fopen(fileName, "rb");
+#endif
+    bool isBinary = false;
+    if (pImport.f != 0)
+    {
+        char magic[sizeof(binaryMagic)];
+        isBinary = fread(magic, 1, sizeof(magic), pImport.f) == sizeof(magic) &&
+            memcmp(magic, binaryMagic, sizeof(magic)) == 0;
+        if (!isBinary)
+        {
+            fclose(pImport.f);
+#if (defined(_WIN32) && defined(UNICODE))
+            pImport.f = _wfopen(fileName, L"r");
+#else
+            pImport.f = fopen(fileName, "r");
+#endif
+        }
+    }
 #if (defined(_WIN32) && defined(UNICODE))
-    pImport.f = _wfopen(fileName, L"r");
     if (pImport.f == 0)
     {
         fprintf(polyStderr, "Unable to open file: %S\n", fileName);
         return 0;
     }
 #else
-    pImport.f = fopen(fileName, "r");
     if (pImport.f == 0)
     {
         fprintf(polyStderr, "Unable to open file: %s\n", fileName);
         return 0;
     }
 #endif
-    if (pImport.DoImport())
+    if (isBinary ? pImport.DoImportBinary() : pImport.DoImport())
         return pImport.Root();
     else
         return 0;
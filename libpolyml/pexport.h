@@ -37,7 +37,8 @@ typedef char TCHAR;
 class PExport: public Exporter, public ScanAddress
 {
 public:
-    PExport();
+    // If binary is true the compact binary form is written rather than the text form.
+    PExport(bool binary = false);
     virtual ~PExport();
 public:
     virtual void exportStore(void);
@@ -50,18 +51,32 @@ private:
 
 private:
     size_t getIndex(PolyObject *p);
+    char objectKind(PolyObject *p);
+    bool codeLayout(PolyObject *p, PolyWord *&cp, POLYUNSIGNED &constCount, POLYUNSIGNED &byteCount);
     void printAddress(void *p);
     void printValue(PolyWord q);
     void printObject(PolyObject *p);
 
+    // Binary format.
+    void exportBinary(void);
+    void writeNumber(POLYUNSIGNED n);
+    void writeValue(PolyWord q);
+    void writeObjectHeader(PolyObject *p);
+    void writeObjectContents(PolyObject *p);
+
     // We don't use the relocation code so just provide a dummy function here.
     virtual PolyWord createRelocation(PolyWord p, void *relocAddr) { return p; }
 
     std::vector<PolyObject *> pMap;
 
+    bool binaryFormat;
+    // Constants within a code object are collected here while writing the binary form.
+    struct CodeConstant { POLYUNSIGNED offset; int code; size_t index; };
+    std::vector<CodeConstant> codeConstants;
+
 };
 
-// Import a file in the portable format and return a pointer to the root object.
+// Import a file in either of the portable formats and return a pointer to the root object.
 PolyObject *ImportPortable(const TCHAR *fileName);
 
 #endif
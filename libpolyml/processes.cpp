@@ -78,12 +78,17 @@
 #include <sys/select.h>
 #endif
 
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
 #ifdef HAVE_WINDOWS_H
 #include <windows.h>
 #endif
 
 #if (!defined(_WIN32))
 #include <pthread.h>
+#include <sched.h>
 #endif
 
 #ifdef HAVE_SYS_SYSCTL_H
@@ -126,6 +131,7 @@
 #include "statistics.h"
 #include "rtsentry.h"
 #include "gc_progress.h"
+#include "ioreactor.h"
 
 extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadKillSelf(FirstArgument threadId);
@@ -143,6 +149,12 @@ extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadNumProcessors();
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadNumPhysicalProcessors();
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadMaxStackSize(FirstArgument threadId, PolyWord newSize);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadSetAffinity(FirstArgument threadId, PolyWord procs);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadGetAffinity(FirstArgument threadId);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadCheckAffinity(FirstArgument threadId, PolyWord procs);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadProcessorTopology(FirstArgument threadId);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadPoolFork(FirstArgument threadId, PolyWord function, PolyWord worker);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadPoolNext(FirstArgument threadId);
 }
 
 #define SAVE(x) taskData->saveVec.push(x)
@@ -159,6 +171,11 @@ extern "C" {
 #define PFLAG_ASYNCH_ONCE   6   // First handle asynchronously then switch to synch.
 #define PFLAG_INTMASK       6   // Mask of the above bits
 
+// A pool worker that has been idle for this long exits.
+#define POOL_IDLE_TIMEOUT  10000   // Milliseconds
+// Maximum number of pool worker threads, including those blocked.
+#define POOL_MAX_WORKERS   256
+
 struct _entrypts processesEPT[] =
 {
     { "PolyThreadKillSelf",             (polyRTSFunction)&PolyThreadKillSelf},
@@ -176,6 +193,12 @@ struct _entrypts processesEPT[] =
     { "PolyThreadNumProcessors",        (polyRTSFunction)&PolyThreadNumProcessors},
     { "PolyThreadNumPhysicalProcessors",(polyRTSFunction)&PolyThreadNumPhysicalProcessors},
     { "PolyThreadMaxStackSize",         (polyRTSFunction)&PolyThreadMaxStackSize},
+    { "PolyThreadSetAffinity",          (polyRTSFunction)&PolyThreadSetAffinity},
+    { "PolyThreadGetAffinity",          (polyRTSFunction)&PolyThreadGetAffinity},
+    { "PolyThreadCheckAffinity",        (polyRTSFunction)&PolyThreadCheckAffinity},
+    { "PolyThreadProcessorTopology",    (polyRTSFunction)&PolyThreadProcessorTopology},
+    { "PolyThreadPoolFork",            (polyRTSFunction)&PolyThreadPoolFork},
+    { "PolyThreadPoolNext",            (polyRTSFunction)&PolyThreadPoolNext},
 
     { NULL, NULL} // End of list.
 };
@@ -199,6 +222,8 @@ public:
     // Called when a thread may block.  Returns some time later when perhaps
     // the input is available.
     virtual void ThreadPauseForIO(TaskData *taskData, Waiter *pWait);
+    virtual bool ThreadWaitForIO(TaskData *taskData, Waiter *pWait);
+    bool InterruptPending(TaskData *taskData);
     // Return the task data for the current thread.
     virtual TaskData *GetTaskDataForThread(void);
     // Create a new task data object for the current thread.
@@ -275,6 +300,20 @@ public:
     void WaitInfinite(TaskData *taskData, Handle hMutex);
     void WaitUntilTime(TaskData *taskData, Handle hMutex, Handle hTime);
     bool WakeThread(PolyObject *targetThread);
+    void ReleaseCondVarMutex(TaskData *taskData, Handle hMutex);
+
+    // Task pool.  Functions queued here are run by a pool of worker threads.
+    void PoolFork(TaskData *taskData, Handle task, Handle worker);
+    Handle PoolNext(TaskData *taskData);
+    // Called by a worker around a call that may block.
+    void PoolWorkerBlocking(TaskData *taskData);
+    void PoolWorkerResumed(TaskData *taskData);
+    // Called with poolLock held when there is work in the queue.
+    bool PoolWakeOrGrow(void);
+    void PoolAddWorker(TaskData *taskData);
+    // These are called with poolLock held.
+    PolyObject *PoolTake(TaskData *taskData);
+    void PoolRemoveWorker(TaskData *taskData);
 
     // Generally, the system runs with multiple threads.  After a
     // fork, though, there is only one thread.
@@ -310,6 +349,14 @@ public:
 
     PCondVar mlThreadWait;  // All the threads block on here until the request has completed.
 
+    // The number of threads with inMLHeap set.  Protected by schedLock.  While
+    // there is a request the root thread is only woken when this reaches zero.
+    unsigned threadsInMLHeap;
+    // The OS thread id of the last thread to release the ML memory after a request.
+    // This is the one that took longest to reach a safe point.  The id is recorded
+    // rather than the TaskData because the thread may exit before the request runs.
+    POLYUNSIGNED safepointLastThread;
+
     int exitResult;
     bool exitRequest;
 
@@ -322,6 +369,29 @@ public:
 #endif
 
     TaskData *sigTask;  // Pointer to current signal task.
+
+    /* poolLock: This protects the task queues and the worker counts.
+       If schedLock is also needed it must be acquired first.  The queues
+       must only be modified by a thread that is using the ML memory
+       since they contain addresses in the heap. */
+    PLock poolLock;
+    // Idle workers wait on this.  Signalled when there is new work.
+    PCondVar poolWait;
+    // Tasks forked by threads that are not workers.  Tasks forked by a
+    // worker go on its own queue.
+    std::deque<PolyObject*> poolQueue;
+    // The workers.  Used when looking for work to steal.
+    std::vector<TaskData*> poolWorkerList;
+    unsigned poolStealIndex; // Where to start looking next time.
+    unsigned poolQueued; // Total number of tasks in all the queues.
+    // The ML function that is run by each worker thread.
+    PolyObject *poolWorkerFunction;
+    unsigned poolWorkers; // Total number of worker threads.
+    unsigned poolIdle; // Number waiting for work.
+    unsigned poolBlocked; // Number blocked while running a task.
+    unsigned poolWakeups; // Number of idle workers that have been woken but not yet run.
+    unsigned poolTarget; // Number of workers we want to be running.
+    unsigned poolMaxWorkers;
 };
 
 // Global process data.
@@ -330,7 +400,11 @@ ProcessExternal *processes = &processesModule;
 
 Processes::Processes(): singleThreaded(false),
     schedLock("Scheduler"), interrupt_exn(0),
-    threadRequest(0), exitResult(0), exitRequest(false), sigTask(0)
+    threadRequest(0), threadsInMLHeap(0), safepointLastThread(0),
+    exitResult(0), exitRequest(false), sigTask(0),
+    poolLock("Task pool"), poolStealIndex(0), poolQueued(0),
+    poolWorkerFunction(0), poolWorkers(0), poolIdle(0),
+    poolBlocked(0), poolWakeups(0), poolTarget(1), poolMaxWorkers(POOL_MAX_WORKERS)
 {
 #ifdef HAVE_WINDOWS_H
     hStopEvent = NULL;
@@ -400,6 +474,7 @@ POLYUNSIGNED PolyThreadMutexUnlock(FirstArgument threadId, PolyWord arg)
   get the lock again. */
 void Processes::MutexBlock(TaskData *taskData, Handle hMutex)
 {
+    PoolWorkerBlocking(taskData);
     PLocker lock(&schedLock);
     // We have to check the value again with schedLock held rather than
     // simply waiting because otherwise the unlocking thread could have
@@ -436,6 +511,7 @@ void Processes::MutexBlock(TaskData *taskData, Handle hMutex)
         taskData->blockMutex = 0; // No longer blocked.
         ThreadUseMLMemoryWithSchedLock(taskData);
     }
+    PoolWorkerResumed(taskData);
     // Test to see if we have been interrupted and if this thread
     // processes interrupts asynchronously we should raise an exception
     // immediately.  Perhaps we do that whenever we exit from the RTS.
@@ -514,15 +590,36 @@ POLYUNSIGNED PolyThreadCondVarWaitUntil(FirstArgument threadId, PolyWord lockArg
 //      a trap i.e. a request to handle an asynchronous event.
 void Processes::WaitInfinite(TaskData *taskData, Handle hMutex)
 {
-    PLocker lock(&schedLock);
-    // Atomically release the mutex.  This is atomic because we hold schedLock
-    // so no other thread can call signal or broadcast.
+    PoolWorkerBlocking(taskData);
+    {
+        PLocker lock(&schedLock);
+        // Atomically release the mutex.  This is atomic because we hold schedLock
+        // so no other thread can call signal or broadcast.
+        ReleaseCondVarMutex(taskData, hMutex);
+        // Wait until we're woken up.  Don't block if we have been interrupted
+        // or killed.
+        if (taskData->requests == kRequestNone)
+        {
+            // Now release the ML memory.  A GC can start.
+            ThreadReleaseMLMemoryWithSchedLock(taskData);
+            globalStats.incCount(PSC_THREADS_WAIT_CONDVAR);
+            taskData->threadLock.Wait(&schedLock);
+            globalStats.decCount(PSC_THREADS_WAIT_CONDVAR);
+            // We want to use the memory again.
+            ThreadUseMLMemoryWithSchedLock(taskData);
+        }
+    }
+    PoolWorkerResumed(taskData);
+}
+
+// Release the mutex associated with a condition variable.  Must be called
+// with schedLock held.  If the mutex was locked we have to release any waiters.
+void Processes::ReleaseCondVarMutex(TaskData *taskData, Handle hMutex)
+{
     Handle decrResult = taskData->AtomicDecrement(hMutex);
     if (UNTAGGED(decrResult->Word()) != 0)
     {
         taskData->AtomicReset(hMutex);
-        // The mutex was locked so we have to release any waiters.
-        // Unlock any waiters.
         for (std::vector<TaskData*>::iterator i = taskArray.begin(); i != taskArray.end(); i++)
         {
             TaskData *p = *i;
@@ -531,18 +628,6 @@ void Processes::WaitInfinite(TaskData *taskData, Handle hMutex)
                 p->threadLock.Signal();
         }
     }
-    // Wait until we're woken up.  Don't block if we have been interrupted
-    // or killed.
-    if (taskData->requests == kRequestNone)
-    {
-        // Now release the ML memory.  A GC can start.
-        ThreadReleaseMLMemoryWithSchedLock(taskData);
-        globalStats.incCount(PSC_THREADS_WAIT_CONDVAR);
-        taskData->threadLock.Wait(&schedLock);
-        globalStats.decCount(PSC_THREADS_WAIT_CONDVAR);
-        // We want to use the memory again.
-        ThreadUseMLMemoryWithSchedLock(taskData);
-    }
 }
 
 // Atomically drop a mutex and wait for a wake up or a time to wake up
@@ -558,41 +643,42 @@ void Processes::WaitUntilTime(TaskData *taskData, Handle hMutex, Handle hWakeTim
     // Unix style times.
     struct timespec tWake;
     // On Unix we represent times as a number of microseconds.
-    Handle hMillion = Make_arbitrary_precision(taskData, 1000000);
-    tWake.tv_sec =
-        get_C_ulong(taskData, DEREFWORD(div_longc(taskData, hMillion, hWakeTime)));
-    tWake.tv_nsec =
-        1000*get_C_ulong(taskData, DEREFWORD(rem_longc(taskData, hMillion, hWakeTime)));
+    // The time will normally be a short integer so avoid the arbitrary
+    // precision arithmetic unless it isn't.
+    PolyWord wakeTime = DEREFWORD(hWakeTime);
+    if (wakeTime.IsTagged() && wakeTime.UnTagged() >= 0)
+    {
+        POLYSIGNED usecs = wakeTime.UnTagged();
+        tWake.tv_sec = (time_t)(usecs / 1000000);
+        tWake.tv_nsec = (long)(usecs % 1000000) * 1000;
+    }
+    else
+    {
+        Handle hMillion = Make_arbitrary_precision(taskData, 1000000);
+        tWake.tv_sec =
+            get_C_ulong(taskData, DEREFWORD(div_longc(taskData, hMillion, hWakeTime)));
+        tWake.tv_nsec =
+            1000*get_C_ulong(taskData, DEREFWORD(rem_longc(taskData, hMillion, hWakeTime)));
+    }
 #endif
-    PLocker lock(&schedLock);
-    // Atomically release the mutex.  This is atomic because we hold schedLock
-    // so no other thread can call signal or broadcast.
-    Handle decrResult = taskData->AtomicDecrement(hMutex);
-    if (UNTAGGED(decrResult->Word()) != 0)
+    PoolWorkerBlocking(taskData);
     {
-        taskData->AtomicReset(hMutex);
-        // The mutex was locked so we have to release any waiters.
-        // Unlock any waiters.
-        for (std::vector<TaskData*>::iterator i = taskArray.begin(); i != taskArray.end(); i++)
+        PLocker lock(&schedLock);
+        ReleaseCondVarMutex(taskData, hMutex);
+        // Wait until we're woken up.  Don't block if we have been interrupted
+        // or killed.
+        if (taskData->requests == kRequestNone)
         {
-            TaskData *p = *i;
-            // If the thread is blocked on this mutex we can signal the thread.
-            if (p && p->blockMutex == DEREFHANDLE(hMutex))
-                p->threadLock.Signal();
+            // Now release the ML memory.  A GC can start.
+            ThreadReleaseMLMemoryWithSchedLock(taskData);
+            globalStats.incCount(PSC_THREADS_WAIT_CONDVAR);
+            (void)taskData->threadLock.WaitUntil(&schedLock, &tWake);
+            globalStats.decCount(PSC_THREADS_WAIT_CONDVAR);
+            // We want to use the memory again.
+            ThreadUseMLMemoryWithSchedLock(taskData);
         }
     }
-    // Wait until we're woken up.  Don't block if we have been interrupted
-    // or killed.
-    if (taskData->requests == kRequestNone)
-    {
-        // Now release the ML memory.  A GC can start.
-        ThreadReleaseMLMemoryWithSchedLock(taskData);
-        globalStats.incCount(PSC_THREADS_WAIT_CONDVAR);
-        (void)taskData->threadLock.WaitUntil(&schedLock, &tWake);
-        globalStats.decCount(PSC_THREADS_WAIT_CONDVAR);
-        // We want to use the memory again.
-        ThreadUseMLMemoryWithSchedLock(taskData);
-    }
+    PoolWorkerResumed(taskData);
 }
 
 bool Processes::WakeThread(PolyObject *targetThread)
@@ -732,6 +818,409 @@ POLYUNSIGNED PolyThreadMaxStackSize(FirstArgument threadId, PolyWord newSize)
     return TAGGED(0).AsUnsigned();
 }
 
+static void processorList(TaskData *taskData, PolyWord procs, std::vector<unsigned> &procList)
+{
+    for (PolyWord p = procs; !ML_Cons_Cell::IsNull(p); p = ((ML_Cons_Cell*)p.AsObjPtr())->t)
+        procList.push_back(get_C_unsigned(taskData, ((ML_Cons_Cell*)p.AsObjPtr())->h));
+}
+
+// Restrict the calling thread to a list of processors.  An empty list allows
+// it to run on any of the processors available to the process.  Returns false
+// if it could not be set.
+POLYUNSIGNED PolyThreadSetAffinity(FirstArgument threadId, PolyWord procs)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    bool result = false;
+
+    try {
+        std::vector<unsigned> procList;
+        processorList(taskData, procs, procList);
+        result = SetThreadAffinity((unsigned)procList.size(), procList.empty() ? 0 : &procList[0]);
+    }
+    catch (KillException &) {
+        processes->ThreadExit(taskData); // TestSynchronousRequests may test for kill
+    }
+    catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(result ? 1 : 0).AsUnsigned();
+}
+
+// Return the list of processors the calling thread may run on.  Returns an
+// empty list if it may run on any of them or if this is not supported.
+POLYUNSIGNED PolyThreadGetAffinity(FirstArgument threadId)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle result = 0;
+
+    try {
+        std::vector<unsigned> procs;
+        if (! GetThreadAffinity(procs))
+            procs.clear();
+        Handle saved = taskData->saveVec.mark();
+        result = SAVE(ListNull);
+        for (std::vector<unsigned>::reverse_iterator i = procs.rbegin(); i != procs.rend(); i++)
+        {
+            Handle next = alloc_and_save(taskData, SIZEOF(ML_Cons_Cell));
+            DEREFLISTHANDLE(next)->h = TAGGED(*i);
+            DEREFLISTHANDLE(next)->t = result->Word();
+            taskData->saveVec.reset(saved);
+            result = SAVE(next->Word());
+        }
+    }
+    catch (KillException &) {
+        processes->ThreadExit(taskData); // TestSynchronousRequests may test for kill
+    }
+    catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
+// Test whether a thread could be restricted to a list of processors without
+// changing the affinity of the calling thread.  Used by fork so that it can
+// raise an exception before the new thread is created.
+POLYUNSIGNED PolyThreadCheckAffinity(FirstArgument threadId, PolyWord procs)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    bool result = false;
+
+    try {
+        std::vector<unsigned> procList;
+        processorList(taskData, procs, procList);
+        result = CheckThreadAffinity((unsigned)procList.size(), procList.empty() ? 0 : &procList[0]);
+    }
+    catch (KillException &) {
+        processes->ThreadExit(taskData); // TestSynchronousRequests may test for kill
+    }
+    catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(result ? 1 : 0).AsUnsigned();
+}
+
+// Return a list of triples of the processor, core and socket numbers.
+POLYUNSIGNED PolyThreadProcessorTopology(FirstArgument threadId)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle result = 0;
+
+    try {
+        std::vector<ProcessorInfo> topology;
+        GetProcessorTopology(topology);
+        Handle saved = taskData->saveVec.mark();
+        result = SAVE(ListNull);
+        for (std::vector<ProcessorInfo>::reverse_iterator i = topology.rbegin(); i != topology.rend(); i++)
+        {
+            Handle triple = alloc_and_save(taskData, 3);
+            DEREFHANDLE(triple)->Set(0, TAGGED(i->processor));
+            DEREFHANDLE(triple)->Set(1, TAGGED(i->core));
+            DEREFHANDLE(triple)->Set(2, TAGGED(i->socket));
+            Handle next = alloc_and_save(taskData, SIZEOF(ML_Cons_Cell));
+            DEREFLISTHANDLE(next)->h = triple->Word();
+            DEREFLISTHANDLE(next)->t = result->Word();
+            taskData->saveVec.reset(saved);
+            result = SAVE(next->Word());
+        }
+    }
+    catch (KillException &) {
+        processes->ThreadExit(taskData); // TestSynchronousRequests may test for kill
+    }
+    catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
+// Task pool used by Thread.Future.  A task is a function that is queued here
+// and run on one of a pool of worker threads rather than having a thread of its
+// own.  The worker threads
+// are ordinary ML threads that repeatedly call PolyThreadPoolNext and run the
+// result.  We aim to have as many workers actually running as there are
+// physical processors.  A task runs to completion on its worker: there is no
+// stack switching so a task that blocks holds its worker thread.  Another worker
+// is then woken or created, up to the maximum, so that the remaining tasks can
+// make progress.
+// A task forked by a worker goes on that worker's own queue.  Idle workers
+// steal from the other end of these queues.
+POLYUNSIGNED PolyThreadPoolFork(FirstArgument threadId, PolyWord function, PolyWord worker)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle pushedFunction = taskData->saveVec.push(function);
+    Handle pushedWorker = taskData->saveVec.push(worker);
+
+    try {
+        processesModule.PoolFork(taskData, pushedFunction, pushedWorker);
+    }
+    catch (KillException &) {
+        processes->ThreadExit(taskData); // TestSynchronousRequests may test for kill
+    }
+    catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(0).AsUnsigned();
+}
+
+// Called by a worker thread to get the next task to run.  Blocks if there is
+// nothing to do.  If the thread has been idle for some time it exits.
+POLYUNSIGNED PolyThreadPoolNext(FirstArgument threadId)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle result = 0;
+
+    try {
+        result = processesModule.PoolNext(taskData);
+    }
+    catch (KillException &) {
+        processes->ThreadExit(taskData); // TestSynchronousRequests may test for kill
+    }
+    catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
+// Called with poolLock held when there is work in the queue.  Wakes an idle
+// worker if there is one.  Otherwise returns true if a new worker should be
+// created, in which case it has already been included in the count.
+bool Processes::PoolWakeOrGrow(void)
+{
+    if (poolIdle > poolWakeups)
+    {
+        poolWakeups++;
+        poolWait.Signal();
+        return false;
+    }
+    unsigned running = poolWorkers - poolIdle - poolBlocked;
+    if (running < poolTarget && poolWorkers < poolMaxWorkers)
+    {
+        poolWorkers++;
+        return true;
+    }
+    return false;
+}
+
+// Create a worker thread after PoolWakeOrGrow has returned true.  If that fails
+// it is not an error as long as there are other workers to run the tasks.
+void Processes::PoolAddWorker(TaskData *taskData)
+{
+    Handle worker = SAVE(poolWorkerFunction);
+    if (! ForkFromRTS(taskData, worker, 0))
+    {
+        PLocker lock(&poolLock);
+        poolWorkers--;
+    }
+}
+
+void Processes::PoolFork(TaskData *taskData, Handle task, Handle worker)
+{
+    bool addWorker;
+    {
+        PLocker lock(&poolLock);
+        poolWorkerFunction = worker->WordP();
+        if (taskData->poolWorker)
+            taskData->poolDeque.push_back(task->WordP());
+        else poolQueue.push_back(task->WordP());
+        poolQueued++;
+        addWorker = PoolWakeOrGrow();
+    }
+    if (! addWorker) return;
+    try {
+        (void)ForkThread(taskData, worker, 0, TAGGED(PFLAG_SYNCH), TAGGED(0));
+    }
+    catch (IOException &) {
+        // If there are no other workers the task will never run so remove
+        // it and pass on the exception.  The GC may have moved it.
+        PLocker lock(&poolLock);
+        poolWorkers--;
+        if (poolWorkers == 0)
+        {
+            // This can't be a worker so it must be on the shared queue.
+            for (std::deque<PolyObject*>::iterator i = poolQueue.begin(); i != poolQueue.end(); i++)
+            {
+                if (*i == task->WordP())
+                {
+                    poolQueue.erase(i);
+                    poolQueued--;
+                    break;
+                }
+            }
+            throw;
+        }
+    }
+}
+
+// Find a task to run.  A worker first takes the most recent task it forked
+// itself since that is likely to share data with what it has just been doing.
+// Otherwise it takes the oldest task from the shared queue or from another worker.
+PolyObject *Processes::PoolTake(TaskData *taskData)
+{
+    if (poolQueued == 0) return 0;
+    PolyObject *result = 0;
+    if (! taskData->poolDeque.empty())
+    {
+        result = taskData->poolDeque.back();
+        taskData->poolDeque.pop_back();
+    }
+    else if (! poolQueue.empty())
+    {
+        result = poolQueue.front();
+        poolQueue.pop_front();
+    }
+    else
+    {
+        size_t n = poolWorkerList.size();
+        for (size_t i = 0; i < n && result == 0; i++)
+        {
+            TaskData *victim = poolWorkerList[(poolStealIndex + i) % n];
+            if (! victim->poolDeque.empty())
+            {
+                result = victim->poolDeque.front();
+                victim->poolDeque.pop_front();
+                poolStealIndex = (unsigned)((poolStealIndex + i + 1) % n);
+            }
+        }
+    }
+    if (result != 0) poolQueued--;
+    return result;
+}
+
+// Called when a worker exits.  Any tasks left on its queue are
+// moved to the shared queue.
+void Processes::PoolRemoveWorker(TaskData *taskData)
+{
+    for (std::vector<TaskData*>::iterator i = poolWorkerList.begin(); i != poolWorkerList.end(); i++)
+    {
+        if (*i == taskData)
+        {
+            poolWorkerList.erase(i);
+            break;
+        }
+    }
+    while (! taskData->poolDeque.empty())
+    {
+        poolQueue.push_back(taskData->poolDeque.front());
+        taskData->poolDeque.pop_front();
+    }
+    poolWorkers--;
+    taskData->poolWorker = false;
+}
+
+Handle Processes::PoolNext(TaskData *taskData)
+{
+    if (! taskData->poolWorker)
+    {
+        // First call from a new worker.  It has already been counted.
+        bool added = true;
+        {
+            PLocker lock(&poolLock);
+            try {
+                poolWorkerList.push_back(taskData);
+                taskData->poolWorker = true;
+            }
+            catch (std::bad_alloc &) {
+                poolWorkers--;
+                added = false;
+            }
+        }
+        if (! added)
+            throw KillException();
+    }
+    // Restore the default attributes whatever the previous task did.
+    taskData->threadObject->flags = TAGGED(PFLAG_SYNCH);
+    while (true)
+    {
+        TestAnyEvents(taskData); // May raise Interrupt or exit if we've been killed.
+        {
+            PLocker lock(&poolLock);
+            PolyObject *next = PoolTake(taskData);
+            if (next != 0)
+            {
+                // Each task starts with an empty thread-local store.
+                taskData->threadObject->threadLocal = TAGGED(0);
+                return SAVE(next);
+            }
+        }
+        // Nothing to do.  Wait until there is.  poolQueued is only changed
+        // by threads using the ML memory so we can test it while we wait.
+        ThreadReleaseMLMemory(taskData);
+        bool exitWorker = false;
+        {
+            PLocker lock(&poolLock);
+            poolIdle++;
+            bool timedOut = false;
+            while (poolWakeups == 0 && poolQueued == 0 &&
+                    taskData->requests == kRequestNone && ! timedOut)
+                timedOut = ! poolWait.WaitFor(&poolLock, POOL_IDLE_TIMEOUT);
+            poolIdle--;
+            if (poolWakeups != 0)
+                poolWakeups--;
+            else if (timedOut && poolQueued == 0)
+            {
+                // We've been idle for a while.  Exit.  Our own queue must be empty.
+                PoolRemoveWorker(taskData);
+                exitWorker = true;
+            }
+        }
+        ThreadUseMLMemory(taskData);
+        // Exit by raising KillException rather than calling ThreadExit here.  The
+        // caller catches all exceptions and would otherwise stop the unwinding.
+        if (exitWorker)
+            throw KillException();
+    }
+}
+
+// Called by a thread before a call that may block.  If this is a task worker
+// and there are tasks waiting to run we may need another worker.
+void Processes::PoolWorkerBlocking(TaskData *taskData)
+{
+    if (! taskData->poolWorker) return;
+    bool addWorker = false;
+    {
+        PLocker lock(&poolLock);
+        poolBlocked++;
+        if (poolQueued != 0)
+            addWorker = PoolWakeOrGrow();
+    }
+    if (addWorker)
+        PoolAddWorker(taskData);
+}
+
+// Called after the call has returned.  This may be called with schedLock held.
+void Processes::PoolWorkerResumed(TaskData *taskData)
+{
+    if (! taskData->poolWorker) return;
+    PLocker lock(&poolLock);
+    poolBlocked--;
+}
+
 // Old dispatch function.  This is only required because the pre-built compiler
 // may use some of these e.g. fork.
 Handle Processes::ThreadDispatch(TaskData *taskData, Handle args, Handle code)
@@ -779,8 +1268,8 @@ void TaskData::FillUnusedSpace(void)
 
 TaskData::TaskData(): allocPointer(0), allocLimit(0), allocSize(MIN_HEAP_SIZE), allocCount(0),
         stack(0), threadObject(0), signalStack(0),
-        inML(false), requests(kRequestNone), blockMutex(0), inMLHeap(false),
-        runningProfileTimer(false)
+        inML(false), osThreadId(0), requests(kRequestNone), blockMutex(0), inMLHeap(false),
+        poolWorker(false), runningProfileTimer(false)
 {
 #ifdef HAVE_WINDOWS_H
     lastCPUTime = 0;
@@ -828,6 +1317,12 @@ void Processes::MakeRequest(TaskData *p, ThreadRequests request)
         p->requests = request;
         p->InterruptCode();
         p->threadLock.Signal();
+        if (p->poolWorker)
+        {
+            // It may be waiting for work.
+            PLocker lock(&poolLock);
+            poolWait.Signal();
+        }
         // Set the value in the ML object as well so the ML code can see it
         p->threadObject->requestCopy = TAGGED(request);
     }
@@ -851,6 +1346,12 @@ void Processes::ThreadExit(TaskData *taskData)
 
     if (singleThreaded) finish(0);
 
+    if (taskData->poolWorker)
+    {
+        PLocker lock(&poolLock);
+        PoolRemoveWorker(taskData);
+    }
+
     schedLock.Lock();
     ThreadReleaseMLMemoryWithSchedLock(taskData); // Allow a GC if it was waiting for us.
     taskData->threadExited = true;
@@ -896,6 +1397,7 @@ void Processes::ThreadUseMLMemoryWithSchedLock(TaskData *taskData)
     }
     ASSERT(! ptaskData->inMLHeap);
     ptaskData->inMLHeap = true;
+    threadsInMLHeap++;
 }
 
 // Called to indicate that the thread has temporarily finished with the
@@ -910,9 +1412,15 @@ void Processes::ThreadReleaseMLMemoryWithSchedLock(TaskData *taskData)
     // Put a dummy object in any unused space.  This maintains the
     // invariant that the allocated area is filled with valid objects.
     ptaskData->FillUnusedSpace();
-    //
+    threadsInMLHeap--;
+    // If there is a request the root thread can only proceed once every thread
+    // has released the memory so only wake it when the last one has.
     if (threadRequest != 0)
-        initialThreadWait.Signal();
+    {
+        safepointLastThread = ptaskData->osThreadId;
+        if (threadsInMLHeap == 0)
+            initialThreadWait.Signal();
+    }
 }
 
 
@@ -941,6 +1449,17 @@ void Processes::MakeRootRequest(TaskData *taskData, MainThreadRequest *request)
         // Now the other requests have been dealt with (and we have schedLock).
         request->completed = false;
         threadRequest = request;
+        globalStats.startSafepoint();
+        safepointLastThread = 0;
+        // Interrupt the threads that are running ML now rather than waiting for the
+        // root thread to wake up and do it.  They will stop at the next function
+        // entry or loop back-edge.
+        for (std::vector<TaskData*>::iterator i = taskArray.begin(); i != taskArray.end(); i++)
+        {
+            TaskData *p = *i;
+            if (p && p != taskData && p->inMLHeap)
+                p->InterruptCode();
+        }
         // Wait for it to complete.
         while (! request->completed)
         {
@@ -1094,14 +1613,46 @@ POLYUNSIGNED PolyThreadKillSelf(FirstArgument threadId)
 void Processes::ThreadPauseForIO(TaskData *taskData, Waiter *pWait)
 {
     TestAnyEvents(taskData); // Consider this a blocking call that may raise Interrupt
+    PoolWorkerBlocking(taskData);
     ThreadReleaseMLMemory(taskData);
     globalStats.incCount(PSC_THREADS_WAIT_IO);
     pWait->Wait(1000); // Wait up to a second
     globalStats.decCount(PSC_THREADS_WAIT_IO);
     ThreadUseMLMemory(taskData);
+    PoolWorkerResumed(taskData);
     TestAnyEvents(taskData); // Check if we've been interrupted.
 }
 
+// Test whether there is an interrupt that TestAnyEvents would raise without
+// clearing it.  Throws KillException if the thread has been killed.
+bool Processes::InterruptPending(TaskData *taskData)
+{
+    PLocker lock(&schedLock);
+    switch (taskData->requests)
+    {
+    case kRequestInterrupt:
+        return (ThreadAttrs(taskData) & PFLAG_INTMASK) != PFLAG_IGNORE;
+    case kRequestKill:
+        throw KillException();
+    default:
+        return false;
+    }
+}
+
+bool Processes::ThreadWaitForIO(TaskData *taskData, Waiter *pWait)
+{
+    if (InterruptPending(taskData))
+        return true;
+    PoolWorkerBlocking(taskData);
+    ThreadReleaseMLMemory(taskData);
+    globalStats.incCount(PSC_THREADS_WAIT_IO);
+    pWait->Wait(1000); // Wait up to a second
+    globalStats.decCount(PSC_THREADS_WAIT_IO);
+    ThreadUseMLMemory(taskData);
+    PoolWorkerResumed(taskData);
+    return InterruptPending(taskData);
+}
+
 // Default waiter: simply wait for the time.  In Unix it may be woken
 // up by a signal.
 void Waiter::Wait(unsigned maxMillisecs)
@@ -1144,15 +1695,20 @@ void WaitHandle::Wait(unsigned maxMillisecs)
 // Unix and Cygwin: Wait for a file descriptor on input.
 void WaitInputFD::Wait(unsigned maxMillisecs)
 {
-    fd_set read_fds, write_fds, except_fds;
-    struct timeval toWait = { 0, 0 };
-    toWait.tv_sec = maxMillisecs / 1000;
-    toWait.tv_usec = (maxMillisecs % 1000) * 1000;
-    FD_ZERO(&read_fds);
-    if (m_waitFD >= 0) FD_SET(m_waitFD, &read_fds);
-    FD_ZERO(&write_fds);
-    FD_ZERO(&except_fds);
-    select(FD_SETSIZE, &read_fds, &write_fds, &except_fds, &toWait);
+    struct pollfd fds;
+    fds.fd = m_waitFD; // Ignored if it is negative
+    fds.events = POLLIN;
+    fds.revents = 0;
+    WaitForDescriptors(&fds, 1, maxMillisecs);
+}
+
+void WaitOutputFD::Wait(unsigned maxMillisecs)
+{
+    struct pollfd fds;
+    fds.fd = m_waitFD;
+    fds.events = POLLOUT;
+    fds.revents = 0;
+    WaitForDescriptors(&fds, 1, maxMillisecs);
 }
 #endif
 
@@ -1247,6 +1803,20 @@ TaskData *Processes::CreateNewTaskData(Handle threadId, Handle threadFunction,
     return taskData;
 }
 
+// The OS thread id of the current thread.  This is the id shown by
+// debuggers and tools such as top so it is used in the statistics to
+// identify the thread that was last to reach a safepoint.
+static POLYUNSIGNED currentOSThreadId(void)
+{
+#if (defined(HAVE_WINDOWS_H))
+    return GetCurrentThreadId();
+#elif (defined(HAVE_SYS_SYSCALL_H) && defined(SYS_gettid))
+    return (POLYUNSIGNED)syscall(SYS_gettid);
+#else
+    return 0;
+#endif
+}
+
 // This function is run when a new thread has been forked.  The
 // parameter is the taskData value for the new thread.  This function
 // is also called directly for the main thread.
@@ -1254,6 +1824,7 @@ TaskData *Processes::CreateNewTaskData(Handle threadId, Handle threadFunction,
 static void *NewThreadFunction(void *parameter)
 {
     TaskData *taskData = (TaskData *)parameter;
+    taskData->osThreadId = currentOSThreadId();
 #ifdef HAVE_WINDOWS_H
     // Cygwin: Get the Windows thread handle in case it's needed for profiling.
     HANDLE thisProcess = GetCurrentProcess();
@@ -1278,6 +1849,7 @@ static void *NewThreadFunction(void *parameter)
 static DWORD WINAPI NewThreadFunction(void *parameter)
 {
     TaskData *taskData = (TaskData *)parameter;
+    taskData->osThreadId = currentOSThreadId();
     TlsSetValue(processesModule.tlsId, taskData);
     taskData->saveVec.init(); // Removal initial data
     globalStats.incCount(PSC_THREADS);
@@ -1426,6 +1998,10 @@ void Processes::BeginRootThread(PolyObject *rootFunction)
 
         if (allStopped && threadRequest != 0)
         {
+            unsigned long safepointTime = globalStats.endSafepoint(safepointLastThread);
+            if (debugOptions & DEBUG_THREADS)
+                Log("THREAD: All threads stopped after %lu us.  Last thread to stop was %" POLYUFMT "\n",
+                    safepointTime, safepointLastThread);
             mainThreadPhase = threadRequest->mtp;
             gcProgressBeginOtherGC(); // The default unless we're doing a GC.
             gMem.ProtectImmutable(false); // GC, sharing and export may all write to the immutable area
@@ -1964,8 +2540,17 @@ static void threaddata_destructor(void *p)
 }
 #endif
 
+static void SaveProcessAffinity(void);
+
 void Processes::Init(void)
 {
+    // Record the processors we may use before any thread is restricted.
+    SaveProcessAffinity();
+
+    // Aim to run a task worker on each physical processor.
+    poolTarget = NumberOfPhysicalProcessors();
+    if (poolTarget == 0) poolTarget = NumberOfProcessors();
+
 #if (!defined(_WIN32))
     pthread_key_create(&tlsId, threaddata_destructor);
 #else
@@ -2037,6 +2622,11 @@ void Processes::GarbageCollect(ScanAddress *process)
         process->ScanRuntimeAddress(&p, ScanAddress::STRENGTH_STRONG);
         interrupt_exn = (PolyException*)p;
     }
+    // Tasks waiting to run.
+    for (std::deque<PolyObject*>::iterator i = poolQueue.begin(); i != poolQueue.end(); i++)
+        process->ScanRuntimeAddress(&(*i), ScanAddress::STRENGTH_STRONG);
+    if (poolWorkerFunction != 0)
+        process->ScanRuntimeAddress(&poolWorkerFunction, ScanAddress::STRENGTH_STRONG);
     for (std::vector<TaskData*>::iterator i = taskArray.begin(); i != taskArray.end(); i++)
     {
         if (*i)
@@ -2056,6 +2646,8 @@ void TaskData::GarbageCollect(ScanAddress *process)
     }
     if (blockMutex != 0)
         process->ScanRuntimeAddress(&blockMutex, ScanAddress::STRENGTH_STRONG);
+    for (std::deque<PolyObject*>::iterator i = poolDeque.begin(); i != poolDeque.end(); i++)
+        process->ScanRuntimeAddress(&(*i), ScanAddress::STRENGTH_STRONG);
     // The allocation spaces are no longer valid.
     allocPointer = 0;
     allocLimit = 0;
@@ -2196,3 +2788,242 @@ extern unsigned NumberOfPhysicalProcessors(void)
     // Any other cases?
     return numProcs;
 }
+
+// Return the socket and core for each logical processor.  If this can't be
+// determined each processor is treated as a separate core on a single socket.
+#if (defined(HAVE_SYSTEM_LOGICAL_PROCESSOR_INFORMATION))
+static bool WinProcessorTopology(std::vector<ProcessorInfo> &topology)
+{
+    GETP getProcInfo = (GETP) GetProcAddress(GetModuleHandle(_T("kernel32")), "GetLogicalProcessorInformation");
+    if (getProcInfo == 0) return false;
+
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION *buff = 0;
+    DWORD space = 0;
+    while (getProcInfo(buff, &space) == FALSE)
+    {
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+        {
+            free(buff);
+            return false;
+        }
+        free(buff);
+        buff = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION)malloc(space);
+        if (buff == 0) return false;
+    }
+    unsigned nItems = space / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION);
+    const unsigned maxProcs = sizeof(ULONG_PTR) * 8;
+    unsigned coreOf[maxProcs], socketOf[maxProcs];
+    bool present[maxProcs];
+    unsigned nCores = 0, nSockets = 0;
+    memset(present, 0, sizeof(present));
+    for (unsigned i = 0; i < nItems; i++)
+    {
+        bool isCore = buff[i].Relationship == RelationProcessorCore;
+        if (! isCore && buff[i].Relationship != RelationProcessorPackage) continue;
+        for (unsigned p = 0; p < maxProcs; p++)
+        {
+            if ((buff[i].ProcessorMask & ((ULONG_PTR)1 << p)) == 0) continue;
+            if (isCore) { coreOf[p] = nCores; present[p] = true; }
+            else socketOf[p] = nSockets;
+        }
+        if (isCore) nCores++; else nSockets++;
+    }
+    free(buff);
+    for (unsigned p = 0; p < maxProcs; p++)
+    {
+        if (! present[p]) continue;
+        ProcessorInfo info;
+        info.processor = p;
+        info.core = coreOf[p];
+        info.socket = nSockets == 0 ? 0 : socketOf[p];
+        topology.push_back(info);
+    }
+    return ! topology.empty();
+}
+#endif
+
+// Read /proc/cpuinfo.  Each processor has a separate section containing
+// "processor", "physical id" and "core id" lines.  The core id is only unique
+// within a socket.
+static bool LinuxProcessorTopology(std::vector<ProcessorInfo> &topology)
+{
+    FILE *cpuInfo = fopen("/proc/cpuinfo", "r");
+    if (cpuInfo == NULL) return false;
+
+    // Pairs of socket and core id in the order we first see them.
+    std::vector<std::pair<long, long> > cores;
+    long processor = -1, socket = 0, coreId = -1;
+    char line[40];
+    bool atEnd = false;
+    while (! atEnd)
+    {
+        atEnd = fgets(line, sizeof(line), cpuInfo) == NULL;
+        // A blank line or the end of the file completes a section.
+        if (atEnd || line[0] == '\n')
+        {
+            if (processor >= 0)
+            {
+                ProcessorInfo info;
+                info.processor = (unsigned)processor;
+                info.socket = (unsigned)socket;
+                if (coreId < 0) coreId = processor; // No core information
+                unsigned i = 0;
+                while (i < cores.size() && cores[i] != std::make_pair(socket, coreId)) i++;
+                if (i == cores.size()) cores.push_back(std::make_pair(socket, coreId));
+                info.core = i;
+                topology.push_back(info);
+            }
+            processor = -1; socket = 0; coreId = -1;
+            continue;
+        }
+        if (strncmp(line, "processor\t:", 11) == 0)
+            processor = strtol(line+11, NULL, 10);
+        else if (strncmp(line, "physical id\t:", 13) == 0)
+            socket = strtol(line+13, NULL, 10);
+        else if (strncmp(line, "core id\t\t:", 10) == 0)
+            coreId = strtol(line+10, NULL, 10);
+        if (strchr(line, '\n') == 0)
+        {
+            int ch;
+            do { ch = getc(cpuInfo); } while (ch != '\n' && ch != EOF);
+        }
+    }
+
+    fclose(cpuInfo);
+    return ! topology.empty();
+}
+
+extern void GetProcessorTopology(std::vector<ProcessorInfo> &topology)
+{
+    topology.clear();
+#if (defined(HAVE_SYSTEM_LOGICAL_PROCESSOR_INFORMATION))
+    if (WinProcessorTopology(topology)) return;
+    topology.clear();
+#endif
+    if (LinuxProcessorTopology(topology)) return;
+    topology.clear();
+    unsigned nProcs = NumberOfProcessors();
+    for (unsigned i = 0; i < nProcs; i++)
+    {
+        ProcessorInfo info;
+        info.processor = info.core = i;
+        info.socket = 0;
+        topology.push_back(info);
+    }
+}
+
+#if (!defined(_WIN32) && defined(HAVE_SCHED_GETAFFINITY) && defined(CPU_ISSET))
+// The processors the process could run on when it started.  This may have been
+// restricted by taskset or a cgroup.  A thread that is allowed to run on any
+// processor is given this set rather than every processor.
+static cpu_set_t processAffinity;
+static bool haveProcessAffinity = false;
+#endif
+
+static void SaveProcessAffinity(void)
+{
+#if (!defined(_WIN32) && defined(HAVE_SCHED_GETAFFINITY) && defined(CPU_ISSET))
+    haveProcessAffinity = sched_getaffinity(0, sizeof(processAffinity), &processAffinity) == 0;
+#endif
+}
+
+extern bool SetThreadAffinity(unsigned nProcs, const unsigned *procs)
+{
+#if (defined(_WIN32))
+    DWORD_PTR mask = 0;
+    if (nProcs == 0)
+    {
+        DWORD_PTR systemMask;
+        if (! GetProcessAffinityMask(GetCurrentProcess(), &mask, &systemMask))
+            return false;
+    }
+    for (unsigned i = 0; i < nProcs; i++)
+    {
+        if (procs[i] >= sizeof(DWORD_PTR) * 8) return false;
+        mask |= (DWORD_PTR)1 << procs[i];
+    }
+    return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#elif (defined(HAVE_SCHED_SETAFFINITY) && defined(CPU_SET))
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (nProcs == 0)
+    {
+#if (defined(HAVE_SCHED_GETAFFINITY) && defined(CPU_ISSET))
+        if (haveProcessAffinity)
+            cpus = processAffinity;
+        else
+#endif
+        // The kernel ignores any processors that don't exist.
+        for (unsigned i = 0; i < CPU_SETSIZE; i++) CPU_SET(i, &cpus);
+    }
+    for (unsigned i = 0; i < nProcs; i++)
+    {
+        if (procs[i] >= CPU_SETSIZE) return false;
+        CPU_SET(procs[i], &cpus);
+    }
+    return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+#else
+    return false;
+#endif
+}
+
+extern bool CheckThreadAffinity(unsigned nProcs, const unsigned *procs)
+{
+#if (defined(_WIN32))
+    DWORD_PTR processMask, systemMask, mask = 0;
+    if (! GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+        return false;
+    if (nProcs == 0) return true;
+    for (unsigned i = 0; i < nProcs; i++)
+    {
+        if (procs[i] >= sizeof(DWORD_PTR) * 8) return false;
+        mask |= (DWORD_PTR)1 << procs[i];
+    }
+    // The thread mask must be a subset of the process mask.
+    return (mask & ~processMask) == 0;
+#elif (defined(HAVE_SCHED_SETAFFINITY) && defined(CPU_SET))
+    if (nProcs == 0) return true;
+    // sched_setaffinity succeeds if at least one of the processors is available.
+    bool available = false;
+    for (unsigned i = 0; i < nProcs; i++)
+    {
+        if (procs[i] >= CPU_SETSIZE) return false;
+#if (defined(HAVE_SCHED_GETAFFINITY) && defined(CPU_ISSET))
+        if (haveProcessAffinity && ! CPU_ISSET(procs[i], &processAffinity))
+            continue;
+#endif
+        available = true;
+    }
+    return available;
+#else
+    return false;
+#endif
+}
+
+extern bool GetThreadAffinity(std::vector<unsigned> &procs)
+{
+    procs.clear();
+#if (defined(_WIN32))
+    // There's no call to get the mask so we have to set it and restore it.
+    DWORD_PTR processMask, systemMask;
+    if (! GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+        return false;
+    DWORD_PTR mask = SetThreadAffinityMask(GetCurrentThread(), processMask);
+    if (mask == 0) return false;
+    SetThreadAffinityMask(GetCurrentThread(), mask);
+    if (mask == processMask) return true; // Not restricted.
+    for (unsigned i = 0; i < sizeof(DWORD_PTR) * 8; i++)
+        if (mask & ((DWORD_PTR)1 << i)) procs.push_back(i);
+    return true;
+#elif (defined(HAVE_SCHED_GETAFFINITY) && defined(CPU_ISSET))
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0) return false;
+    if (haveProcessAffinity && CPU_EQUAL(&cpus, &processAffinity))
+        return true; // Not restricted.
+    for (unsigned i = 0; i < CPU_SETSIZE; i++)
+        if (CPU_ISSET(i, &cpus)) procs.push_back(i);
+    return true;
+#else
+    return false;
+#endif
+}
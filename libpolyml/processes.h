@@ -37,6 +37,9 @@
 #include "noreturn.h"
 #include "locking.h"
 
+#include <deque>
+#include <vector>
+
 class SaveVecEntry;
 typedef SaveVecEntry *Handle;
 class StackSpace;
@@ -149,6 +152,7 @@ public:
     int         lastError;      // Last error from foreign code.
     void        *signalStack;  // Stack to handle interrupts (Unix only)
     bool        inML;          // True when this is in ML, false in the RTS
+    POLYUNSIGNED osThreadId;   // Thread id from the OS.  Only used in the statistics.
 
     // Get a TaskData pointer given the ML taskId.
     // This is called at the start of every RTS function that may allocate memory.
@@ -171,6 +175,11 @@ private:
     // While it is true the thread can manipulate ML memory so no other
     // thread can garbage collect.
     bool inMLHeap;
+    // True if this thread is one of the pool of threads running tasks.
+    bool poolWorker;
+    // Tasks forked by this thread while it is a worker.  It takes work from
+    // the back and other workers steal from the front.  Protected by poolLock.
+    std::deque<PolyObject*> poolDeque;
 
     // In Linux, at least, we need to run a separate timer in each thread
     bool runningProfileTimer;
@@ -278,6 +287,16 @@ public:
 private:
     int m_waitFD;
 };
+
+// Unix: Wait until a file descriptor is available for output
+class WaitOutputFD: public Waiter
+{
+public:
+    WaitOutputFD(int fd): m_waitFD(fd) {}
+    virtual void Wait(unsigned maxMillisecs);
+private:
+    int m_waitFD;
+};
 #endif
 
 
@@ -306,6 +325,10 @@ public:
     virtual void ThreadPauseForIO(TaskData *taskData, Waiter *pWait) = 0;
     // As ThreadPauseForIO but when there is no stream
     virtual void ThreadPause(TaskData *taskData) { ThreadPauseForIO(taskData, Waiter::defaultWaiter); }
+    // As ThreadPauseForIO but an interrupt is not raised.  Returns true if there is
+    // an interrupt pending.  It remains pending and is raised by the next call to
+    // TestAnyEvents.  This is used when an operation may have to be completed first.
+    virtual bool ThreadWaitForIO(TaskData *taskData, Waiter *pWait) = 0;
 
     // If a thread is blocking for some time it should release its use
     // of the ML memory.  That allows a GC. ThreadUseMLMemory returns true if
@@ -349,6 +372,27 @@ public:
 extern unsigned NumberOfProcessors(void);
 extern unsigned NumberOfPhysicalProcessors(void);
 
+// The position of a logical processor within the machine.  Core numbers
+// are unique across sockets.
+typedef struct {
+    unsigned processor; // Number used when setting affinity
+    unsigned core;
+    unsigned socket;
+} ProcessorInfo;
+
+extern void GetProcessorTopology(std::vector<ProcessorInfo> &topology);
+
+// Restrict the calling thread to run on the given processors.  If nProcs is
+// zero the thread may run on any of the processors the process could use when
+// it started.  Returns false if this is not supported or fails.
+extern bool SetThreadAffinity(unsigned nProcs, const unsigned *procs);
+// Test whether SetThreadAffinity would succeed without changing anything.
+extern bool CheckThreadAffinity(unsigned nProcs, const unsigned *procs);
+// Get the processors the calling thread may run on.  The list is empty if
+// the thread is not restricted beyond the process.  Returns false if
+// this is not supported.
+extern bool GetThreadAffinity(std::vector<unsigned> &procs);
+
 extern ProcessExternal *processes;
 
 extern struct _entrypts processesEPT[];
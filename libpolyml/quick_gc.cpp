@@ -136,14 +136,7 @@ public:
 #   endif
 #endif
 
-#ifdef POLYML32IN64
-typedef uint32_t ptrasint;
-#else
-typedef uintptr_t ptrasint;
-#endif
-
-
-static bool atomiclySetForwarding(LocalMemSpace *space, ptrasint *pt, ptrasint testVal, ptrasint update)
+bool atomiclySetForwarding(PLock *lock, POLYUNSIGNED *pt, POLYUNSIGNED testVal, POLYUNSIGNED update)
 {
 #ifdef _MSC_VER
 # if (SIZEOF_POLYWORD == 8)
@@ -175,7 +168,7 @@ static bool atomiclySetForwarding(LocalMemSpace *space, ptrasint *pt, ptrasint t
     return result == testVal;
 #else
     // Fallback on other targets.
-    PLocker lock(&space->spaceLock);
+    PLocker locker(lock);
     if (pt[-1] == testVal)
     {
         pt[-1] = update;
@@ -208,7 +201,7 @@ PolyObject *QuickGCScanner::FindNewAddress(PolyObject *obj, POLYUNSIGNED L, Loca
     // be worth-while.
     if (isMutable || OBJ_IS_CODE_OBJECT(L))
     {
-        if (! atomiclySetForwarding(srcSpace, (ptrasint*)obj, L, OBJ_SET_POINTER(newObject)))
+        if (! atomiclySetForwarding(&srcSpace->spaceLock, (POLYUNSIGNED*)obj, L, OBJ_SET_POINTER(newObject)))
         {
             newObject = obj->GetForwardingPtr();
             if (debugOptions & DEBUG_GC_DETAIL)
@@ -64,6 +64,7 @@
 #include "poly_specific.h"
 #include "objsize.h"
 #include "network.h"
+#include "iouring.h"
 #include "machine_dep.h"
 #include "exporter.h"
 #include "statistics.h"
@@ -90,6 +91,7 @@ static entrypts entryPointTable[] =
     polySpecificEPT,
     objSizeEPT,
     networkingEPT,
+    ioUringEPT,
     exporterEPT,
     statisticsEPT,
     savestateEPT,
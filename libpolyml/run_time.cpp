@@ -62,6 +62,7 @@
 extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyFullGC(FirstArgument threadId);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyIsBigEndian();
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolySearchByteVector(PolyWord vec, PolyWord start, PolyWord end, PolyWord byteValue);
 }
 
 #define SAVE(x) taskData->saveVec.push(x)
@@ -105,6 +106,19 @@ Handle alloc_and_save(TaskData *taskData, uintptr_t size, unsigned flags)
     return taskData->saveVec.push(alloc(taskData, size, flags));
 }
 
+// Reduce the length of an object.  This allows a buffer to be allocated for the
+// largest possible result and then cut down to the size actually used.  The space
+// that is released is filled with dummy objects so that the heap can still be
+// scanned.  It must only be used on an object that has not yet been returned to ML.
+void shrinkObject(PolyObject *obj, uintptr_t newWords)
+{
+    POLYUNSIGNED lengthWord = obj->LengthWord();
+    POLYUNSIGNED oldWords = OBJ_OBJECT_LENGTH(lengthWord);
+    if (newWords >= oldWords) return;
+    obj->SetLengthWord((POLYUNSIGNED)newWords, (byte)(lengthWord >> OBJ_PRIVATE_FLAGS_SHIFT));
+    gMem.FillUnusedSpace(obj->Offset((POLYUNSIGNED)newWords), oldWords - newWords);
+}
+
 POLYUNSIGNED PolyFullGC(FirstArgument threadId)
 {
     TaskData *taskData = TaskData::FindTaskForId(threadId);
@@ -408,10 +422,24 @@ POLYUNSIGNED PolyIsBigEndian()
 #endif
 }
 
+// Return the index of the first occurrence of a byte in a string or Word8Vector
+// between start and end, or end if it is not present.  This is a fast call so
+// it must not allocate.
+POLYUNSIGNED PolySearchByteVector(PolyWord vec, PolyWord start, PolyWord end, PolyWord byteValue)
+{
+    POLYUNSIGNED from = start.UnTagged(), to = end.UnTagged();
+    if (from >= to) return end.AsUnsigned();
+    const char *base = ((PolyStringObject*)vec.AsObjPtr())->chars;
+    const void *found = memchr(base + from, (int)byteValue.UnTagged(), to - from);
+    if (found == 0) return end.AsUnsigned();
+    return TAGGED((const char *)found - base).AsUnsigned();
+}
+
 struct _entrypts runTimeEPT[] =
 {
     { "PolyFullGC",                     (polyRTSFunction)&PolyFullGC},
     { "PolyIsBigEndian",                (polyRTSFunction)&PolyIsBigEndian},
+    { "PolySearchByteVector",           (polyRTSFunction)&PolySearchByteVector},
 
     { NULL, NULL} // End of list.
 };
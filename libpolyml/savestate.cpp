@@ -59,6 +59,22 @@
 #include <unistd.h>
 #endif
 
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
@@ -104,11 +120,22 @@ typedef char TCHAR;
 #include "machine_dep.h"
 #include "osmem.h"
 #include "gc.h" // For FullGC.
+#include "gctaskfarm.h"
 #include "timing.h"
 #include "rtsentry.h"
 #include "check_objects.h"
 #include "rtsentry.h"
 
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
 #include "../polyexports.h" // For InitHeaderFromExport
 #include "version.h" // For InitHeaderFromExport
 
@@ -118,12 +145,12 @@ typedef char TCHAR;
 #endif
 
 extern "C" {
-    POLYEXTERNALSYMBOL POLYUNSIGNED PolySaveState(FirstArgument threadId, PolyWord fileName, PolyWord depth);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolySaveState(FirstArgument threadId, PolyWord fileName, PolyWord depth, PolyWord flags);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyLoadState(FirstArgument threadId, PolyWord arg);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyShowHierarchy(FirstArgument threadId);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyRenameParent(FirstArgument threadId, PolyWord childName, PolyWord parentName);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyShowParent(FirstArgument threadId, PolyWord arg);
-    POLYEXTERNALSYMBOL POLYUNSIGNED PolyStoreModule(FirstArgument threadId, PolyWord name, PolyWord contents);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyStoreModule(FirstArgument threadId, PolyWord name, PolyWord contents, PolyWord compress);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyLoadModule(FirstArgument threadId, PolyWord arg);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyLoadHierarchy(FirstArgument threadId, PolyWord arg);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyGetModuleDirectory(FirstArgument threadId);
@@ -170,7 +197,7 @@ private:
  */
 
 #define SAVEDSTATESIGNATURE "POLYSAVE"
-#define SAVEDSTATEVERSION   2
+#define SAVEDSTATEVERSION   3
 
 // File header for a saved state file.  This appears as the first entry
 // in the file.
@@ -206,6 +233,7 @@ typedef struct _savedStateSegmentDescr
     unsigned    segmentFlags;           // Segment flags (see SSF_ values)
     unsigned    segmentIndex;           // The index of this segment or the segment it overwrites
     void        *originalAddress;       // The base address when the segment was written.
+    size_t      compressedSize;         // Size of the data in the file if SSF_COMPRESSED is set
 } SavedStateSegmentDescr;
 
 #define SSF_WRITABLE    1               // The segment contains mutable data
@@ -213,6 +241,601 @@ typedef struct _savedStateSegmentDescr
 #define SSF_NOOVERWRITE 4               // The segment must not be further overwritten
 #define SSF_BYTES       8               // The segment contains only byte data
 #define SSF_CODE        16              // The segment contains only code
+#define SSF_COMPRESSED  32              // The segment data are compressed with zstd
+#define SSF_PAGES       64              // The overwrite contains only the pages that have changed
+
+// An overwrite segment with SSF_PAGES set contains a count of the pages, the byte
+// offset of each page in ascending order and then the pages themselves.  The last
+// page in the segment may be shorter.  These are never compressed.
+#define DIFFERENTIALPAGESIZE    4096
+
+// Segment data are aligned in the file so that the loader can map them
+// directly.  This is a multiple of the page size on all current systems.
+#define SEGMENTALIGNMENT    65536
+
+#ifdef HAVE_LIBZSTD
+static const bool compressionSupported = true;
+#else
+static const bool compressionSupported = false;
+#endif
+
+// Write out the data for a segment, compressing it if that has been requested
+// and is supported.  Returns the number of bytes written if the data were
+// compressed or zero if they were written unchanged.
+static size_t WriteSegmentData(FILE *exportFile, const void *data, size_t length, bool compress)
+{
+#ifdef HAVE_LIBZSTD
+    if (compress && length != 0)
+    {
+        off_t startPos = ftell(exportFile);
+        size_t written = 0;
+        ZSTD_CCtx *cctx = ZSTD_createCCtx();
+        if (cctx != 0)
+        {
+            // This fails if the library was built without thread support.
+            (void)ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, gpTaskFarm->ThreadCount());
+            ZSTD_inBuffer input = { data, length, 0 };
+            size_t bufSize = ZSTD_CStreamOutSize();
+            AutoFree<byte*> buffer((byte*)malloc(bufSize));
+            size_t remaining = 1;
+            while ((byte*)buffer != 0 && remaining != 0)
+            {
+                ZSTD_outBuffer output = { buffer, bufSize, 0 };
+                remaining = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_end);
+                if (ZSTD_isError(remaining) || fwrite(buffer, 1, output.pos, exportFile) != output.pos)
+                    break;
+                written += output.pos;
+            }
+            ZSTD_freeCCtx(cctx);
+            // Use the compressed data only if it succeeded and is smaller.
+            if (remaining == 0 && written < length)
+                return written;
+        }
+        fseek(exportFile, startPos, SEEK_SET);
+    }
+#endif
+    fwrite(data, length, 1, exportFile);
+    return 0;
+}
+
+// Decompress the data for a segment.
+static bool DecompressSegmentData(const byte *compressed, size_t compressedSize, void *dest, size_t length)
+{
+#ifdef HAVE_LIBZSTD
+    size_t result = ZSTD_decompress(dest, length, compressed, compressedSize);
+    return ! ZSTD_isError(result) && result == length;
+#else
+    return false;
+#endif
+}
+
+// Compressed segments are read from the file on the main thread and then
+// decompressed in parallel on the GC task farm.  If startLater is true the
+// segments are only read until Start is called.  The module loader reads the
+// file while a GC may be using the farm.
+class SegmentDecompressor
+{
+public:
+    SegmentDecompressor(bool startLater = false): started(! startLater) {}
+    ~SegmentDecompressor() { (void)WaitForCompletion(); }
+
+    // Read the compressed data for a segment and queue it to be decompressed into dest.
+    // Returns an error message if the data could not be read.
+    const char *AddSegment(FILE *loadFile, const SavedStateSegmentDescr *descr, void *dest);
+    // Queue the segments that have been read.  The caller must be able to use the farm.
+    void Start();
+    // Wait for the queued segments.  Returns an error message if there was a problem.
+    const char *WaitForCompletion();
+
+private:
+    class Segment
+    {
+    public:
+        Segment(): compressed(0), compressedSize(0), dest(0), length(0), failed(false) {}
+        byte *compressed;
+        size_t compressedSize;
+        void *dest;
+        size_t length;
+        bool failed;
+    };
+    static void DecompressTask(GCTaskId*, void *arg1, void *arg2);
+    bool started;
+    std::deque<Segment> segments;
+};
+
+const char *SegmentDecompressor::AddSegment(FILE *loadFile, const SavedStateSegmentDescr *descr, void *dest)
+{
+#ifndef HAVE_LIBZSTD
+    return "File contains compressed segments but compression is not supported";
+#else
+    byte *compressed = (byte*)malloc(descr->compressedSize);
+    if (compressed == 0)
+        return "Unable to allocate memory";
+    if (fseek(loadFile, descr->segmentData, SEEK_SET) != 0 ||
+        fread(compressed, descr->compressedSize, 1, loadFile) != 1)
+    {
+        free(compressed);
+        return "Unable to read segment";
+    }
+    segments.push_back(Segment());
+    Segment *segment = &segments.back();
+    segment->compressed = compressed;
+    segment->compressedSize = descr->compressedSize;
+    segment->dest = dest;
+    segment->length = descr->segmentSize;
+    if (started)
+        gpTaskFarm->AddWorkOrRunNow(&DecompressTask, segment, 0);
+    return 0;
+#endif
+}
+
+void SegmentDecompressor::Start()
+{
+    if (started)
+        return;
+    started = true;
+    for (std::deque<Segment>::iterator i = segments.begin(); i != segments.end(); i++)
+        gpTaskFarm->AddWorkOrRunNow(&DecompressTask, &(*i), 0);
+}
+
+void SegmentDecompressor::DecompressTask(GCTaskId*, void *arg1, void *)
+{
+    Segment *segment = (Segment*)arg1;
+    segment->failed =
+        ! DecompressSegmentData(segment->compressed, segment->compressedSize, segment->dest, segment->length);
+    // Release the buffer as soon as possible.
+    free(segment->compressed);
+    segment->compressed = 0;
+}
+
+const char *SegmentDecompressor::WaitForCompletion()
+{
+    const char *errorResult = 0;
+    if (started && ! segments.empty())
+        gpTaskFarm->WaitForCompletion();
+    for (std::deque<Segment>::iterator i = segments.begin(); i != segments.end(); i++)
+    {
+        // A segment that was never started still has its buffer.
+        if ((i->failed || i->compressed != 0) && errorResult == 0)
+            errorResult = "Unable to decompress segment";
+        free(i->compressed);
+    }
+    segments.clear();
+    return errorResult;
+}
+
+#if (!defined(_WIN32) && !defined(POLYML32IN64))
+// Segments of saved states that had to be decompressed or relocated can be kept
+// in a per-host cache so that later processes loading the same file map the result
+// rather than repeating the work.  The cache is enabled by setting POLYSTATECACHE
+// to a directory.  The directory and the entries must be owned by the user and not
+// writable by anyone else.  Entries are keyed by the identity of the saved state
+// file rather than a hash of the contents so that looking one up does not need to
+// read the segment.  When an entry is made any entries for earlier versions of the
+// same file are removed and, if the cache is larger than POLYSTATECACHESIZE
+// megabytes, by default 1024, the entries that were least recently used are removed.
+// An entry holds the relocated segment data followed by a SegmentCacheKey, the
+// address of each segment in the file's descriptor table when the entry was made,
+// the number of addresses in the data that refer to each of those segments and
+// then the positions of those addresses grouped by segment.  An entry is only
+// mapped at the address at which it was made.  If other segments, in particular
+// those of a position-independent executable, are at different addresses only
+// the addresses that refer to them are adjusted.
+#define SEGMENTCACHESIGNATURE "POLYSCAC"
+
+typedef struct _segmentCacheKey
+{
+    char        signature[8];           // Should contain SEGMENTCACHESIGNATURE
+    uint64_t    fileDevice;             // Identity of the saved state file
+    uint64_t    fileInode;
+    uint64_t    fileSize;
+    int64_t     fileModified;           // In nanoseconds where available
+    int64_t     fileChanged;
+    time_t      timeStamp;              // Time stamp of the saved state
+    time_t      executableStamp;        // Time stamp of the executable
+    unsigned    segmentIndex;
+    unsigned    segmentFlags;
+    size_t      segmentSize;
+    unsigned    nDescrs;                // Number of segments in the descriptor table
+    void        *loadAddress;           // Not included in the entry name.
+} SegmentCacheKey;
+
+// A position is the byte offset in the segment shifted left with the bottom bit
+// set for a 32-bit relative address in code.
+#define SEGMENTCACHERELATIVE    1
+
+#define SEGMENTCACHEDEFAULTSIZE 1024 // Megabytes
+
+// The name is a hash of the path of the saved state file followed by a hash of
+// the key without the load address.  Entries for other versions of the same file
+// have the same prefix.
+#define SEGMENTCACHEPREFIXLENGTH    17 // Including the '-'
+#define SEGMENTCACHENAMELENGTH      33
+
+class SegmentCache
+{
+public:
+    SegmentCache(): enabled(false) { memset(&fileKey, 0, sizeof(fileKey)); }
+    ~SegmentCache();
+
+    // Set up the cache for a saved state.  Returns false if the cache is not enabled.
+    bool Open(const char *fileName, FILE *loadFile, time_t timeStamp, unsigned nDescrs);
+    // Map a cached copy of a segment at the address at which it was made.
+    // Returns zero if there is no usable entry.
+    PermanentMemSpace *MapSegment(unsigned descrNo, const SavedStateSegmentDescr *descr,
+                                  unsigned flags, unsigned hierarchy);
+    // Adjust the addresses in a mapped segment that refer to segments that have moved
+    // since the entry was made.  Returns false if that is not possible.
+    bool AdjustSegment(unsigned descrNo, const SavedStateSegmentDescr *descrs, PolyWord **targetAddresses);
+    // Make an entry for a segment once it has been relocated.  Returns true if
+    // the entry was made.
+    bool SaveSegment(unsigned descrNo, const SavedStateSegmentDescr *descrs, PolyWord **targetAddresses);
+    // Remove entries for other versions of the saved state and, if the cache is
+    // too large, the least recently used entries.  Called once after all the
+    // new entries for a file have been made.
+    void Clean(const SavedStateSegmentDescr *descrs);
+
+private:
+    std::string EntryName(const SavedStateSegmentDescr *descr);
+    void MakeKey(const SavedStateSegmentDescr *descr, SegmentCacheKey *key);
+
+    bool enabled;
+    std::string cacheDir;
+    SegmentCacheKey fileKey;
+    // The start of the names of the entries for this file.  This is the same for
+    // every version of the file.
+    std::string entryPrefix;
+
+    // A mapped entry.  The file is kept open until the addresses have been adjusted.
+    class MappedEntry
+    {
+    public:
+        MappedEntry(): fd(-1), space(0) {}
+        int fd;
+        PermanentMemSpace *space;
+        std::vector<void*> addresses;
+        std::vector<uint64_t> counts;
+    };
+    std::map<unsigned, MappedEntry> mapped;
+};
+
+// Record the positions of the addresses in a segment that refer to other segments.
+class SegmentCacheScanner: public ScanAddress
+{
+public:
+    SegmentCacheScanner(PermanentMemSpace *s, unsigned own, const std::map<unsigned, unsigned> &idx, unsigned nDescrs):
+        space(s), ownDescr(own), indexToDescr(idx), positions(nDescrs), failed(false) {}
+
+    virtual PolyObject *ScanObjectAddress(PolyObject *base) { return base; }
+    virtual POLYUNSIGNED ScanAddressAt(PolyWord *pt) { Record((byte*)pt, (PolyWord*)(*pt).AsObjPtr(), 0); return 0; }
+    virtual POLYUNSIGNED ScanCodeAddressAt(PolyObject **pt) { Record((byte*)pt, (PolyWord*)*pt, 0); return 0; }
+    virtual void ScanConstant(PolyObject *base, byte *addressOfConstant, ScanRelocationKind code);
+
+    void Record(byte *at, PolyWord *target, uint64_t kind);
+
+    PermanentMemSpace *space;
+    unsigned ownDescr;
+    const std::map<unsigned, unsigned> &indexToDescr;
+    std::vector<std::vector<uint64_t> > positions;
+    bool failed;
+};
+
+void SegmentCacheScanner::ScanConstant(PolyObject *base, byte *addressOfConstant, ScanRelocationKind code)
+{
+    PolyObject *p = GetConstantValue(addressOfConstant, code);
+    if (p != 0)
+        Record(addressOfConstant, (PolyWord*)p, code == PROCESS_RELOC_I386RELATIVE ? SEGMENTCACHERELATIVE : 0);
+}
+
+void SegmentCacheScanner::Record(byte *at, PolyWord *target, uint64_t kind)
+{
+    // As with SpaceForAddress subtract one to get the length word.
+    MemSpace *targetSpace = gMem.SpaceForAddress(target - 1);
+    if (targetSpace == 0 || targetSpace->spaceType != ST_PERMANENT)
+    {
+        failed = true;
+        return;
+    }
+    std::map<unsigned, unsigned>::const_iterator i = indexToDescr.find(((PermanentMemSpace*)targetSpace)->index);
+    if (i == indexToDescr.end())
+        failed = true;
+    // The entry is always mapped at the same address so addresses within it never change.
+    else if (i->second != ownDescr)
+        positions[i->second].push_back((uint64_t)(at - (byte*)space->bottom) << 1 | kind);
+}
+
+static uint64_t hashBytes(const void *bytes, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ ((const byte*)bytes)[i]) * 1099511628211ULL;
+    return hash;
+}
+
+// A directory or file is only trusted if it belongs to us and others can't modify it.
+static bool IsPrivate(const struct stat &st)
+{
+    return st.st_uid == geteuid() && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+SegmentCache::~SegmentCache()
+{
+    for (std::map<unsigned, MappedEntry>::iterator i = mapped.begin(); i != mapped.end(); i++)
+        close(i->second.fd);
+}
+
+bool SegmentCache::Open(const char *fileName, FILE *loadFile, time_t timeStamp, unsigned nDescrs)
+{
+    const char *dir = getenv("POLYSTATECACHE");
+    if (dir == 0 || *dir == 0)
+        return false;
+    struct stat st;
+    if (stat(dir, &st) != 0)
+    {
+        if (mkdir(dir, 0700) != 0 || stat(dir, &st) != 0)
+            return false;
+    }
+    if (! S_ISDIR(st.st_mode) || ! IsPrivate(st))
+        return false;
+    if (fstat(fileno(loadFile), &st) != 0)
+        return false;
+    cacheDir = dir;
+    // Saving a state renames a new file over the old one so the inode changes
+    // with each version.  Use a hash of the full path for the prefix so that
+    // entries for earlier versions can be found and removed.
+    char *realName = realpath(fileName, NULL);
+    const char *path = realName != NULL ? realName : fileName;
+    char buff[SEGMENTCACHEPREFIXLENGTH+2];
+    snprintf(buff, sizeof(buff), "/%016llx-", (unsigned long long)hashBytes(path, strlen(path)));
+    free(realName);
+    entryPrefix = buff;
+    memcpy(fileKey.signature, SEGMENTCACHESIGNATURE, sizeof(fileKey.signature));
+    fileKey.fileDevice = st.st_dev;
+    fileKey.fileInode = st.st_ino;
+    fileKey.fileSize = st.st_size;
+#ifdef HAVE_STRUCT_STAT_ST_ATIM
+    // A state saved again within the same second can reuse the inode and have
+    // the same size so use the full resolution of the times.
+    fileKey.fileModified = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    fileKey.fileChanged = (int64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+#else
+    fileKey.fileModified = st.st_mtime;
+    fileKey.fileChanged = st.st_ctime;
+#endif
+    fileKey.timeStamp = timeStamp;
+    fileKey.executableStamp = exportTimeStamp;
+    fileKey.nDescrs = nDescrs;
+    enabled = true;
+    return true;
+}
+
+void SegmentCache::MakeKey(const SavedStateSegmentDescr *descr, SegmentCacheKey *key)
+{
+    // Copy the padding as well so that keys can be compared with memcmp.
+    memcpy(key, &fileKey, sizeof(SegmentCacheKey));
+    key->segmentIndex = descr->segmentIndex;
+    key->segmentFlags = descr->segmentFlags;
+    key->segmentSize = descr->segmentSize;
+}
+
+std::string SegmentCache::EntryName(const SavedStateSegmentDescr *descr)
+{
+    SegmentCacheKey key;
+    MakeKey(descr, &key);
+    char buff[SEGMENTCACHENAMELENGTH-SEGMENTCACHEPREFIXLENGTH+1];
+    snprintf(buff, sizeof(buff), "%016llx",
+        (unsigned long long)hashBytes(&key, offsetof(SegmentCacheKey, loadAddress)));
+    return cacheDir + entryPrefix + buff;
+}
+
+void SegmentCache::Clean(const SavedStateSegmentDescr *descrs)
+{
+#ifdef HAVE_DIRENT_H
+    if (! enabled)
+        return;
+    std::vector<std::string> current;
+    for (unsigned i = 0; i < fileKey.nDescrs; i++)
+        current.push_back(EntryName(&descrs[i]).substr(cacheDir.length()+1));
+    std::string prefix = entryPrefix.substr(1); // Without the '/'
+    uint64_t limit = SEGMENTCACHEDEFAULTSIZE;
+    const char *sizeEnv = getenv("POLYSTATECACHESIZE");
+    if (sizeEnv != 0 && *sizeEnv != 0)
+        limit = strtoull(sizeEnv, 0, 10);
+    limit *= 1024 * 1024;
+
+    DIR *dir = opendir(cacheDir.c_str());
+    if (dir == 0)
+        return;
+    // The entries that are kept with their modification times, which are updated
+    // when they are used, and their sizes.
+    std::vector<std::pair<std::pair<time_t, uint64_t>, std::string> > entries;
+    uint64_t total = 0;
+    struct dirent *dp;
+    while ((dp = readdir(dir)) != 0)
+    {
+        std::string name = dp->d_name;
+        // Ignore anything that isn't an entry, including temporary files.
+        if (name.length() != SEGMENTCACHENAMELENGTH || name[SEGMENTCACHEPREFIXLENGTH-1] != '-')
+            continue;
+        std::string path = cacheDir + "/" + name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0 || ! S_ISREG(st.st_mode))
+            continue;
+        if (name.compare(0, SEGMENTCACHEPREFIXLENGTH, prefix) == 0 &&
+            std::find(current.begin(), current.end(), name) == current.end())
+        {
+            // An entry for another version of this file.
+            if (unlink(path.c_str()) == 0 && (debugOptions & DEBUG_SAVING))
+                Log("SAVE: Removed stale cache entry %s\n", path.c_str());
+            continue;
+        }
+        entries.push_back(std::make_pair(std::make_pair(st.st_mtime, (uint64_t)st.st_size), path));
+        total += st.st_size;
+    }
+    closedir(dir);
+    if (total <= limit)
+        return;
+    std::sort(entries.begin(), entries.end());
+    for (size_t i = 0; i < entries.size() && total > limit; i++)
+    {
+        if (unlink(entries[i].second.c_str()) == 0)
+        {
+            total -= entries[i].first.second;
+            if (debugOptions & DEBUG_SAVING)
+                Log("SAVE: Removed cache entry %s to limit the size\n", entries[i].second.c_str());
+        }
+    }
+#endif
+}
+
+PermanentMemSpace *SegmentCache::MapSegment(unsigned descrNo, const SavedStateSegmentDescr *descr,
+                                            unsigned flags, unsigned hierarchy)
+{
+    // Segments that contain entry points are set up by ClearVolatile on every load.
+    if (! enabled || (descr->segmentFlags & SSF_NOOVERWRITE))
+        return 0;
+    int fd = open(EntryName(descr).c_str(), O_RDONLY);
+    if (fd == -1)
+        return 0;
+    MappedEntry entry;
+    SegmentCacheKey key, entryKey;
+    MakeKey(descr, &key);
+    entry.addresses.resize(fileKey.nDescrs);
+    entry.counts.resize(fileKey.nDescrs);
+    off_t tablePos = descr->segmentSize + sizeof(SegmentCacheKey);
+    size_t addrBytes = fileKey.nDescrs * sizeof(void*), countBytes = fileKey.nDescrs * sizeof(uint64_t);
+    uint64_t totalCount = 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ! IsPrivate(st) ||
+        pread(fd, &entryKey, sizeof(entryKey), descr->segmentSize) != (ssize_t)sizeof(entryKey) ||
+        memcmp(&entryKey, &key, offsetof(SegmentCacheKey, loadAddress)) != 0 ||
+        pread(fd, &entry.addresses[0], addrBytes, tablePos) != (ssize_t)addrBytes ||
+        pread(fd, &entry.counts[0], countBytes, tablePos + addrBytes) != (ssize_t)countBytes)
+    {
+        close(fd);
+        return 0;
+    }
+    for (unsigned i = 0; i < fileKey.nDescrs; i++)
+        totalCount += entry.counts[i];
+    if ((uint64_t)st.st_size != tablePos + addrBytes + countBytes + totalCount * sizeof(uint64_t))
+    {
+        close(fd);
+        return 0;
+    }
+    entry.space = gMem.AllocateNewPermanentSpace(descr->segmentSize, flags, descr->segmentIndex,
+                    hierarchy, fd, 0, entryKey.loadAddress, true);
+    if (entry.space == 0)
+    {
+        close(fd);
+        return 0;
+    }
+#ifdef UTIME_NOW
+    // Record that the entry has been used.
+    (void)futimens(fd, 0);
+#endif
+    entry.fd = fd;
+    mapped[descrNo] = entry;
+    return entry.space;
+}
+
+bool SegmentCache::AdjustSegment(unsigned descrNo, const SavedStateSegmentDescr *descrs, PolyWord **targetAddresses)
+{
+    MappedEntry &entry = mapped[descrNo];
+    off_t pos = descrs[descrNo].segmentSize + sizeof(SegmentCacheKey) +
+        fileKey.nDescrs * (sizeof(void*) + sizeof(uint64_t));
+    for (unsigned i = 0; i < fileKey.nDescrs; i++)
+    {
+        size_t count = (size_t)entry.counts[i];
+        intptr_t delta = (byte*)targetAddresses[descrs[i].segmentIndex] - (byte*)entry.addresses[i];
+        if (delta != 0 && count != 0)
+        {
+            std::vector<uint64_t> positions(count);
+            if (pread(entry.fd, &positions[0], count * sizeof(uint64_t), pos) != (ssize_t)(count * sizeof(uint64_t)))
+                return false;
+            for (size_t j = 0; j < count; j++)
+            {
+                byte *at = (byte*)entry.space->bottom + (positions[j] >> 1);
+                byte *writeAt = entry.space->writeAble(at);
+                if (positions[j] & SEGMENTCACHERELATIVE)
+                {
+                    int32_t disp;
+                    memcpy(&disp, at, sizeof(disp));
+                    intptr_t newDisp = disp + delta;
+                    if (newDisp != (int32_t)newDisp)
+                        return false;
+                    disp = (int32_t)newDisp;
+                    memcpy(writeAt, &disp, sizeof(disp));
+                }
+                else
+                {
+                    uintptr_t value;
+                    memcpy(&value, at, sizeof(value));
+                    value += delta;
+                    memcpy(writeAt, &value, sizeof(value));
+                }
+            }
+        }
+        pos += count * sizeof(uint64_t);
+    }
+    return true;
+}
+
+bool SegmentCache::SaveSegment(unsigned descrNo, const SavedStateSegmentDescr *descrs, PolyWord **targetAddresses)
+{
+    const SavedStateSegmentDescr *descr = &descrs[descrNo];
+    if (! enabled || (descr->segmentFlags & SSF_NOOVERWRITE))
+        return false;
+    PermanentMemSpace *space = gMem.SpaceForIndex(descr->segmentIndex);
+    std::map<unsigned, unsigned> indexToDescr;
+    for (unsigned i = 0; i < fileKey.nDescrs; i++)
+    {
+        if (indexToDescr.find(descrs[i].segmentIndex) == indexToDescr.end())
+            indexToDescr[descrs[i].segmentIndex] = i;
+    }
+    SegmentCacheScanner scanner(space, descrNo, indexToDescr, fileKey.nDescrs);
+    scanner.ScanAddressesInRegion(space->bottom, (PolyWord*)((byte*)space->bottom + descr->segmentSize));
+    if (scanner.failed)
+        return false;
+
+    std::string name = EntryName(descr);
+    // Write to a temporary file and rename it so that other processes never see
+    // a partial entry.
+    std::string pattern = name + ".XXXXXX";
+    std::vector<char> tempName(pattern.begin(), pattern.end());
+    tempName.push_back(0);
+    int fd = mkstemp(&tempName[0]);
+    if (fd == -1)
+        return false;
+    SegmentCacheKey key;
+    MakeKey(descr, &key);
+    key.loadAddress = space->bottom;
+    std::vector<void*> addresses(fileKey.nDescrs);
+    std::vector<uint64_t> counts(fileKey.nDescrs);
+    for (unsigned i = 0; i < fileKey.nDescrs; i++)
+    {
+        addresses[i] = targetAddresses[descrs[i].segmentIndex];
+        counts[i] = scanner.positions[i].size();
+    }
+    bool ok = write(fd, space->bottom, descr->segmentSize) == (ssize_t)descr->segmentSize &&
+        write(fd, &key, sizeof(key)) == (ssize_t)sizeof(key) &&
+        write(fd, &addresses[0], addresses.size() * sizeof(void*)) == (ssize_t)(addresses.size() * sizeof(void*)) &&
+        write(fd, &counts[0], counts.size() * sizeof(uint64_t)) == (ssize_t)(counts.size() * sizeof(uint64_t));
+    for (unsigned i = 0; ok && i < fileKey.nDescrs; i++)
+    {
+        size_t bytes = scanner.positions[i].size() * sizeof(uint64_t);
+        ok = bytes == 0 || write(fd, &scanner.positions[i][0], bytes) == (ssize_t)bytes;
+    }
+    close(fd);
+    if (ok && rename(&tempName[0], name.c_str()) == 0)
+    {
+        if (debugOptions & DEBUG_SAVING)
+            Log("SAVE: Segment %u cached in %s\n", descr->segmentIndex, name.c_str());
+        return true;
+    }
+    unlink(&tempName[0]);
+    return false;
+}
+#endif
 
 typedef struct _relocationEntry
 {
@@ -238,20 +861,23 @@ typedef struct _relocationEntry
 class HierarchyTable
 {
 public:
-    HierarchyTable(const TCHAR *file, time_t time):
-      fileName(_tcsdup(file)), timeStamp(time) { }
+    HierarchyTable(const TCHAR *file, time_t time, bool diff):
+      fileName(_tcsdup(file)), timeStamp(time), differential(diff) { }
     AutoFree<TCHAR*> fileName;
     time_t          timeStamp;
+    // True if this was written by a differential save.  The page snapshot is
+    // then still that of the parent and the next differential save replaces it.
+    bool            differential;
 };
 
 HierarchyTable **hierarchyTable;
 
 static unsigned hierarchyDepth;
 
-static bool AddHierarchyEntry(const TCHAR *fileName, time_t timeStamp)
+static bool AddHierarchyEntry(const TCHAR *fileName, time_t timeStamp, bool differential = false)
 {
     // Add an entry to the hierarchy table for this file.
-    HierarchyTable *newEntry = new HierarchyTable(fileName, timeStamp);
+    HierarchyTable *newEntry = new HierarchyTable(fileName, timeStamp, differential);
     if (newEntry == 0) return false;
     HierarchyTable **newTable =
         (HierarchyTable **)realloc(hierarchyTable, sizeof(HierarchyTable *)*(hierarchyDepth+1));
@@ -296,6 +922,193 @@ static bool sameFile(const char *x, const char *y)
 }
 #endif
 
+#ifndef _WIN32
+// A saved state is written to a temporary file in the same directory which is
+// renamed when it is complete.  The file is removed if it has not been renamed.
+// The temporary name is the target followed by .polysave.<pid>.<n>.  If a process
+// crashed while saving, its file is removed by the next save to the same name.
+// If the directory is not writable the existing file is overwritten instead.
+#define TEMPSAVESUFFIX  ".polysave."
+
+class TempSaveFile
+{
+public:
+    TempSaveFile(): inPlace(false) {}
+    ~TempSaveFile() { if (! tempName.empty()) unlink(tempName.c_str()); }
+    // Create the file.  Returns null on failure with errno set.
+    FILE *Create(const char *fileName);
+    // Replace the target with the temporary file.
+    bool Rename();
+
+private:
+    void RemoveStale();
+    std::string tempName, targetName;
+    bool inPlace;
+};
+
+// Remove temporary files left by processes that no longer exist.
+void TempSaveFile::RemoveStale()
+{
+#ifdef HAVE_DIRENT_H
+    std::string::size_type slash = targetName.rfind('/');
+    // The directory including the final slash.  Empty for the current directory.
+    std::string dirName = slash == std::string::npos ? std::string() : targetName.substr(0, slash+1);
+    std::string prefix = targetName.substr(dirName.length()) + TEMPSAVESUFFIX;
+    DIR *dir = opendir(dirName.empty() ? "." : dirName.c_str());
+    if (dir == NULL)
+        return;
+    struct dirent *dp;
+    while ((dp = readdir(dir)) != NULL)
+    {
+        if (strncmp(dp->d_name, prefix.c_str(), prefix.length()) != 0)
+            continue;
+        char *end;
+        long pid = strtol(dp->d_name + prefix.length(), &end, 10);
+        if (end == dp->d_name + prefix.length() || *end != '.' || pid <= 0 || pid == (long)getpid())
+            continue;
+        if (kill((pid_t)pid, 0) != 0 && errno == ESRCH)
+            (void)unlink((dirName + dp->d_name).c_str());
+    }
+    closedir(dir);
+#endif
+}
+
+FILE *TempSaveFile::Create(const char *fileName)
+{
+    // If the name is a symbolic link replace the file it refers to.
+    targetName = fileName;
+    char *realName = realpath(fileName, NULL);
+    if (realName != NULL)
+    {
+        targetName = realName;
+        free(realName);
+    }
+    RemoveStale();
+    // Open the file with the same mode as the file being replaced or, for a new
+    // file, the mode that fopen would have used.
+    struct stat existing;
+    bool haveExisting = stat(targetName.c_str(), &existing) == 0;
+    for (unsigned n = 0; ; n++)
+    {
+        char suffix[60];
+        snprintf(suffix, sizeof(suffix), TEMPSAVESUFFIX "%d.%u", (int)getpid(), n);
+        tempName = targetName + suffix;
+        int fd = open(tempName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+        if (fd != -1)
+        {
+            if (haveExisting)
+            {
+                // Keep the group if we can.  Only root can keep the owner.
+                if (fchown(fd, existing.st_uid, existing.st_gid) != 0) {}
+                if (fchmod(fd, existing.st_mode & 07777) != 0) {}
+            }
+            FILE *file = fdopen(fd, "w+b");
+            if (file == NULL)
+                close(fd);
+            return file;
+        }
+        if (errno != EEXIST || n >= 100)
+        {
+            tempName.clear();
+            if (errno == EACCES || errno == EPERM)
+            {
+                // We can't create a file in the directory but we may be able
+                // to write the existing one.  Any process that has mapped it
+                // will see the changes or fault.
+                inPlace = true;
+                return fopen(targetName.c_str(), "w+b");
+            }
+            return NULL;
+        }
+    }
+}
+
+bool TempSaveFile::Rename()
+{
+    if (inPlace)
+        return true;
+    if (rename(tempName.c_str(), targetName.c_str()) != 0)
+        return false;
+    tempName.clear();
+    return true;
+}
+#endif
+
+// Check that a saved state still has the time stamp it had when it was saved or loaded.
+static bool unchangedSince(const TCHAR *fileName, time_t timeStamp)
+{
+    AutoClose file(_tfopen(fileName, _T("rb")));
+    SavedStateHeader header;
+    if ((FILE*)file == NULL || fread(&header, sizeof(SavedStateHeader), 1, file) != 1)
+        return false;
+    return strncmp(header.headerSignature, SAVEDSTATESIGNATURE, sizeof(header.headerSignature)) == 0 &&
+        header.headerVersion == SAVEDSTATEVERSION && header.timeStamp == timeStamp;
+}
+
+/*
+ *  Page snapshot: a copy of the overwritable mutable permanent spaces as they
+ *  were when a state was last saved or loaded, not counting differential saves.
+ *  A differential save only writes the pages whose contents differ from the copy.
+ *  Comparing the bytes rather than a hash of each page means that a change is
+ *  never missed.  The copy needs as much memory as those spaces.  Like the
+ *  hierarchy table this is only updated by the main thread.
+ */
+
+class PageSnapshot
+{
+public:
+    // Record the contents of the overwritable mutable spaces.  If there is not
+    // enough memory the snapshot is left empty and a differential save writes
+    // the spaces in full.
+    void Take();
+    void Clear() { pageCopies.clear(); }
+    // Set pageOffsets to the byte offsets of the pages that have changed.
+    // Returns false if there is no snapshot for this space.
+    bool ChangedPages(PermanentMemSpace *space, size_t length, std::vector<size_t> &pageOffsets);
+
+private:
+    std::map<PermanentMemSpace*, std::vector<byte> > pageCopies;
+};
+
+static PageSnapshot pageSnapshot;
+
+void PageSnapshot::Take()
+{
+    pageCopies.clear();
+    try {
+        for (std::vector<PermanentMemSpace*>::iterator i = gMem.pSpaces.begin(); i < gMem.pSpaces.end(); i++)
+        {
+            PermanentMemSpace *space = *i;
+            if (space->isMutable && !space->noOverwrite && !space->isCode)
+                pageCopies[space].assign((byte*)space->bottom, (byte*)space->topPointer);
+        }
+    }
+    catch (std::bad_alloc&) {
+        pageCopies.clear();
+    }
+}
+
+bool PageSnapshot::ChangedPages(PermanentMemSpace *space, size_t length, std::vector<size_t> &pageOffsets)
+{
+#ifdef POLYML32IN64
+    // The code address in a closure is two words and may be split between pages.
+    return false;
+#else
+    std::map<PermanentMemSpace*, std::vector<byte> >::iterator entry = pageCopies.find(space);
+    if (entry == pageCopies.end() || entry->second.size() != length)
+        return false;
+    const byte *copy = entry->second.empty() ? 0 : &entry->second[0];
+    pageOffsets.clear();
+    for (size_t offset = 0; offset < length; offset += DIFFERENTIALPAGESIZE)
+    {
+        size_t pageLength = length - offset < DIFFERENTIALPAGESIZE ? length - offset : DIFFERENTIALPAGESIZE;
+        if (memcmp((byte*)space->bottom + offset, copy + offset, pageLength) != 0)
+            pageOffsets.push_back(offset);
+    }
+    return true;
+#endif
+}
+
 /*
  *  Saving state.
  */
@@ -382,13 +1195,15 @@ void SaveStateExport::ScanConstant(PolyObject *base, byte *addr, ScanRelocationK
 class SaveRequest: public MainThreadRequest
 {
 public:
-    SaveRequest(const TCHAR *name, unsigned h): MainThreadRequest(MTP_SAVESTATE),
-        fileName(name), newHierarchy(h),
+    SaveRequest(const TCHAR *name, unsigned h, bool c, bool d): MainThreadRequest(MTP_SAVESTATE),
+        fileName(name), newHierarchy(h), compress(c && compressionSupported), differential(d),
         errorMessage(0), errCode(0) {}
 
     virtual void Perform();
     const TCHAR *fileName;
     unsigned newHierarchy;
+    bool compress;
+    bool differential; // Only write the mutable pages that have changed since the last save or load.
     const char *errorMessage;
     int errCode;
 };
@@ -487,9 +1302,29 @@ void SaveRequest::Perform()
         }
     }
 
+    // A differential save writes only the changes since its parent was saved or
+    // loaded, so check that the parent file has not been replaced since.
+    if (differential && ! unchangedSince(hierarchyTable[newHierarchy-2]->fileName, hierarchyTable[newHierarchy-2]->timeStamp))
+    {
+        errorMessage = "The parent of a differential save has been changed or removed";
+        errCode = 0;
+        if (debugOptions & DEBUG_SAVING)
+            Log("SAVE: Parent file has changed since it was saved or loaded.\n");
+        return;
+    }
+
     SaveStateExport exports;
     // Open the file.  This could quite reasonably fail if the path is wrong.
-    exports.exportFile = _tfopen(fileName, _T("wb"));
+    // It is opened for reading as well so that it can be mapped.
+#ifndef _WIN32
+    // An existing file is not truncated because another process may have mapped
+    // segments of it into memory.  Instead the state is written to a new file
+    // which replaces it once it is complete.
+    TempSaveFile tempFile;
+    exports.exportFile = tempFile.Create(fileName);
+#else
+    exports.exportFile = _tfopen(fileName, _T("w+b"));
+#endif
     if (exports.exportFile == NULL)
     {
         errorMessage = "Cannot open save file";
@@ -498,10 +1333,19 @@ void SaveRequest::Perform()
             Log("SAVE: Cannot open save file.\n");
         return;
     }
+#ifndef _WIN32
+    // Unless the data are to be compressed the new spaces are mapped from the
+    // file so the data are copied directly into it rather than into memory and
+    // then written.  They are placed after the header and the remaining tables
+    // are written after them.
+    if (! compress)
+        exports.backing = new ExportFileBacking(fileno(exports.exportFile), false, SEGMENTALIGNMENT, SEGMENTALIGNMENT);
+#endif
 
     // Scan over the permanent mutable area copying all reachable data that is
     // not in a lower hierarchy into new permanent segments.
     CopyScan copyScan(newHierarchy);
+    copyScan.backing = exports.backing;
     copyScan.initialise(false);
     bool success = true;
     try {
@@ -516,6 +1360,7 @@ void SaveRequest::Perform()
                 copyScan.ScanAddressesInRegion(space->bottom, space->top);
             }
         }
+        copyScan.WaitForCompletion();
     }
     catch (MemoryException &)
     {
@@ -616,6 +1461,25 @@ void SaveRequest::Perform()
         }
     }
 
+    // Similarly restore the length words of any files mapped into memory.  All
+    // references now point to the copies so these will be unmapped by the next GC.
+    for (std::vector<PermanentMemSpace *>::iterator i = gMem.mSpaces.begin(); i < gMem.mSpaces.end(); i++)
+    {
+        PermanentMemSpace *space = *i;
+        for (PolyWord *pt = space->bottom; pt < space->top; )
+        {
+            pt++;
+            PolyObject *obj = (PolyObject*)pt;
+#ifdef POLYML32IN64
+            if ((uintptr_t)obj & 4)
+                continue; // Filler word used for alignment.
+#endif
+            if (obj->ContainsForwardingPtr())
+                obj->SetLengthWord(obj->FollowForwardingChain()->LengthWord());
+            pt += obj->Length();
+        }
+    }
+
     // Update the global memory space table.  Old segments at the same level
     // or lower are removed.  The new segments become permanent.
     // Try to promote the spaces even if we've had a failure because export
@@ -664,6 +1528,9 @@ void SaveRequest::Perform()
 #endif
     // Write out the header.
     fwrite(&saveHeader, sizeof(saveHeader), 1, exports.exportFile);
+    // Skip the data that have been copied directly into the file.
+    if (exports.backing != 0)
+        fseek(exports.exportFile, (off_t)exports.backing->endOffset, SEEK_SET);
 
     // We need a segment header for each permanent area whether it is
     // actually in this file or not.
@@ -723,9 +1590,48 @@ void SaveRequest::Perform()
                 p += length;
             }
             descrs[k].relocationCount = exports.relocationCount;
-            // Write out the data.
-            descrs[k].segmentData = ftell(exports.exportFile);
-            fwrite(entry->mtOriginalAddr, entry->mtLength, 1, exports.exportFile);
+            std::vector<size_t> changedPages;
+            if (differential && k < permanentEntries && (entry->mtFlags & MTF_EXECUTABLE) == 0 &&
+                pageSnapshot.ChangedPages(gMem.SpaceForIndex(entry->mtIndex), entry->mtLength, changedPages))
+            {
+                // Write only the pages of the parent's space that have changed.
+                if (debugOptions & DEBUG_SAVING)
+                    Log("SAVE: Segment %u: %zu of %zu pages changed\n", (unsigned)entry->mtIndex, changedPages.size(),
+                        (entry->mtLength + DIFFERENTIALPAGESIZE - 1) / DIFFERENTIALPAGESIZE);
+                descrs[k].segmentData = ftell(exports.exportFile);
+                descrs[k].segmentFlags |= SSF_PAGES;
+                size_t pageCount = changedPages.size();
+                fwrite(&pageCount, sizeof(size_t), 1, exports.exportFile);
+                if (pageCount != 0)
+                    fwrite(&changedPages[0], sizeof(size_t), pageCount, exports.exportFile);
+                for (std::vector<size_t>::iterator i = changedPages.begin(); i != changedPages.end(); i++)
+                {
+                    size_t pageLength = entry->mtLength - *i;
+                    if (pageLength > DIFFERENTIALPAGESIZE) pageLength = DIFFERENTIALPAGESIZE;
+                    fwrite((char*)entry->mtOriginalAddr + *i, pageLength, 1, exports.exportFile);
+                }
+                continue;
+            }
+            uint64_t mappedOffset;
+            if (k >= permanentEntries && exports.backing != 0 &&
+                exports.backing->FileOffset(gMem.SpaceForIndex(entry->mtIndex), mappedOffset))
+            {
+                // Already in the file.
+                descrs[k].segmentData = (off_t)mappedOffset;
+                continue;
+            }
+            // Write out the data.  Uncompressed data are aligned so they can be mapped.
+            off_t dataPos = ftell(exports.exportFile);
+            if (! compress)
+            {
+                dataPos = (dataPos + SEGMENTALIGNMENT - 1) & ~((off_t)SEGMENTALIGNMENT - 1);
+                fseek(exports.exportFile, dataPos, SEEK_SET);
+            }
+            descrs[k].segmentData = dataPos;
+            descrs[k].compressedSize =
+                WriteSegmentData(exports.exportFile, entry->mtOriginalAddr, entry->mtLength, compress);
+            if (descrs[k].compressedSize != 0)
+                descrs[k].segmentFlags |= SSF_COMPRESSED;
        }
     }
 
@@ -742,13 +1648,54 @@ void SaveRequest::Perform()
     // Rewrite the header and the segment tables now they're complete.
     fseek(exports.exportFile, 0, SEEK_SET);
     fwrite(&saveHeader, sizeof(saveHeader), 1, exports.exportFile);
+    fseek(exports.exportFile, saveHeader.segmentDescr, SEEK_SET);
     fwrite(descrs, sizeof(SavedStateSegmentDescr), exports.memTableEntries, exports.exportFile);
+    if (fflush(exports.exportFile) != 0 || ferror(exports.exportFile))
+    {
+        errorMessage = "Error while writing saved state";
+        errCode = ERRORNUMBER;
+    }
+#ifndef _WIN32
+    else if (! tempFile.Rename())
+    {
+        errorMessage = "Cannot rename save file";
+        errCode = ERRORNUMBER;
+    }
+#endif
+
+    // The spaces mapped from the file are now permanent spaces.  Make the mappings
+    // private, as they are when a saved state is loaded, so that later changes,
+    // particularly to mutable data, are not written to the file.
+    for (std::vector<PermanentMemSpace*>::iterator i = gMem.pSpaces.begin(); i < gMem.pSpaces.end(); i++)
+    {
+        PermanentMemSpace *space = *i;
+        uint64_t mappedOffset;
+        if (exports.backing != 0 && exports.backing->FileOffset(space, mappedOffset) &&
+            ! space->allocator->MakeFileAreaPrivate(space->bottom, (char*)space->top - (char*)space->bottom,
+                fileno(exports.exportFile), mappedOffset))
+        {
+            // The data in the file are complete but they could be altered.
+            errorMessage = "Unable to remap saved data";
+            errCode = ERRORNUMBER;
+            if (debugOptions & DEBUG_SAVING)
+                Log("SAVE: Unable to make mapping of space %p private.\n", space);
+        }
+    }
 
     if (debugOptions & DEBUG_SAVING)
         Log("SAVE: Writing complete.\n");
 
     // Add an entry to the hierarchy table for this file.
-    (void)AddHierarchyEntry(fileName, saveHeader.timeStamp);
+    (void)AddHierarchyEntry(fileName, saveHeader.timeStamp, differential && errorMessage == 0);
+
+    // The contents of the mutable spaces are now those in the file.  After a
+    // differential save the snapshot of the parent is kept because the next
+    // differential save replaces this one.  If the file may be incomplete there
+    // is no snapshot so that a later differential save writes the spaces in full.
+    if (errorMessage != 0)
+        pageSnapshot.Clear();
+    else if (! differential)
+        pageSnapshot.Take();
 
     delete[](descrs);
 
@@ -756,7 +1703,11 @@ void SaveRequest::Perform()
 }
 
 // Write a saved state file.
-POLYUNSIGNED PolySaveState(FirstArgument threadId, PolyWord fileName, PolyWord depth)
+// Flags for PolySaveState.
+#define SAVE_COMPRESS       1   // Compress the segments
+#define SAVE_DIFFERENTIAL   2   // Save a child of the last state saved or loaded with only the changes
+
+POLYUNSIGNED PolySaveState(FirstArgument threadId, PolyWord fileName, PolyWord depth, PolyWord flags)
 {
     TaskData *taskData = TaskData::FindTaskForId(threadId);
     ASSERT(taskData != 0);
@@ -765,18 +1716,35 @@ POLYUNSIGNED PolySaveState(FirstArgument threadId, PolyWord fileName, PolyWord d
 
     try {
         TempString fileNameBuff(Poly_string_to_T_alloc(fileName));
-        // The value of depth is zero for top-level save so we need to add one for hierarchy.
-        unsigned newHierarchy = get_C_unsigned(taskData, depth) + 1;
+        unsigned saveFlags = get_C_unsigned(taskData, flags);
+        unsigned newHierarchy;
+        if (saveFlags & SAVE_DIFFERENTIAL)
+        {
+            // The depth is ignored: this is a child of the deepest file unless that
+            // was itself written by a differential save.  In that case it is replaced,
+            // so the hierarchy does not grow with each checkpoint.
+            if (hierarchyDepth == 0)
+                raise_fail(taskData, "There is no saved state to make a differential save from");
+            if (hierarchyTable[hierarchyDepth-1]->differential)
+                newHierarchy = hierarchyDepth;
+            else newHierarchy = hierarchyDepth + 1;
+        }
+        else
+        {
+            // The value of depth is zero for top-level save so we need to add one for hierarchy.
+            newHierarchy = get_C_unsigned(taskData, depth) + 1;
 
-        if (newHierarchy > hierarchyDepth + 1)
-            raise_fail(taskData, "Depth must be no more than the current hierarchy plus one");
+            if (newHierarchy > hierarchyDepth + 1)
+                raise_fail(taskData, "Depth must be no more than the current hierarchy plus one");
+        }
 
         // Request a full GC first.  The main reason is to avoid running out of memory as a
         // result of repeated saves.  Old export spaces are turned into local spaces and
         // the GC will delete them if they are completely empty
         FullGC(taskData);
 
-        SaveRequest request(fileNameBuff, newHierarchy);
+        SaveRequest request(fileNameBuff, newHierarchy,
+            (saveFlags & SAVE_COMPRESS) != 0, (saveFlags & SAVE_DIFFERENTIAL) != 0);
         processes->MakeRootRequest(taskData, &request);
         if (request.errorMessage)
             raise_syscall(taskData, request.errorMessage, request.errCode);
@@ -842,6 +1810,10 @@ void StateLoader::Perform(void)
         }
         (void)LoadFile(true, 0, TAGGED(0));
     }
+    // Record the contents of the mutable spaces for a later differential save.
+    if (errorResult == 0)
+        pageSnapshot.Take();
+    else pageSnapshot.Clear();
 }
 
 class ClearVolatile: public ScanAddress
@@ -914,6 +1886,26 @@ SpaceBTreeTree::~SpaceBTreeTree()
 }
 
 
+// Relocation is split into chunks of about this many words or relocation
+// entries and these are processed in parallel on the GC task farm.
+#define RELOCATIONCHUNKWORDS    (128*1024)
+#define RELOCATIONCHUNKENTRIES  (16*1024)
+
+// A chunk of relocation work.  Either a range of objects or a block of
+// explicit relocations.
+class RelocationChunk
+{
+public:
+    RelocationChunk(): bottom(0), top(0), space(0), writeSpace(0), baseAddr(0), entries(0), count(0), errorResult(0) {}
+    PolyWord *bottom, *top;     // Objects to relocate
+    MemSpace *space;            // If non-null the targets are checked against existing spaces.
+    MemSpace *writeSpace;       // If non-null the space being relocated, which is not yet in the table.
+    PolyWord *baseAddr;         // Base address for the explicit relocations
+    RelocationEntry *entries;
+    unsigned count;
+    const char *errorResult;
+};
+
 // This class is used to relocate addresses in areas that have been loaded.
 class LoadRelocate: public ScanAddress
 {
@@ -923,6 +1915,17 @@ public:
     ~LoadRelocate();
 
     void RelocateObject(PolyObject *p);
+    void RelocateObjects(PolyWord *bottom, PolyWord *top);
+    // Relocate only the words that are within the given pages.
+    void RelocatePages(PolyWord *bottom, PolyWord *top, const std::vector<size_t> &pageOffsets);
+    void ApplyRelocations(RelocationChunk *chunk);
+    // Queue the objects in a region to be relocated.
+    void RelocateRegion(PolyWord *bottom, PolyWord *top);
+    // Queue explicit relocations.  Takes ownership of the entries.
+    void AddRelocations(MemSpace *space, PolyWord *baseAddr, RelocationEntry *entries, unsigned count,
+                        MemSpace *writeSpace = 0);
+    // Wait for the queued work to finish.  Returns an error message if there was a problem.
+    const char *WaitForRelocation();
     virtual PolyObject *ScanObjectAddress(PolyObject *base) { ASSERT(0); return base; } // Not used
     virtual void ScanConstant(PolyObject *base, byte *addressOfConstant, ScanRelocationKind code);
     void RelocateAddressAt(PolyWord *pt);
@@ -936,10 +1939,19 @@ public:
     unsigned nDescrs;
     SpaceBTree *spaceTree;
     intptr_t relativeOffset;
+
+private:
+    static void RelocationTask(GCTaskId*, void *arg1, void *arg2);
+    // Chunks that have been queued.  A deque is used because the addresses
+    // of existing entries do not change when a new one is added.
+    std::deque<RelocationChunk> chunks;
+    std::vector<RelocationEntry*> relocationBlocks;
 };
 
 LoadRelocate::~LoadRelocate()
 {
+    // If we have returned early because of an error we must still wait.
+    (void)WaitForRelocation();
     if (descrs) delete[](descrs);
     if (targetAddresses) delete[](targetAddresses);
     delete(spaceTree);
@@ -988,7 +2000,13 @@ void LoadRelocate::RelocateAddressAt(PolyWord *pt)
 {
     PolyWord val = *pt;
     if (! val.IsTagged())
-        *gMem.SpaceForAddress(pt)->writeAble(pt) = RelocateAddress(val.AsObjPtr(originalBaseAddr));
+    {
+        PolyWord newValue = RelocateAddress(val.AsObjPtr(originalBaseAddr));
+        // Only update it if it has changed.  Pages that are mapped from the file
+        // are only copied when they are written.
+        if (newValue != val)
+            *gMem.SpaceForAddress(pt)->writeAble(pt) = newValue;
+    }
 }
 
 PolyObject *LoadRelocate::RelocateAddress(PolyObject *obj)
@@ -1018,51 +2036,209 @@ PolyObject *LoadRelocate::RelocateAddress(PolyObject *obj)
         tr = ((SpaceBTreeTree*)tr)->tree[(t >> j) & 0xff];
     }
 
-    // This should never happen.
-    ASSERT(0);
-    return 0;
+    // This should never happen.
+    ASSERT(0);
+    return 0;
+}
+
+// This is based on Exporter::relocateObject but does the reverse.
+// It attempts to adjust all the addresses in the object when it has
+// been read in.
+void LoadRelocate::RelocateObject(PolyObject *p)
+{
+    if (p->IsByteObject())
+    {
+    }
+    else if (p->IsCodeObject())
+    {
+        POLYUNSIGNED constCount;
+        PolyWord *cp;
+        ASSERT(! p->IsMutable() );
+        p->GetConstSegmentForCode(cp, constCount);
+        /* Now the constant area. */
+        for (POLYUNSIGNED i = 0; i < constCount; i++) RelocateAddressAt(&(cp[i]));
+        // Saved states and modules have relocation entries for constants in the code.
+        // We can't use them when loading object files in 32-in-64 so have to process the
+        // constants here.
+        if (processCodeConstants)
+        {
+            POLYUNSIGNED length = p->Length();
+            machineDependent->ScanConstantsWithinCode(p, p, length, this);
+        }
+    }
+    else if (p->IsClosureObject())
+    {
+        // The first word is the address of the code.
+        POLYUNSIGNED length = p->Length();
+        PolyObject *newCode = RelocateAddress(*(PolyObject**)p);
+        if (newCode != *(PolyObject**)p)
+            *(PolyObject**)p = newCode;
+        for (POLYUNSIGNED i = sizeof(PolyObject*)/sizeof(PolyWord); i < length; i++)
+            RelocateAddressAt(p->Offset(i));
+    }
+    else /* Ordinary objects, essentially tuples. */
+    {
+        POLYUNSIGNED length = p->Length();
+        for (POLYUNSIGNED i = 0; i < length; i++) RelocateAddressAt(p->Offset(i));
+    }
+}
+
+// Relocate the objects in a range.
+void LoadRelocate::RelocateObjects(PolyWord *bottom, PolyWord *top)
+{
+    for (PolyWord *p = bottom; p < top; )
+    {
+        p++;
+        PolyObject *obj = (PolyObject*)p;
+        POLYUNSIGNED length = obj->Length();
+        RelocateObject(obj);
+        p += length;
+    }
+}
+
+// An overwrite with SSF_PAGES replaces only some of the pages of a space.  The
+// rest of the space was relocated when the parent was loaded so only the words
+// within the new pages are relocated.  Objects may span page boundaries.
+// Spaces containing code are always written in full.
+void LoadRelocate::RelocatePages(PolyWord *bottom, PolyWord *top, const std::vector<size_t> &pageOffsets)
+{
+    std::vector<size_t>::const_iterator page = pageOffsets.begin();
+    for (PolyWord *p = bottom; p < top && page != pageOffsets.end(); )
+    {
+        p++;
+        PolyObject *obj = (PolyObject*)p;
+        POLYUNSIGNED length = obj->Length();
+        PolyWord *end = p + length;
+        p = end;
+        // Skip pages that are wholly before this object.
+        while (page != pageOffsets.end() && (byte*)bottom + *page + DIFFERENTIALPAGESIZE <= (byte*)obj)
+            page++;
+        if (length == 0 || obj->IsByteObject())
+            continue;
+        ASSERT(! obj->IsCodeObject());
+        for (std::vector<size_t>::const_iterator q = page;
+             q != pageOffsets.end() && (byte*)bottom + *q < (byte*)end; q++)
+        {
+            PolyWord *pageStart = (PolyWord*)((byte*)bottom + *q);
+            PolyWord *pageEnd = pageStart + DIFFERENTIALPAGESIZE / sizeof(PolyWord);
+            PolyWord *from = pageStart < (PolyWord*)obj ? (PolyWord*)obj : pageStart;
+            PolyWord *to = pageEnd < end ? pageEnd : end;
+            for (PolyWord *pt = from; pt < to; pt++)
+            {
+                if (pt == (PolyWord*)obj && obj->IsClosureObject())
+                {
+                    // The first word is the address of the code.
+                    PolyObject *newCode = RelocateAddress(*(PolyObject**)obj);
+                    if (newCode != *(PolyObject**)obj)
+                        *(PolyObject**)obj = newCode;
+                }
+                else RelocateAddressAt(pt);
+            }
+        }
+    }
+}
+
+// Process a block of explicit relocations.  These are used for constants
+// within the code and, in modules, for all addresses.
+// If we get errors just skip the error and continue rather than leave
+// everything in an unstable state.
+void LoadRelocate::ApplyRelocations(RelocationChunk *chunk)
+{
+    for (unsigned k = 0; k < chunk->count; k++)
+    {
+        RelocationEntry *reloc = &chunk->entries[k];
+        byte *setAddress = (byte*)chunk->baseAddr + reloc->relocAddress;
+        byte *targetAddress;
+        if (chunk->space != 0)
+        {
+            MemSpace *toSpace = gMem.SpaceForIndex(reloc->targetSegment);
+            if (toSpace == NULL)
+            {
+                chunk->errorResult = "Unknown space reference in relocation";
+                continue;
+            }
+            targetAddress = (byte*)toSpace->bottom + reloc->targetAddress;
+            if (setAddress >= (byte*)chunk->space->top || targetAddress >= (byte*)toSpace->top)
+            {
+                chunk->errorResult = "Bad relocation";
+                continue;
+            }
+        }
+        else targetAddress = (byte*)targetAddresses[reloc->targetSegment] + reloc->targetAddress;
+        if (chunk->writeSpace == 0)
+            ScanAddress::SetConstantValue(setAddress, (PolyObject*)(targetAddress), reloc->relKind);
+        // Only write the value if it has changed so that pages mapped from a file
+        // remain shared if the space has been loaded at its original address.
+        else if (GetConstantValue(setAddress, reloc->relKind) != (PolyObject*)targetAddress)
+            ScanAddress::SetConstantValue(setAddress, chunk->writeSpace->writeAble(setAddress),
+                (PolyObject*)(targetAddress), reloc->relKind);
+    }
+}
+
+void LoadRelocate::RelocationTask(GCTaskId*, void *arg1, void *arg2)
+{
+    LoadRelocate *relocate = (LoadRelocate*)arg1;
+    RelocationChunk *chunk = (RelocationChunk*)arg2;
+    if (chunk->entries)
+        relocate->ApplyRelocations(chunk);
+    else relocate->RelocateObjects(chunk->bottom, chunk->top);
 }
 
-// This is based on Exporter::relocateObject but does the reverse.
-// It attempts to adjust all the addresses in the object when it has
-// been read in.
-void LoadRelocate::RelocateObject(PolyObject *p)
+// Split the region into chunks at object boundaries.  Finding the boundaries only
+// needs the length words so the chunks can be relocated while we continue.
+void LoadRelocate::RelocateRegion(PolyWord *bottom, PolyWord *top)
 {
-    if (p->IsByteObject())
-    {
-    }
-    else if (p->IsCodeObject())
+    PolyWord *chunkStart = bottom;
+    for (PolyWord *p = bottom; p < top; )
     {
-        POLYUNSIGNED constCount;
-        PolyWord *cp;
-        ASSERT(! p->IsMutable() );
-        p->GetConstSegmentForCode(cp, constCount);
-        /* Now the constant area. */
-        for (POLYUNSIGNED i = 0; i < constCount; i++) RelocateAddressAt(&(cp[i]));
-        // Saved states and modules have relocation entries for constants in the code.
-        // We can't use them when loading object files in 32-in-64 so have to process the
-        // constants here.
-        if (processCodeConstants)
+        p++;
+        p += ((PolyObject*)p)->Length();
+        if (p - chunkStart >= RELOCATIONCHUNKWORDS || p >= top)
         {
-            POLYUNSIGNED length = p->Length();
-            machineDependent->ScanConstantsWithinCode(p, p, length, this);
+            chunks.push_back(RelocationChunk());
+            RelocationChunk *chunk = &chunks.back();
+            chunk->bottom = chunkStart;
+            chunk->top = p;
+            gpTaskFarm->AddWorkOrRunNow(&RelocationTask, this, chunk);
+            chunkStart = p;
         }
     }
-    else if (p->IsClosureObject())
-    {
-        // The first word is the address of the code.
-        POLYUNSIGNED length = p->Length();
-        *(PolyObject**)p = RelocateAddress(*(PolyObject**)p);
-        for (POLYUNSIGNED i = sizeof(PolyObject*)/sizeof(PolyWord); i < length; i++)
-            RelocateAddressAt(p->Offset(i));
-    }
-    else /* Ordinary objects, essentially tuples. */
-    {
-        POLYUNSIGNED length = p->Length();
-        for (POLYUNSIGNED i = 0; i < length; i++) RelocateAddressAt(p->Offset(i));
+}
+
+void LoadRelocate::AddRelocations(MemSpace *space, PolyWord *baseAddr, RelocationEntry *entries, unsigned count,
+                                  MemSpace *writeSpace)
+{
+    relocationBlocks.push_back(entries);
+    for (unsigned k = 0; k < count; k += RELOCATIONCHUNKENTRIES)
+    {
+        chunks.push_back(RelocationChunk());
+        RelocationChunk *chunk = &chunks.back();
+        chunk->space = space;
+        chunk->writeSpace = writeSpace;
+        chunk->baseAddr = baseAddr;
+        chunk->entries = entries + k;
+        chunk->count = count - k < RELOCATIONCHUNKENTRIES ? count - k : RELOCATIONCHUNKENTRIES;
+        gpTaskFarm->AddWorkOrRunNow(&RelocationTask, this, chunk);
     }
 }
 
+const char *LoadRelocate::WaitForRelocation()
+{
+    const char *errorResult = 0;
+    if (! chunks.empty())
+        gpTaskFarm->WaitForCompletion();
+    for (std::deque<RelocationChunk>::iterator i = chunks.begin(); i != chunks.end(); i++)
+    {
+        if (i->errorResult != 0 && errorResult == 0)
+            errorResult = i->errorResult;
+    }
+    chunks.clear();
+    for (std::vector<RelocationEntry*>::iterator i = relocationBlocks.begin(); i != relocationBlocks.end(); i++)
+        delete[](*i);
+    relocationBlocks.clear();
+    return errorResult;
+}
+
 // Update addresses as constants within the code.
 void LoadRelocate::ScanConstant(PolyObject *base, byte *addressOfConstant, ScanRelocationKind code)
 {
@@ -1080,6 +2256,34 @@ void LoadRelocate::ScanConstant(PolyObject *base, byte *addressOfConstant, ScanR
     }
 }
 
+// Read an overwrite segment that contains only the pages that have changed.
+// Returns an error message if there was a problem.
+static const char *ReadChangedPages(FILE *loadFile, const SavedStateSegmentDescr *descr, MemSpace *space,
+                                    std::vector<size_t> &pageOffsets)
+{
+    size_t pageCount;
+    if (fseek(loadFile, descr->segmentData, SEEK_SET) != 0 ||
+        fread(&pageCount, sizeof(size_t), 1, loadFile) != 1 ||
+        pageCount > (descr->segmentSize + DIFFERENTIALPAGESIZE - 1) / DIFFERENTIALPAGESIZE)
+        return "Unable to read segment";
+    pageOffsets.resize(pageCount);
+    if (pageCount != 0 && fread(&pageOffsets[0], sizeof(size_t), pageCount, loadFile) != pageCount)
+        return "Unable to read segment";
+    if (descr->segmentSize > (size_t)((char*)space->top - (char*)space->bottom))
+        return "Mismatch for existing memory space";
+    for (std::vector<size_t>::iterator i = pageOffsets.begin(); i != pageOffsets.end(); i++)
+    {
+        if (*i >= descr->segmentSize || *i % DIFFERENTIALPAGESIZE != 0 ||
+            (i != pageOffsets.begin() && *i <= i[-1]))
+            return "Bad page in segment";
+        size_t pageLength = descr->segmentSize - *i;
+        if (pageLength > DIFFERENTIALPAGESIZE) pageLength = DIFFERENTIALPAGESIZE;
+        if (fread((char*)space->bottom + *i, pageLength, 1, loadFile) != 1)
+            return "Unable to read segment";
+    }
+    return 0;
+}
+
 // Load a saved state file.  Calls itself to handle parent files.
 bool StateLoader::LoadFile(bool isInitial, time_t requiredStamp, PolyWord tail)
 {
@@ -1233,6 +2437,13 @@ bool StateLoader::LoadFile(bool isInitial, time_t requiredStamp, PolyWord tail)
 
     // Read in and create the new segments first.  If we have problems,
     // in particular if we have run out of memory, then it's easier to recover.  
+    SegmentDecompressor decompressor;
+    // Segments that have been mapped from the cache and are already relocated.
+    std::vector<bool> fromCache(relocate.nDescrs, false);
+#if (!defined(_WIN32) && !defined(POLYML32IN64))
+    SegmentCache cache;
+    (void)cache.Open(thisFile, loadFile, header.timeStamp, relocate.nDescrs);
+#endif
     for (unsigned i = 0; i < relocate.nDescrs; i++)
     {
         SavedStateSegmentDescr *descr = &relocate.descrs[i];
@@ -1261,8 +2472,25 @@ bool StateLoader::LoadFile(bool isInitial, time_t requiredStamp, PolyWord tail)
                 (descr->segmentFlags & SSF_NOOVERWRITE ? MTF_NO_OVERWRITE : 0) |
                 (descr->segmentFlags & SSF_BYTES ? MTF_BYTES : 0) |
                 (descr->segmentFlags & SSF_CODE ? MTF_EXECUTABLE : 0);
-            PermanentMemSpace *newSpace =
-                gMem.AllocateNewPermanentSpace(descr->segmentSize, mFlags, descr->segmentIndex, hierarchyDepth + 1);
+            PermanentMemSpace *newSpace = 0;
+            bool isMapped = false;
+#if (!defined(_WIN32) && !defined(POLYML32IN64))
+            newSpace = cache.MapSegment(i, descr, mFlags, hierarchyDepth + 1);
+            fromCache[i] = isMapped = newSpace != 0;
+#endif
+#ifndef _WIN32
+            // If the data are aligned try mapping them from the file, preferably at
+            // the original address.  Pages are then only read when they are used and
+            // are shared with other processes that have loaded the same file.
+            if (newSpace == 0 && (descr->segmentFlags & SSF_COMPRESSED) == 0 && descr->segmentData % SEGMENTALIGNMENT == 0)
+            {
+                newSpace = gMem.AllocateNewPermanentSpace(descr->segmentSize, mFlags, descr->segmentIndex,
+                    hierarchyDepth + 1, fileno(loadFile), descr->segmentData, descr->originalAddress);
+                isMapped = newSpace != 0;
+            }
+#endif
+            if (newSpace == 0)
+                newSpace = gMem.AllocateNewPermanentSpace(descr->segmentSize, mFlags, descr->segmentIndex, hierarchyDepth + 1);
             if (newSpace == 0)
             {
                 errorResult = "Unable to allocate memory";
@@ -1271,8 +2499,21 @@ bool StateLoader::LoadFile(bool isInitial, time_t requiredStamp, PolyWord tail)
 
             PolyWord *mem  = newSpace->bottom;
             PolyWord* writeAble = newSpace->writeAble(mem);
-            if (fseek(loadFile, descr->segmentData, SEEK_SET) != 0 ||
-                fread(writeAble, descr->segmentSize, 1, loadFile) != 1)
+            if (debugOptions & DEBUG_SAVING)
+                Log("SAVE: Segment %u %s at %p (originally %p) size %zu\n", descr->segmentIndex,
+                    fromCache[i] ? "mapped from cache" : isMapped ? "mapped" :
+                    descr->segmentFlags & SSF_COMPRESSED ? "decompressed" : "read",
+                    mem, descr->originalAddress, descr->segmentSize);
+            if (fromCache[i]) {}
+            else if (descr->segmentFlags & SSF_COMPRESSED)
+            {
+                errorResult = decompressor.AddSegment(loadFile, descr, writeAble);
+                if (errorResult != 0)
+                    return false;
+            }
+            else if (! isMapped &&
+                (fseek(loadFile, descr->segmentData, SEEK_SET) != 0 ||
+                 fread(writeAble, descr->segmentSize, 1, loadFile) != 1))
             {
                 errorResult = "Unable to read segment";
                 return false;
@@ -1283,6 +2524,45 @@ bool StateLoader::LoadFile(bool isInitial, time_t requiredStamp, PolyWord tail)
             // Leave it writable until we've done the relocations.
 
             relocate.targetAddresses[descr->segmentIndex] = mem;
+        }
+    }
+
+#if (!defined(_WIN32) && !defined(POLYML32IN64))
+    // Now that every segment has an address adjust the references in cached segments
+    // to any that have moved.  If that fails read the original data over it.
+    for (unsigned i = 0; i < relocate.nDescrs; i++)
+    {
+        SavedStateSegmentDescr *descr = &relocate.descrs[i];
+        if (! fromCache[i] || cache.AdjustSegment(i, relocate.descrs, relocate.targetAddresses))
+            continue;
+        fromCache[i] = false;
+        PermanentMemSpace *newSpace = gMem.SpaceForIndex(descr->segmentIndex);
+        if (descr->segmentFlags & SSF_COMPRESSED)
+        {
+            errorResult = decompressor.AddSegment(loadFile, descr, newSpace->writeAble(newSpace->bottom));
+            if (errorResult != 0)
+                return false;
+        }
+        else if (fseek(loadFile, descr->segmentData, SEEK_SET) != 0 ||
+                 fread(newSpace->writeAble(newSpace->bottom), descr->segmentSize, 1, loadFile) != 1)
+        {
+            errorResult = "Unable to read segment";
+            return false;
+        }
+    }
+#endif
+
+    // Wait until any compressed segments have been decompressed.
+    errorResult = decompressor.WaitForCompletion();
+    if (errorResult != 0)
+        return false;
+
+    for (unsigned i = 0; i < relocate.nDescrs; i++)
+    {
+        SavedStateSegmentDescr *descr = &relocate.descrs[i];
+        if (descr->segmentData != 0 && (descr->segmentFlags & SSF_OVERWRITE) == 0)
+        {
+            PermanentMemSpace *newSpace = gMem.SpaceForIndex(descr->segmentIndex);
             if (newSpace->noOverwrite)
             {
                 ClearVolatile cwbr;
@@ -1291,16 +2571,50 @@ bool StateLoader::LoadFile(bool isInitial, time_t requiredStamp, PolyWord tail)
         }
     }
 
-    // Now read in the mutable overwrites and relocate.
+    // If every segment, including those in parents and the executable, is at the
+    // address it had when the file was saved the addresses in the data are already
+    // correct and we can skip relocation.
+    bool needRelocation = false;
+#ifdef POLYML32IN64
+    needRelocation = true;
+#else
+    for (unsigned i = 0; i < relocate.nDescrs; i++)
+    {
+        if (relocate.targetAddresses[relocate.descrs[i].segmentIndex] != relocate.descrs[i].originalAddress)
+            needRelocation = true;
+    }
+#endif
+    if (! needRelocation && (debugOptions & DEBUG_SAVING))
+        Log("SAVE: All segments are at their original addresses - no relocation needed\n");
+
+    // Now read in the mutable overwrites and relocate.  The relocation is done in
+    // parallel while we continue reading.
 
     for (unsigned j = 0; j < relocate.nDescrs; j++)
     {
         SavedStateSegmentDescr *descr = &relocate.descrs[j];
         MemSpace *space = gMem.SpaceForIndex(descr->segmentIndex);
         ASSERT(space != NULL); // We should have created it.
+        std::vector<size_t> pageOffsets;
         if (descr->segmentFlags & SSF_OVERWRITE)
         {
-            if (fseek(loadFile, descr->segmentData, SEEK_SET) != 0 ||
+            if (descr->segmentFlags & SSF_PAGES)
+            {
+                errorResult = ReadChangedPages(loadFile, descr, space, pageOffsets);
+                if (errorResult != 0)
+                    return false;
+            }
+            else if (descr->segmentFlags & SSF_COMPRESSED)
+            {
+                // These are usually small so there's no point in doing them in parallel.
+                SegmentDecompressor overwrite;
+                errorResult = overwrite.AddSegment(loadFile, descr, space->bottom);
+                if (errorResult == 0)
+                    errorResult = overwrite.WaitForCompletion();
+                if (errorResult != 0)
+                    return false;
+            }
+            else if (fseek(loadFile, descr->segmentData, SEEK_SET) != 0 ||
                 fread(space->bottom, descr->segmentSize, 1, loadFile) != 1)
             {
                 errorResult = "Unable to read segment";
@@ -1309,54 +2623,51 @@ bool StateLoader::LoadFile(bool isInitial, time_t requiredStamp, PolyWord tail)
         }
 
         // Relocation.
-        if (descr->segmentData != 0)
+        if (descr->segmentData != 0 && needRelocation && ! fromCache[j])
         {
             // Adjust the addresses in the loaded segment.
-            for (PolyWord *p = space->bottom; p < space->top; )
-            {
-                p++;
-                PolyObject *obj = (PolyObject*)p;
-                POLYUNSIGNED length = obj->Length();
-                relocate.RelocateObject(obj);
-                p += length;
-            }
+            if (descr->segmentFlags & SSF_PAGES)
+                relocate.RelocatePages(space->bottom, space->top, pageOffsets);
+            else relocate.RelocateRegion(space->bottom, space->top);
         }
 
         // Process explicit relocations.
-        // If we get errors just skip the error and continue rather than leave
-        // everything in an unstable state.
-        if (descr->relocations)
+        if (descr->relocations && needRelocation && ! fromCache[j])
         {
-            if (fseek(loadFile, descr->relocations, SEEK_SET) != 0)
+            RelocationEntry *entries = new RelocationEntry[descr->relocationCount];
+            if (fseek(loadFile, descr->relocations, SEEK_SET) != 0 ||
+                fread(entries, sizeof(RelocationEntry), descr->relocationCount, loadFile) != descr->relocationCount)
             {
+                delete[](entries);
                 errorResult = "Unable to read relocation segment";
                 return false;
             }
-            for (unsigned k = 0; k < descr->relocationCount; k++)
-            {
-                RelocationEntry reloc;
-                if (fread(&reloc, sizeof(reloc), 1, loadFile) != 1)
-                {
-                    errorResult = "Unable to read relocation segment";
-                    return false;
-                }
-                MemSpace *toSpace = gMem.SpaceForIndex(reloc.targetSegment);
-                if (toSpace == NULL)
-                {
-                    errorResult = "Unknown space reference in relocation";
-                    continue;
-                }
-                byte *setAddress = (byte*)space->bottom + reloc.relocAddress;
-                byte *targetAddress = (byte*)toSpace->bottom + reloc.targetAddress;
-                if (setAddress >= (byte*)space->top || targetAddress >= (byte*)toSpace->top)
-                {
-                    errorResult = "Bad relocation";
-                    continue;
-                }
-                ScanAddress::SetConstantValue(setAddress, (PolyObject*)(targetAddress), reloc.relKind);
-            }
+            relocate.AddRelocations(space, space->bottom, entries, descr->relocationCount);
+        }
+    }
+
+    const char *relocationError = relocate.WaitForRelocation();
+    if (relocationError != 0)
+        errorResult = relocationError;
+
+#if (!defined(_WIN32) && !defined(POLYML32IN64))
+    // Cache the segments that had to be decompressed or relocated.
+    else
+    {
+        bool cached = false;
+        for (unsigned j = 0; j < relocate.nDescrs; j++)
+        {
+            SavedStateSegmentDescr *descr = &relocate.descrs[j];
+            if (descr->segmentData != 0 && (descr->segmentFlags & SSF_OVERWRITE) == 0 && ! fromCache[j] &&
+                    (needRelocation || (descr->segmentFlags & SSF_COMPRESSED)) &&
+                    cache.SaveSegment(j, relocate.descrs, relocate.targetAddresses))
+                cached = true;
         }
+        // Remove old entries once all the new ones have been made.
+        if (cached)
+            cache.Clean(relocate.descrs);
     }
+#endif
 
     // Set the final permissions.
     for (unsigned j = 0; j < relocate.nDescrs; j++)
@@ -1648,7 +2959,7 @@ POLYUNSIGNED PolyShowParent(FirstArgument threadId, PolyWord arg)
 
 // Module system
 #define MODULESIGNATURE "POLYMODU"
-#define MODULEVERSION   2
+#define MODULEVERSION   3
 
 typedef struct _moduleHeader
 {
@@ -1673,13 +2984,14 @@ typedef struct _moduleHeader
 class ModuleStorer: public MainThreadRequest
 {
 public:
-    ModuleStorer(const TCHAR *file, Handle r):
-        MainThreadRequest(MTP_STOREMODULE), fileName(file), root(r), errorMessage(0), errCode(0) {}
+    ModuleStorer(const TCHAR *file, Handle r, bool c):
+        MainThreadRequest(MTP_STOREMODULE), fileName(file), root(r), compress(c), errorMessage(0), errCode(0) {}
 
     virtual void Perform();
 
     const TCHAR *fileName;
     Handle root;
+    bool compress;
     const char *errorMessage;
     int errCode;
 };
@@ -1687,13 +2999,14 @@ public:
 class ModuleExport: public SaveStateExport
 {
 public:
-    ModuleExport(): SaveStateExport(1/* Everything EXCEPT the executable. */) {}
+    ModuleExport(bool c): SaveStateExport(1/* Everything EXCEPT the executable. */), compress(c) {}
     virtual void exportStore(void); // Write the data out.
+    bool compress;
 };
 
 void ModuleStorer::Perform()
 {
-    ModuleExport exporter;
+    ModuleExport exporter(compress);
 #if (defined(_WIN32) && defined(UNICODE))
     exporter.exportFile = _wfopen(fileName, L"wb");
 #else
@@ -1705,6 +3018,10 @@ void ModuleStorer::Perform()
         errCode = ERRORNUMBER;
         return;
     }
+#ifndef _WIN32
+    // Hold the copy in a temporary file rather than in memory if possible.
+    exporter.backing = ExportFileBacking::CreateTemporary(fileName);
+#endif
     // RunExport copies everything reachable from the root, except data from
     // the executable because we've set the hierarchy to 1, using CopyScan.
     // It builds the tables in the export data structure then calls exportStore
@@ -1798,9 +3115,17 @@ void ModuleExport::exportStore(void)
                 p += length;
             }
             thisDescr->relocationCount = this->relocationCount;
-            // Write out the data.
-            thisDescr->segmentData = ftell(exportFile);
-            fwrite(entry->mtOriginalAddr, entry->mtLength, 1, exportFile);
+            // Write out the data.  Uncompressed code is aligned so that it can be mapped when loaded.
+            off_t dataPos = ftell(exportFile);
+            if (! compress && (entry->mtFlags & MTF_EXECUTABLE))
+            {
+                dataPos = (dataPos + SEGMENTALIGNMENT - 1) & ~((off_t)SEGMENTALIGNMENT - 1);
+                fseek(exportFile, dataPos, SEEK_SET);
+            }
+            thisDescr->segmentData = dataPos;
+            thisDescr->compressedSize = WriteSegmentData(exportFile, entry->mtOriginalAddr, entry->mtLength, compress);
+            if (thisDescr->compressedSize != 0)
+                thisDescr->segmentFlags |= SSF_COMPRESSED;
         }
     }
 
@@ -1814,7 +3139,7 @@ void ModuleExport::exportStore(void)
 }
 
 // Store a module
-POLYUNSIGNED PolyStoreModule(FirstArgument threadId, PolyWord name, PolyWord contents)
+POLYUNSIGNED PolyStoreModule(FirstArgument threadId, PolyWord name, PolyWord contents, PolyWord compress)
 {
     TaskData *taskData = TaskData::FindTaskForId(threadId);
     ASSERT(taskData != 0);
@@ -1824,7 +3149,7 @@ POLYUNSIGNED PolyStoreModule(FirstArgument threadId, PolyWord name, PolyWord con
 
     try {
         TempString fileName(name);
-        ModuleStorer storer(fileName, pushedContents);
+        ModuleStorer storer(fileName, pushedContents, compress.UnTagged() != 0);
         processes->MakeRootRequest(taskData, &storer);
         if (storer.errorMessage)
             raise_syscall(taskData, storer.errorMessage, storer.errCode);
@@ -1836,14 +3161,26 @@ POLYUNSIGNED PolyStoreModule(FirstArgument threadId, PolyWord name, PolyWord con
     return TAGGED(0).AsUnsigned();
 }
 
-// Load a module.
+// Load a module.  The file is read and relocated into new spaces that are not yet
+// in the memory tables while other threads continue to run.  The spaces are then
+// added to the tables in a short root request.
 class ModuleLoader: public MainThreadRequest
 {
 public:
     ModuleLoader(TaskData *taskData, const TCHAR *file):
         MainThreadRequest(MTP_LOADMODULE), callerTaskData(taskData), fileName(file),
-            errorResult(NULL), errNumber(0), rootHandle(0) {}
-
+            errorResult(NULL), errNumber(0), rootHandle(0), decompressor(true), rootAddress(0) {}
+    ~ModuleLoader();
+
+    // Read the header and find the existing spaces.  The caller must be using the ML memory.
+    bool ReadHeader();
+    // Create the new spaces and read the data and relocations.  The caller need not
+    // be using the ML memory.
+    void LoadSpaces();
+    // Decompress and relocate the new spaces on the GC task farm.  The caller must
+    // be using the ML memory so that a GC, which also uses the farm, can't run.
+    void RelocateSpaces();
+    // Add the new spaces to the tables.
     virtual void Perform();
 
     TaskData *callerTaskData;
@@ -1851,55 +3188,86 @@ public:
     const char *errorResult;
     int errNumber;
     Handle rootHandle;
+
+private:
+    AutoClose loadFile;
+    ModuleHeader header;
+    LoadRelocate relocate;
+    // The existing spaces the module refers to and the addresses used for them.
+    std::vector<std::pair<unsigned, PolyWord*> > existingSpaces;
+    // The new spaces.  These are deleted unless they have been added to the tables.
+    std::vector<MemSpace*> newSpaces;
+    SegmentDecompressor decompressor;
+    // Relocations that have been read but not yet passed to relocate.
+    class ModuleRelocations
+    {
+    public:
+        MemSpace *space;
+        RelocationEntry *entries;
+        unsigned count;
+    };
+    std::vector<ModuleRelocations> relocations;
+    PolyObject *rootAddress;
 };
 
-void ModuleLoader::Perform()
+ModuleLoader::~ModuleLoader()
 {
-    AutoClose loadFile(_tfopen(fileName, _T("rb")));
+    for (std::vector<ModuleRelocations>::iterator i = relocations.begin(); i != relocations.end(); i++)
+        delete[](i->entries);
+    for (std::vector<MemSpace*>::iterator i = newSpaces.begin(); i != newSpaces.end(); i++)
+        gMem.DeleteLoadedSpace(*i);
+}
+
+// Only one module loader can use the task farm at a time because only one
+// thread can wait for it to complete.
+static PLock moduleFarmLock("Module loader");
+
+bool ModuleLoader::ReadHeader()
+{
+    loadFile = _tfopen(fileName, _T("rb"));
     if ((FILE*)loadFile == NULL)
     {
         errorResult = "Cannot open load file";
         errNumber = ERRORNUMBER;
-        return;
+        return false;
     }
 
-    ModuleHeader header;
     // Read the header and check the signature.
     if (fread(&header, sizeof(ModuleHeader), 1, loadFile) != 1)
     {
         errorResult = "Unable to load header";
-        return;
+        return false;
     }
     if (strncmp(header.headerSignature, MODULESIGNATURE, sizeof(header.headerSignature)) != 0)
     {
         errorResult = "File is not a Poly/ML module";
-        return;
+        return false;
     }
     if (header.headerVersion != MODULEVERSION ||
         header.headerLength != sizeof(ModuleHeader) ||
         header.segmentDescrLength != sizeof(SavedStateSegmentDescr))
     {
         errorResult = "Unsupported version of module file";
-        return;
+        return false;
     }
     if (header.executableTimeStamp != exportTimeStamp)
     {
         // Time-stamp does not match executable.
         errorResult = 
                 "Module was exported from a different executable or the executable has changed";
-        return;
+        return false;
     }
-    LoadRelocate relocate;
-    relocate.nDescrs = header.segmentDescrCount;
-    relocate.descrs = new SavedStateSegmentDescr[relocate.nDescrs];
+    // The sizes come from the file so allocation may fail.
+    try {
+        relocate.nDescrs = header.segmentDescrCount;
+        relocate.descrs = new SavedStateSegmentDescr[relocate.nDescrs];
 
-    if (fseek(loadFile, header.segmentDescr, SEEK_SET) != 0 ||
-        fread(relocate.descrs, sizeof(SavedStateSegmentDescr), relocate.nDescrs, loadFile) != relocate.nDescrs)
-    {
-        errorResult = "Unable to read segment descriptors";
-        return;
-    }
-    {
+        if (fseek(loadFile, header.segmentDescr, SEEK_SET) != 0 ||
+            fread(relocate.descrs, sizeof(SavedStateSegmentDescr), relocate.nDescrs, loadFile) != relocate.nDescrs)
+        {
+            errorResult = "Unable to read segment descriptors";
+            return false;
+        }
         unsigned maxIndex = 0;
         for (unsigned i = 0; i < relocate.nDescrs; i++)
             if (relocate.descrs[i].segmentIndex > maxIndex)
@@ -1907,9 +3275,11 @@ void ModuleLoader::Perform()
         relocate.targetAddresses = new PolyWord*[maxIndex+1];
         for (unsigned i = 0; i <= maxIndex; i++) relocate.targetAddresses[i] = 0;
     }
+    catch (std::bad_alloc&) {
+        errorResult = "Unable to allocate memory";
+        return false;
+    }
 
-    // Read in and create the new segments first.  If we have problems,
-    // in particular if we have run out of memory, then it's easier to recover.  
     for (unsigned i = 0; i < relocate.nDescrs; i++)
     {
         SavedStateSegmentDescr *descr = &relocate.descrs[i];
@@ -1921,97 +3291,229 @@ void ModuleLoader::Perform()
                 descr->segmentSize != (size_t)((char*)space->top - (char*)space->bottom)*/)
             {
                 errorResult = "Mismatch for existing memory space";
-                return;
+                return false;
             }
-            else relocate.targetAddresses[descr->segmentIndex] = space->bottom;
+            relocate.targetAddresses[descr->segmentIndex] = space->bottom;
+            existingSpaces.push_back(std::pair<unsigned, PolyWord*>(descr->segmentIndex, space->bottom));
         }
-        else
-        { // New segment.
-            if (space != NULL)
-            {
-                errorResult = "Segment already exists";
-                return;
-            }
-            // Allocate memory for the new segment.
-            size_t actualSize = descr->segmentSize;
-            MemSpace *space;
-            if (descr->segmentFlags & SSF_CODE)
-            {
-                CodeSpace *cSpace = gMem.NewCodeSpace(actualSize);
-                if (cSpace == 0)
-                {
-                    errorResult = "Unable to allocate memory";
-                    return;
-                }
-                space = cSpace;
-                cSpace->firstFree = (PolyWord*)((byte*)space->bottom + descr->segmentSize);
-                if (cSpace->firstFree != cSpace->top)
-                    gMem.FillUnusedSpace(cSpace->firstFree, cSpace->top - cSpace->firstFree);
-            }
-            else
+        else if (space != NULL)
+        {
+            errorResult = "Segment already exists";
+            return false;
+        }
+    }
+    return true;
+}
+
+void ModuleLoader::LoadSpaces()
+{
+    // Read in and create the new segments first.  If we have problems,
+    // in particular if we have run out of memory, then it's easier to recover.
+    // Other threads may be running a GC so compressed segments are only read here.
+    for (unsigned i = 0; i < relocate.nDescrs; i++)
+    {
+        SavedStateSegmentDescr *descr = &relocate.descrs[i];
+        if (descr->segmentData == 0) continue;
+        // Allocate memory for the new segment.
+        size_t actualSize = descr->segmentSize;
+        MemSpace *space;
+        bool isMapped = false;
+        if (descr->segmentFlags & SSF_CODE)
+        {
+            CodeSpace *cSpace = 0;
+            // If the code is aligned in the file map it, preferably at the original address.
+            // Pages that are not modified are then shared with other processes that
+            // load the same module.
+            if ((descr->segmentFlags & SSF_COMPRESSED) == 0 && descr->segmentData % SEGMENTALIGNMENT == 0)
             {
-                LocalMemSpace *lSpace = gMem.NewLocalSpace(actualSize, descr->segmentFlags & SSF_WRITABLE);
-                if (lSpace == 0)
-                {
-                    errorResult = "Unable to allocate memory";
-                    return;
-                }
-                space = lSpace;
-                lSpace->lowerAllocPtr = (PolyWord*)((byte*)lSpace->bottom + descr->segmentSize);
+                cSpace = gMem.NewMappedCodeSpace(actualSize, fileno(loadFile), descr->segmentData, descr->originalAddress);
+                isMapped = cSpace != 0;
             }
-            if (fseek(loadFile, descr->segmentData, SEEK_SET) != 0 ||
-                fread(space->bottom, descr->segmentSize, 1, loadFile) != 1)
+            if (cSpace == 0)
+                cSpace = gMem.NewCodeSpace(actualSize / sizeof(PolyWord), false);
+            if (cSpace == 0)
             {
-                errorResult = "Unable to read segment";
+                errorResult = "Unable to allocate memory";
                 return;
             }
-            relocate.targetAddresses[descr->segmentIndex] = space->bottom;
-            if (space->isMutable && (descr->segmentFlags & SSF_BYTES) != 0)
+            newSpaces.push_back(cSpace);
+            space = cSpace;
+            cSpace->firstFree = (PolyWord*)((byte*)space->bottom + descr->segmentSize);
+            if (cSpace->firstFree != cSpace->top)
+                gMem.FillUnusedSpace(cSpace->writeAble(cSpace->firstFree), cSpace->top - cSpace->firstFree);
+        }
+        else
+        {
+            LocalMemSpace *lSpace = gMem.NewLocalSpace(actualSize, descr->segmentFlags & SSF_WRITABLE, false);
+            if (lSpace == 0)
             {
-                ClearVolatile cwbr;
-                cwbr.ScanAddressesInRegion(space->bottom, (PolyWord*)((byte*)space->bottom + descr->segmentSize));
+                errorResult = "Unable to allocate memory";
+                return;
             }
+            newSpaces.push_back(lSpace);
+            space = lSpace;
+            lSpace->lowerAllocPtr = (PolyWord*)((byte*)lSpace->bottom + descr->segmentSize);
         }
+        if (isMapped) {}
+        else if (descr->segmentFlags & SSF_COMPRESSED)
+        {
+            errorResult = decompressor.AddSegment(loadFile, descr, space->writeAble(space->bottom));
+            if (errorResult != 0)
+                return;
+        }
+        else if (fseek(loadFile, descr->segmentData, SEEK_SET) != 0 ||
+            fread(space->writeAble(space->bottom), descr->segmentSize, 1, loadFile) != 1)
+        {
+            errorResult = "Unable to read segment";
+            return;
+        }
+        relocate.targetAddresses[descr->segmentIndex] = space->bottom;
     }
-    // Now deal with relocation.
+
+    // Read the relocations.  All the addresses in a module are explicit relocations.
+    std::vector<MemSpace*>::iterator nextSpace = newSpaces.begin();
     for (unsigned j = 0; j < relocate.nDescrs; j++)
     {
         SavedStateSegmentDescr *descr = &relocate.descrs[j];
-        PolyWord *baseAddr = relocate.targetAddresses[descr->segmentIndex];
-        ASSERT(baseAddr != NULL); // We should have created it.
-        // Process explicit relocations.
-        // If we get errors just skip the error and continue rather than leave
+        if (descr->segmentData == 0) continue;
+        MemSpace *space = *nextSpace++;
+        // If we get errors just skip the segment and continue rather than leave
         // everything in an unstable state.
         if (descr->relocations)
         {
-            if (fseek(loadFile, descr->relocations, SEEK_SET) != 0)
-                errorResult = "Unable to read relocation segment";
-            for (unsigned k = 0; k < descr->relocationCount; k++)
+            // The count comes from the file so allocation may fail.
+            RelocationEntry *entries;
+            try {
+                entries = new RelocationEntry[descr->relocationCount];
+            }
+            catch (std::bad_alloc&) {
+                errorResult = "Unable to allocate memory";
+                continue;
+            }
+            if (fseek(loadFile, descr->relocations, SEEK_SET) != 0 ||
+                fread(entries, sizeof(RelocationEntry), descr->relocationCount, loadFile) != descr->relocationCount)
             {
-                RelocationEntry reloc;
-                if (fread(&reloc, sizeof(reloc), 1, loadFile) != 1)
-                    errorResult = "Unable to read relocation segment";
-                byte *setAddress = (byte*)baseAddr + reloc.relocAddress;
-                byte *targetAddress = (byte*)relocate.targetAddresses[reloc.targetSegment] + reloc.targetAddress;
-                ScanAddress::SetConstantValue(setAddress, (PolyObject*)(targetAddress), reloc.relKind);
+                delete[](entries);
+                errorResult = "Unable to read relocation segment";
+                continue;
+            }
+            ModuleRelocations relocs;
+            relocs.space = space;
+            relocs.entries = entries;
+            relocs.count = descr->relocationCount;
+            try {
+                relocations.push_back(relocs);
             }
+            catch (std::bad_alloc&) {
+                delete[](entries);
+                errorResult = "Unable to allocate memory";
+            }
+        }
+    }
+}
+
+void ModuleLoader::RelocateSpaces()
+{
+    PLocker locker(&moduleFarmLock);
+    // Wait until any compressed segments have been decompressed.
+    decompressor.Start();
+    errorResult = decompressor.WaitForCompletion();
+    if (errorResult != 0)
+        return;
+
+    std::vector<MemSpace*>::iterator nextSpace = newSpaces.begin();
+    for (unsigned i = 0; i < relocate.nDescrs; i++)
+    {
+        SavedStateSegmentDescr *descr = &relocate.descrs[i];
+        if (descr->segmentData == 0) continue;
+        PolyWord *base = relocate.targetAddresses[descr->segmentIndex];
+        MemSpace *space = *nextSpace++;
+        if (space->isMutable && (descr->segmentFlags & SSF_BYTES) != 0)
+        {
+            ClearVolatile cwbr;
+            cwbr.ScanAddressesInRegion(base, (PolyWord*)((byte*)base + descr->segmentSize));
+        }
+    }
+    // Relocate the spaces.  Each block of entries belongs to relocate once it has
+    // been added.  We must wait for any work that has been queued, even on failure.
+    try {
+        while (! relocations.empty())
+        {
+            ModuleRelocations relocs = relocations.back();
+            relocations.pop_back();
+            relocate.AddRelocations(0, relocs.space->bottom, relocs.entries, relocs.count, relocs.space);
         }
     }
+    catch (std::bad_alloc&) {
+        errorResult = "Unable to allocate memory";
+    }
+    (void)relocate.WaitForRelocation();
+    rootAddress = (PolyObject*)((byte*)relocate.targetAddresses[header.rootSegment] + header.rootOffset);
+}
 
-    // Get the root address.  Push this to the caller's save vec.  If we put the
-    // newly created areas into local memory we could get a GC as soon as we
-    // complete this root request.
+void ModuleLoader::Perform()
+{
+    // The existing spaces may have changed, e.g. because a saved state has been
+    // loaded, while the module was being relocated.
+    for (std::vector<std::pair<unsigned, PolyWord*> >::iterator i = existingSpaces.begin(); i != existingSpaces.end(); i++)
+    {
+        MemSpace *space = gMem.SpaceForIndex(i->first);
+        if (space == NULL || space->bottom != i->second)
+        {
+            errorResult = "Memory spaces changed while loading module";
+            return;
+        }
+    }
+    for (unsigned i = 0; i < relocate.nDescrs; i++)
+    {
+        if (relocate.descrs[i].segmentData != 0 && gMem.SpaceForIndex(relocate.descrs[i].segmentIndex) != NULL)
+        {
+            errorResult = "Segment already exists";
+            return;
+        }
+    }
+    while (! newSpaces.empty())
     {
-        PolyWord *baseAddr = relocate.targetAddresses[header.rootSegment];
-        rootHandle = callerTaskData->saveVec.push((PolyObject*)((byte*)baseAddr + header.rootOffset));
+        if (! gMem.AddLoadedSpace(newSpaces.back()))
+        {
+            errorResult = "Unable to allocate memory";
+            return;
+        }
+        newSpaces.pop_back();
     }
+    // Push the root to the caller's save vec.  If we put the newly created areas
+    // into local memory we could get a GC as soon as we complete this root request.
+    rootHandle = callerTaskData->saveVec.push(rootAddress);
 }
 
 static Handle LoadModule(TaskData *taskData, Handle args)
 {
     TempString fileName(args->Word());
     ModuleLoader loader(taskData, fileName);
-    processes->MakeRootRequest(taskData, &loader);
+    if (loader.ReadHeader())
+    {
+        // Reading the module does not touch the ML heap so other threads, including
+        // the GC, can run at the same time.  We must be using the ML memory again
+        // before returning, even with an exception.
+        processes->ThreadReleaseMLMemory(taskData);
+        try {
+            loader.LoadSpaces();
+        }
+        catch (std::bad_alloc&) {
+            loader.errorResult = "Unable to allocate memory";
+        }
+        catch (...) {
+            processes->ThreadUseMLMemory(taskData);
+            throw;
+        }
+        processes->ThreadUseMLMemory(taskData);
+        // Decompression and relocation use the GC task farm.  Other threads can
+        // still run ML code while this happens but they can't start a GC.
+        if (loader.errorResult == 0)
+            loader.RelocateSpaces();
+        if (loader.errorResult == 0)
+            processes->MakeRootRequest(taskData, &loader);
+    }
 
     if (loader.errorResult != 0)
     {
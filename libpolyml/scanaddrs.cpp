@@ -235,7 +235,11 @@ PolyObject *ScanAddress::GetConstantValue(byte *addressOfConstant, ScanRelocatio
 void ScanAddress::SetConstantValue(byte *addressOfConstant, PolyObject *p, ScanRelocationKind code)
 {
     MemSpace* space = gMem.SpaceForAddress(addressOfConstant);
-    byte* addressToWrite = space->writeAble(addressOfConstant);
+    SetConstantValue(addressOfConstant, space->writeAble(addressOfConstant), p, code);
+}
+
+void ScanAddress::SetConstantValue(byte *addressOfConstant, byte *addressToWrite, PolyObject *p, ScanRelocationKind code)
+{
     switch (code)
     {
     case PROCESS_RELOC_DIRECT: // Absolute address
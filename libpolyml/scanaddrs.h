@@ -97,6 +97,8 @@ public:
 #endif
     // Store a constant in the code.
     static void SetConstantValue(byte *addressOfConstant, PolyObject *p, ScanRelocationKind code);
+    // Set a constant through a different address, e.g. in a space not yet in the table.
+    static void SetConstantValue(byte *addressOfConstant, byte *addressToWrite, PolyObject *p, ScanRelocationKind code);
 };
 
 #endif
@@ -747,6 +747,10 @@ POLYUNSIGNED ProcessAddToVector::AddObjectToDepthVector(PolyObject *obj)
         return 0; // Level is zero
     }
 
+    // A file mapped into memory is left alone.
+    if (space->spaceType == ST_PERMANENT && ((PermanentMemSpace*)space)->mappedFile)
+        return 0;
+
     if (space->spaceType == ST_PERMANENT &&
              ((PermanentMemSpace*)space)->hierarchy == 0)
     {
@@ -164,6 +164,8 @@ Statistics::Statistics(): accessLock("Statistics")
     memset(&gcUserTime, 0, sizeof(gcUserTime));
     memset(&gcSystemTime, 0, sizeof(gcSystemTime));
     memset(&gcRealTime, 0, sizeof(gcRealTime));
+    memset(&safepointStart, 0, sizeof(safepointStart));
+    safepointTotal = safepointMax = 0;
 
 #ifdef _WIN32
     // File mapping handle
@@ -267,6 +269,7 @@ void Statistics::Init()
     addCounter(PSC_GC_SHARING, POLY_STATS_ID_GC_SHARING, "GCSharingCount");
     addCounter(PSC_GC_STATE, POLY_STATS_ID_GC_STATE, "GCState");
     addCounter(PSC_GC_PERCENT, POLY_STATS_ID_GC_PERCENT, "GCPercent");
+    addCounter(PSC_SAFEPOINT_LAST_THREAD, POLY_STATS_ID_SAFEPOINT_LAST_THREAD, "SafepointLastThread");
 
     addSize(PSS_TOTAL_HEAP, POLY_STATS_ID_TOTAL_HEAP, "TotalHeap");
     addSize(PSS_AFTER_LAST_GC, POLY_STATS_ID_AFTER_LAST_GC, "HeapAfterLastGC");
@@ -282,6 +285,9 @@ void Statistics::Init()
     addTime(PST_GC_STIME, POLY_STATS_ID_GC_STIME, "GCSystemTime");
     addTime(PST_NONGC_RTIME, POLY_STATS_ID_NONGC_RTIME, "NonGCRealTime");
     addTime(PST_GC_RTIME, POLY_STATS_ID_GC_RTIME, "GCRealTime");
+    addTime(PST_SAFEPOINT_RTIME, POLY_STATS_ID_SAFEPOINT_RTIME, "SafepointRealTime");
+    addTime(PST_SAFEPOINT_MAX_RTIME, POLY_STATS_ID_SAFEPOINT_MAX_RTIME, "SafepointMaxRealTime");
+    addTime(PST_SAFEPOINT_LAST_RTIME, POLY_STATS_ID_SAFEPOINT_LAST_RTIME, "SafepointLastRealTime");
 
     addUser(0, POLY_STATS_ID_USER0, "UserCounter0");
     addUser(1, POLY_STATS_ID_USER1, "UserCounter1");
@@ -691,6 +697,42 @@ void Statistics::updatePeriodicStats(size_t freeWords, unsigned threadsInML)
     }
 }
 
+void Statistics::startSafepoint(void)
+{
+#if (defined(_WIN32))
+    GetSystemTimeAsFileTime(&safepointStart);
+#else
+    gettimeofday(&safepointStart, NULL);
+#endif
+}
+
+// Called from the root thread when all the threads have stopped.
+unsigned long Statistics::endSafepoint(POLYUNSIGNED lastThreadId)
+{
+    unsigned long long usecs;
+#if (defined(_WIN32))
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    subFiletimes(&now, &safepointStart);
+    ULARGE_INTEGER li;
+    li.LowPart = now.dwLowDateTime;
+    li.HighPart = now.dwHighDateTime;
+    usecs = li.QuadPart / 10;
+#else
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    subTimevals(&now, &safepointStart);
+    usecs = (unsigned long long)now.tv_sec * 1000000 + now.tv_usec;
+#endif
+    safepointTotal += usecs;
+    if (usecs > safepointMax) safepointMax = usecs;
+    setTimeValue(PST_SAFEPOINT_RTIME, (unsigned long)(safepointTotal / 1000000), (unsigned long)(safepointTotal % 1000000));
+    setTimeValue(PST_SAFEPOINT_MAX_RTIME, (unsigned long)(safepointMax / 1000000), (unsigned long)(safepointMax % 1000000));
+    setTimeValue(PST_SAFEPOINT_LAST_RTIME, (unsigned long)(usecs / 1000000), (unsigned long)(usecs % 1000000));
+    setCount(PSC_SAFEPOINT_LAST_THREAD, lastThreadId);
+    return (unsigned long)usecs;
+}
+
 void Statistics::setUserCounter(unsigned which, POLYSIGNED value)
 {
     if (statMemory && userAddrs[which])
@@ -52,6 +52,7 @@ enum {
 
     PSC_GC_STATE,                   // Whether in GC, ML or other phase
     PSC_GC_PERCENT,                 // How far through the GC.
+    PSC_SAFEPOINT_LAST_THREAD,      // OS thread id of the slowest thread at the last safepoint
 
     N_PS_INTS
 };
@@ -63,6 +64,9 @@ enum {
     PST_GC_STIME,
     PST_NONGC_RTIME,
     PST_GC_RTIME,
+    PST_SAFEPOINT_RTIME,
+    PST_SAFEPOINT_MAX_RTIME,
+    PST_SAFEPOINT_LAST_RTIME,
     N_PS_TIMES
 };
 
@@ -109,6 +113,13 @@ public:
     
     void updatePeriodicStats(size_t freeSpace, unsigned threadsInML);
 
+    // Time taken between a request to stop the threads e.g. for a GC and
+    // the time when they have all stopped.  endSafepoint is passed the
+    // OS thread id of the last thread to stop and returns the time in
+    // microseconds.
+    void startSafepoint(void);
+    unsigned long endSafepoint(POLYUNSIGNED lastThreadId);
+
     bool exportStats;
 
 private:
@@ -135,6 +146,13 @@ private:
     void addTime(int cEnum, unsigned statId, const char *name);
     void addUser(int n, unsigned statId, const char *name);
 
+#ifdef _WIN32
+    FILETIME safepointStart;
+#else
+    struct timeval safepointStart;
+#endif
+    unsigned long long safepointTotal, safepointMax; // Microseconds
+
     size_t getSizeWithLock(int which);
     void setSizeWithLock(int which, size_t s);
     void setTimeValue(int which, unsigned long secs, unsigned long usecs);
@@ -94,6 +94,14 @@
 #endif
 
 #include <limits>
+
+#if (defined(__GNUC__) && (defined(HOSTARCHITECTURE_X86_64) || defined(HOSTARCHITECTURE_X86)))
+#include <x86intrin.h>
+#define USE_RDTSC 1
+#elif (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86)))
+#include <intrin.h>
+#define USE_RDTSC 1
+#endif
 // Windows headers define min/max macros, which messes up trying to use std::numeric_limits<T>::min/max()
 #ifdef min
 #undef min
@@ -131,6 +139,10 @@ extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyTimingGetChildUser(FirstArgument threadId);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyTimingGetChildSystem(FirstArgument threadId);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyTimingGetGCSystem(FirstArgument threadId);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyTimingMonotonicNanosecs();
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyTimingCycleCount();
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyTimingMonotonicNanosecsLong(FirstArgument threadId);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyTimingCycleCountLong(FirstArgument threadId);
 }
 
 #if (defined(_WIN32))
@@ -561,6 +573,101 @@ POLYUNSIGNED PolyTimingGetReal(FirstArgument threadId)
     else return result->Word().AsUnsigned();
 }
 
+// Return a tagged integer from a count for the fast calls.  They can't allocate
+// so if the count is too large to be tagged, which happens within seconds on
+// 32-bit platforms, this returns -1 and the ML code makes the full call instead.
+static POLYUNSIGNED taggedCount(uint64_t count)
+{
+    if (count > (uint64_t)MAXTAGGED)
+        return TAGGED(-1).AsUnsigned();
+    return TAGGED((POLYSIGNED)count).AsUnsigned();
+}
+
+// Return a count as an arbitrary precision value for the full calls.
+static POLYUNSIGNED arbitraryCount(FirstArgument threadId, uint64_t count)
+{
+    TaskData* taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle result = 0;
+
+    try {
+        result = Make_arbitrary_precision(taskData, count);
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
+static uint64_t monotonicNanosecs()
+{
+#if (defined(_WIN32))
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER count;
+    QueryPerformanceCounter(&count);
+    uint64_t secs = count.QuadPart / frequency.QuadPart;
+    uint64_t rem = count.QuadPart % frequency.QuadPart;
+    return secs * 1000000000 + rem * 1000000000 / frequency.QuadPart;
+#elif (defined(CLOCK_MONOTONIC))
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+// Return the processor cycle counter where there is one that can be read
+// directly.  On other platforms this is the same as the monotonic clock.
+static uint64_t cycleCount()
+{
+#if (defined(USE_RDTSC))
+    return __rdtsc();
+#elif (defined(__GNUC__) && defined(HOSTARCHITECTURE_AARCH64))
+    uint64_t count;
+    __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r"(count));
+    return count;
+#else
+    return monotonicNanosecs();
+#endif
+}
+
+// Return the value of a monotonic clock in nanoseconds.  The starting point is
+// arbitrary.  This is a fast call so it does not allocate and does not take
+// any locks.  It returns -1 if the value is too large for a tagged integer.
+POLYUNSIGNED PolyTimingMonotonicNanosecs()
+{
+    return taggedCount(monotonicNanosecs());
+}
+
+// As PolyTimingMonotonicNanosecs but returns an arbitrary precision value.
+POLYUNSIGNED PolyTimingMonotonicNanosecsLong(FirstArgument threadId)
+{
+    return arbitraryCount(threadId, monotonicNanosecs());
+}
+
+// Return the processor cycle counter.  The counter may differ between processors
+// and its rate may not be the processor's clock rate so it is only suitable for
+// comparing short timings.  As with the clock this returns -1 if the value is
+// too large for a tagged integer.
+POLYUNSIGNED PolyTimingCycleCount()
+{
+    return taggedCount(cycleCount());
+}
+
+POLYUNSIGNED PolyTimingCycleCountLong(FirstArgument threadId)
+{
+    return arbitraryCount(threadId, cycleCount());
+}
+
 /* Return User CPU time used by child processes.  (Posix only) */
 POLYUNSIGNED PolyTimingGetChildUser(FirstArgument threadId)
 {
@@ -746,6 +853,10 @@ struct _entrypts timingEPT[] =
     { "PolyTimingGetChildUser",         (polyRTSFunction)&PolyTimingGetChildUser},
     { "PolyTimingGetChildSystem",       (polyRTSFunction)&PolyTimingGetChildSystem},
     { "PolyTimingGetGCSystem",          (polyRTSFunction)&PolyTimingGetGCSystem},
+    { "PolyTimingMonotonicNanosecs",    (polyRTSFunction)&PolyTimingMonotonicNanosecs},
+    { "PolyTimingCycleCount",           (polyRTSFunction)&PolyTimingCycleCount},
+    { "PolyTimingMonotonicNanosecsLong", (polyRTSFunction)&PolyTimingMonotonicNanosecsLong},
+    { "PolyTimingCycleCountLong",       (polyRTSFunction)&PolyTimingCycleCountLong},
 
     { NULL, NULL} // End of list.
 };
@@ -109,6 +109,15 @@
 #include <sys/utsname.h>
 #endif
 
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#if (defined(HAVE_SPAWN_H) && defined(HAVE_POSIX_SPAWN))
+#include <spawn.h>
+#define USE_POSIX_SPAWN 1
+#endif
+
 #ifdef HAVE_SIGNAL_H
 #include <signal.h>
 #endif
@@ -371,6 +380,7 @@ static unsigned unixConstVec[] =
 
 /* Auxiliary functions which implement the more complex cases. */
 static Handle waitForProcess(TaskData *taskData, Handle args);
+static Handle spawnProcess(TaskData *taskData, Handle args);
 static Handle makePasswordEntry(TaskData *taskData, struct passwd *pw);
 static Handle makeGroupEntry(TaskData *taskData, struct group *grp);
 static Handle getUname(TaskData *taskData);
@@ -690,6 +700,9 @@ Handle OS_spec_dispatch_c(TaskData *taskData, Handle args, Handle code)
     case 33: /* sysconf. */
         return getSysConf(taskData, args);
 
+    case 34: /* Run a new executable with pipes connected to stdin and stdout. */
+        return spawnProcess(taskData, args);
+
         /* Filesys entries. */
     case 50: /* Set the file creation mask and return the old one. */
         {
@@ -1027,8 +1040,10 @@ Handle OS_spec_dispatch_c(TaskData *taskData, Handle args, Handle code)
     case 117: /* Set the file status and access flags. */
         {
             int flags = get_C_long(taskData, DEREFHANDLE(args)->Get(1));
-            if (fcntl(getStreamFileDescriptor(taskData, DEREFHANDLE(args)->Get(0)), F_SETFL, flags) < 0)
+            int fd = getStreamFileDescriptor(taskData, DEREFHANDLE(args)->Get(0));
+            if (fcntl(fd, F_SETFL, flags) < 0)
                 raise_syscall(taskData, "fcntl failed", errno);
+            forgetDescriptorKind(fd);
             return Make_fixed_precision(taskData, 0);
         }
 
@@ -1203,9 +1218,20 @@ POLYUNSIGNED PolyPosixSleep(FirstArgument threadId, PolyWord maxMillisecs, PolyW
     return TAGGED(receivedSignalCount).AsUnsigned();
 }
 
+// A pidfd for a child process.  This becomes readable when the process exits.
+class ProcessDescriptor
+{
+public:
+    ProcessDescriptor(): fd(-1), failed(false) {}
+    ~ProcessDescriptor() { if (fd >= 0) close(fd); }
+    int fd;
+    bool failed;
+};
+
 Handle waitForProcess(TaskData *taskData, Handle args)
 /* Get result status of a child process. */
 {
+    ProcessDescriptor pidFd;
 TryAgain:
     // We should check for interrupts even if we're not going to block.
     processes->TestAnyEvents(taskData);
@@ -1243,6 +1269,22 @@ TryAgain:
        and come back here later. */
     if (pres == 0 && !(callFlags & WNOHANG))
     {
+#ifdef SYS_pidfd_open
+        // If we are waiting for a specific process to exit we can wait for its
+        // pidfd in the same way as any other descriptor rather than polling.
+        // A pidfd does not report a process that has stopped.
+        if (kind == 1 && !(callFlags & WUNTRACED) && pidFd.fd < 0 && !pidFd.failed)
+        {
+            pidFd.fd = syscall(SYS_pidfd_open, pid, 0);
+            pidFd.failed = pidFd.fd < 0;
+        }
+        if (pidFd.fd >= 0)
+        {
+            WaitInputFD waiter(pidFd.fd);
+            processes->ThreadPauseForIO(taskData, &waiter);
+        }
+        else
+#endif
         processes->ThreadPause(taskData);
         goto TryAgain;
     }
@@ -1261,6 +1303,94 @@ TryAgain:
     }
 }
 
+// Create a pipe with both ends close-on-exec.  The ends are only inherited by
+// a child if they are explicitly duplicated onto another descriptor.
+static void makePipe(TaskData *taskData, int fds[2])
+{
+#ifdef HAVE_PIPE2
+    if (pipe2(fds, O_CLOEXEC) < 0) raise_syscall(taskData, "pipe failed", errno);
+#else
+    if (pipe(fds) < 0) raise_syscall(taskData, "pipe failed", errno);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+}
+
+// Run an executable with pipes connected to its standard input and output.
+// The arguments are the path, the argument list and the environment.  The path
+// is not searched for in PATH.  Returns the process id, the descriptor to read the child's
+// output and the descriptor to write to its input.  posix_spawn avoids copying
+// the page tables of the parent as fork does.  Because the pipes are created
+// close-on-exec their ends are not inherited by children started concurrently
+// by other threads.
+static Handle spawnProcess(TaskData *taskData, Handle args)
+{
+    TempCString path(DEREFHANDLE(args)->Get(0));
+    int toChild[2], fromChild[2];
+    makePipe(taskData, toChild);
+    try {
+        makePipe(taskData, fromChild);
+    }
+    catch (...) {
+        close(toChild[0]);
+        close(toChild[1]);
+        throw;
+    }
+    char **argl = stringListToVector(SAVE(DEREFHANDLE(args)->Get(1)));
+    char **envl = stringListToVector(SAVE(DEREFHANDLE(args)->Get(2)));
+    pid_t pid = -1;
+    int err = 0;
+
+#ifdef USE_POSIX_SPAWN
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attrs;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, toChild[0], 0);
+    posix_spawn_file_actions_adddup2(&actions, fromChild[1], 1);
+    posix_spawnattr_init(&attrs);
+    // Unmask all signals in the child as restoreSignals does before exec.
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    posix_spawnattr_setsigmask(&attrs, &sigset);
+    posix_spawnattr_setflags(&attrs, POSIX_SPAWN_SETSIGMASK);
+    err = posix_spawn(&pid, path, &actions, &attrs, argl, envl);
+    posix_spawnattr_destroy(&attrs);
+    posix_spawn_file_actions_destroy(&actions);
+#else
+    // The child only calls async-signal-safe functions before exec.
+    pid = fork();
+    if (pid == 0)
+    {
+        dup2(toChild[0], 0);
+        dup2(fromChild[1], 1);
+        restoreSignals();
+        execve(path, argl, envl);
+        _exit(126);
+    }
+    if (pid < 0) err = errno;
+#endif
+    freeStringVector(argl);
+    freeStringVector(envl);
+    // Close the child's ends in the parent.
+    close(toChild[0]);
+    close(fromChild[1]);
+    if (err != 0)
+    {
+        close(toChild[1]);
+        close(fromChild[0]);
+        raise_syscall(taskData, "spawn failed", err);
+    }
+
+    Handle pidHandle = Make_fixed_precision(taskData, pid);
+    Handle inHandle = wrapFileDescriptor(taskData, fromChild[0]);
+    Handle outHandle = wrapFileDescriptor(taskData, toChild[1]);
+    Handle result = ALLOC(3);
+    DEREFHANDLE(result)->Set(0, pidHandle->Word());
+    DEREFHANDLE(result)->Set(1, inHandle->Word());
+    DEREFHANDLE(result)->Set(2, outHandle->Word());
+    return result;
+}
+
 static Handle makePasswordEntry(TaskData *taskData, struct passwd *pw)
 /* Return a password entry. */
 {
@@ -145,6 +145,7 @@ extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyPollIODescriptors(FirstArgument threadId, PolyWord streamVec, PolyWord bitVec, PolyWord maxMillisecs);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyTestForInput(FirstArgument threadId, PolyWord strm, PolyWord waitMillisecs);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyTestForOutput(FirstArgument threadId, PolyWord strm, PolyWord waitMillisecs);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyBasicIOMapFile(FirstArgument threadId, PolyWord fileName);
 }
 
 // References to the standard streams.  They are only needed if we are compiling
@@ -1403,6 +1404,24 @@ POLYEXTERNALSYMBOL POLYUNSIGNED PolyTestForOutput(FirstArgument threadId, PolyWo
     return TAGGED(result ? 1 : 0).AsUnsigned();
 }
 
+// Mapping files into memory is not currently implemented in Windows.
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyBasicIOMapFile(FirstArgument threadId, PolyWord fileName)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+
+    try {
+        raise_exception_string(taskData, EXC_Fail, "Mapping files is not implemented");
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(0).AsUnsigned();
+}
+
 struct _entrypts basicIOEPT[] =
 {
     { "PolyChDir",                      (polyRTSFunction)&PolyChDir },
@@ -1410,6 +1429,7 @@ struct _entrypts basicIOEPT[] =
     { "PolyPollIODescriptors",          (polyRTSFunction)&PolyPollIODescriptors },
     { "PolyTestForInput",               (polyRTSFunction)&PolyTestForInput },
     { "PolyTestForOutput",              (polyRTSFunction)&PolyTestForOutput },
+    { "PolyBasicIOMapFile",             (polyRTSFunction)&PolyBasicIOMapFile },
 
     { NULL, NULL } // End of list.
 };
@@ -81,6 +81,11 @@
 #define POLY_STATS_ID_GC_STATE               31
 #define POLY_STATS_ID_GC_PERCENT             32
 
+#define POLY_STATS_ID_SAFEPOINT_RTIME        33     // Total real time waiting for threads to stop
+#define POLY_STATS_ID_SAFEPOINT_MAX_RTIME    34     // Longest time waiting for threads to stop
+#define POLY_STATS_ID_SAFEPOINT_LAST_RTIME   35     // Time waiting for threads to stop at the last GC or other request
+#define POLY_STATS_ID_SAFEPOINT_LAST_THREAD  36     // OS thread id of the last thread to stop at that request
+
 #endif // POLY_STATISTICS_INCLUDED
 
 